@@ -35,6 +35,7 @@
  */
 typedef struct eq_server_s {
     in_addr_t                  server_addr; ///< server IP address
+    uint8_t                    weight;      ///< server weight
     TAILQ_ENTRY(eq_server_s)   entries;     ///< list entries
 } eq_server_t;
 
@@ -55,6 +56,7 @@ typedef struct eq_app_s {
     in_addr_t   application_addr;  ///< application IP address (network byte-order)
     uint16_t    application_port;  ///< application port (network byte-order)
     uint16_t    session_timeout;   ///< session timeout
+    uint8_t     balancing_mode;    ///< balancing mode (BALANCING_MODE_*)
     eq_smon_t * server_mon_params; ///< server monitoring parameters
     server_list_t * servers;       ///< server list
     uint32_t    session_count;     ///< last reported number of active sessions
@@ -457,6 +459,9 @@ delete_server(uint16_t svc_set_id,
  * @param[in] down_retry_interval
  *      The time to wait before retrying a probe (connection attempt) once a 
  *      server is marked down.
+ *
+ * @param[in] balancing_mode
+ *      How servers are picked for new sessions (BALANCING_MODE_*)
  */
 void
 update_application(uint16_t svc_set_id,
@@ -467,7 +472,8 @@ update_application(uint16_t svc_set_id,
                    uint16_t connection_interval,
                    uint16_t connection_timeout,
                    uint8_t timeouts_allowed,
-                   uint16_t down_retry_interval)
+                   uint16_t down_retry_interval,
+                   uint8_t balancing_mode)
 {
     eq_app_t * app;
     eq_serviceset_t * ss;
@@ -532,6 +538,7 @@ update_application(uint16_t svc_set_id,
         app->application_port = app_port;
         app->application_addr = app_addr;
         app->session_timeout = session_timeout;
+        app->balancing_mode = balancing_mode;
         
         LOG(LOG_INFO, "%s: Added new application <%d,%s> to configuration",
                 __func__, svc_set_id, app_name);
@@ -541,7 +548,16 @@ update_application(uint16_t svc_set_id,
     
     // it is now new, so we need to check for changes
     
-    app->session_timeout = session_timeout;
+    if(app->session_timeout != session_timeout) {
+        
+        app->session_timeout = session_timeout;
+        
+        // the monitor only knows about applications with servers
+        if(TAILQ_FIRST(app->servers) != NULL) {
+            monitor_change_session_timeout(svc_set_id, app->application_addr,
+                    app->application_port, session_timeout);
+        }
+    }
     
     if(app->application_port != app_port || app->application_addr != app_addr) {
         
@@ -551,16 +567,27 @@ update_application(uint16_t svc_set_id,
         
         app->application_port = app_port;
         app->application_addr = app_addr;
+        app->balancing_mode = balancing_mode;
         
         server = TAILQ_FIRST(app->servers);
         while(server != NULL) {
 
             monitor_add_server(svc_set_id, app->application_addr,
                     app->application_port, server->server_addr,
-                    app->server_mon_params);
+                    server->weight, app->server_mon_params,
+                    app->balancing_mode, app->session_timeout);
             
             server = TAILQ_NEXT(server, entries);
         }
+    } else if(app->balancing_mode != balancing_mode) {
+        
+        app->balancing_mode = balancing_mode;
+        
+        // the monitor only knows about applications with servers
+        if(TAILQ_FIRST(app->servers) != NULL) {
+            monitor_change_balancing_mode(svc_set_id, app_addr, app_port,
+                    balancing_mode);
+        }
     }
     
     if(app->server_mon_params == NULL) {
@@ -597,11 +624,15 @@ update_application(uint16_t svc_set_id,
  * 
  * @param[in] server_addr
  *      The server's address
+ * 
+ * @param[in] weight
+ *      The server's weight
  */
 void
 add_server(uint16_t svc_set_id,
            char * app_name,
-           in_addr_t server_addr)
+           in_addr_t server_addr,
+           uint8_t weight)
 {
     eq_app_t * app;
     eq_serviceset_t * ss;
@@ -634,7 +665,14 @@ add_server(uint16_t svc_set_id,
     server = TAILQ_FIRST(app->servers);
     while(server != NULL) {
         if(server->server_addr == server_addr) {
-            return; // already know about this server
+            // already know about this server, check for a new weight
+            if(server->weight != weight) {
+                server->weight = weight;
+                monitor_change_server_weight(svc_set_id,
+                        app->application_addr, app->application_port,
+                        server_addr, weight);
+            }
+            return;
         }
         server = TAILQ_NEXT(server, entries);            
     }
@@ -642,11 +680,13 @@ add_server(uint16_t svc_set_id,
     server = malloc(sizeof(eq_server_t));
     INSIST_ERR(server != NULL);
     server->server_addr = server_addr;
+    server->weight = weight;
     TAILQ_INSERT_TAIL(app->servers, server, entries);
     
     // tell the monitor about this new server
     monitor_add_server(svc_set_id, app->application_addr, app->application_port,
-            server_addr, app->server_mon_params);
+            server_addr, weight, app->server_mon_params, app->balancing_mode,
+            app->session_timeout);
 }
 
 
@@ -169,6 +169,9 @@ delete_server(uint16_t svc_set_id,
  * @param[in] down_retry_interval
  *      The time to wait before retrying a probe (connection attempt) once a 
  *      server is marked down.
+ *
+ * @param[in] balancing_mode
+ *      How servers are picked for new sessions (BALANCING_MODE_*)
  */
 void
 update_application(uint16_t svc_set_id,
@@ -179,7 +182,8 @@ update_application(uint16_t svc_set_id,
                    uint16_t connection_interval,
                    uint16_t connection_timeout,
                    uint8_t timeouts_allowed,
-                   uint16_t down_retry_interval);
+                   uint16_t down_retry_interval,
+                   uint8_t balancing_mode);
 
 
 /**
@@ -193,11 +197,15 @@ update_application(uint16_t svc_set_id,
  * 
  * @param[in] server_addr
  *      The server's address
+ * 
+ * @param[in] weight
+ *      The server's weight
  */
 void
 add_server(uint16_t svc_set_id,
            char * app_name,
-           in_addr_t server_addr);
+           in_addr_t server_addr,
+           uint8_t weight);
 
 
 /**
@@ -33,6 +33,12 @@
 #define RETRY_CONNECT 60
 #define CONNECT_RETRIES    1  ///< max number of connect retries
 
+/**
+ * Max size of a MSG_STATUS_UPDATE message; the session counts of more
+ * applications go out in several messages
+ */
+#define STATUS_BATCH_LEN 4096
+
 
 /*** Data Structures ***/
 
@@ -74,9 +80,134 @@ static void connect_mgmt(evContext ctx, void * uap,
     struct timespec due, struct timespec inter);
 
 
+/**
+ * Fwd declaration of function to send the buffered messages
+ */
+static void process_notifications_messages(evContext ctx, void * uap,
+    struct timespec due, struct timespec inter);
+
+
+/**
+ * Schedule processing the buffered messages again in a few seconds, after
+ * failing to send some of them
+ */
+static void
+retry_notifications(void)
+{
+    if(evSetTimer(main_ctx, process_notifications_messages, NULL,
+            evAddTime(evNowTime(), evConsTime(5, 0)),
+            evConsTime(0, 0), NULL)) {
+
+        LOG(LOG_EMERG, "%s: evSetTimer() failed! Will not be "
+                "able to process buffered notifications", __func__);
+    }
+}
+
+
+/**
+ * Pack the session counts queued at the head of the buffered messages into 
+ * one MSG_STATUS_UPDATE message of up to STATUS_BATCH_LEN bytes and send it.
+ * Should be called with the msgs_lock held, and it is held upon return.
+ * 
+ * @return
+ *      SUCCESS if the message was sent (or there was nothing to send);
+ *      otherwise EFAIL, and the session counts are buffered again
+ */
+static status_t
+send_sessions_batch(void)
+{
+    notification_msg_t * msg;
+    sessions_status_t * session_status, * session_data;
+    char * app_name;
+    uint8_t * data;
+    int rc, len, name_len, rec_len;
+    struct notification_buffer_s batch = TAILQ_HEAD_INITIALIZER(batch);
+    
+    data = malloc(STATUS_BATCH_LEN);
+    INSIST_ERR(data != NULL);
+    len = 0;
+    
+    while((msg = TAILQ_FIRST(&notification_msgs)) != NULL &&
+            msg->action == MSG_STATUS_UPDATE) {
+        
+        session_status = (sessions_status_t *)(msg->message);
+        
+        app_name = get_app_name(
+                session_status->svc_set_id, msg->app_addr, msg->app_port);
+        
+        if(app_name == NULL) { // application is gone; drop its count
+            TAILQ_REMOVE(&notification_msgs, msg, entries);
+            free(msg->message);
+            free(msg);
+            continue;
+        }
+        
+        // keep the next record 4-byte aligned
+        name_len = (strlen(app_name) + 1 + 3) & ~3;
+        rec_len = sizeof(sessions_status_t) + name_len;
+        
+        if(len + rec_len > STATUS_BATCH_LEN) {
+            if(len > 0) {
+                break; // full; the rest goes in the next message
+            }
+            data = realloc(data, rec_len); // lone record is too big anyway
+            INSIST_ERR(data != NULL);
+        }
+        
+        TAILQ_REMOVE(&notification_msgs, msg, entries);
+        TAILQ_INSERT_TAIL(&batch, msg, entries);
+        
+        session_data = (sessions_status_t *)(data + len);
+        session_data->active_sessions = htonl(session_status->active_sessions);
+        session_data->svc_set_id = htons(session_status->svc_set_id);
+        session_data->app_name_len = htons(name_len);
+        strncpy(session_data->app_name, app_name, name_len); // zero pads
+        
+        len += rec_len;
+    }
+    
+    if(len == 0) {
+        free(data);
+        return SUCCESS;
+    }
+    
+    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+    
+    LOG(LOG_INFO, "%s: Sending application status update (%d bytes) to "
+            "mgmt component.", __func__, len);
+    
+    rc = pconn_client_send(mgmt_client, MSG_STATUS_UPDATE, data, len);
+    
+    free(data);
+    
+    INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+    
+    if(rc != PCONN_OK) {
+        // put the counts back in and process soon
+        
+        LOG(LOG_ERR, "%s: Failed to send (%d) to mgmt component."
+                " Error: %d", __func__, MSG_STATUS_UPDATE, rc);
+        
+        TAILQ_CONCAT(&batch, &notification_msgs, entries);
+        TAILQ_CONCAT(&notification_msgs, &batch, entries);
+        
+        return EFAIL;
+    }
+    
+    while((msg = TAILQ_FIRST(&batch)) != NULL) {
+        TAILQ_REMOVE(&batch, msg, entries);
+        free(msg->message);
+        free(msg);
+    }
+    
+    return SUCCESS;
+}
+
+
 /**
  * Go through the buffered messages and send them to the mgmt component 
- * if it's connected.
+ * if it's connected. Consecutive session counts go out together in as few
+ * messages as possible.
  *
  * @param[in] ctx
  *     The event context for this application
@@ -95,9 +226,7 @@ process_notifications_messages(evContext ctx UNUSED, void * uap  UNUSED,
             struct timespec due UNUSED, struct timespec inter UNUSED)
 {
     notification_msg_t * msg;
-    sessions_status_t * session_status, * session_data;
     server_status_t * server_status, * server_data;
-    void * data;
     char * app_name;
     int rc = 0, len;
     
@@ -109,85 +238,69 @@ process_notifications_messages(evContext ctx UNUSED, void * uap  UNUSED,
     
     while((msg = TAILQ_FIRST(&notification_msgs)) != NULL) {
         
+        if(msg->action == MSG_STATUS_UPDATE) {
+            if(send_sessions_batch() != SUCCESS) {
+                break;
+            }
+            continue;
+        }
+        
         TAILQ_REMOVE(&notification_msgs, msg, entries);
         
         INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
         
-        if(msg->action == MSG_STATUS_UPDATE) {
-            session_status = (sessions_status_t *)(msg->message);
-
-            app_name = get_app_name(
-                    session_status->svc_set_id, msg->app_addr, msg->app_port);
-            
-            len = sizeof(sessions_status_t) + strlen(app_name) + 1;
-            session_data = calloc(1, len);
-            INSIST_ERR(session_data != NULL);
-            
-            session_data->active_sessions = session_status->active_sessions;
-            session_data->svc_set_id = session_status->svc_set_id;
-            session_data->app_name_len = strlen(app_name) + 1;
-            strcpy(session_data->app_name, app_name);
-            
-            data = session_data;
-            
-            LOG(LOG_INFO, "%s: Sending application status update to "
-                    "mgmt component.", __func__);
+        server_status = (server_status_t *)(msg->message);
 
-        } else {
-            server_status = (server_status_t *)(msg->message);
-
-            app_name = get_app_name(
-                    server_status->svc_set_id, msg->app_addr, msg->app_port);
-            
-            len = sizeof(server_status_t) + strlen(app_name) + 1;
-            server_data = calloc(1, len);
-            INSIST_ERR(server_data != NULL);
-            
-            server_data->server_status = server_status->server_status;
-            server_data->svc_set_id = server_status->svc_set_id;
-            server_data->server_addr = server_status->server_addr;
-            server_data->app_name_len = strlen(app_name) + 1;
-            strcpy(server_data->app_name, app_name);
-            
-            data = server_data;
-            
-            LOG(LOG_INFO, "%s: Sending server status update to "
-                    "mgmt component.", __func__);
+        app_name = get_app_name(
+                server_status->svc_set_id, msg->app_addr, msg->app_port);
+        
+        if(app_name == NULL) { // application is gone
+            free(msg->message);
+            free(msg);
+            INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+            continue;
         }
         
-        rc = pconn_client_send(mgmt_client, msg->action, data, len);
+        len = sizeof(server_status_t) + strlen(app_name) + 1;
+        server_data = calloc(1, len);
+        INSIST_ERR(server_data != NULL);
+        
+        server_data->server_status = server_status->server_status;
+        server_data->svc_set_id = server_status->svc_set_id;
+        server_data->server_addr = server_status->server_addr;
+        server_data->app_name_len = strlen(app_name) + 1;
+        strcpy(server_data->app_name, app_name);
+        
+        LOG(LOG_INFO, "%s: Sending server status update to "
+                "mgmt component.", __func__);
+        
+        rc = pconn_client_send(mgmt_client, msg->action, server_data, len);
+        
+        free(server_data);
+        
+        INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
       
         if(rc != PCONN_OK) {
             // put message back in and process soon
             
             LOG(LOG_ERR, "%s: Failed to send (%d) to mgmt component."
                     " Error: %d", __func__, msg->action, rc);
-
-            INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
-            
-            TAILQ_INSERT_TAIL(&notification_msgs, msg, entries);
-            
-            INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
             
-            if(evSetTimer(main_ctx, process_notifications_messages, NULL,
-                    evAddTime(evNowTime(), evConsTime(5, 0)),
-                    evConsTime(0, 0), NULL)) {
-
-                LOG(LOG_EMERG, "%s: evSetTimer() failed! Will not be "
-                        "able to process buffered notifications", __func__);
-            }
-        } else {
-            free(msg->message);
-            free(msg);
+            TAILQ_INSERT_HEAD(&notification_msgs, msg, entries);
+            break;
         }
-        free(data);
         
-        INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+        free(msg->message);
+        free(msg);
     }
     
-    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+    if(msg != NULL) { // stopped on a failure
+        INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+        retry_notifications();
+        return;
+    }
     
-    return;
+    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
 }
 
 
@@ -390,8 +503,8 @@ mgmt_client_message(pconn_client_t * session,
         update_application(ntohs(data->svc_set_id),
                data->app_name, data->app_addr, data->app_port,
                ntohs(data->session_timeout), ntohs(data->connection_interval),
-               ntohs(data->connection_timeout), ntohs(data->timeouts_allowed),
-               ntohs(data->down_retry_interval));
+               ntohs(data->connection_timeout), data->timeouts_allowed,
+               ntohs(data->down_retry_interval), data->balancing_mode);
         
         break;
     }
@@ -405,7 +518,7 @@ mgmt_client_message(pconn_client_t * session,
             __func__, data->app_name);
         
         add_server(ntohs(data->svc_set_id), data->app_name,
-                data->server_addr);
+                data->server_addr, data->weight);
         
         break;
     }   
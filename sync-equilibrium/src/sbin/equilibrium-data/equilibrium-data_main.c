@@ -80,7 +80,7 @@ each of the new additions individually for further explanation.
  8                 application-address w.x.y.z;            ##mandatory
  9                 application-port port-number;
 10                 servers {                               ##mandatory
-11                     a.b.c.d;
+11                     a.b.c.d weight number;
 12                     e.f.g.h;
 13                 }
 14                 server-monitor {
@@ -90,10 +90,11 @@ each of the new additions individually for further explanation.
 18                     server-down-retry-interval time-in-seconds;
 19                 }
 20                 session-timeout time-in-seconds;
-21             }
-22         }
-23     }
-24 }
+21                 balancing-mode (least-sessions | consistent-hash);
+22             }
+23         }
+24     }
+25 }
 
 \endverbatim
 <b>Figure 1  The system's extensions to the JUNOS configuration hierarchy.</b>
@@ -134,7 +135,10 @@ of these attributes.
 
 Line 10 introduces the \c servers object. This is a container object for the
 server-address attributes of which there may be up to 99, but at 
-least one. Thus, the servers object is also mandatory.
+least one. Thus, the servers object is also mandatory. Each server may be 
+given a \c weight as on line 11; a server gets a share of the new sessions in
+proportion to its weight. This attribute is optional, and when unspecified, 
+the default value used is 1. The valid range for this attribute is 1-100.
 
 Line 14 sets up the \c server-monitor object. When this optional object 
 is present the servers in the list (inside the servers object) are each 
@@ -146,9 +150,11 @@ state, and hence the system would not direct traffic to them.
 
 Line 15 allows the configuration of \c server-connection-interval, a custom 
 probing interval that the monitor will use. This is measured in seconds. 
-Precisely every time this interval fires after system initialization, a 
-connection to each server in the list will be attempted to verify its state. If
-a connection is made, an HTTP request is sent, and a response is awaited. This 
+Once every interval each server in the list is probed to verify its state; 
+each server at its own point in the interval so that the probes are spread 
+out. A probe sends an HTTP HEAD request and awaits a response. The connection 
+to the server is kept open for the next probe when the server allows it; 
+otherwise a new connection is made for each probe. This 
 attribute is optional, and when unspecified the default value used is 60. The 
 valid range for this attribute is 1-3600.
 
@@ -171,7 +177,7 @@ in seconds. This attribute is optional, and when unspecified, the default value
 used is 300 (which is equivalent to 5 minutes). The valid range for this 
 attribute is 1-3600.
 
-Lastly, line 20 configures a \c session-timeout attribute for each client of the
+Line 20 configures a \c session-timeout attribute for each client of the
 current application that has sent traffic through the system. This is measured 
 in seconds. This attribute is optional, and when unspecified, the default value 
 used is 900 (which is equivalent to 15 minutes). The valid range for this 
@@ -180,6 +186,15 @@ servers' session timeout. The system shall flush out sessions aged by the amount
 of the timeout, where a session's age is effectively incremented every second 
 and reset to new upon observing traffic from the flow.
 
+Lastly, line 21 configures the \c balancing-mode, or how a server is picked 
+for a new session. With \c least-sessions, the less loaded (for its weight) 
+of two servers picked at random is used. With \c consistent-hash, the client 
+address is looked up in a table of the servers built with Maglev hashing, so 
+that a client keeps going to the same server across sessions, and a server 
+going up or down only moves about its own share of the clients. This 
+attribute is optional, and when unspecified, the default value used is 
+least-sessions.
+
 A sample use case is shown in Figure 2 In this sample scenario, 3 servers are
 used for load balancing the normal traffic, and 4 more servers are load 
 balancing the special search traffic. What the servers are used for (normal and 
@@ -398,7 +413,10 @@ normally (until we see the first fragment). This is necessary, since no port
 information is present in trailing fragments, so we cannot determine if the 
 traffic matches that of an application. Also, when we do see the first 
 fragment, we must store the fragment ID, and match on this in trailing 
-fragments as an alternative to the ports in step 3.
+fragments as an alternative to the ports in step 3. The fragment IDs are kept 
+in a small fragment cache per data CPU, apart from the sessions table, and are 
+forgotten after a few seconds. A trailing fragment is looked up in the cache of 
+the CPU it arrives on first, and then in the caches of the other data CPUs.
 
 Another assumption we make is that since HTTP requests may get fragmented (at 
 various levels), we enforce that we must observe the start of the HTTP request 
@@ -438,9 +456,12 @@ management component indicating the server's status.
 
 Furthermore, the monitoring manager has an extra duty when a server goes down. 
 In order to expedite the client being able to reach a new server, the 
-monitoring manager will iterate over the session entries in the flow table 
-searching for flows that are using the server. If any entries are found, they 
-are removed immediately.
+monitoring manager will remove the flows that are using the server immediately. 
+It finds them in an index of the flows by server, rather than iterating over 
+all the session entries in the flow table. The flows of a removed application 
+or service set are likewise found in indexes by application and by service set.
+Each data CPU keeps its own indexes of the flows it creates, so that creating 
+flows never contends for a lock with other data CPUs.
 
 When the monitoring manager probes a server, it requests the root (/) resource 
 from it. As long as a valid HTTP response is returned, the server is assumed up 
@@ -450,21 +471,21 @@ regardless of the response status code.
 
 In this section we concentrate on the aging behaviour. As mentioned in 
 Section \ref cnf_ui_sec "Configuration User Interface", the session aging for 
-each application can be customized using the session-timeout parameter. The 
-aging manager, scheduled on its own thread, will perform this task. If possible 
-it will run attached to a user-type hardware thread. This thread has the shared 
-responsibility of receiving the configuration updates, and it is also the main 
-thread initially bound to a control-type hardware thread.
-
-The aging manager is only scheduled to run every 15 seconds. Its duty is to 
-iterate over the lookup table entries and remove session entries in the table 
-when they have expired. To do this it compares the current time to the session 
-expiration time which was last updated when a packet passed through the system 
-matching this session.
-
-As it does this iteration, it also counts the number of active sessions for 
-each application in each service set. When the iteration has finished it 
-reports these counters to the management component.
+each application can be customized using the session-timeout parameter. Each 
+packet processing thread performs this task for the sessions it created, using 
+its own timer wheel with a one-second tick. The thread advances its wheel 
+between packets, so no other thread ever has to walk the lookup table.
+
+A session is put on the wheel once, when it is created, to fire when it would 
+expire if no more traffic matched it. Packets matching the session only update 
+its timestamp. When its timer fires, the session is removed if it has expired; 
+otherwise it is put back on the wheel to fire at its new expiration time. Thus 
+the aging work is proportional to the number of sessions coming due rather 
+than to the size of the lookup table.
+
+Every 15 seconds, the main thread counts the number of active sessions for 
+each application in each service set and reports these counters to the 
+management component.
 
 \subsubsection snd_sec Sending Status Updates
 
@@ -475,11 +496,12 @@ the data component sends to the management component.
 
 In the first case, the monitoring manager will be sending status updates when a 
 server's state changes. The maximum frequency of these updates depends on the 
-monitor's configuration of course. Secondly, the aging manager sends status 
+monitor's configuration of course. Secondly, the main thread sends status 
 updates about the number of sessions that are assumed to still be active. The 
-frequency of these updates is approximately every 15 seconds, but the content 
-of the message, being the number of active flows, again depends on the 
-session-timeout configuration. Generally we can expect larger numbers when a 
+frequency of these updates is approximately every 15 seconds, but only the 
+counters that changed are sent (all of them are sent every few minutes), and 
+they are packed into as few messages as possible. The counters, being the 
+number of active flows, again depend on the session-timeout configuration. Generally we can expect larger numbers when a 
 longer session-timeout value is configured.
 
 Finally, although the status updates come from managers running on separate 
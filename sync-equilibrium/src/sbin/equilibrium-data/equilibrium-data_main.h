@@ -42,6 +42,11 @@
 
 /*** Constants ***/
 
+/**
+ * Size of a cache line on the data cores
+ */
+#define CACHE_LINE_SIZE 64
+
 /*** Data structures ***/
 
 /*** GLOBAL/EXTERNAL Functions ***/
@@ -35,6 +35,45 @@
 #define LOGM(_level, _fmt...)   \
     LOG((_level), "Server Monitor: " _fmt)
 
+/**
+ * Max sessions a cpu adds to (or removes from) a server before they are
+ * added to the server's shared session count
+ */
+#define SERVER_LOAD_BATCH 16
+
+#define APP_INDEX_MIN_SIZE 64 ///< min # of slots in app_index (power of 2)
+
+#define READER_IDLE 0         ///< Reader epoch of a cpu not using app_index
+
+#define RECLAIM_INTERVAL 1    ///< seconds between freeing retired data
+
+#define MONITOR_READER MSP_MAX_CPUS     ///< reader state of the monitor thread
+
+#define READER_COUNT (MSP_MAX_CPUS + 1) ///< data cpus and the monitor thread
+
+/**
+ * Number of one-second slots in the probe wheel. It is a power of 2 greater
+ * than the longest probe interval (3600) so any probe is at most one turn away
+ */
+#define PROBE_WHEEL_SIZE 4096
+
+#define PROBE_RESPONSE_LEN 512 ///< max bytes read of a probe response
+
+/**
+ * Number of slots in the lookup table of a consistent-hash application. It is
+ * prime so that every server's permutation visits every slot, and much larger
+ * than the max number of servers (99) so that shares match weights closely.
+ */
+#define LOOKUP_TABLE_SIZE 65537
+
+#define LOOKUP_EMPTY 0xFFFF   ///< lookup table slot not yet filled
+
+/**
+ * Every STATS_FULL_INTERVAL-th push of stats reports all applications, not
+ * only those whose session count changed, so the mgmt component resyncs
+ */
+#define STATS_FULL_INTERVAL 20
+
 
 /*** Data structures ***/
 
@@ -45,20 +84,49 @@
 typedef struct mon_app_info_s mon_app_info_t;
 
 
+/**
+ * What the probe of a server is waiting for
+ */
+typedef enum {
+    PROBE_IDLE = 0,      ///< the next probe (may keep the connection open)
+    PROBE_CONNECTING,    ///< the connection to the server
+    PROBE_WAITING        ///< the response to the request sent
+} probe_state_e;
+
+
+/**
+ * The sessions a cpu added to (or removed from) a server and has not yet
+ * added to its shared count, on its own cache line (servers are allocated
+ * aligned to CACHE_LINE_SIZE for this)
+ */
+typedef struct server_load_s {
+    int32_t                  delta;        ///< sessions added (or removed)
+} __attribute__((aligned(CACHE_LINE_SIZE))) server_load_t;
+
+
 /**
  * An item in a server set
  */
 typedef struct mon_server_info_s {
     in_addr_t                server_addr;  ///< server IP address
-    uint32_t                 sessions;     ///< number of sessions active
+    atomic_uint_t            sessions;     ///< approx. number of sessions active
     int                      sock;         ///< fd of socket to this server
-    evTimerID                test_timer;   ///< timer id
     evConnID                 conn_id;      ///< the eventlib socket cnx handle
     evFileID                 file_id;      ///< the eventlib socket read handle 
     mon_app_info_t           * app;        ///< the app this server is in
+    uint8_t                  weight;       ///< share of new sessions
     boolean                  is_up;        ///< server status (knows which set it is in)
     uint16_t                 timeouts;     ///< number of timeouts observed
     TAILQ_ENTRY(mon_server_info_s) entries; ///< next/prev entries
+    probe_state_e            probe_state;  ///< what the probe waits for
+    boolean                  reused;       ///< probe is on a kept connection
+    boolean                  in_wheel;     ///< whether it is in the probe wheel
+    uint32_t                 wheel_slot;   ///< slot in the probe wheel
+    uint32_t                 probe_gen;    ///< changed when probes are stopped
+    TAILQ_ENTRY(mon_server_info_s) wheel_entries; ///< next/prev in wheel slot
+    uint16_t                 resp_len;     ///< length of the response read
+    char                     resp[PROBE_RESPONSE_LEN]; ///< response read
+    server_load_t            load[MSP_MAX_CPUS]; ///< per-cpu uncounted sessions
 } mon_server_info_t;
 
 
@@ -68,6 +136,21 @@ typedef struct mon_server_info_s {
 typedef TAILQ_HEAD(server_info_set_s, mon_server_info_s) server_info_set_t;
 
 
+/**
+ * A read-only copy of an application's up servers used to pick servers in
+ * the data threads without any lock. A new one is published (swapping the
+ * pointer) whenever the up servers, their weights, or the balancing mode
+ * change.
+ */
+typedef struct mon_selector_s {
+    uint32_t                 count;        ///< number of up servers
+    uint32_t                 mask;         ///< mask of the by_addr table
+    uint16_t                 * lookup;     ///< consistent-hash table or NULL
+    mon_server_info_t        ** by_addr;   ///< servers hashed by address
+    mon_server_info_t        * servers[0]; ///< the up servers
+} mon_selector_t;
+
+
 /**
  * The key of a mon_app_info_t
  */
@@ -87,15 +170,68 @@ struct mon_app_info_s {
     mon_app_key_t     key;                  ///< key
     msp_spinlock_t    app_lock;             ///< lock for this application
     eq_smon_t         * server_mon_params;  ///< server monitoring parameters
-    server_info_set_t * up_servers;         ///< up server list, sorted by sessions
+    uint8_t           balancing_mode;       ///< BALANCING_MODE_*
+    volatile uint16_t session_timeout;      ///< session timeout (seconds)
+    server_info_set_t * up_servers;         ///< up server list
     server_info_set_t * down_servers;       ///< down server list
+    mon_selector_t    * volatile selector;  ///< published up servers
+    uint32_t          reported_sessions;    ///< session count last reported
+    boolean           reported;             ///< whether it has been reported
 };
 
 
+/**
+ * A read-only hashtable (open addressing) of the applications used to find
+ * them in the data threads without any lock. A new one is published
+ * (swapping the pointer) whenever applications are added or removed.
+ */
+typedef struct app_index_s {
+    uint32_t          mask;                 ///< mask of the apps table
+    mon_app_info_t    * apps[0];            ///< apps hashed by key
+} app_index_t;
+
+
+/**
+ * The reader state of a cpu, on its own cache line so that entering and
+ * leaving never writes to a line shared with another cpu
+ */
+typedef struct reader_s {
+    volatile uint32_t epoch;  ///< global_epoch upon entering or READER_IDLE
+    uint32_t          seed;   ///< random state for picking servers
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_t;
+
+
+/**
+ * Data waiting to be freed
+ */
+typedef struct retired_s {
+    void *            data;   ///< data to free
+    uint32_t          epoch;  ///< global_epoch when it was retired
+    TAILQ_ENTRY(retired_s) entries; ///< next/prev retired data
+} retired_t;
+
+
 static patroot apps;        ///< patricia tree root of mon_app_info_t's
 static boolean doShutdown;  ///< flag to exit from the main event loop
 static evContext mon_ctx;   ///< monitoring context
 static msp_spinlock_t apps_big_lock; ///< lock for whole apps config (pat tree)
+static app_index_t * volatile app_index; ///< published index of apps
+static reader_t readers[READER_COUNT];   ///< reader state of each cpu
+static volatile uint32_t global_epoch = READER_IDLE + 1; ///< per retire
+static msp_spinlock_t retired_lock;      ///< lock for retired
+static uint32_t wheel_tick;              ///< seconds the probe wheel turned
+static msp_spinlock_t wheel_lock;        ///< lock for probe_wheel
+static uint32_t stats_pushes;            ///< times stats were pushed
+
+/**
+ * Servers by the second their next probe (or probe timeout) is due
+ */
+static server_info_set_t probe_wheel[PROBE_WHEEL_SIZE];
+
+/**
+ * Data no longer published to the data threads in the order it was retired
+ */
+static TAILQ_HEAD(, retired_s) retired = TAILQ_HEAD_INITIALIZER(retired);
 
 /*** STATIC/INTERNAL Functions ***/
 
@@ -108,27 +244,568 @@ PATNODE_TO_STRUCT(app_entry, mon_app_info_t, node)
 
 
 /**
- * Forward declaration of function probe server
+ * Forward declaration of function init_http_connection
+ */
+static status_t
+init_http_connection(mon_server_info_t * server);
+
+
+/**
+ * Get the hash of an application's key
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @return the hash
+ */
+static inline uint32_t
+app_hash(uint16_t ss_id, in_addr_t app_addr, uint16_t app_port)
+{
+    uint32_t h;
+    
+    h = (app_addr ^ (((uint32_t)app_port << 16) | ss_id)) * 0x9E3779B1;
+    return h ^ (h >> 16);
+}
+
+
+/**
+ * Get the hash of a server's address
+ * 
+ * @param[in] server_addr
+ *      Server address
+ * 
+ * @return the hash
+ */
+static inline uint32_t
+server_hash(in_addr_t server_addr)
+{
+    uint32_t h;
+    
+    h = server_addr * 0x9E3779B1;
+    return h ^ (h >> 16);
+}
+
+
+/**
+ * Announce that a cpu starts using the published apps and servers. This
+ * takes no locks and writes only to this cpu's own state.
+ * 
+ * @param[in] cpu
+ *      The current cpu
+ */
+static inline void
+reader_enter(int cpu)
+{
+    readers[cpu].epoch = global_epoch;
+    __sync_synchronize();
+}
+
+
+/**
+ * Announce that a cpu is done using the published apps and servers
+ * 
+ * @param[in] cpu
+ *      The current cpu
+ */
+static inline void
+reader_exit(int cpu)
+{
+    __sync_synchronize();
+    readers[cpu].epoch = READER_IDLE;
+}
+
+
+/**
+ * Free some data that is no longer published to the data threads, once no
+ * cpu can still be using it
+ * 
+ * @param[in] data
+ *      The data (allocated with malloc)
+ */
+static void
+retire(void * data)
+{
+    retired_t * r;
+    uint32_t epoch;
+    
+    if(data == NULL) {
+        return;
+    }
+    
+    r = calloc(1, sizeof(retired_t));
+    INSIST_ERR(r != NULL);
+    r->data = data;
+    
+    INSIST_ERR(msp_spinlock_lock(&retired_lock) == MSP_OK);
+    
+    __sync_synchronize(); // unpublished before the epoch advances
+    
+    r->epoch = epoch = global_epoch;
+    if(++epoch == READER_IDLE) {
+        ++epoch;
+    }
+    global_epoch = epoch;
+    
+    TAILQ_INSERT_TAIL(&retired, r, entries);
+    
+    INSIST_ERR(msp_spinlock_unlock(&retired_lock) == MSP_OK);
+}
+
+
+/**
+ * Free the retired data that no cpu can still be using
+ * 
+ * @param[in] ctx
+ *     The event context for this application
+ * 
+ * @param[in] uap
+ *     The user data for this callback
+ * 
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ * 
+ * @param[in] inter
+ *     The period; when this will next be called 
+ */
+static void
+reclaim_retired(evContext ctx __unused,
+                void * uap __unused,
+                struct timespec due __unused,
+                struct timespec inter __unused)
+{
+    retired_t * r;
+    uint32_t i, epoch, oldest = READER_IDLE;
+    
+    INSIST_ERR(msp_spinlock_lock(&retired_lock) == MSP_OK);
+    
+    __sync_synchronize();
+    
+    // find the oldest epoch of any cpu using published data
+    
+    for(i = 0; i < READER_COUNT; ++i) {
+        epoch = readers[i].epoch;
+        if(epoch != READER_IDLE && (oldest == READER_IDLE ||
+                (int32_t)(epoch - oldest) < 0)) {
+            oldest = epoch;
+        }
+    }
+    
+    // anything retired before that epoch began is no longer in use
+    
+    while((r = TAILQ_FIRST(&retired)) != NULL) {
+        if(oldest != READER_IDLE && (int32_t)(r->epoch - oldest) >= 0) {
+            break;
+        }
+        TAILQ_REMOVE(&retired, r, entries);
+        free(r->data);
+        free(r);
+    }
+    
+    INSIST_ERR(msp_spinlock_unlock(&retired_lock) == MSP_OK);
+}
+
+
+/**
+ * Build and publish the index of all applications for the data threads,
+ * retiring the one it replaces. Should have the apps_big_lock to use this.
+ */
+static void
+publish_app_index(void)
+{
+    app_index_t * index, * old;
+    mon_app_info_t * app;
+    uint32_t i, count = 0, size = APP_INDEX_MIN_SIZE;
+    
+    app = app_entry(patricia_find_next(&apps, NULL));
+    while(app != NULL) {
+        ++count;
+        app = app_entry(patricia_find_next(&apps, &app->node));
+    }
+    
+    while(size < count * 2) { // keep it at most half full
+        size <<= 1;
+    }
+    
+    index = calloc(1, sizeof(app_index_t) + size * sizeof(mon_app_info_t *));
+    INSIST_ERR(index != NULL);
+    index->mask = size - 1;
+    
+    app = app_entry(patricia_find_next(&apps, NULL));
+    while(app != NULL) {
+        i = app_hash(app->key.svc_set_id, app->key.app_addr,
+                app->key.app_port) & index->mask;
+        while(index->apps[i] != NULL) {
+            i = (i + 1) & index->mask;
+        }
+        index->apps[i] = app;
+        app = app_entry(patricia_find_next(&apps, &app->node));
+    }
+    
+    old = app_index;
+    __sync_synchronize(); // built before it is published
+    app_index = index;
+    
+    retire(old);
+}
+
+
+/**
+ * Fill the consistent-hash lookup table of a selector (Maglev). Each server
+ * has its own permutation of the slots derived only from its address. In
+ * turns, each server claims the next free slot in its permutation, once per
+ * unit of weight, until the table is full. Since permutations do not depend
+ * on the other servers, a server going up or down moves only about its own
+ * share of the slots.
+ * 
+ * @param[in] sel
+ *      The selector with its servers and lookup table set
+ */
+static void
+build_lookup(mon_selector_t * sel)
+{
+    uint32_t * offset, * skip, * next;
+    uint32_t i, w, slot, filled = 0;
+    
+    offset = calloc(sel->count * 3, sizeof(uint32_t));
+    INSIST_ERR(offset != NULL);
+    skip = &offset[sel->count];
+    next = &skip[sel->count];
+    
+    for(i = 0; i < sel->count; ++i) {
+        offset[i] = server_hash(sel->servers[i]->server_addr)
+                        % LOOKUP_TABLE_SIZE;
+        skip[i] = server_hash(~sel->servers[i]->server_addr)
+                        % (LOOKUP_TABLE_SIZE - 1) + 1;
+    }
+    
+    memset(sel->lookup, 0xFF, LOOKUP_TABLE_SIZE * sizeof(uint16_t));
+    
+    while(filled < LOOKUP_TABLE_SIZE) {
+        for(i = 0; i < sel->count && filled < LOOKUP_TABLE_SIZE; ++i) {
+            for(w = 0; w < sel->servers[i]->weight
+                    && filled < LOOKUP_TABLE_SIZE; ++w) {
+                do {
+                    slot = (offset[i] + (uint64_t)next[i] * skip[i])
+                                % LOOKUP_TABLE_SIZE;
+                    ++next[i];
+                } while(sel->lookup[slot] != LOOKUP_EMPTY);
+                
+                sel->lookup[slot] = i;
+                ++filled;
+            }
+        }
+    }
+    
+    free(offset);
+}
+
+
+/**
+ * Build and publish the set of up servers of an application for the data
+ * threads (with its lookup table in the consistent-hash mode), retiring the
+ * one it replaces. Should have a lock on the application to use this function.
+ * 
+ * @param[in] app
+ *      The application
+ */
+static void
+publish_selector(mon_app_info_t * app)
+{
+    mon_selector_t * sel, * old;
+    mon_server_info_t * server;
+    uint32_t i, count = 0, size = 1, lookup_size = 0;
+    
+    server = TAILQ_FIRST(app->up_servers);
+    while(server != NULL) {
+        ++count;
+        server = TAILQ_NEXT(server, entries);
+    }
+    
+    while(size < count * 2) { // keep it at most half full
+        size <<= 1;
+    }
+    
+    if(app->balancing_mode == BALANCING_MODE_CONSISTENT_HASH && count > 0) {
+        lookup_size = LOOKUP_TABLE_SIZE;
+    }
+    
+    sel = calloc(1, sizeof(mon_selector_t) +
+            (count + size) * sizeof(mon_server_info_t *) +
+            lookup_size * sizeof(uint16_t));
+    INSIST_ERR(sel != NULL);
+    sel->by_addr = &sel->servers[count];
+    sel->mask = size - 1;
+    
+    if(lookup_size != 0) {
+        sel->lookup = (uint16_t *)&sel->by_addr[size];
+    }
+    
+    server = TAILQ_FIRST(app->up_servers);
+    while(server != NULL) {
+        sel->servers[sel->count++] = server;
+        
+        i = server_hash(server->server_addr) & sel->mask;
+        while(sel->by_addr[i] != NULL) {
+            i = (i + 1) & sel->mask;
+        }
+        sel->by_addr[i] = server;
+        
+        server = TAILQ_NEXT(server, entries);
+    }
+    
+    if(sel->lookup != NULL) {
+        build_lookup(sel);
+    }
+    
+    old = app->selector;
+    __sync_synchronize(); // built before it is published
+    app->selector = sel;
+    
+    retire(old);
+}
+
+
+/**
+ * Retire an application and its published servers once it is no longer in
+ * the published app_index. Its server sets must already be emptied.
+ * 
+ * @param[in] app
+ *      The application
+ */
+static void
+retire_app(mon_app_info_t * app)
+{
+    free(app->down_servers);
+    free(app->up_servers);
+    retire(app->selector);
+    retire(app);
+}
+
+
+/**
+ * Find an application in the published app_index. The caller must have
+ * entered as a reader.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @return the application if found; otherwise NULL
+ */
+static mon_app_info_t *
+find_app(uint16_t ss_id, in_addr_t app_addr, uint16_t app_port)
+{
+    app_index_t * index = app_index;
+    mon_app_info_t * app;
+    uint32_t i;
+    
+    if(index == NULL) {
+        return NULL;
+    }
+    
+    i = app_hash(ss_id, app_addr, app_port) & index->mask;
+    
+    while((app = index->apps[i]) != NULL) {
+        if(app->key.app_addr == app_addr && app->key.app_port == app_port
+           && app->key.svc_set_id == ss_id) {
+            return app;
+        }
+        i = (i + 1) & index->mask;
+    }
+    
+    return NULL;
+}
+
+
+/**
+ * Count sessions added to (or removed from) a server on this cpu, adding them
+ * to the server's shared count only once they reach SERVER_LOAD_BATCH
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @param[in] cpu
+ *      The current cpu
+ * 
+ * @param[in] change
+ *      The number of sessions added (or removed if negative)
+ */
+static inline void
+update_load(mon_server_info_t * server, int cpu, int32_t change)
+{
+    server_load_t * load = &server->load[cpu];
+    
+    load->delta += change;
+    
+    if(load->delta >= SERVER_LOAD_BATCH || load->delta <= -SERVER_LOAD_BATCH) {
+        atomic_add_uint((uint32_t)load->delta, &server->sessions);
+        load->delta = 0;
+    }
+}
+
+
+/**
+ * Get the approximate load of a server as seen by this cpu
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @param[in] cpu
+ *      The current cpu
+ * 
+ * @return the approximate number of sessions
+ */
+static inline int32_t
+approx_load(mon_server_info_t * server, int cpu)
+{
+    return (int32_t)server->sessions + server->load[cpu].delta;
+}
+
+
+/**
+ * Get the number of sessions of a server including those not yet added to its
+ * shared count
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @return the number of sessions
+ */
+static uint32_t
+server_sessions(mon_server_info_t * server)
+{
+    int32_t total;
+    int i;
+    
+    total = (int32_t)server->sessions;
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        total += server->load[i].delta;
+    }
+    
+    return (total < 0) ? 0 : total;
+}
+
+
+/**
+ * Reset the session counts of a server (when it changes sets)
+ * 
+ * @param[in] server
+ *      The server
  */
 static void
-probe_server(evContext c, void * u, struct timespec d, struct timespec i);
+reset_load(mon_server_info_t * server)
+{
+    int i;
+    
+    server->sessions = 0;
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        server->load[i].delta = 0;
+    }
+}
+
+
+/**
+ * Get the next pseudo-random number of this cpu (xorshift)
+ * 
+ * @param[in] cpu
+ *      The current cpu
+ * 
+ * @return the pseudo-random number
+ */
+static inline uint32_t
+next_random(int cpu)
+{
+    uint32_t x = readers[cpu].seed;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    readers[cpu].seed = x;
+    
+    return x;
+}
+
+
+/**
+ * Schedule the next probe of a server, or the timeout of its current probe,
+ * in the probe wheel. Should have a lock on the application of the server to
+ * use this function.
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @param[in] delay
+ *      The number of seconds from now
+ */
+static void
+schedule_probe(mon_server_info_t * server, uint32_t delay)
+{
+    if(delay == 0) {
+        delay = 1;
+    } else if(delay >= PROBE_WHEEL_SIZE) {
+        delay = PROBE_WHEEL_SIZE - 1;
+    }
+    
+    // Get wheel lock
+    INSIST_ERR(msp_spinlock_lock(&wheel_lock) == MSP_OK);
+    
+    if(server->in_wheel) {
+        TAILQ_REMOVE(&probe_wheel[server->wheel_slot], server, wheel_entries);
+    }
+    
+    server->wheel_slot = (wheel_tick + delay) & (PROBE_WHEEL_SIZE - 1);
+    server->in_wheel = TRUE;
+    TAILQ_INSERT_TAIL(&probe_wheel[server->wheel_slot], server, wheel_entries);
+    
+    // Release wheel lock
+    INSIST_ERR(msp_spinlock_unlock(&wheel_lock) == MSP_OK);
+}
+
+
+/**
+ * Get the delay until the next regular probe of a server. Each server is
+ * probed at its own phase of the interval (from its address), so the probes
+ * of many servers configured at once are spread over the interval.
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @param[in] interval
+ *      The probe interval in seconds
+ * 
+ * @return the number of seconds from now (1 to interval)
+ */
+static uint32_t
+probe_delay(mon_server_info_t * server, uint32_t interval)
+{
+    uint32_t phase = server_hash(server->server_addr) % interval;
+    
+    return interval - (wheel_tick + phase) % interval;
+}
 
 
 /**
- * Stop any timers and shutdown any probe socket connections to the server.
- * Should have a lock on the application of the server to use this function.
+ * Shutdown any probe socket connection to the server, leaving any scheduled
+ * probe. Should have a lock on the application of the server to use this
+ * function.
  * 
  * @param[in] server
  *      The server
  */
 static void
-stop_server_probes(mon_server_info_t * server)
+close_probe_connection(mon_server_info_t * server)
 {
-    if(evTestID(server->test_timer)) {
-        evClearTimer(mon_ctx, server->test_timer);
-        evInitID(&server->test_timer);
-    }
-    
     if(evTestID(server->file_id)) {
         evDeselectFD(mon_ctx, server->file_id);
         evInitID(&server->file_id);
@@ -144,12 +821,42 @@ stop_server_probes(mon_server_info_t * server)
     }
 
     server->sock = -1;
+    server->probe_state = PROBE_IDLE;
+    server->reused = FALSE;
+}
+
+
+/**
+ * Unschedule any probe and shutdown any probe socket connections to the
+ * server. Should have a lock on the application of the server to use this
+ * function.
+ * 
+ * @param[in] server
+ *      The server
+ */
+static void
+stop_server_probes(mon_server_info_t * server)
+{
+    // Get wheel lock
+    INSIST_ERR(msp_spinlock_lock(&wheel_lock) == MSP_OK);
+    
+    if(server->in_wheel) {
+        TAILQ_REMOVE(&probe_wheel[server->wheel_slot], server, wheel_entries);
+        server->in_wheel = FALSE;
+    }
+    
+    ++server->probe_gen; // in case probe_tick has just taken it off the wheel
+    
+    // Release wheel lock
+    INSIST_ERR(msp_spinlock_unlock(&wheel_lock) == MSP_OK);
+    
+    close_probe_connection(server);
 }
 
 
 /**
- * When a server probe timeout occurs or connection fails, set timers 
- * appropriately and move server depending on timeouts reached.
+ * When a server probe timeout occurs or connection fails, schedule the next
+ * probe and move server depending on timeouts reached.
  * Should have a lock on the application of the server to use this function.
  * 
  * @param[in] server
@@ -158,10 +865,9 @@ stop_server_probes(mon_server_info_t * server)
 static void
 server_probe_failed(mon_server_info_t * server)
 {
-    struct in_addr addr;
     mon_app_info_t * app = server->app;
     
-    stop_server_probes(server);
+    close_probe_connection(server);
     
     // check if the timeouts have surpassed the allowed number 
     // and we mark the server down if so
@@ -170,32 +876,21 @@ server_probe_failed(mon_server_info_t * server)
 
         // still ok, so schedule next probe to server with connection_interval
         
-        if(evSetTimer(mon_ctx, probe_server, server, evAddTime(evNowTime(),
-            evConsTime(app->server_mon_params->connection_interval, 0)),
-            evConsTime(0, 0), &server->test_timer)) {
-
-            addr.s_addr = server->server_addr; // for inet_ntoa
-            LOGM(LOG_EMERG, "%s: Failed to initialize a probe timer to probe "
-                "server %s (Error: %m)", __func__, inet_ntoa(addr));
-        }
+        schedule_probe(server,
+                probe_delay(server, app->server_mon_params->connection_interval));
     } else {
         // server is down, use down_retry_interval
         
-        if(evSetTimer(mon_ctx, probe_server, server, evAddTime(evNowTime(),
-            evConsTime(app->server_mon_params->down_retry_interval, 0)),
-            evConsTime(0, 0), &server->test_timer)) {
-
-            addr.s_addr = server->server_addr; // for inet_ntoa
-            LOGM(LOG_EMERG, "%s: Failed to initialize a probe timer to probe "
-                "server %s (Error: %m)", __func__, inet_ntoa(addr));
-        }
+        schedule_probe(server,
+                probe_delay(server, app->server_mon_params->down_retry_interval));
         
         // it is was previously up, take it down
         if(server->is_up) {
             server->is_up = FALSE;
-            server->sessions = 0;
+            reset_load(server);
             TAILQ_REMOVE(app->up_servers, server, entries);
             TAILQ_INSERT_HEAD(app->down_servers, server, entries);
+            publish_selector(app);
             
             notify_server_status(app->key.svc_set_id, app->key.app_addr,
                     app->key.app_port, server->server_addr, SERVER_STATUS_DOWN);
@@ -207,6 +902,83 @@ server_probe_failed(mon_server_info_t * server)
 }
 
 
+/**
+ * When a server probe gets an HTTP response, schedule the next probe and
+ * move the server up if it was down.
+ * Should have a lock on the application of the server to use this function.
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @param[in] keep_open
+ *      Whether to keep the connection open for the next probe
+ */
+static void
+server_probe_succeeded(mon_server_info_t * server, boolean keep_open)
+{
+    mon_app_info_t * app = server->app;
+    
+    if(keep_open) {
+        server->probe_state = PROBE_IDLE; // keep reading to see it close
+    } else {
+        close_probe_connection(server);
+    }
+    
+    // server is ok, so schedule next probe to server with connection_interval
+    schedule_probe(server,
+            probe_delay(server, app->server_mon_params->connection_interval));
+    
+    // it is was previously down, take it up
+    if(!server->is_up) {
+        server->is_up = TRUE;
+        reset_load(server);
+        TAILQ_REMOVE(app->down_servers, server, entries);
+        TAILQ_INSERT_HEAD(app->up_servers, server, entries);
+        publish_selector(app);
+        
+        notify_server_status(app->key.svc_set_id, app->key.app_addr,
+                app->key.app_port, server->server_addr, SERVER_STATUS_UP);
+    }
+    
+    server->timeouts = 0; // reset
+}
+
+
+/**
+ * Send the HTTP request of a probe on the server's connection. It is a HEAD
+ * request so the response has no body to read before the connection can be
+ * used again.
+ * Should have a lock on the application of the server to use this function.
+ * 
+ * @param[in] server
+ *      The server
+ * 
+ * @return SUCCESS upon sending the request; otherwise EFAIL
+ */
+static status_t
+send_probe_request(mon_server_info_t * server)
+{
+    const char * HEAD_REQ = "HEAD / HTTP/1.1\r\nHost: %s\r\n\r\n";
+    const uint8_t BUF_LEN = 64;
+    char buf[BUF_LEN];
+    struct in_addr addr;
+    
+    addr.s_addr = server->server_addr; // for inet_ntoa
+    snprintf(buf, BUF_LEN, HEAD_REQ, inet_ntoa(addr));
+    
+    server->resp_len = 0;
+    server->probe_state = PROBE_WAITING;
+    
+    if(send(server->sock, buf, strlen(buf), 0) == -1) {
+        LOGM(LOG_ERR, "%s: failed to send HTTP request to %s (Error: %m)",
+                __func__, inet_ntoa(addr));
+        return EFAIL;
+    }
+    
+    return SUCCESS;
+}
+
+
 /**
  * Read messages from an HTTP server sending us a response
  * 
@@ -228,16 +1000,15 @@ http_read(evContext ctx __unused,
           int fd __unused,
           int evmask __unused)
 {
-    const uint8_t BUF_LEN  = 64;
     mon_server_info_t * server = (mon_server_info_t *)uap;
     mon_app_info_t * app;
     struct in_addr addr;
-    char buf[BUF_LEN];
+    boolean keep_open;
+    char * end;
     int rc;
     
     INSIST_ERR(server != NULL);
     app = server->app;
-    bzero(buf, BUF_LEN);
     
     // Get application lock
     INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
@@ -254,75 +1025,79 @@ http_read(evContext ctx __unused,
     
     addr.s_addr = server->server_addr; // for inet_ntoa
 
-    // Validate that it is an HTTP response
-    if((rc = recv(server->sock, buf, BUF_LEN - 1, 0)) < 0) {
-        
-        LOGM(LOG_WARNING, "%s: Probe to server %s did not get an HTTP "
-            "response (Error: %m)", __func__, inet_ntoa(addr));
-        
-        server_probe_failed(server);
+    rc = recv(server->sock, server->resp + server->resp_len,
+            PROBE_RESPONSE_LEN - 1 - server->resp_len, 0);
+    
+    if(server->probe_state != PROBE_WAITING) {
+        // the server closed (or wrote to) the connection kept for next probe
+        close_probe_connection(server);
         
         // Release application lock
         INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
         return;
-        
-    } else {
-        if(rc < 3) {
-            LOGM(LOG_WARNING, "%s: Probe to server %s did not get a long enough"
-                    "response to tell if it was an HTTP response (Content: %s)",
-                    __func__, inet_ntoa(addr), buf);
-            
-            server_probe_failed(server);
+    }
+    
+    if(rc <= 0) {
+        if(server->reused && server->resp_len == 0) {
+            // the server closed the kept connection before getting the
+            // request, so it is not a failure; just connect again
             
-            // Release application lock
-            INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-            return;
+            close_probe_connection(server);
             
-        } else if(strnstr(buf, "HTTP", 4) == NULL) {
-
+            if(init_http_connection(server) != SUCCESS) {
+                server_probe_failed(server);
+            }
+        } else {
             LOGM(LOG_WARNING, "%s: Probe to server %s did not get an HTTP "
-                "response (Content: %s)", __func__, inet_ntoa(addr), buf);
+                "response (Error: %m)", __func__, inet_ntoa(addr));
             
             server_probe_failed(server);
-            
-            // Release application lock
-            INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-            return;
         }
+        
+        // Release application lock
+        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+        return;
     }
     
-    LOGM(LOG_INFO, "%s: Probe to server %s returned an HTTP response",
-            __func__, inet_ntoa(addr));
+    server->resp_len += rc;
+    server->resp[server->resp_len] = '\0';
     
-    stop_server_probes(server);
+    // Validate that it is an HTTP response once we have enough to tell
     
-    // server is ok, so schedule next probe to server with connection_interval
-    if(evSetTimer(mon_ctx, probe_server, server, evAddTime(evNowTime(),
-            evConsTime(app->server_mon_params->connection_interval, 0)),
-            evConsTime(0, 0), &server->test_timer)) {
+    if(server->resp_len < 5) {
+        // Release application lock
+        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+        return; // wait for more, the probe timeout still applies
+    }
+    
+    if(strncmp(server->resp, "HTTP/", 5) != 0) {
 
-        addr.s_addr = server->server_addr; // for inet_ntoa
-        LOGM(LOG_EMERG, "%s: Failed to initialize a probe timer to probe "
-            "server %s (Error: %m)", __func__, inet_ntoa(addr));
+        LOGM(LOG_WARNING, "%s: Probe to server %s did not get an HTTP "
+            "response (Content: %s)", __func__, inet_ntoa(addr), server->resp);
+        
+        server_probe_failed(server);
         
         // Release application lock
         INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
         return;
     }
     
-    // it is was previously down, take it up
-    if(!server->is_up) {
-        server->is_up = TRUE;
-        server->sessions = 0;
-        TAILQ_REMOVE(app->down_servers, server, entries);
-        TAILQ_INSERT_HEAD(app->up_servers, server, entries);
-        
-        notify_server_status(server->app->key.svc_set_id,
-                server->app->key.app_addr, server->app->key.app_port,
-                server->server_addr, SERVER_STATUS_UP);
+    end = strstr(server->resp, "\r\n\r\n");
+    
+    if(end == NULL && server->resp_len < PROBE_RESPONSE_LEN - 1) {
+        // Release application lock
+        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+        return; // wait for the rest of the headers
     }
     
-    server->timeouts = 0; // reset
+    // keep the connection for the next probe if we read the whole response
+    // and the server allows it
+    
+    keep_open = (end != NULL && end[4] == '\0' &&
+            strncmp(server->resp, "HTTP/1.1", 8) == 0 &&
+            strcasestr(server->resp, "\r\nConnection: close") == NULL);
+    
+    server_probe_succeeded(server, keep_open);
     
     // Release application lock
     INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
@@ -359,9 +1134,6 @@ http_connect(evContext ctx __unused, void * uap, int fd,
              const void *la __unused, int lalen __unused,
              const void *ra __unused, int ralen __unused)
 {
-    const char * GET_REQ = "GET / HTTP/1.1\nHost: %s\n\n";
-    const uint8_t BUF_LEN = 255;
-    char buf[BUF_LEN];
     mon_server_info_t * server;
     mon_app_info_t * app;
     struct in_addr addr;
@@ -371,8 +1143,6 @@ http_connect(evContext ctx __unused, void * uap, int fd,
     
     app = server->app;
     
-    bzero(buf, BUF_LEN);
-    
     // Get application lock
     INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
 
@@ -403,7 +1173,7 @@ http_connect(evContext ctx __unused, void * uap, int fd,
     LOGM(LOG_INFO, "%s: Connected to server %s. Sending HTTP Request...",
             __func__, inet_ntoa(addr));
     
-    // setup reading callback
+    // setup reading callback, kept while the connection is
     evInitID(&server->file_id);
     if(evSelectFD(mon_ctx, server->sock, EV_READ, http_read, server,
             &server->file_id)) {
@@ -411,71 +1181,9 @@ http_connect(evContext ctx __unused, void * uap, int fd,
         LOGM(LOG_ERR, "%s: evSelectFD failed (Error: %m)", __func__);
         server_probe_failed(server);
 
-    } else {
-        // Send HTTP GET Request
-        
-        sprintf(buf, GET_REQ, inet_ntoa(addr));
-        if(send(server->sock, buf, strlen(buf), 0) == -1) {
-
-            LOGM(LOG_ERR, "%s: failed to send HTTP request to %s (Error: %m)",
-                    __func__, inet_ntoa(addr));
-            server_probe_failed(server);
-        } else {
-            LOGM(LOG_INFO, "%s: Sent HTTP Request to %s",
-                __func__, inet_ntoa(addr));
-        }
-    }
-    
-    // Release application lock
-    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-}
-
-
-/**
- * Timeout for the probe the server is hit
- * 
- * @param[in] ctx
- *     The event context for this application
- * 
- * @param[in] uap
- *     The user data for this callback
- * 
- * @param[in] due
- *     The absolute time when the event is due (now)
- * 
- * @param[in] inter
- *     The period; when this will next be called 
- */
-static void
-probe_timeout(evContext ctx __unused,
-            void * uap,
-            struct timespec due __unused,
-            struct timespec inter __unused)
-{
-    mon_server_info_t * server = (mon_server_info_t *)uap;
-    mon_app_info_t * app;
-    struct in_addr addr;
-    
-    INSIST_ERR(server != NULL);
-    app = server->app;
-    
-    // Get application lock
-    INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
-
-    addr.s_addr = server->server_addr; // for inet_ntoa
-    
-    if(app->server_mon_params == NULL) {
-        // Release application lock
-        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-        LOGM(LOG_ERR, "%s: Probe timeout for server %s in an application with "
-            "no server monitoring parameters", __func__, inet_ntoa(addr));
-        return;
+    } else if(send_probe_request(server) != SUCCESS) {
+        server_probe_failed(server);
     }
-
-    LOGM(LOG_INFO, "%s: Probe timeout for server %s",
-            __func__, inet_ntoa(addr));
-    
-    server_probe_failed(server);
     
     // Release application lock
     INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
@@ -536,6 +1244,9 @@ init_http_connection(mon_server_info_t * server)
     addr.s_addr = server->server_addr; // for inet_ntoa
     LOGM(LOG_INFO,"%s: Connecting to server %s", __func__, inet_ntoa(addr));
     
+    server->probe_state = PROBE_CONNECTING;
+    server->reused = FALSE;
+    
     // setup reading callback
     evInitID(&server->conn_id);
     if(evConnect(mon_ctx, server->sock, (struct sockaddr *)&server_addr,
@@ -545,78 +1256,49 @@ init_http_connection(mon_server_info_t * server)
                 __func__, inet_ntoa(addr));
         close(server->sock);
         server->sock = -1;
+        server->probe_state = PROBE_IDLE;
         return EFAIL;
     }
     
-    // schedule timeout for probe to server
-    if(evSetTimer(mon_ctx, probe_timeout, server, evAddTime(evNowTime(),
-            evConsTime(server->app->server_mon_params->connection_timeout, 0)),
-            evConsTime(0, 0), &server->test_timer)) {
-        
-        LOGM(LOG_EMERG, "%s: Failed to initialize a probe timeout timer for "
-            "probe to server %s (Error: %m)", __func__, inet_ntoa(addr));
-    }
-    
     return SUCCESS;
 }
 
 
 /**
- * Probe the server
- * 
- * @param[in] ctx
- *     The event context for this application
- * 
- * @param[in] uap
- *     The user data for this callback
- * 
- * @param[in] due
- *     The absolute time when the event is due (now)
+ * Start a probe of the server. The request goes on the connection kept from
+ * the last probe if there is one; otherwise we connect first. Either way the
+ * probe fails if it gets no HTTP response within the connection timeout.
+ * Should have a lock on the application of the server to use this function.
  * 
- * @param[in] inter
- *     The period; when this will next be called 
+ * @param[in] server
+ *      The server
  */
 static void
-probe_server(evContext ctx __unused,
-            void * uap,
-            struct timespec due __unused,
-            struct timespec inter __unused)
+start_probe(mon_server_info_t * server)
 {
-    mon_server_info_t * server = (mon_server_info_t *)uap;
-    mon_app_info_t * app;
-    struct in_addr addr;
-    
-    INSIST_ERR(server != NULL);
-    app = server->app;
-    
-    // Get application lock
-    INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
-    
-    if(evTestID(server->test_timer)) {
-        evClearTimer(mon_ctx, server->test_timer);
-        evInitID(&server->test_timer);
-    }
+    // schedule timeout for probe to server
+    schedule_probe(server, server->app->server_mon_params->connection_timeout);
     
-    if(app->server_mon_params == NULL) {
-        addr.s_addr = server->server_addr; // for inet_ntoa
-        // Release application lock
-        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-        LOGM(LOG_ERR, "%s: Request to probe server %s in an application with no "
-            "server monitoring parameters", __func__, inet_ntoa(addr));
-        return;
+    if(server->sock != -1) {
+        server->reused = TRUE;
+        
+        if(send_probe_request(server) == SUCCESS) {
+            return;
+        }
+        
+        close_probe_connection(server); // try a new connection
     }
     
     if(init_http_connection(server) != SUCCESS) {
         server_probe_failed(server);
     }
-    
-    // Release application lock
-    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
 }
 
 
 /**
- * Dummy keep-alive function
+ * Advance the probe wheel by one second: start the probes due now, and fail
+ * the probes timing out now. This one timer replaces the probe and timeout
+ * timers of every server.
  * 
  * @param[in] ctx
  *     The event context for this application
@@ -631,12 +1313,62 @@ probe_server(evContext ctx __unused,
  *     The period; when this will next be called 
  */
 static void
-keep_alive(evContext ctx __unused,
+probe_tick(evContext ctx __unused,
            void * uap __unused,
            struct timespec due __unused,
            struct timespec inter __unused)
 {
-
+    mon_server_info_t * server;
+    mon_app_info_t * app;
+    struct in_addr addr;
+    uint32_t slot, gen;
+    
+    // servers (and apps) taken off the wheel are not freed until we are done
+    reader_enter(MONITOR_READER);
+    
+    // Get wheel lock
+    INSIST_ERR(msp_spinlock_lock(&wheel_lock) == MSP_OK);
+    
+    slot = ++wheel_tick & (PROBE_WHEEL_SIZE - 1);
+    
+    while((server = TAILQ_FIRST(&probe_wheel[slot])) != NULL) {
+        TAILQ_REMOVE(&probe_wheel[slot], server, wheel_entries);
+        server->in_wheel = FALSE;
+        gen = server->probe_gen;
+        app = server->app;
+        
+        // Release wheel lock (it is taken after application locks)
+        INSIST_ERR(msp_spinlock_unlock(&wheel_lock) == MSP_OK);
+        
+        // Get application lock
+        INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
+        
+        // skip it if its probes were stopped or rescheduled meanwhile
+        if(server->probe_gen == gen && !server->in_wheel &&
+                app->server_mon_params != NULL) {
+            
+            if(server->probe_state == PROBE_IDLE) {
+                start_probe(server);
+            } else {
+                addr.s_addr = server->server_addr; // for inet_ntoa
+                LOGM(LOG_INFO, "%s: Probe timeout for server %s",
+                        __func__, inet_ntoa(addr));
+                
+                server_probe_failed(server);
+            }
+        }
+        
+        // Release application lock
+        INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+        
+        // Get wheel lock
+        INSIST_ERR(msp_spinlock_lock(&wheel_lock) == MSP_OK);
+    }
+    
+    // Release wheel lock
+    INSIST_ERR(msp_spinlock_unlock(&wheel_lock) == MSP_OK);
+    
+    reader_exit(MONITOR_READER);
 }
 
 
@@ -651,17 +1383,15 @@ keep_alive(evContext ctx __unused,
 static void *
 start_monitor(void * params __unused)
 {
-    const int KEEP_ALIVE = 5; //900;
     evEvent event;
     int rc = 0;
     
     INSIST_ERR(evCreate(&mon_ctx) != -1);
     
-    // Give the context a dummy event to keep it alive
-    if(evSetTimer(mon_ctx, keep_alive, NULL, evConsTime(0, 0),
-            evConsTime(KEEP_ALIVE, 0), NULL)) {
-        LOGM(LOG_EMERG, "%s: Failed to initialize main loop's keep alive timer",
-            __func__);
+    // Start probing (which also keeps the context alive)
+    if(evSetTimer(mon_ctx, probe_tick, NULL, evNowTime(),
+            evConsTime(1, 0), NULL)) {
+        LOGM(LOG_EMERG, "%s: Failed to initialize the probe timer", __func__);
         return NULL;
     }
     
@@ -705,8 +1435,28 @@ init_monitor(evContext ctx, int cpu)
 {
     pthread_attr_t attr;
     pthread_t tid;
+    int i;
+    
+    msp_spinlock_init(&apps_big_lock);
+    msp_spinlock_init(&retired_lock);
+    msp_spinlock_init(&wheel_lock);
+    
+    for(i = 0; i < READER_COUNT; ++i) {
+        readers[i].epoch = READER_IDLE;
+        readers[i].seed = 0x9E3779B9 * (i + 1); // any non-zero seed
+    }
     
-    msp_spinlock_init(&apps_big_lock);
+    for(i = 0; i < PROBE_WHEEL_SIZE; ++i) {
+        TAILQ_INIT(&probe_wheel[i]);
+    }
+    
+    // free what the data threads may still be using periodically
+    if(evSetTimer(ctx, reclaim_retired, NULL, evNowTime(),
+            evConsTime(RECLAIM_INTERVAL, 0), NULL)) {
+        LOG(LOG_EMERG, "%s: Failed to initialize a timer to free retired "
+            "monitor data (Error: %m)", __func__);
+        return EFAIL;
+    }
     
     patricia_root_init(&apps, FALSE, sizeof(mon_app_key_t), 0);
                    // root, is key ptr, key size, key offset
@@ -715,6 +1465,15 @@ init_monitor(evContext ctx, int cpu)
         // There's no other user CPU to bind to, so use whatever we are
         // currently bound to  
         mon_ctx = ctx; // use the main event context
+        
+        // Start probing
+        if(evSetTimer(mon_ctx, probe_tick, NULL, evNowTime(),
+                evConsTime(1, 0), NULL)) {
+            LOG(LOG_EMERG, "%s: Failed to initialize the probe timer "
+                "(Error: %m)", __func__);
+            return EFAIL;
+        }
+        
         return SUCCESS;
     }
     
@@ -781,22 +1540,22 @@ shutdown_monitor(void)
         while((server = TAILQ_FIRST(app->up_servers)) != NULL) {
             stop_server_probes(server);
             TAILQ_REMOVE(app->up_servers, server, entries);
-            free(server);
+            retire(server);
         }
-        free(app->up_servers);
         
         while((server = TAILQ_FIRST(app->down_servers)) != NULL) {
             stop_server_probes(server);
-            TAILQ_REMOVE(app->up_servers, server, entries);
-            free(server);
+            TAILQ_REMOVE(app->down_servers, server, entries);
+            retire(server);
         }
-        free(app->down_servers);
         
         patricia_delete(&apps, &app->node);
         
-        free(app);
+        retire_app(app);
     }
     
+    publish_app_index();
+    
     // Release big lock
     INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
 }
@@ -817,17 +1576,31 @@ shutdown_monitor(void)
  * @param[in] server_addr
  *      The server address, of the server within that application
  *
+ * @param[in] weight
+ *      The server's share of new sessions relative to the other servers
+ *
  * @param[in] monitor
  *      The server monitoring parameters (all servers in the same 
  *      application must have the same monitor). If NULL, then server 
  *      is not monitored and assumed UP.
+ *
+ * @param[in] balancing_mode
+ *      The balancing mode of the application (BALANCING_MODE_*), only used
+ *      when this is the application's first server
+ *
+ * @param[in] session_timeout
+ *      The session timeout of the application, only used when this is the
+ *      application's first server
  */
 void
 monitor_add_server(uint16_t ss_id,
                    in_addr_t app_addr,
                    uint16_t app_port,
                    in_addr_t server_addr,
-                   eq_smon_t * monitor)
+                   uint8_t weight,
+                   eq_smon_t * monitor,
+                   uint8_t balancing_mode,
+                   uint16_t session_timeout)
 {
     mon_app_key_t key;
     mon_app_info_t * app;
@@ -869,10 +1642,14 @@ monitor_add_server(uint16_t ss_id,
             return;
         }
         
+        publish_app_index();
+        
         // Release big lock
         INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
         
         app->server_mon_params = monitor;
+        app->balancing_mode = balancing_mode;
+        app->session_timeout = session_timeout;
         
         app->down_servers = malloc(sizeof(server_info_set_t));
         INSIST_ERR(app->down_servers != NULL);
@@ -899,7 +1676,7 @@ monitor_add_server(uint16_t ss_id,
                     LOG(LOG_ERR, "%s: Server already exists in monitor config",
                             __func__);
                     // Release application lock
-                    INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
+                    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
                     return;
                 }
                 server = TAILQ_NEXT(server, entries);            
@@ -914,7 +1691,7 @@ monitor_add_server(uint16_t ss_id,
                     LOG(LOG_ERR, "%s: Server already exists in monitor config",
                             __func__);
                     // Release application lock
-                    INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
+                    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
                     return;
                 }
                 server = TAILQ_NEXT(server, entries);            
@@ -927,15 +1704,17 @@ monitor_add_server(uint16_t ss_id,
             LOG(LOG_ERR, "%s: monitor configuration does not match existing "
                     "monitor configuration for this application", __func__);
             // Release application lock
-            INSIST_ERR(msp_spinlock_lock(&app->app_lock) == MSP_OK);
+            INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
             return;
         }
     }
     
-    // add the server
-    server = calloc(1, sizeof(mon_server_info_t));
-    INSIST_ERR(server != NULL);
+    // add the server (aligned so that each cpu's load is on its own line)
+    INSIST_ERR(posix_memalign((void **)&server, CACHE_LINE_SIZE,
+            sizeof(mon_server_info_t)) == 0);
+    bzero(server, sizeof(mon_server_info_t));
     server->server_addr = server_addr;
+    server->weight = (weight == 0) ? 1 : weight; // every server gets a share
     server->app = app;
     server->sock = -1;
     
@@ -945,16 +1724,11 @@ monitor_add_server(uint16_t ss_id,
         TAILQ_INSERT_TAIL(app->down_servers, server, entries);
         
         // schedule probe to server immediately
-        if(evSetTimer(mon_ctx, probe_server, server, evConsTime(0, 0),
-                evConsTime(0, 0), &server->test_timer)) {
-            addr.s_addr = server_addr; // for inet_ntoa
-            LOG(LOG_EMERG, "%s: Failed to initialize a probe timer to "
-                "probe server %s (Error: %m)", __func__, inet_ntoa(addr));
-        }
+        schedule_probe(server, 1);
     } else {
         server->is_up = TRUE;
-        // insert at the head since it is sorted by server->sessions
         TAILQ_INSERT_HEAD(app->up_servers, server, entries);
+        publish_selector(app);
         
         addr.s_addr = server_addr; // for inet_ntoa
         LOG(LOG_INFO, "%s: Added (permanently UP) server %s",
@@ -1053,10 +1827,14 @@ monitor_remove_server(uint16_t ss_id,
     
     stop_server_probes(server);
     
+    if(server->is_up) {
+        publish_selector(app);
+    }
+    
     clean_sessions_using_server(app->key.svc_set_id,
             app->key.app_addr, app->key.app_port, server->server_addr);
     
-    free(server);
+    retire(server);
     
     // check if we have any servers left
     if(TAILQ_EMPTY(app->up_servers) && TAILQ_EMPTY(app->down_servers)) {
@@ -1074,13 +1852,13 @@ monitor_remove_server(uint16_t ss_id,
                     __func__);
             return;
         }
+        
+        publish_app_index();
 
         // Release big lock
         INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
         
-        free(app->down_servers);
-        free(app->up_servers);
-        free(app);
+        retire_app(app);
     } else {
         // Release application lock
         INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
@@ -1142,6 +1920,8 @@ monitor_remove_all_servers_in_app(uint16_t ss_id,
                 __func__);
         return;
     }
+    
+    publish_app_index();
 
     // Release big lock
     INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
@@ -1150,20 +1930,18 @@ monitor_remove_all_servers_in_app(uint16_t ss_id,
     while((server = TAILQ_FIRST(app->up_servers)) != NULL) {
         stop_server_probes(server);
         TAILQ_REMOVE(app->up_servers, server, entries);
-        free(server);
+        retire(server);
     }
     while((server = TAILQ_FIRST(app->down_servers)) != NULL) {
         stop_server_probes(server);
         TAILQ_REMOVE(app->down_servers, server, entries);
-        free(server);
+        retire(server);
     }
     
     clean_sessions_with_app(
             app->key.svc_set_id, app->key.app_addr, app->key.app_port);
     
-    free(app->down_servers);
-    free(app->up_servers);
-    free(app);
+    retire_app(app);
 }
 
 
@@ -1209,6 +1987,10 @@ monitor_remove_all_servers_in_service_set(uint16_t ss_id)
         tmp_app->app = app;
         TAILQ_INSERT_TAIL(&app_list, tmp_app, entries);
     }
+    
+    if(!TAILQ_EMPTY(&app_list)) {
+        publish_app_index();
+    }
 
     // Release big lock
     INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
@@ -1226,18 +2008,16 @@ monitor_remove_all_servers_in_service_set(uint16_t ss_id)
         while((server = TAILQ_FIRST(app->up_servers)) != NULL) {
             stop_server_probes(server);
             TAILQ_REMOVE(app->up_servers, server, entries);
-            free(server);
+            retire(server);
         }
         while((server = TAILQ_FIRST(app->down_servers)) != NULL) {
             stop_server_probes(server);
             TAILQ_REMOVE(app->down_servers, server, entries);
-            free(server);
+            retire(server);
         }
         
         TAILQ_REMOVE(&app_list, tmp_app, entries);
-        free(app->down_servers);
-        free(app->up_servers);
-        free(app);
+        retire_app(app);
         free(tmp_app);
     }
 }
@@ -1315,12 +2095,7 @@ change_monitoring_config(uint16_t ss_id,
         
         if(monitor != NULL) {
             // schedule probe to server immediately
-            if(evSetTimer(mon_ctx, probe_server, server, evConsTime(0, 0),
-                    evConsTime(0, 0), &server->test_timer)) {
-                addr.s_addr = server->server_addr; // for inet_ntoa
-                LOG(LOG_EMERG, "%s: Failed to initialize a probe timer to probe "
-                    "server %s (Error: %m)", __func__, inet_ntoa(addr));
-            }
+            schedule_probe(server, 1);
         }
         server = TAILQ_NEXT(server, entries);            
     }
@@ -1334,12 +2109,7 @@ change_monitoring_config(uint16_t ss_id,
         if(monitor != NULL) {
             
             // schedule probe to server immediately
-            if(evSetTimer(mon_ctx, probe_server, server, evConsTime(0, 0),
-                    evConsTime(0, 0), &server->test_timer)) {
-                addr.s_addr = server->server_addr; // for inet_ntoa
-                LOG(LOG_EMERG, "%s: Failed to initialize a probe timer to probe "
-                    "server %s (Error: %m)", __func__, inet_ntoa(addr));
-            }
+            schedule_probe(server, 1);
             
             server = TAILQ_NEXT(server, entries);
 
@@ -1348,9 +2118,7 @@ change_monitoring_config(uint16_t ss_id,
             tmp = TAILQ_NEXT(server, entries); // save next
             TAILQ_REMOVE(app->down_servers, server, entries);
             
-            // insert at head since sessions should be zero
-            // (and up_servers is sorted by sessions)
-            server->sessions = 0; // enforce
+            reset_load(server);
             server->is_up = TRUE;
             TAILQ_INSERT_HEAD(app->up_servers, server, entries);
             
@@ -1362,13 +2130,17 @@ change_monitoring_config(uint16_t ss_id,
         }    
     }
     
+    if(monitor == NULL) {
+        publish_selector(app);
+    }
+    
     // Release application lock
     INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
 }
 
 
 /**
- * Get the server with the least load for this application
+ * Change the weight of a server
  * 
  * @param[in] ss_id
  *      service-set id
@@ -1379,18 +2151,22 @@ change_monitoring_config(uint16_t ss_id,
  * @param[in] app_port
  *      Application port
  * 
- * @return the server address if the application exists and has any up servers.
- *    returns 0 if the application does not exist and,
- *            (in_addr_t)-1 if there are no "up" servers but the app exists
+ * @param[in] server_addr
+ *      The server address, of the server within that application
+ *
+ * @param[in] weight
+ *      The server's share of new sessions relative to the other servers
  */
-in_addr_t
-monitor_get_server_for(uint16_t ss_id,
-                       in_addr_t app_addr,
-                       uint16_t app_port)
+void
+monitor_change_server_weight(uint16_t ss_id,
+                             in_addr_t app_addr,
+                             uint16_t app_port,
+                             in_addr_t server_addr,
+                             uint8_t weight)
 {
     mon_app_key_t key;
     mon_app_info_t * app;
-    mon_server_info_t * server, *tmp, *tmp2;
+    mon_server_info_t * server;
     
     bzero(&key, sizeof(mon_app_key_t));
     key.svc_set_id = ss_id;
@@ -1406,7 +2182,10 @@ monitor_get_server_for(uint16_t ss_id,
     if(app == NULL) {
         // Release big lock
         INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
-        return 0;
+        
+        LOG(LOG_ERR, "%s: Failed to get application in the monitor config",
+                __func__);
+        return;
     }
     
     // Get application lock
@@ -1415,47 +2194,45 @@ monitor_get_server_for(uint16_t ss_id,
     // Release big lock
     INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
     
-   
-    // Get the first server, since it should have the least load
+    if(weight == 0) {
+        weight = 1; // every server gets a share
+    }
     
+    // check for the server in one of the sets
     server = TAILQ_FIRST(app->up_servers);
-    if(server == NULL) {
-        return (in_addr_t)-1;
+    while(server != NULL) {
+        if(server->server_addr == server_addr) {
+            server->weight = weight;
+            publish_selector(app);
+            break;
+        }
+        server = TAILQ_NEXT(server, entries);
     }
-    ++server->sessions;
     
-    // Go through the up servers and preserve the ordering by load 
-    
-    tmp2 = tmp = TAILQ_NEXT(server, entries);
-    while(tmp != NULL) {
-        if(tmp->sessions < server->sessions) {
-            tmp = TAILQ_NEXT(tmp, entries);
-        } else {
-            if(tmp != tmp2) {
-                // insert server here
-                TAILQ_REMOVE(app->up_servers, server, entries);
-                TAILQ_INSERT_BEFORE(tmp, server, entries);
+    if(server == NULL) {
+        server = TAILQ_FIRST(app->down_servers);
+        while(server != NULL) {
+            if(server->server_addr == server_addr) {
+                server->weight = weight; // published once it is up
+                break;
             }
-            // else don't need to move it
-            break;
+            server = TAILQ_NEXT(server, entries);
+        }
+        
+        if(server == NULL) {
+            LOG(LOG_ERR, "%s: Failed to find the server in the monitor config",
+                    __func__);
         }
-    }
-    // if we went through all of them
-    if(tmp == NULL) {
-        // insert server at start
-        TAILQ_REMOVE(app->up_servers, server, entries);
-        TAILQ_INSERT_TAIL(app->up_servers, server, entries);
     }
     
     // Release application lock
     INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
-    
-    return server->server_addr;
 }
 
 
 /**
- * Find the server in the app, and reduce the load by one
+ * Change the balancing mode of an application. Existing sessions keep their
+ * servers.
  * 
  * @param[in] ss_id
  *      service-set id
@@ -1466,18 +2243,17 @@ monitor_get_server_for(uint16_t ss_id,
  * @param[in] app_port
  *      Application port
  * 
- * @param[in] server_addr
- *      Server address
+ * @param[in] balancing_mode
+ *      The balancing mode (BALANCING_MODE_*)
  */
 void
-monitor_remove_session_for_server(uint16_t ss_id,
-                                  in_addr_t app_addr,
-                                  uint16_t app_port,
-                                  in_addr_t server_addr)
+monitor_change_balancing_mode(uint16_t ss_id,
+                              in_addr_t app_addr,
+                              uint16_t app_port,
+                              uint8_t balancing_mode)
 {
     mon_app_key_t key;
     mon_app_info_t * app;
-    mon_server_info_t * server, *tmp, *tmp2;
     
     bzero(&key, sizeof(mon_app_key_t));
     key.svc_set_id = ss_id;
@@ -1493,6 +2269,9 @@ monitor_remove_session_for_server(uint16_t ss_id,
     if(app == NULL) {
         // Release big lock
         INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
+        
+        LOG(LOG_ERR, "%s: Failed to get application in the monitor config",
+                __func__);
         return;
     }
     
@@ -1501,48 +2280,258 @@ monitor_remove_session_for_server(uint16_t ss_id,
     
     // Release big lock
     INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
-   
-    server = TAILQ_FIRST(app->up_servers);
+    
+    if(app->balancing_mode != balancing_mode) {
+        app->balancing_mode = balancing_mode;
+        publish_selector(app);
+    }
+    
+    // Release application lock
+    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+}
 
-    while(server != NULL) {
-        if(server->server_addr == server_addr) {
-            --server->sessions;
+
+/**
+ * Change the session timeout of an application
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] session_timeout
+ *      The session timeout (seconds)
+ */
+void
+monitor_change_session_timeout(uint16_t ss_id,
+                               in_addr_t app_addr,
+                               uint16_t app_port,
+                               uint16_t session_timeout)
+{
+    mon_app_key_t key;
+    mon_app_info_t * app;
+    
+    bzero(&key, sizeof(mon_app_key_t));
+    key.svc_set_id = ss_id;
+    key.app_addr = app_addr;
+    key.app_port = app_port;
+    
+    // Get big lock
+    INSIST_ERR(msp_spinlock_lock(&apps_big_lock) == MSP_OK);
+    
+    // get the application
+    app = app_entry(patricia_get(&apps, sizeof(key), &key));
+    
+    if(app == NULL) {
+        // Release big lock
+        INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
+        
+        LOG(LOG_ERR, "%s: Failed to get application in the monitor config",
+                __func__);
+        return;
+    }
+    
+    // read by the data cpus without any lock
+    app->session_timeout = session_timeout;
+    
+    // Release big lock
+    INSIST_ERR(msp_spinlock_unlock(&apps_big_lock) == MSP_OK);
+}
+
+
+/**
+ * Get the session timeout of an application. This takes no locks, so it can
+ * be called by the data cpus.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @return the session timeout or 0 if the application does not exist
+ */
+uint16_t
+monitor_get_session_timeout(uint16_t ss_id,
+                            in_addr_t app_addr,
+                            uint16_t app_port)
+{
+    mon_app_info_t * app;
+    uint16_t session_timeout = 0;
+    int cpu;
+    
+    cpu = msp_get_current_cpu();
+    
+    reader_enter(cpu);
+    
+    // get the application
+    app = find_app(ss_id, app_addr, app_port);
+    
+    if(app != NULL) {
+        session_timeout = app->session_timeout;
+    }
+    
+    reader_exit(cpu);
+    
+    return session_timeout;
+}
+
+
+/**
+ * Get a server for a new session of this application. In the least-sessions
+ * mode it is the less loaded (for its weight) of two up servers picked at
+ * random. In the consistent-hash mode it is the one the client address maps
+ * to in the application's lookup table. This takes no locks, so it scales
+ * with the number of data cpus calling it.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] client_addr
+ *      Client address
+ * 
+ * @return the server address if the application exists and has any up servers.
+ *    returns 0 if the application does not exist and,
+ *            (in_addr_t)-1 if there are no "up" servers but the app exists
+ */
+in_addr_t
+monitor_get_server_for(uint16_t ss_id,
+                       in_addr_t app_addr,
+                       uint16_t app_port,
+                       in_addr_t client_addr)
+{
+    mon_app_info_t * app;
+    mon_selector_t * sel;
+    mon_server_info_t * server, * other;
+    in_addr_t server_addr;
+    uint32_t r, i;
+    int cpu;
+    
+    cpu = msp_get_current_cpu();
+    
+    reader_enter(cpu);
+    
+    // get the application
+    app = find_app(ss_id, app_addr, app_port);
+    
+    if(app == NULL) {
+        reader_exit(cpu);
+        return 0;
+    }
+    
+    sel = app->selector;
+    
+    if(sel == NULL || sel->count == 0) {
+        reader_exit(cpu);
+        return (in_addr_t)-1;
+    }
+    
+    if(sel->lookup != NULL) {
+        // Use the server the client maps to (scaling the hash to the table)
+        
+        i = ((uint64_t)server_hash(client_addr) * LOOKUP_TABLE_SIZE) >> 32;
+        server = sel->servers[sel->lookup[i]];
+        
+    } else {
+        // Pick two different up servers at random and use the one with less
+        // load for its weight
+        
+        r = next_random(cpu);
+        i = r % sel->count;
+        server = sel->servers[i];
+        
+        if(sel->count > 1) {
+            other = sel->servers[
+                    (i + 1 + (r >> 16) % (sel->count - 1)) % sel->count];
             
-            // Go through the up servers and preserve the ordering by load
-            tmp2 = tmp = TAILQ_PREV(server, server_info_set_s, entries);
-            while(tmp != NULL) {
-                if(tmp->sessions > server->sessions) {
-                    tmp = TAILQ_PREV(tmp, server_info_set_s, entries);
-                } else {
-                    if(tmp != tmp2) {
-                        // insert server here
-                        TAILQ_REMOVE(app->up_servers, server, entries);
-                        TAILQ_INSERT_AFTER(app->up_servers, 
-                                tmp, server, entries);
-                    }
-                    // else don't need to move it
-                    break;
-                }
-            }
-            // if we went through all of them
-            if(tmp == NULL) {
-                // insert server at start
-                TAILQ_REMOVE(app->up_servers, server, entries);
-                TAILQ_INSERT_HEAD(app->up_servers, server, entries);
+            if((int64_t)approx_load(other, cpu) * server->weight <
+                    (int64_t)approx_load(server, cpu) * other->weight) {
+                server = other;
             }
-            
+        }
+    }
+    
+    update_load(server, cpu, 1);
+    server_addr = server->server_addr;
+    
+    reader_exit(cpu);
+    
+    return server_addr;
+}
+
+
+/**
+ * Find the server in the app, and reduce the load by one
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] server_addr
+ *      Server address
+ */
+void
+monitor_remove_session_for_server(uint16_t ss_id,
+                                  in_addr_t app_addr,
+                                  uint16_t app_port,
+                                  in_addr_t server_addr)
+{
+    mon_app_info_t * app;
+    mon_selector_t * sel;
+    mon_server_info_t * server;
+    uint32_t i;
+    int cpu;
+    
+    cpu = msp_get_current_cpu();
+    
+    reader_enter(cpu);
+    
+    // get the application
+    app = find_app(ss_id, app_addr, app_port);
+    
+    if(app == NULL || (sel = app->selector) == NULL) {
+        reader_exit(cpu);
+        return;
+    }
+    
+    // find the server if it is still up
+    
+    i = server_hash(server_addr) & sel->mask;
+    
+    while((server = sel->by_addr[i]) != NULL) {
+        if(server->server_addr == server_addr) {
+            update_load(server, cpu, -1);
             break;
         }
-        server = TAILQ_NEXT(server, entries);
+        i = (i + 1) & sel->mask;
     }
     
-    // Release application lock
-    INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
+    reader_exit(cpu);
 }
 
 
 /**
- * Send server/application load stats to the mgmt component 
+ * Send server/application load stats to the mgmt component. Only the
+ * applications whose session count changed since it was last reported are
+ * sent, except every STATS_FULL_INTERVAL-th time when all of them are.
  */
 void
 monitor_send_stats(void)
@@ -1550,10 +2539,13 @@ monitor_send_stats(void)
     mon_app_info_t * app;
     mon_server_info_t * server;
     uint32_t session_count;
+    boolean full;
     
     // Get big lock
     INSIST_ERR(msp_spinlock_lock(&apps_big_lock) == MSP_OK);
     
+    full = (stats_pushes++ % STATS_FULL_INTERVAL == 0);
+    
     app = app_entry(patricia_find_next(&apps, NULL));
     
     while(app != NULL) { // go thru all apps
@@ -1566,15 +2558,19 @@ monitor_send_stats(void)
         server = TAILQ_FIRST(app->up_servers);
         while(server != NULL) { // go thru all servers
             
-            session_count += server->sessions; // add to total for app
+            session_count += server_sessions(server); // add to total for app
             
             server = TAILQ_NEXT(server, entries);
         }
         
         // report
-        notify_application_sessions(app->key.svc_set_id,
-                app->key.app_addr, app->key.app_port, session_count);
-        
+        if(full || !app->reported || app->reported_sessions != session_count) {
+            notify_application_sessions(app->key.svc_set_id,
+                    app->key.app_addr, app->key.app_port, session_count);
+            
+            app->reported_sessions = session_count;
+            app->reported = TRUE;
+        }
         
         // Release application lock
         INSIST_ERR(msp_spinlock_unlock(&app->app_lock) == MSP_OK);
@@ -70,17 +70,31 @@ shutdown_monitor(void);
  * @param[in] server_addr
  *      The server address, of the server within that application
  *
+ * @param[in] weight
+ *      The server's share of new sessions relative to the other servers
+ *
  * @param[in] monitor
  *      The server monitoring parameters (all servers in the same 
  *      application must have the same monitor). If NULL, then server 
  *      is not monitored and assumed UP.
+ *
+ * @param[in] balancing_mode
+ *      The balancing mode of the application (BALANCING_MODE_*), only used
+ *      when this is the application's first server
+ *
+ * @param[in] session_timeout
+ *      The session timeout of the application, only used when this is the
+ *      application's first server
  */
 void
 monitor_add_server(uint16_t ss_id,
                    in_addr_t app_addr,
                    uint16_t app_port,
                    in_addr_t server_addr,
-                   eq_smon_t * monitor);
+                   uint8_t weight,
+                   eq_smon_t * monitor,
+                   uint8_t balancing_mode,
+                   uint16_t session_timeout);
 
 
 /**
@@ -159,7 +173,56 @@ change_monitoring_config(uint16_t ss_id,
 
 
 /**
- * Get the server with the least load for this application
+ * Change the weight of a server
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] server_addr
+ *      The server address, of the server within that application
+ *
+ * @param[in] weight
+ *      The server's share of new sessions relative to the other servers
+ */
+void
+monitor_change_server_weight(uint16_t ss_id,
+                             in_addr_t app_addr,
+                             uint16_t app_port,
+                             in_addr_t server_addr,
+                             uint8_t weight);
+
+
+/**
+ * Change the balancing mode of an application. Existing sessions keep their
+ * servers.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] balancing_mode
+ *      The balancing mode (BALANCING_MODE_*)
+ */
+void
+monitor_change_balancing_mode(uint16_t ss_id,
+                              in_addr_t app_addr,
+                              uint16_t app_port,
+                              uint8_t balancing_mode);
+
+
+/**
+ * Change the session timeout of an application
  * 
  * @param[in] ss_id
  *      service-set id
@@ -170,6 +233,56 @@ change_monitoring_config(uint16_t ss_id,
  * @param[in] app_port
  *      Application port
  * 
+ * @param[in] session_timeout
+ *      The session timeout (seconds)
+ */
+void
+monitor_change_session_timeout(uint16_t ss_id,
+                               in_addr_t app_addr,
+                               uint16_t app_port,
+                               uint16_t session_timeout);
+
+
+/**
+ * Get the session timeout of an application. This takes no locks, so it can
+ * be called by the data cpus.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @return the session timeout or 0 if the application does not exist
+ */
+uint16_t
+monitor_get_session_timeout(uint16_t ss_id,
+                            in_addr_t app_addr,
+                            uint16_t app_port);
+
+
+/**
+ * Get a server for a new session of this application. In the least-sessions
+ * mode it is the less loaded (for its weight) of two up servers picked at
+ * random. In the consistent-hash mode it is the one the client address maps
+ * to in the application's lookup table. This takes no locks, so it scales
+ * with the number of data cpus calling it.
+ * 
+ * @param[in] ss_id
+ *      service-set id
+ * 
+ * @param[in] app_addr
+ *      Application address, used to identify the application
+ * 
+ * @param[in] app_port
+ *      Application port
+ * 
+ * @param[in] client_addr
+ *      Client address
+ * 
  * @return the server address if the application exists and has any up servers.
  *    returns 0 if the application does not exist and,
  *            (in_addr_t)-1 if there are no "up" servers but the app exists
@@ -177,7 +290,8 @@ change_monitoring_config(uint16_t ss_id,
 in_addr_t
 monitor_get_server_for(uint16_t ss_id,
                        in_addr_t app_addr,
-                       uint16_t app_port);
+                       uint16_t app_port,
+                       in_addr_t client_addr);
 
 
 /**
@@ -38,91 +38,1236 @@
 
 #define EQ_SESSION_ENTRY_NAME "equilibrium session entry" ///< entry o.c. name
 
-#define SESSION_AGE_CHECK_INTERVAL 15 ///< run aging routine interval in seconds
+#define CLEANUP_INTERVAL 15 ///< run cleanup routine interval in seconds
+
+#define DOWN_SERVER_SESSION_DURATION 60 ///< age of flows to apps w/o servers up
+
+#define NON_APP_SESSION_DURATION 300    ///< age of flows not to an application
 
 #define MAX_MSP_SEND_RETRIES 100 ///< Max msp_data_send retires before panic
 
-/**
- * Must have this many bytes of each packet in the jbuf to analyze it
- */
-#define IP_NEEDED_BYTES (sizeof(struct ip))
+/**
+ * Must have this many bytes of each packet in the jbuf to analyze it
+ */
+#define IP_NEEDED_BYTES (sizeof(struct ip))
+
+/**
+ * Must have this many bytes of each packet in the jbuf to analyze it for nat
+ */
+#define TCP_NEEDED_BYTES (sizeof(struct ip) + sizeof(struct tcphdr))
+
+/**
+ * The number of buckets, must be a power of 2, current 2^19
+ */
+#define SESSIONS_BUCKET_COUNT (512 * 1024)
+
+/**
+ * The number of session slots stored inline in each bucket. With a 4-byte
+ * lock, a 4-byte overflow counter, and 8-byte pointers this fills a cache line.
+ */
+#define SESSION_BUCKET_SLOTS 5
+
+/**
+ * The max number of buckets following a full home bucket that are probed
+ * (open addressing). The table has this many extra buckets at its end, so
+ * probing never wraps around (and bucket locks are always taken in ascending
+ * order)
+ */
+#define SESSION_MAX_PROBE 8
+
+/**
+ * The number of buckets allocated in the table including the probe overflow
+ */
+#define SESSIONS_BUCKET_TOTAL (SESSIONS_BUCKET_COUNT + SESSION_MAX_PROBE)
+
+/**
+ * The number of entries in the fragment cache of each data cpu, must be a
+ * power of 2
+ */
+#define FRAG_CACHE_COUNT (4 * 1024)
+
+/**
+ * The max number of entries following the one a fragment hashes to that are
+ * probed in a fragment cache (open addressing)
+ */
+#define FRAG_MAX_PROBE 4
+
+/**
+ * The number of seconds the first fragment of a datagram is remembered, by
+ * when the other fragments should have followed it
+ */
+#define FRAG_DURATION 5
+
+/**
+ * The number of bits of time (seconds) each level of a timer wheel spans
+ */
+#define WHEEL_BITS 6
+
+/**
+ * The number of slots in each level of a timer wheel
+ */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+/**
+ * The mask to get a slot index in a timer wheel level
+ */
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/**
+ * The maximum time ahead of a timer wheel's current time a session can be
+ * armed for (roughly an hour); later expiries are clamped and re-armed when due
+ */
+#define WHEEL_MAX_DELTA ((WHEEL_SLOTS - 1) * WHEEL_SLOTS - 1)
+
+/**
+ * The number of buckets in each data cpu's index of sessions by server, must
+ * be a power of 2
+ */
+#define SERVER_INDEX_COUNT (4 * 1024)
+
+/**
+ * The number of buckets in each data cpu's index of sessions by application,
+ * must be a power of 2
+ */
+#define APP_INDEX_COUNT 512
+
+/**
+ * The number of buckets in each data cpu's index of sessions by service set,
+ * must be a power of 2
+ */
+#define SVC_SET_INDEX_COUNT 64
+
+/**
+ * The max number of indexed sessions a cleanup goes through while holding
+ * an index bucket lock
+ */
+#define CLEAN_BATCH 1024
+
+/**
+ * Our mask defining the width of our hash function
+ */
+const uint32_t HASH_MASK = SESSIONS_BUCKET_COUNT - 1;
+
+/**
+ * Our mask defining the width of our fragment cache hash function
+ */
+const uint32_t FRAG_HASH_MASK = FRAG_CACHE_COUNT - 1;
+
+
+/*** Data Structures ***/
+
+/**
+ * The indexes of the sessions used to find the sessions affected by cleanups
+ */
+typedef enum {
+    INDEX_BY_SERVER = 0,  ///< by service set, application, and server
+    INDEX_BY_APP,         ///< by service set and application
+    INDEX_BY_SVC_SET,     ///< by service set
+    INDEX_COUNT           ///< number of indexes
+} index_type_e;
+
+
+/**
+ * flow entry information structure (one direction of a session)
+ */
+typedef struct session_entry_s {
+    struct session_pair_s      * pair;    ///< session this direction belongs to
+    in_addr_t                    saddr;   ///< src IP address
+    in_addr_t                    daddr;   ///< dest IP address
+    uint16_t                     sport;   ///< src port
+    uint16_t                     dport;   ///< dest port
+    uint8_t                      dir;     ///< direction
+    in_addr_t                    faddr;   ///< IP address of facade if INGRESS entry, or real server if EGRESS entry
+    uint16_t                     ss_id;   ///< svc set id
+    uint32_t                     hash;    ///< hash of the 5-tuple and ss_id
+} session_entry_t;
+
+
+/**
+ * A session: both of its flow entries in one allocation sharing one lock and
+ * one timestamp
+ */
+typedef struct session_pair_s {
+    msp_spinlock_t               lock;    ///< lock for both directions
+    time_t                       age_ts;  ///< session timestamp (either direction)
+    session_entry_t              forward; ///< EGRESS entry (from the client)
+    session_entry_t              reverse; ///< INGRESS entry (from the server)
+    
+    // aging related (protected by the timer wheel's lock):
+    time_t                       expiry;  ///< time the pair's timer is due
+    struct timer_wheel_s *       wheel;   ///< timer wheel of its data cpu
+    struct wheel_slot_s *        slot;    ///< wheel slot or NULL if due
+    TAILQ_ENTRY(session_pair_s)  timer;   ///< next and prev in wheel slot
+    volatile boolean             unlinked; ///< removed from the table by a
+                                           ///< clean_sessions_* function
+                                           ///< while not in a wheel slot
+    
+    // cleanup index related (links protected by the index buckets' locks):
+    struct session_index_s *     idx[INDEX_COUNT];       ///< index buckets
+                                                         ///< or NULL
+    TAILQ_ENTRY(session_pair_s)  idx_entry[INDEX_COUNT]; ///< next and prev in
+                                                         ///< each idx
+} session_pair_t;
+
+
+/**
+ * A bucket of an index of the sessions in the sessions_table, so that the
+ * clean_sessions_* functions only visit the sessions they might remove.
+ *
+ * Session pairs are indexed when they are created (once both entries are in
+ * the sessions_table) and unindexed when their forward entry is removed from
+ * the sessions_table. The clean_sessions_* functions collect the keys of the
+ * sessions they are after with the index bucket lock, and then look them up
+ * in the sessions_table. Index locks are taken last, so any other lock may
+ * be held while getting one.
+ */
+typedef struct session_index_s {
+    msp_spinlock_t                  lock;  ///< lock for this index bucket
+    TAILQ_HEAD(, session_pair_s)    pairs; ///< the indexed session pairs
+} session_index_t;
+
+
+/**
+ * The indexes of the sessions created by a data cpu
+ *
+ * Each data cpu indexes the pairs it creates in its own indexes, so the data
+ * cpus never contend for index locks among themselves. Only the cleanups
+ * take them from another thread, and they release them after every
+ * CLEAN_BATCH pairs they go through (keeping their place in the bucket with
+ * a cursor pair).
+ */
+typedef struct session_indexes_s {
+    session_index_t  by_server[SERVER_INDEX_COUNT];   ///< sessions by server
+    session_index_t  by_app[APP_INDEX_COUNT];         ///< sessions by app
+    session_index_t  by_svc_set[SVC_SET_INDEX_COUNT]; ///< sessions by ss
+} session_indexes_t;
+
+
+/**
+ * The KEY of a session (its forward entry) collected from an index
+ */
+typedef struct session_key_s {
+    in_addr_t   saddr;    ///< src IP address
+    in_addr_t   daddr;    ///< dest IP address
+    uint16_t    sport;    ///< src port
+    uint16_t    dport;    ///< dest port
+    uint16_t    ss_id;    ///< svc set id
+    uint32_t    hash;     ///< hash of the KEY fields
+} session_key_t;
+
+
+/**
+ * Criteria used to select the sessions removed by a cleanup
+ */
+typedef struct session_filter_s {
+    index_type_e  type;        ///< which fields below are used
+    uint16_t      ss_id;       ///< svc set id
+    in_addr_t     app_addr;    ///< application address
+    uint16_t      app_port;    ///< application port
+    in_addr_t     server_addr; ///< server address
+} session_filter_t;
+
+
+/**
+ * A list of session pairs armed to expire in the same timer wheel slot
+ */
+typedef TAILQ_HEAD(wheel_slot_s, session_pair_s) wheel_slot_t;
+
+
+/**
+ * A hierarchical timer wheel with a one second tick used to age sessions.
+ * There is one per data cpu, advanced from the top of its packet loop.
+ *
+ * Level 0 has a slot for each of the next WHEEL_SLOTS seconds. Level 1 has
+ * a slot for each of the next WHEEL_SLOTS spans of WHEEL_SLOTS seconds,
+ * which gets cascaded down into level 0 as the span comes up.
+ *
+ * Session pairs are armed once when they are created and re-armed lazily
+ * when their timer fires, only if they saw traffic since it was armed. The
+ * data path just updates the pair's age_ts. Thus the work done aging is
+ * proportional to the number of sessions expiring rather than the size of
+ * the sessions_table.
+ *
+ * Once armed, a pair stays on its timer wheel until the wheel frees it. The
+ * clean_sessions_* functions only unlink pairs from the sessions_table and
+ * move them to the wheel's unlinked list, which the wheel frees at its next
+ * tick.
+ */
+typedef struct timer_wheel_s {
+    msp_spinlock_t  lock;                              ///< lock for this wheel
+    time_t          now;                               ///< time advanced to
+    wheel_slot_t    slots[2][WHEEL_SLOTS];             ///< armed pairs
+    wheel_slot_t    unlinked;                          ///< pairs to free
+} timer_wheel_t;
+
+
+/**
+ * A bucket in a hashtable_t
+ *
+ * Each bucket occupies one cache line. Along with the session pointers, it
+ * keeps a fingerprint of each session's KEY inline, so that looking up a
+ * session only dereferences the session entry that is very likely to match.
+ */
+typedef struct hash_bucket_s {
+    msp_spinlock_t     bucket_lock;                   ///< lock for this bucket
+    atomic_uint_t      overflow;                      ///< # sessions homed here,
+                                                      ///< but stored further on
+    uint16_t           fp[SESSION_BUCKET_SLOTS];      ///< slot fingerprints
+    session_entry_t *  session[SESSION_BUCKET_SLOTS]; ///< slots (NULL if empty)
+} __attribute__((aligned(CACHE_LINE_SIZE))) hash_bucket_t;
+
+
+/**
+ * An entry in a fragment cache used to find the session of IP fragments
+ * (which have no TCP header) given the first fragment of their datagram.
+ * Two fit in a cache line.
+ *
+ * Only the data cpu owning the cache writes its entries, and it makes seq odd
+ * while it does, so that any cpu can read them without a lock and tell when
+ * it read an entry being changed.
+ */
+typedef struct frag_entry_s {
+    volatile uint32_t seq;        ///< # of changes (odd while changing)
+    in_addr_t         saddr;      ///< src IP address (KEY field)
+    in_addr_t         daddr;      ///< dest IP address (KEY field)
+    uint16_t          frag_group; ///< frag group (IP ID) (KEY field)
+    uint16_t          ss_id;      ///< svc set id (KEY field)
+    uint16_t          sport;      ///< session's src port
+    uint16_t          dport;      ///< session's dest port
+    uint32_t          expiry;     ///< time the entry is stale (0 if unused)
+    uint32_t          pad[2];     ///< to 32 bytes
+} frag_entry_t;
+
+
+/**
+ * The fragment cache of a data cpu
+ *
+ * Non-first IP fragments have no TCP header, so they are mapped back to the
+ * ports of their session with the fragment caches, which are keyed by the
+ * addresses, frag group (IP ID), and service set id. They are kept apart from
+ * the sessions_table, so fragments never take its locks. The data cpu seeing
+ * a first fragment remembers it in its own cache (using open addressing and
+ * replacing the entry closest to going stale when the probed ones are all in
+ * use), and the following fragments are looked up in the cache of the data
+ * cpu they arrive on first, and then in the others'.
+ */
+typedef struct frag_cache_s {
+    frag_entry_t  entry[FRAG_CACHE_COUNT];   ///< entries (open addressing)
+} __attribute__((aligned(CACHE_LINE_SIZE))) frag_cache_t;
+
+
+/**
+ * A hashtable for the sessions_table
+ *
+ * The source and destination addresses and ports along with the service set
+ * id are hashed to lookup a home bucket. The table uses open addressing: a
+ * session is stored in an empty slot of its home bucket, or if the home bucket
+ * is full, in an empty slot of one of the next SESSION_MAX_PROBE buckets.
+ */
+typedef struct hashtable_s {
+    hash_bucket_t hash_bucket[SESSIONS_BUCKET_TOTAL]; ///<maps hashes to buckets
+} hashtable_t;
+
+
+static evTimerID aging_timer;        ///< timer set to do aging and cleanup
+static msp_shm_handle_t shm_handle;  ///< handle for shared memory allocator
+static msp_oc_handle_t table_handle; ///< handle for OC table allocator
+static msp_oc_handle_t entry_handle; ///< handle for OC table entry allocator
+static void * sessions_mem;          ///< OC memory holding the sessions_table
+static hashtable_t * sessions_table; ///< pointer to the hashtable of sessions
+static atomic_uint_t loops_running;  ///< # of data loops running
+static volatile uint8_t do_shutdown; ///< do the data loops need to shutdown
+static uint32_t obj_cache_id;        ///< ID for OC memory tracking
+static timer_wheel_t wheels[MSP_MAX_CPUS]; ///< timer wheels by data cpu
+static frag_cache_t frag_caches[MSP_MAX_CPUS]; ///< fragment caches by data cpu
+static int loop_cpus[MSP_MAX_CPUS];        ///< cpus running data loops
+static volatile int loop_count;            ///< # of cpus in loop_cpus
+static session_indexes_t indexes[MSP_MAX_CPUS]; ///< session indexes by cpu
+
+/*** STATIC/INTERNAL Functions ***/
+
+
+/**
+ * Mix the bits of a 32-bit value (murmur3 finalizer)
+ *
+ * @param[in] h
+ *      The input value
+ *
+ * @return the mixed value
+ */
+static inline uint32_t
+mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+
+/**
+ * Get the hash of a session's KEY fields
+ *
+ * @param[in] saddr
+ *      The source address
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] sport
+ *      The source port
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] ss_id
+ *      The service set id
+ *
+ * @return the hash; its lower bits select the home bucket
+ */
+static inline uint32_t
+session_hash(in_addr_t saddr,
+             in_addr_t daddr,
+             uint16_t sport,
+             uint16_t dport,
+             uint16_t ss_id)
+{
+    return mix32(mix32(mix32(saddr) ^ daddr) ^
+                 (((uint32_t)sport << 16) | dport) ^ ((uint32_t)ss_id << 7));
+}
+
+
+/**
+ * Get the fingerprint of a session's KEY fields. It is a second hash, mixed
+ * independently of session_hash, since the sessions probed together share
+ * the session_hash bits selecting their home bucket.
+ *
+ * @param[in] saddr
+ *      The source address
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] sport
+ *      The source port
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] ss_id
+ *      The service set id
+ *
+ * @return the fingerprint (never 0, which marks an empty slot)
+ */
+static inline uint16_t
+session_fp(in_addr_t saddr,
+           in_addr_t daddr,
+           uint16_t sport,
+           uint16_t dport,
+           uint16_t ss_id)
+{
+    uint16_t fp;
+
+    fp = mix32(mix32(daddr ^ 0x9E3779B9) ^ saddr ^
+               (((uint32_t)dport << 16) | sport) ^ ss_id) >> 16;
+
+    return (fp != 0) ? fp : 1;
+}
+
+
+/**
+ * Get the hash of a fragment's KEY fields
+ *
+ * @param[in] saddr
+ *      The source address
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] frag_group
+ *      The fragment group (IP ID)
+ *
+ * @param[in] ss_id
+ *      The service set id
+ *
+ * @return the hash; its lower bits select the first entry probed
+ */
+static inline uint32_t
+frag_hash(in_addr_t saddr,
+          in_addr_t daddr,
+          uint16_t frag_group,
+          uint16_t ss_id)
+{
+    return mix32(mix32(saddr) ^ daddr ^ (((uint32_t)ss_id << 16) | frag_group));
+}
+
+
+/**
+ * Remember the ports of the session of a first fragment in the current
+ * cpu's fragment cache
+ *
+ * @param[in] session
+ *      The session entry (locked) matching the first fragment
+ *
+ * @param[in] frag_group
+ *      The fragment group (IP ID)
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+static void
+record_fragment(session_entry_t * session, uint16_t frag_group, int cpu)
+{
+    frag_entry_t * entry, * victim = NULL;
+    uint32_t hash, i;
+    
+    hash = frag_hash(session->saddr, session->daddr, frag_group,
+            session->ss_id);
+    
+    // use the entry already for this fragment group, or else the one
+    // closest to going stale (unused ones are stale)
+    
+    for(i = 0; i < FRAG_MAX_PROBE; ++i) {
+        entry = &frag_caches[cpu].entry[(hash + i) & FRAG_HASH_MASK];
+        
+        if(entry->saddr == session->saddr && entry->daddr == session->daddr
+           && entry->frag_group == frag_group
+           && entry->ss_id == session->ss_id) {
+            victim = entry;
+            break;
+        }
+        
+        if(victim == NULL || (int32_t)(entry->expiry - victim->expiry) < 0) {
+            victim = entry;
+        }
+    }
+    
+    ++victim->seq; // changing
+    __sync_synchronize();
+    
+    victim->saddr = session->saddr;
+    victim->daddr = session->daddr;
+    victim->frag_group = frag_group;
+    victim->ss_id = session->ss_id;
+    victim->sport = session->sport;
+    victim->dport = session->dport;
+    victim->expiry = (uint32_t)get_current_time() + FRAG_DURATION;
+    
+    __sync_synchronize();
+    ++victim->seq; // done
+}
+
+
+/**
+ * Look for the ports of the session of a fragment in a fragment cache
+ *
+ * @param[in] cache
+ *      The fragment cache
+ *
+ * @param[in] ip_pkt
+ *      The IP fragment
+ *
+ * @param[in] ss_id
+ *      The service set id
+ *
+ * @param[in] hash
+ *      The hash of the fragment's KEY fields
+ *
+ * @param[out] sport
+ *      The session's src port if found
+ *
+ * @param[out] dport
+ *      The session's dest port if found
+ *
+ * @return TRUE if found; FALSE otherwise
+ */
+static boolean
+find_fragment_in(frag_cache_t * cache,
+                 struct ip * ip_pkt,
+                 uint16_t ss_id,
+                 uint32_t hash,
+                 uint16_t * sport,
+                 uint16_t * dport)
+{
+    frag_entry_t * entry;
+    uint32_t i, seq, now;
+    boolean match;
+    
+    now = (uint32_t)get_current_time();
+    
+    for(i = 0; i < FRAG_MAX_PROBE; ++i) {
+        entry = &cache->entry[(hash + i) & FRAG_HASH_MASK];
+        
+        seq = entry->seq;
+        if(seq & 1) { // being changed
+            continue;
+        }
+        __sync_synchronize();
+        
+        match = (entry->saddr == ip_pkt->ip_src.s_addr
+                && entry->daddr == ip_pkt->ip_dst.s_addr
+                && entry->frag_group == ip_pkt->ip_id && entry->ss_id == ss_id
+                && (int32_t)(entry->expiry - now) > 0);
+        *sport = entry->sport;
+        *dport = entry->dport;
+        
+        __sync_synchronize();
+        
+        if(match && entry->seq == seq) {
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+
+/**
+ * Find a session entry in the sessions_table. The home bucket of the session
+ * (hash & HASH_MASK) must be locked by the caller.
+ *
+ * @param[in] hash
+ *      The hash of the KEY fields
+ *
+ * @param[in] saddr
+ *      The source address
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] sport
+ *      The source port
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] ss_id
+ *      The service set id
+ *
+ * @return the session entry (with its pair locked) if found; otherwise NULL
+ */
+static session_entry_t *
+find_session(uint32_t hash,
+             in_addr_t saddr,
+             in_addr_t daddr,
+             uint16_t sport,
+             uint16_t dport,
+             uint16_t ss_id)
+{
+    hash_bucket_t * bucket, * home;
+    session_entry_t * session;
+    uint16_t fp = session_fp(saddr, daddr, sport, dport, ss_id);
+    int i, s;
+
+    home = &sessions_table->hash_bucket[hash & HASH_MASK];
+
+    for(i = 0; i <= SESSION_MAX_PROBE; ++i) {
+
+        bucket = home + i;
+
+        if(i > 0) {
+            if(home->overflow == 0) { // nothing homed here was stored elsewhere
+                return NULL;
+            }
+
+            // Get the bucket lock (always in ascending order)
+            INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+        }
+
+        for(s = 0; s < SESSION_BUCKET_SLOTS; ++s) {
+            session = bucket->session[s];
+            if(bucket->fp[s] == fp && session != NULL
+               && session->saddr == saddr && session->daddr == daddr
+               && session->sport == sport && session->dport == dport
+               && session->ss_id == ss_id) {
+
+                // Get the session lock
+                INSIST_ERR(msp_spinlock_lock(&session->pair->lock) == MSP_OK);
+
+                if(i > 0) {
+                    // Release the bucket lock
+                    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                            == MSP_OK);
+                }
+                return session;
+            }
+        }
+
+        if(i > 0) {
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Insert a session entry into the sessions_table. The home bucket of the
+ * session (session->hash & HASH_MASK) must be locked by the caller.
+ *
+ * @param[in] session
+ *      The session entry with its KEY fields and hash set
+ *
+ * @return SUCCESS if inserted; EFAIL if there was no free slot
+ */
+static status_t
+insert_session(session_entry_t * session)
+{
+    hash_bucket_t * bucket, * home;
+    int i, s;
+
+    home = &sessions_table->hash_bucket[session->hash & HASH_MASK];
+
+    for(i = 0; i <= SESSION_MAX_PROBE; ++i) {
+
+        bucket = home + i;
+
+        if(i > 0) {
+            // Get the bucket lock (always in ascending order)
+            INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+        }
+
+        for(s = 0; s < SESSION_BUCKET_SLOTS; ++s) {
+            if(bucket->session[s] == NULL) {
+                bucket->fp[s] = session_fp(session->saddr, session->daddr,
+                        session->sport, session->dport, session->ss_id);
+                bucket->session[s] = session;
+
+                if(i > 0) {
+                    atomic_add_uint(1, &home->overflow);
+
+                    // Release the bucket lock
+                    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                            == MSP_OK);
+                }
+                return SUCCESS;
+            }
+        }
+
+        if(i > 0) {
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+        }
+    }
+
+    return EFAIL;
+}
+
+
+/**
+ * Remove a session entry from the slot of the bucket where it is stored.
+ * The bucket must be locked by the caller.
+ *
+ * @param[in] bucket
+ *      The bucket where the session is stored
+ *
+ * @param[in] slot
+ *      The slot of the bucket where the session is stored
+ */
+static void
+remove_session(hash_bucket_t * bucket, int slot)
+{
+    hash_bucket_t * home;
+
+    home = &sessions_table->hash_bucket[bucket->session[slot]->hash & HASH_MASK];
+
+    if(home != bucket) {
+        atomic_sub_uint(1, &home->overflow);
+    }
+
+    bucket->session[slot] = NULL;
+    bucket->fp[slot] = 0;
+}
+
+
+/**
+ * Remove a session entry from the sessions_table wherever it is stored.
+ * No bucket locks may be held by the caller.
+ *
+ * @param[in] session
+ *      The session entry
+ */
+static void
+unlink_session(session_entry_t * session)
+{
+    hash_bucket_t * bucket, * home;
+    int i, s;
+
+    home = &sessions_table->hash_bucket[session->hash & HASH_MASK];
+
+    for(i = 0; i <= SESSION_MAX_PROBE; ++i) {
+
+        bucket = home + i;
+
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+        for(s = 0; s < SESSION_BUCKET_SLOTS; ++s) {
+            if(bucket->session[s] == session) {
+                remove_session(bucket, s);
+
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return;
+            }
+        }
+
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
+}
+
+
+/**
+ * Free a session pair once its forward entry is removed from the
+ * sessions_table. No bucket or session locks may be held by the caller.
+ *
+ * @param[in] pair
+ *      The session pair
+ *
+ * @param[in] cpu
+ *      The current cpu (used for object cache free calls)
+ */
+static void
+release_pair(session_pair_t * pair, uint32_t cpu)
+{
+    unlink_session(&pair->reverse);
+    
+    // wait for any cpu that found the pair before it was unlinked
+    INSIST_ERR(msp_spinlock_lock(&pair->lock) == MSP_OK);
+    INSIST_ERR(msp_spinlock_unlock(&pair->lock) == MSP_OK);
+    
+    msp_objcache_free(entry_handle, pair, cpu, obj_cache_id);
+}
+
+
+/**
+ * Get the bucket of a data cpu's index for the sessions matching a filter
+ *
+ * @param[in] filter
+ *      The criteria (its type selects the index)
+ *
+ * @param[in] cpu
+ *      The data cpu that created the sessions
+ *
+ * @return the index bucket
+ */
+static session_index_t *
+index_bucket(session_filter_t * filter, int cpu)
+{
+    switch(filter->type) {
+    
+    case INDEX_BY_SERVER:
+        return &indexes[cpu].by_server[mix32(mix32(mix32(filter->server_addr)
+                ^ filter->app_addr) ^ (((uint32_t)filter->ss_id << 16) |
+                filter->app_port)) & (SERVER_INDEX_COUNT - 1)];
+        
+    case INDEX_BY_APP:
+        return &indexes[cpu].by_app[mix32(mix32(filter->app_addr) ^
+                (((uint32_t)filter->ss_id << 16) | filter->app_port))
+                & (APP_INDEX_COUNT - 1)];
+        
+    default:
+        return &indexes[cpu].by_svc_set[
+                filter->ss_id & (SVC_SET_INDEX_COUNT - 1)];
+    }
+}
+
+
+/**
+ * Check if a session is selected by a filter
+ *
+ * @param[in] session
+ *      The forward (egress) entry of the session
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @return TRUE if the session matches all the criteria; FALSE otherwise
+ */
+static boolean
+match_session(session_entry_t * session, session_filter_t * filter)
+{
+    switch(filter->type) {
+    
+    case INDEX_BY_SERVER:
+        if(session->faddr != filter->server_addr) {
+            return FALSE;
+        }
+        // fall through
+        
+    case INDEX_BY_APP:
+        if(session->daddr != filter->app_addr ||
+                session->dport != filter->app_port) {
+            return FALSE;
+        }
+        // fall through
+        
+    default:
+        return session->ss_id == filter->ss_id;
+    }
+}
+
+
+/**
+ * Index a session pair by its service set, application, and server (if it
+ * has one) in the indexes of the data cpu creating it
+ *
+ * @param[in] pair
+ *      The session pair with its forward entry set
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+static void
+index_pair(session_pair_t * pair, int cpu)
+{
+    session_filter_t filter;
+    session_index_t * idx;
+    int type;
+    
+    filter.ss_id = pair->forward.ss_id;
+    filter.app_addr = pair->forward.daddr;
+    filter.app_port = pair->forward.dport;
+    filter.server_addr = pair->forward.faddr;
+    
+    for(type = 0; type < INDEX_COUNT; ++type) {
+        
+        if(type == INDEX_BY_SERVER && (filter.server_addr == 0 ||
+                filter.server_addr == (in_addr_t)-1)) {
+            pair->idx[type] = NULL; // no server
+            continue;
+        }
+        
+        filter.type = type;
+        idx = index_bucket(&filter, cpu);
+        
+        // Get the index bucket lock
+        INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+        TAILQ_INSERT_TAIL(&idx->pairs, pair, idx_entry[type]);
+        INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+        
+        pair->idx[type] = idx;
+    }
+}
+
 
 /**
- * Must have this many bytes of each packet in the jbuf to analyze it for nat
+ * Remove a session pair from the indexes
+ *
+ * @param[in] pair
+ *      The session pair
  */
-#define TCP_NEEDED_BYTES (sizeof(struct ip) + sizeof(struct tcphdr))
+static void
+unindex_pair(session_pair_t * pair)
+{
+    int type;
+    
+    for(type = 0; type < INDEX_COUNT; ++type) {
+        if(pair->idx[type] != NULL) {
+            // Get the index bucket lock
+            INSIST_ERR(msp_spinlock_lock(&pair->idx[type]->lock) == MSP_OK);
+            TAILQ_REMOVE(&pair->idx[type]->pairs, pair, idx_entry[type]);
+            INSIST_ERR(msp_spinlock_unlock(&pair->idx[type]->lock) == MSP_OK);
+            
+            pair->idx[type] = NULL;
+        }
+    }
+}
 
-/**
- * The number of buckets, must be a power of 2, current 2^19
- */
-#define SESSIONS_BUCKET_COUNT (512 * 1024)
 
 /**
- * Our mask defining the width of our hash function
+ * Remove the reverse entry of a session pair from the sessions_table once its
+ * forward entry was removed by a clean_sessions_* function, and leave the
+ * pair to be freed by its timer wheel at its next tick. No bucket or session
+ * locks may be held by the caller.
+ *
+ * @param[in] pair
+ *      The session pair
  */
-const uint32_t HASH_MASK = SESSIONS_BUCKET_COUNT - 1;
-
+static void
+unlink_pair(session_pair_t * pair)
+{
+    unlink_session(&pair->reverse);
+    
+    // wait for any cpu that found the pair before it was unlinked
+    INSIST_ERR(msp_spinlock_lock(&pair->lock) == MSP_OK);
+    INSIST_ERR(msp_spinlock_unlock(&pair->lock) == MSP_OK);
+    
+    INSIST_ERR(msp_spinlock_lock(&pair->wheel->lock) == MSP_OK);
+    
+    if(pair->slot != NULL) {
+        TAILQ_REMOVE(pair->slot, pair, timer);
+        TAILQ_INSERT_TAIL(&pair->wheel->unlinked, pair, timer);
+        pair->slot = &pair->wheel->unlinked;
+    } else {
+        // not armed yet or due, expire_session or arm_session_timer see this
+        pair->unlinked = TRUE;
+    }
+    
+    INSIST_ERR(msp_spinlock_unlock(&pair->wheel->lock) == MSP_OK);
+}
 
-/*** Data Structures ***/
 
 /**
- * flow entry information structure 
+ * Get how long a session lasts without seeing traffic before it is aged out
+ *
+ * @param[in] session
+ *      The forward (egress) entry of the session
+ *
+ * @return the duration in seconds
  */
-typedef struct session_entry_s {
-    struct session_entry_s     * reverse; ///< reverse flow contains other addr/port
-    in_addr_t                    saddr;   ///< src IP address
-    in_addr_t                    daddr;   ///< dest IP address
-    uint16_t                     sport;   ///< src port
-    uint16_t                     dport;   ///< dest port
-    uint8_t                      cpu;     ///< the cpu on which this entry was allocated
-    uint8_t                      dir;     ///< direction
-    in_addr_t                    faddr;   ///< IP address of facade if INGRESS entry, or real server if EGRESS entry
-    time_t                       age_ts;  ///< session/flow timestamp
-    uint16_t                     ss_id;   ///< svc set id
-    uint16_t                     frag_group; ///< fragment group (ID)
-    msp_spinlock_t               lock;    ///< flow lock
-    TAILQ_ENTRY(session_entry_s) entries; ///< next and prev list entries
-} session_entry_t;
+static time_t
+session_duration(session_entry_t * session)
+{
+    if(session->faddr == 0) {
+        // an entry for a non-application
+        return NON_APP_SESSION_DURATION;
+    } else if(session->faddr == (in_addr_t)-1) {
+        // entry for a flow matching an application w/ no servers up
+        return DOWN_SERVER_SESSION_DURATION;
+    }
+    
+    // it is a session entry for an application
+    return monitor_get_session_timeout(
+            session->ss_id, session->daddr, session->dport);
+}
 
 
 /**
- * A list/set of servers type as a tailq
+ * Arm a session pair's timer in a timer wheel. The wheel must be locked by
+ * the caller.
+ *
+ * @param[in] wheel
+ *      The timer wheel
+ *
+ * @param[in] pair
+ *      The session pair with its expiry set
  */
-typedef TAILQ_HEAD(ht_bucket_list_s, session_entry_s) ht_bucket_list_t;
+static void
+arm_session_timer(timer_wheel_t * wheel, session_pair_t * pair)
+{
+    if(pair->unlinked) { // removed by a clean_sessions_* function
+        TAILQ_INSERT_TAIL(&wheel->unlinked, pair, timer);
+        pair->slot = &wheel->unlinked;
+        return;
+    }
+    
+    if(pair->expiry <= wheel->now) {
+        pair->expiry = wheel->now + 1; // fire at the next tick
+    } else if(pair->expiry - wheel->now > WHEEL_MAX_DELTA) {
+        pair->expiry = wheel->now + WHEEL_MAX_DELTA;
+    }
+    
+    if(pair->expiry - wheel->now < WHEEL_SLOTS) {
+        pair->slot = &wheel->slots[0][pair->expiry & WHEEL_MASK];
+    } else {
+        pair->slot =
+                &wheel->slots[1][(pair->expiry >> WHEEL_BITS) & WHEEL_MASK];
+    }
+    
+    TAILQ_INSERT_TAIL(pair->slot, pair, timer);
+}
 
 
 /**
- * A bucket in a hashtable_t
+ * Expire a session pair whose timer is due if it hasn't seen traffic since
+ * the timer was armed, otherwise leave it to be re-armed
+ *
+ * @param[in] pair
+ *      The session pair whose timer is due (no longer in a wheel slot)
+ *
+ * @param[in] now
+ *      The current time of the wheel
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
+ *
+ * @return TRUE if the pair was freed; FALSE if it needs to be re-armed
  */
-typedef struct hash_bucket_s {
-    msp_spinlock_t        bucket_lock;    ///< lock for this bucket
-    ht_bucket_list_t      bucket_entries; ///< list of entries in bucket
-} hash_bucket_t;
+static boolean
+expire_session(session_pair_t * pair, time_t now, int cpu)
+{
+    hash_bucket_t * bucket, * home;
+    session_entry_t * session = &pair->forward;
+    time_t duration;
+    int i, s;
+    
+    if(pair->unlinked) { // removed by a clean_sessions_* function
+        msp_objcache_free(entry_handle, pair, cpu, obj_cache_id);
+        return TRUE;
+    }
+    
+    duration = session_duration(session);
+    
+    // find the forward entry where it is stored (it never moves)
+    
+    home = &sessions_table->hash_bucket[session->hash & HASH_MASK];
+    
+    for(i = 0; i <= SESSION_MAX_PROBE; ++i) {
+        
+        bucket = home + i;
+        
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+        
+        for(s = 0; s < SESSION_BUCKET_SLOTS; ++s) {
+            if(bucket->session[s] == session) {
+                break;
+            }
+        }
+        
+        if(s < SESSION_BUCKET_SLOTS) {
+            
+            // Get the session lock
+            INSIST_ERR(msp_spinlock_lock(&pair->lock) == MSP_OK);
+            
+            if(pair->age_ts + duration > now) { // not expired
+                pair->expiry = pair->age_ts + duration;
+                
+                // Release the session and bucket locks
+                INSIST_ERR(msp_spinlock_unlock(&pair->lock) == MSP_OK);
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return FALSE;
+            }
+            
+            remove_session(bucket, s);
+            unindex_pair(pair);
+            
+            // Release the session and bucket locks
+            INSIST_ERR(msp_spinlock_unlock(&pair->lock) == MSP_OK);
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+            
+            if(session->faddr != 0 && session->faddr != (in_addr_t)-1) {
+                monitor_remove_session_for_server(session->ss_id,
+                        session->daddr, session->dport, session->faddr);
+            }
+            
+            release_pair(pair, cpu);
+            return TRUE;
+        }
+        
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
+    
+    // a clean_sessions_* function removed it, but is still unlinking its
+    // reverse entry, so check again at the next tick
+    
+    pair->expiry = now + 1;
+    return FALSE;
+}
 
 
 /**
- * A hashtable for the sessions_table
+ * Free the session pairs left on a data cpu's timer wheel by the
+ * clean_sessions_* functions
+ *
+ * @param[in] wheel
+ *      The timer wheel of the data cpu
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
  */
-typedef struct hashtable_s {
-    hash_bucket_t hash_bucket[SESSIONS_BUCKET_COUNT]; ///<maps hashes to buckets
-} hashtable_t;
-
+static void
+free_unlinked_pairs(timer_wheel_t * wheel, int cpu)
+{
+    wheel_slot_t unlinked;
+    session_pair_t * pair;
+    
+    TAILQ_INIT(&unlinked);
+    
+    INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+    TAILQ_CONCAT(&unlinked, &wheel->unlinked, timer);
+    INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+    
+    // unlink_pair is done with them once they are on the list
+    
+    while((pair = TAILQ_FIRST(&unlinked)) != NULL) {
+        TAILQ_REMOVE(&unlinked, pair, timer);
+        msp_objcache_free(entry_handle, pair, cpu, obj_cache_id);
+    }
+}
 
-static evTimerID aging_timer;        ///< timer set to do aging and cleanup
-static msp_shm_handle_t shm_handle;  ///< handle for shared memory allocator
-static msp_oc_handle_t table_handle; ///< handle for OC table allocator
-static msp_oc_handle_t entry_handle; ///< handle for OC table entry allocator
-static hashtable_t * sessions_table; ///< pointer to the hashtable of sessions
-static atomic_uint_t loops_running;  ///< # of data loops running
-static volatile uint8_t do_shutdown; ///< do the data loops need to shutdown
-static uint32_t obj_cache_id;        ///< ID for OC memory tracking
 
-/*** STATIC/INTERNAL Functions ***/
+/**
+ * Advance a data cpu's timer wheel up to the current time, freeing the
+ * session pairs unlinked from it, and age out the sessions that are due
+ *
+ * @param[in] wheel
+ *      The timer wheel of the data cpu
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
+ */
+static void
+advance_timer_wheel(timer_wheel_t * wheel, int cpu)
+{
+    time_t current_time = get_current_time();
+    wheel_slot_t due, rearm;
+    session_pair_t * pair;
+    
+    free_unlinked_pairs(wheel, cpu);
+    
+    while(wheel->now < current_time) {
+        
+        TAILQ_INIT(&due);
+        TAILQ_INIT(&rearm);
+        
+        INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+        
+        ++wheel->now;
+        
+        if((wheel->now & WHEEL_MASK) == 0) {
+            // cascade the next span from level 1 down into level 0
+            TAILQ_CONCAT(&rearm,
+               &wheel->slots[1][(wheel->now >> WHEEL_BITS) & WHEEL_MASK], timer);
+            
+            while((pair = TAILQ_FIRST(&rearm)) != NULL) {
+                TAILQ_REMOVE(&rearm, pair, timer);
+                arm_session_timer(wheel, pair);
+            }
+        }
+        
+        TAILQ_CONCAT(&due, &wheel->slots[0][wheel->now & WHEEL_MASK], timer);
+        
+        TAILQ_FOREACH(pair, &due, timer) {
+            pair->slot = NULL; // unlink_pair now leaves them to expire_session
+        }
+        
+        INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+        
+        while((pair = TAILQ_FIRST(&due)) != NULL) {
+            TAILQ_REMOVE(&due, pair, timer);
+            
+            if(!expire_session(pair, wheel->now, cpu)) {
+                TAILQ_INSERT_TAIL(&rearm, pair, timer);
+            }
+        }
+        
+        if(!TAILQ_EMPTY(&rearm)) {
+            INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+            
+            while((pair = TAILQ_FIRST(&rearm)) != NULL) {
+                TAILQ_REMOVE(&rearm, pair, timer);
+                arm_session_timer(wheel, pair);
+            }
+            
+            INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+        }
+    }
+}
 
 
 /**
- * Callback to periodically age out entries in our sessions_table and
- * cleanup shared memory
+ * Callback to periodically send stats and cleanup shared memory. Sessions
+ * are aged out by the data cpus' timer wheels.
  * 
  * @param[in] ctx
  *     The event context for this application
@@ -142,96 +1287,6 @@ aging_cleanup(evContext ctx __unused,
               struct timespec due __unused,
               struct timespec inter __unused)
 {
-    const time_t down_server_flow_duration = 60;
-    const time_t non_app_flow_duration = 300;
-    
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    session_entry_t * session, * next;
-    time_t current_time, down_server_flow_timeout, non_app_flow_timeout;
-    
-    cpu = msp_get_current_cpu();
-    
-    current_time = get_current_time();
-    down_server_flow_timeout = current_time - down_server_flow_duration;
-    non_app_flow_timeout = current_time - non_app_flow_duration;
-    
-    for(i = 0; i < SESSIONS_BUCKET_COUNT; ++i) {
-        
-        bucket = &sessions_table->hash_bucket[i];
-        
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-      
-        session = TAILQ_FIRST(&bucket->bucket_entries);
-        
-        while(session != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(session, entries);
-            
-            // Get the session lock
-            INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-            
-            // check for timeout/expiry
-            
-            if(session->faddr == 0) {
-                // an entry for a non-application
-                if(session->age_ts < non_app_flow_timeout) {
-                    
-                    TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                    msp_objcache_free(entry_handle, session, cpu, obj_cache_id);
-                    session = next;
-                    continue;
-                }
-            } else if(session->faddr == (in_addr_t)-1) {
-                // entry for a flow matching an application w/ no servers up
-                if(session->age_ts < down_server_flow_timeout) {
-                    
-                    TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                    msp_objcache_free(entry_handle, session, cpu, obj_cache_id);
-                    session = next;
-                    continue;
-                }
-            } else {
-                // it is a session entry for an application
-                
-                if(session->dir == JBUF_PACKET_DIR_INGRESS) {
-                    if(session->age_ts +
-                        get_app_session_timeout(session->ss_id,
-                            session->faddr, session->sport) < current_time) {
-
-                        TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                        msp_objcache_free(entry_handle, session, cpu, obj_cache_id);
-                        session = next;
-                        continue;
-                    }
-                } else {
-                    if(session->age_ts +
-                       get_app_session_timeout(session->ss_id,
-                            session->daddr, session->dport) < current_time) {
-                        
-                        // since it is egress
-                        monitor_remove_session_for_server(session->ss_id,
-                                session->daddr, session->dport, session->faddr);
-                        
-                        TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                        msp_objcache_free(entry_handle, session, cpu, obj_cache_id);
-                        session = next;
-                        continue;
-                    }
-                }
-            }
-            
-            // Release the session lock
-            INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            session = next;
-        }
-        
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
-    
     monitor_send_stats(); // (update to mgmt component)
     
     msp_objcache_reclaim(shm_handle);
@@ -322,14 +1377,186 @@ pullup_bytes(struct jbuf ** pkt_buf, uint16_t num_bytes)
 }
 
 
+/**
+ * Create the pair of session entries for a new egress flow and insert them
+ * into the sessions_table. No bucket or session locks may be held by the
+ * caller, since a server is picked for the flow (which may take the monitor's
+ * locks) before anything is published.
+ * 
+ * @param[in] ip_pkt
+ *      The IP packet
+ * 
+ * @param[in] tcp_hdr
+ *      The TCP header of the packet
+ * 
+ * @param[in] ss_id
+ *      The service set id
+ * 
+ * @param[in] hash
+ *      The hash of the packet's KEY fields
+ * 
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache alloc calls)
+ * 
+ * @return the forward (egress) session entry with its pair locked; NULL upon
+ *         failure (error is logged)
+ */
+static session_entry_t *
+create_session(struct ip * ip_pkt,
+               struct tcphdr * tcp_hdr,
+               uint16_t ss_id,
+               uint32_t hash,
+               int cpu)
+{
+    hash_bucket_t * bucket;
+    session_pair_t * pair;
+    session_entry_t * session, * reverse, * found;
+    
+    pair = msp_objcache_alloc(entry_handle, cpu, obj_cache_id);
+    if(pair == NULL) {
+        LOG(LOG_ERR, "%s: Failed to allocate object cache for a "
+                "session entry", __func__);
+        return NULL;
+    }
+    
+    msp_spinlock_init(&pair->lock);
+    pair->age_ts = get_current_time();
+    pair->wheel = &wheels[cpu];
+    pair->slot = NULL;
+    pair->unlinked = FALSE;
+    bzero(pair->idx, sizeof(pair->idx));
+    
+    session = &pair->forward;
+    session->pair = pair;
+    session->saddr = ip_pkt->ip_src.s_addr;
+    session->daddr = ip_pkt->ip_dst.s_addr;
+    session->sport = tcp_hdr->th_sport;
+    session->dport = tcp_hdr->th_dport;
+    session->ss_id = ss_id;
+    session->dir = JBUF_PACKET_DIR_EGRESS;
+    session->hash = hash;
+    
+    // init reverse
+    
+    reverse = &pair->reverse;
+    reverse->pair = pair;
+    reverse->daddr = ip_pkt->ip_src.s_addr;
+    reverse->sport = tcp_hdr->th_dport;
+    reverse->dport = tcp_hdr->th_sport;
+    reverse->ss_id = ss_id;
+    reverse->dir = JBUF_PACKET_DIR_INGRESS;
+    
+    // find out if this flow will match an application
+    // ip_dst must match that of an application in this service set
+    
+    session->faddr = monitor_get_server_for(
+            session->ss_id, session->daddr, session->dport, session->saddr);
+    
+    if(session->faddr == (in_addr_t)-1) {
+        // indicate it is for an app, but no servers are up
+        reverse->faddr = (in_addr_t)-1;
+        reverse->saddr = ip_pkt->ip_dst.s_addr;
+    } else if(session->faddr == 0) {
+        // indicate not for an app
+        reverse->faddr = 0;
+        reverse->saddr = ip_pkt->ip_dst.s_addr;
+    } else {
+        // session->faddr is actually the real server address now
+        
+        // for reverse set faddr to the facade
+        reverse->faddr = ip_pkt->ip_dst.s_addr;
+        
+        // ingress src will be real server
+        reverse->saddr = session->faddr;
+    }
+    
+    reverse->hash = session_hash(reverse->saddr, reverse->daddr,
+            reverse->sport, reverse->dport, ss_id);
+    
+    // insert the forward entry unless another cpu did so meanwhile
+    
+    bucket = &sessions_table->hash_bucket[hash & HASH_MASK];
+    
+    // Get the bucket lock
+    INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    
+    found = find_session(hash, session->saddr, session->daddr,
+            session->sport, session->dport, ss_id);
+    
+    if(found != NULL || insert_session(session) != SUCCESS) {
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+        
+        if(session->faddr != 0 && session->faddr != (in_addr_t)-1) {
+            monitor_remove_session_for_server(session->ss_id,
+                    session->daddr, session->dport, session->faddr);
+        }
+        
+        msp_objcache_free(entry_handle, pair, cpu, obj_cache_id);
+        
+        if(found == NULL) {
+            LOG(LOG_ERR, "%s: Failed to find a free slot in the session "
+                    "table for a session to %s", __func__,
+                    inet_ntoa(ip_pkt->ip_dst));
+        }
+        return found;
+    }
+    
+    // Release the bucket lock
+    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    
+    // insert the reverse entry
+    
+    bucket = &sessions_table->hash_bucket[reverse->hash & HASH_MASK];
+    
+    // Get the bucket lock
+    INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    
+    if(insert_session(reverse) != SUCCESS) {
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+        
+        // the forward entry is published, so unlink it before freeing
+        
+        unlink_session(session);
+        
+        if(session->faddr != 0 && session->faddr != (in_addr_t)-1) {
+            monitor_remove_session_for_server(session->ss_id,
+                    session->daddr, session->dport, session->faddr);
+        }
+        
+        release_pair(pair, cpu);
+        
+        LOG(LOG_ERR, "%s: Failed to find a free slot in the session table "
+                "for a session reverse entry from %s", __func__,
+                inet_ntoa(ip_pkt->ip_dst));
+        return NULL;
+    }
+    
+    // Release the bucket lock
+    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    
+    // index it for the cleanups
+    index_pair(pair, cpu);
+    
+    // arm the pair's aging timer in this data cpu's timer wheel
+    pair->expiry = pair->age_ts + session_duration(session);
+    
+    INSIST_ERR(msp_spinlock_lock(&wheels[cpu].lock) == MSP_OK);
+    arm_session_timer(&wheels[cpu], pair);
+    INSIST_ERR(msp_spinlock_unlock(&wheels[cpu].lock) == MSP_OK);
+    
+    // Get the session lock
+    INSIST_ERR(msp_spinlock_lock(&pair->lock) == MSP_OK);
+    
+    return session;
+}
+
+
 /**
  * Process an IP packet that is TCP, and the TCP header must be available 
  * in the bytes following the IP address.
  * 
- * @param[in] pkt_buf
- *      The received jbuf for this packet, that will 
- *      go to http_request_filter if needed
- * 
  * @param[in] ip_pkt
  *      The IP packet
  * 
@@ -347,9 +1574,8 @@ process_packet(struct ip * ip_pkt,
                int cpu)
 {
     uint32_t hash;
-    uint16_t * key;
+    uint16_t ss_id;
     int len;
-    in_addr_t facade, real;
     hash_bucket_t * bucket;
     session_entry_t * session;
     struct tcphdr * tcp_hdr = 
@@ -366,220 +1592,55 @@ process_packet(struct ip * ip_pkt,
         return EFAIL;
     }
     
-    // get hash of the two IP addresses
+    // get hash of the full KEY: addresses, ports, and service set id
+    // hash output is 32 bits; its lower bits select the home bucket
     
-    key = (uint16_t *)&ip_pkt->ip_src;
-    hash = 0x5F5F;
-    hash = ((hash << 5) + hash) ^ key[0];
-    hash = ((hash << 5) + hash) ^ key[1];
-    hash = ((hash << 5) + hash) ^ key[2];
-    hash = ((hash << 5) + hash) ^ key[3];
-    
-    hash &= HASH_MASK;
+    ss_id = ss_info->info.intf_type.svc_set_id;
+    hash = session_hash(ip_pkt->ip_src.s_addr, ip_pkt->ip_dst.s_addr,
+            tcp_hdr->th_sport, tcp_hdr->th_dport, ss_id);
     
     // use hash to lookup a hash bucket and find the matching entry
     
-    bucket = &sessions_table->hash_bucket[hash]; // get bucket
+    bucket = &sessions_table->hash_bucket[hash & HASH_MASK]; // get home bucket
     
     // Get the bucket lock
     INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-  
-    session = TAILQ_FIRST(&bucket->bucket_entries);
     
-    while(session != NULL) {
-        if(session->saddr == ip_pkt->ip_src.s_addr
-                && session->daddr == ip_pkt->ip_dst.s_addr
-                && session->ss_id == ss_info->info.intf_type.svc_set_id
-                && session->dport == tcp_hdr->th_dport
-                && session->sport == tcp_hdr->th_sport) {
-
-            break; // match
-        }
-        session = TAILQ_NEXT(session, entries);
-    }
+    session = find_session(hash, ip_pkt->ip_src.s_addr, ip_pkt->ip_dst.s_addr,
+            tcp_hdr->th_sport, tcp_hdr->th_dport, ss_id);
+    
+    // Release the bucket lock
+    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
     
     // if there's no matching session, then create one... the slow path
     if(session == NULL) {
         if(ss_info->pkt_dir == JBUF_PACKET_DIR_INGRESS) {
             // not initiated by a client,
             // so definietly can't belong to an application
-            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
             return SUCCESS;
         }
         // SLOW PATH FOR EGRESS TRAFFIC:
         
-        session = msp_objcache_alloc(entry_handle, cpu, obj_cache_id);
+        session = create_session(ip_pkt, tcp_hdr, ss_id, hash, cpu);
         if(session == NULL) {
-            // Release the bucket lock
-            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-            
-            LOG(LOG_ERR, "%s: Failed to allocate object cache for a "
-                    "session entry", __func__);
-            return EFAIL;
-        }
-        session->reverse = msp_objcache_alloc(entry_handle, cpu, obj_cache_id);
-        if(session->reverse == NULL) {
-            
-            msp_objcache_free(entry_handle, session, cpu, obj_cache_id);
-            
-            // Release the bucket lock
-            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-            
-            LOG(LOG_ERR, "%s: Failed to allocate object cache for a "
-                    "session reverse entry", __func__);
             return EFAIL;
         }
-        
-        // init and grab lock
-        msp_spinlock_init(&session->lock);
-        INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-        
-        TAILQ_INSERT_HEAD(&bucket->bucket_entries, session, entries);
-        
-        session->age_ts = get_current_time();
-        session->saddr = ip_pkt->ip_src.s_addr;
-        session->daddr = ip_pkt->ip_dst.s_addr;
-        session->sport = tcp_hdr->th_sport;
-        session->dport = tcp_hdr->th_dport;
-        session->ss_id = ss_info->info.intf_type.svc_set_id;
-        session->dir = JBUF_PACKET_DIR_EGRESS;
-        session->cpu = cpu;
-        
-
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-        
-        // init reverse
-        
-        // init and grab lock
-        msp_spinlock_init(&session->reverse->lock);
-        INSIST_ERR(msp_spinlock_lock(&session->reverse->lock) == MSP_OK);
-        
-        session->reverse->age_ts = session->age_ts;
-        session->reverse->saddr = ip_pkt->ip_dst.s_addr;
-        session->reverse->daddr = ip_pkt->ip_src.s_addr;
-        session->reverse->sport = tcp_hdr->th_dport;
-        session->reverse->dport = tcp_hdr->th_sport;
-        session->reverse->ss_id = ss_info->info.intf_type.svc_set_id;
-        session->reverse->reverse = session;
-        session->reverse->dir = JBUF_PACKET_DIR_INGRESS;
-        session->reverse->cpu = cpu;
-        
-        // find out if this flow will match an application
-        // ip_dst must match that of an application in this service set
-        
-        session->faddr = monitor_get_server_for(
-                session->ss_id, session->daddr, session->dport);
-        
-        if(session->faddr == (in_addr_t)-1) {
-            // indicate it is for an app, but no servers are up
-            session->reverse->faddr = (in_addr_t)-1;
-            session->reverse->saddr = ip_pkt->ip_dst.s_addr;
-        } else if(session->faddr == 0) {
-            // indicate not for an app
-            session->reverse->faddr = 0;
-            session->reverse->saddr = ip_pkt->ip_dst.s_addr;
-        } else {
-            // session->faddr is actually the real server address now
-            
-            // for reverse set faddr to the facade
-            session->reverse->faddr = ip_pkt->ip_dst.s_addr;
-            
-            // ingress src will be real server
-            session->reverse->saddr = session->faddr;
-        }
-        
-        session->reverse->frag_group = 0;
-        
-        // If it is the first fragment note the frag ID
-        if((ntohs(ip_pkt->ip_off) & IP_MF)) {
-            session->frag_group = ip_pkt->ip_id;
-        } else {
-            session->frag_group = 0;
-        }
-        
-        // get hash of the reverse flow to find bucket for reverse entry
-
-        hash = 0x5F5F;
-        key = (uint16_t *)&session->reverse->saddr;
-        hash = ((hash << 5) + hash) ^ key[0];
-        hash = ((hash << 5) + hash) ^ key[1];
-        hash = ((hash << 5) + hash) ^ key[2];
-        hash = ((hash << 5) + hash) ^ key[3];        
-        hash &= HASH_MASK;
-        
-        // use hash to lookup a hash bucket and find the matching entry
-        bucket = &sessions_table->hash_bucket[hash]; // get bucket
-        
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-        
-        TAILQ_INSERT_HEAD(&bucket->bucket_entries, session->reverse, entries);
-        
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);        
-        
-        if(session->faddr == 0) {
-            // Release the session lock
-            INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            INSIST_ERR(msp_spinlock_unlock(&session->reverse->lock) == MSP_OK);
-            return SUCCESS; // not an application, so nothing to change
-        }
-        if(session->faddr == (in_addr_t)-1) {
-            // Release the session lock
-            INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            INSIST_ERR(msp_spinlock_unlock(&session->reverse->lock) == MSP_OK);
-            
-            LOG(LOG_ERR, "%s: Dropping packet found to an application with no "
-                    "servers up.", __func__);
-            return EFAIL; // indicate to drop, when no servers are up
-        }
-        
-        // going to a real server for an application, so
-        // replace the facade's address with the real server's address
-        
-        // adjust IP checksum taking IP addresses into account
-        checksum_adjust((unsigned char *)&ip_pkt->ip_sum,
-            (unsigned char *)&ip_pkt->ip_dst, sizeof(in_addr_t),
-            (unsigned char *)&session->faddr, sizeof(in_addr_t));
-        
-        // adjust TCP checksum taking IP addresses into account
-        checksum_adjust((unsigned char *)&tcp_hdr->th_sum,
-            (unsigned char *)&ip_pkt->ip_dst, sizeof(in_addr_t),
-            (unsigned char *)&session->faddr, sizeof(in_addr_t));
-        
-        // change address
-        facade = ip_pkt->ip_dst.s_addr;
-        real = ip_pkt->ip_dst.s_addr = session->faddr;
-        
-        // Release the session lock (don't need for filter)
-        INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-        INSIST_ERR(msp_spinlock_unlock(&session->reverse->lock) == MSP_OK);
-        
-        return SUCCESS;
     }
     
-    // else there's a matching session, so use it to forward the traffic
+    // there's a matching session (locked), so use it to forward the traffic
     // FAST PATH:
-
-    // Get the session lock
-    INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
     
-    // Release the bucket lock
-    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    
-    // If it is the first fragment note the frag ID
+    // If it is the first fragment note the frag ID, so the next fragments
+    // (without the TCP header) can be mapped back to this session
     if((ntohs(ip_pkt->ip_off) & IP_MF)) {
-        session->frag_group = ip_pkt->ip_id;
-    } else {
-        session->frag_group = 0;
+        record_fragment(session, ip_pkt->ip_id, cpu);
     }
     
     if(session->faddr == (in_addr_t)-1) {
         // all servers down for the application for this flow
         
         // Release the session lock
-        INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
+        INSIST_ERR(msp_spinlock_unlock(&session->pair->lock) == MSP_OK);
         
         LOG(LOG_ERR, "%s: Dropping packet found to an application with no "
                 "servers up.", __func__);
@@ -588,7 +1649,7 @@ process_packet(struct ip * ip_pkt,
         return EFAIL;
     }
     
-    session->age_ts = get_current_time();
+    session->pair->age_ts = get_current_time();
     
     if(session->faddr != 0) { // it is for an application
         if(ss_info->pkt_dir == JBUF_PACKET_DIR_INGRESS) {
@@ -622,18 +1683,12 @@ process_packet(struct ip * ip_pkt,
                 (unsigned char *)&session->faddr, sizeof(in_addr_t));
             
             // change address
-            facade = ip_pkt->ip_dst.s_addr;
-            real = ip_pkt->ip_dst.s_addr = session->faddr;
-            
-            // Release the session lock (faster...don't need for filter)
-            INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            
-            return SUCCESS;
+            ip_pkt->ip_dst.s_addr = session->faddr;
         }
     }
     
     // Release the session lock
-    INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
+    INSIST_ERR(msp_spinlock_unlock(&session->pair->lock) == MSP_OK);
     
     return SUCCESS;
 }
@@ -650,52 +1705,61 @@ process_packet(struct ip * ip_pkt,
  * @param[in] ss_info
  *      The service set info from the jbuf
  * 
+ * @param[in] cpu
+ *      The current cpu
+ * 
  * @return SUCCESS if the packet can be sent out; EFAIL if it can be dropped
  */
 static status_t
-process_fragment(struct ip * ip_pkt, jbuf_svc_set_info_t * ss_info)
+process_fragment(struct ip * ip_pkt, jbuf_svc_set_info_t * ss_info, int cpu)
 {
     uint32_t hash;
-    uint16_t * key;
+    uint16_t ss_id, sport = 0, dport = 0;
     hash_bucket_t * bucket;
-    session_entry_t * session;
-    
-    // get hash of the two IP addresses
+    session_entry_t * session = NULL;
+    boolean found;
+    int i;
     
-    key = (uint16_t *)&ip_pkt->ip_src;
-    hash = 0x5F5F;
-    hash = ((hash << 5) + hash) ^ key[0];
-    hash = ((hash << 5) + hash) ^ key[1];
-    hash = ((hash << 5) + hash) ^ key[2];
-    hash = ((hash << 5) + hash) ^ key[3];
+    ss_id = ss_info->info.intf_type.svc_set_id;
     
-    hash &= HASH_MASK;    
+    // map the fragment back to the ports of its session (from the first
+    // fragment) since there's no TCP header in this one; the first fragment
+    // was most likely seen by this cpu
     
-    // use hash to lookup a hash bucket and find the matching entry
-    
-    bucket = &sessions_table->hash_bucket[hash]; // get bucket
+    hash = frag_hash(ip_pkt->ip_src.s_addr, ip_pkt->ip_dst.s_addr,
+            ip_pkt->ip_id, ss_id);
     
-    // Get the bucket lock
-    INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-  
-    session = TAILQ_FIRST(&bucket->bucket_entries);
+    found = find_fragment_in(&frag_caches[cpu], ip_pkt, ss_id, hash,
+            &sport, &dport);
     
-    while(session != NULL) {
-        if(session->saddr == ip_pkt->ip_src.s_addr 
-                && session->daddr == ip_pkt->ip_dst.s_addr
-                && session->ss_id == ss_info->info.intf_type.svc_set_id
-                && session->frag_group == ip_pkt->ip_id) {
-
-            break; // match
+    for(i = 0; !found && i < loop_count; ++i) {
+        if(loop_cpus[i] != cpu) {
+            found = find_fragment_in(&frag_caches[loop_cpus[i]], ip_pkt,
+                    ss_id, hash, &sport, &dport);
         }
-        session = TAILQ_NEXT(session, entries);
     }
     
-    // if there's no matching session, so we haven't seen the first fragment yet
-    if(session == NULL) {
+    if(found) {
+        
+        hash = session_hash(ip_pkt->ip_src.s_addr, ip_pkt->ip_dst.s_addr,
+                sport, dport, ss_id);
+        
+        // use hash to lookup a hash bucket and find the matching entry
+        
+        bucket = &sessions_table->hash_bucket[hash & HASH_MASK]; // get bucket
+        
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+        
+        session = find_session(hash, ip_pkt->ip_src.s_addr,
+                ip_pkt->ip_dst.s_addr, sport, dport, ss_id);
+        
         // Release the bucket lock
         INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-        
+    }
+    
+    // if there's no matching session, so we haven't seen the first fragment yet
+    if(session == NULL) {
         LOG(LOG_WARNING, "%s: Received a packet from %s. It is an IP "
                 "fragment, but we have not yet received the first "
                 "fragment, so we cannot tell if it belongs to an "
@@ -705,20 +1769,15 @@ process_fragment(struct ip * ip_pkt, jbuf_svc_set_info_t * ss_info)
         return SUCCESS; // don't know anything about this flow
     }
     
-    // else there's a matching session, so use it to forward the traffic
+    // else there's a matching session (locked), so use it to forward the
+    // traffic
     // FAST PATH:
-
-    // Get the session lock
-    INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-    
-    // Release the bucket lock
-    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
     
     if(session->faddr == (in_addr_t)-1) {
         // all servers down for the application for this flow
         
         // Release the session lock
-        INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
+        INSIST_ERR(msp_spinlock_unlock(&session->pair->lock) == MSP_OK);
         
         LOG(LOG_ERR, "%s: Dropping packet found to an application with no "
                 "servers up.", __func__);
@@ -727,7 +1786,7 @@ process_fragment(struct ip * ip_pkt, jbuf_svc_set_info_t * ss_info)
         return EFAIL;
     }
     
-    session->age_ts = get_current_time();
+    session->pair->age_ts = get_current_time();
     
     if(session->faddr != 0) { // it is for an application
         if(ss_info->pkt_dir == JBUF_PACKET_DIR_INGRESS) {
@@ -756,7 +1815,7 @@ process_fragment(struct ip * ip_pkt, jbuf_svc_set_info_t * ss_info)
     }
     
     // Release the session lock
-    INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
+    INSIST_ERR(msp_spinlock_unlock(&session->pair->lock) == MSP_OK);
     
     return SUCCESS;
 }
@@ -834,6 +1893,11 @@ equilibrium_process_packet(msp_dataloop_args_t * params)
     // Start the packet loop...
     while(!do_shutdown) {
         
+        // Age out sessions whose timers are due (usually a no-op)
+        if(wheels[cpu].now < get_current_time()) {
+            advance_timer_wheel(&wheels[cpu], cpu);
+        }
+        
         // Dequeue a packet from the rx-fifo
         pkt_buf = msp_data_recv(params->dhandle, &type);
         
@@ -874,7 +1938,7 @@ equilibrium_process_packet(msp_dataloop_args_t * params)
         if((ip_frag_offset & IP_OFFMASK)) {
             
             // It's a fragment, but not the first fragment
-            if(process_fragment(ip_pkt, &ss_info)) {
+            if(process_fragment(ip_pkt, &ss_info, cpu)) {
 
                 LOG(LOG_NOTICE, "%s: Dropping a packet who's processing failed",
                     __func__);
@@ -909,6 +1973,203 @@ equilibrium_process_packet(msp_dataloop_args_t * params)
 }
 
 
+/**
+ * Collect the KEYs of the next sessions in an index bucket that match a
+ * filter, going through at most CLEAN_BATCH pairs after the cursor, and move
+ * the cursor past them
+ *
+ * @param[in] idx
+ *      The index bucket for the filter
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @param[in] cursor
+ *      The cursor pair in the index bucket, where the last call left off; it
+ *      is removed from the bucket once the end is reached
+ *
+ * @param[out] keys
+ *      The keys collected (room for CLEAN_BATCH keys)
+ *
+ * @param[out] more
+ *      Set to TRUE if the end of the bucket wasn't reached
+ *
+ * @return the number of keys collected
+ */
+static uint32_t
+collect_sessions(session_index_t * idx,
+                 session_filter_t * filter,
+                 session_pair_t * cursor,
+                 session_key_t * keys,
+                 boolean * more)
+{
+    session_pair_t * pair;
+    session_entry_t * session;
+    uint32_t count = 0, visited;
+    
+    // Get the index bucket lock
+    INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+    
+    pair = TAILQ_NEXT(cursor, idx_entry[filter->type]);
+    TAILQ_REMOVE(&idx->pairs, cursor, idx_entry[filter->type]);
+    
+    for(visited = 0; pair != NULL && visited < CLEAN_BATCH; ++visited) {
+        
+        // pairs aren't freed while indexed, and the fields of their forward
+        // entry never change; skip the cursors of any other cleanups
+        
+        session = &pair->forward;
+        
+        if(session->pair == pair && match_session(session, filter)) {
+            keys[count].saddr = session->saddr;
+            keys[count].daddr = session->daddr;
+            keys[count].sport = session->sport;
+            keys[count].dport = session->dport;
+            keys[count].ss_id = session->ss_id;
+            keys[count].hash = session->hash;
+            ++count;
+        }
+        
+        pair = TAILQ_NEXT(pair, idx_entry[filter->type]);
+    }
+    
+    if(pair != NULL) { // resume from there next time
+        TAILQ_INSERT_BEFORE(pair, cursor, idx_entry[filter->type]);
+    }
+    
+    // Release the index bucket lock
+    INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+    
+    *more = (pair != NULL);
+    return count;
+}
+
+
+/**
+ * Remove the sessions with the given KEYs if they still match a filter
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @param[in] keys
+ *      The KEYs of the sessions
+ *
+ * @param[in] count
+ *      The number of keys
+ */
+static void
+remove_collected_sessions(session_filter_t * filter,
+                          session_key_t * keys,
+                          uint32_t count)
+{
+    uint32_t k, i;
+    int s;
+    hash_bucket_t * bucket;
+    session_entry_t * session;
+    session_key_t * key;
+    uint16_t fp;
+    
+    for(k = 0; k < count; ++k) {
+        
+        key = &keys[k];
+        fp = session_fp(key->saddr, key->daddr, key->sport, key->dport,
+                key->ss_id);
+        
+        // look in the home bucket and the ones it may have overflowed into
+        
+        for(i = 0; i <= SESSION_MAX_PROBE; ++i) {
+            
+            bucket = &sessions_table->hash_bucket[(key->hash & HASH_MASK) + i];
+            
+            // Get the bucket lock
+            INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+            
+            for(s = 0; s < SESSION_BUCKET_SLOTS; ++s) {
+                session = bucket->session[s];
+                if(session != NULL && bucket->fp[s] == fp
+                   && session->dir == JBUF_PACKET_DIR_EGRESS
+                   && session->saddr == key->saddr
+                   && session->daddr == key->daddr
+                   && session->sport == key->sport
+                   && session->dport == key->dport
+                   && session->ss_id == key->ss_id) {
+                    break;
+                }
+            }
+            
+            if(s == SESSION_BUCKET_SLOTS) {
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                continue;
+            }
+            
+            // check it again now it's in the table (it may be a newer one)
+            if(!match_session(session, filter)) {
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                break;
+            }
+            
+            // we need to delete this session
+            
+            remove_session(bucket, s);
+            unindex_pair(session->pair);
+            
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+            
+            unlink_pair(session->pair); // its timer wheel frees it next tick
+            break;
+        }
+    }
+}
+
+
+/**
+ * Remove the sessions matching a filter, found with the indexes for it of
+ * every data cpu
+ *
+ * @param[in] filter
+ *      The criteria
+ */
+static void
+clean_indexed_sessions(session_filter_t * filter)
+{
+    session_index_t * idx;
+    session_pair_t cursor;
+    session_key_t * keys;
+    uint32_t count;
+    boolean more;
+    int i;
+    
+    keys = malloc(CLEAN_BATCH * sizeof(session_key_t));
+    INSIST_ERR(keys != NULL);
+    
+    for(i = 0; i < loop_count; ++i) {
+        
+        idx = index_bucket(filter, loop_cpus[i]);
+        
+        bzero(&cursor, sizeof(cursor)); // its forward.pair isn't itself
+        
+        // Get the index bucket lock
+        INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+        TAILQ_INSERT_HEAD(&idx->pairs, &cursor, idx_entry[filter->type]);
+        INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+        
+        do {
+            count = collect_sessions(idx, filter, &cursor, keys, &more);
+            remove_collected_sessions(filter, keys, count);
+        } while(more);
+    }
+    
+    free(keys);
+    
+    msp_objcache_reclaim(shm_handle);
+}
+
+
 /*** GLOBAL/EXTERNAL Functions ***/
 
 
@@ -924,13 +2185,14 @@ equilibrium_process_packet(msp_dataloop_args_t * params)
 status_t
 init_packet_loops(evContext ctx)
 {
-    int i, rc, core;
+    int i, j, rc, core;
     msp_dataloop_params_t params;
     msp_dataloop_result_t result;
     msp_shm_params_t shmp;
     msp_objcache_params_t ocp;
     
-    shm_handle = table_handle = entry_handle = sessions_table = NULL;
+    shm_handle = table_handle = entry_handle = sessions_mem = NULL;
+    sessions_table = NULL;
     evInitID(&aging_timer);
     
     LOG(LOG_INFO, "%s: Initializing object cache for data loops", __func__);
@@ -952,7 +2214,7 @@ init_packet_loops(evContext ctx)
     
     // create object cache allocator for the session/flow look up table
     ocp.oc_shm = shm_handle;
-    ocp.oc_size  = sizeof(hashtable_t);
+    ocp.oc_size  = sizeof(hashtable_t) + CACHE_LINE_SIZE; // room to align
     strncpy(ocp.oc_name, EQ_SESSION_TABLE_NAME, OC_NAME_LEN);
 
     if(msp_objcache_create(&ocp) != MSP_OK) {
@@ -965,7 +2227,7 @@ init_packet_loops(evContext ctx)
 
     // create object cache allocator for the session/flow look up table entries
     ocp.oc_shm = shmp.shm;
-    ocp.oc_size  = sizeof(session_entry_t);
+    ocp.oc_size  = sizeof(session_pair_t);
     strncpy(ocp.oc_name, EQ_SESSION_TABLE_NAME, OC_NAME_LEN);
 
     if (msp_objcache_create(&ocp) != MSP_OK) {
@@ -978,28 +2240,66 @@ init_packet_loops(evContext ctx)
     
     // allocate sessions_table in OC:
     
-    sessions_table = msp_objcache_alloc(table_handle,
+    sessions_mem = msp_objcache_alloc(table_handle,
             msp_get_current_cpu(), obj_cache_id);
-    if(sessions_table == NULL) {
+    if(sessions_mem == NULL) {
         LOG(LOG_ERR, "%s: Failed to allocate object cache for sessions table ",
                 __func__);
         return EFAIL;
     }
     
-    for(i = 0; i < SESSIONS_BUCKET_COUNT; ++i) {
+    // align the buckets to cache lines
+    sessions_table = (hashtable_t *)(((uintptr_t)sessions_mem +
+            CACHE_LINE_SIZE - 1) & ~((uintptr_t)CACHE_LINE_SIZE - 1));
+    
+    bzero(sessions_table, sizeof(hashtable_t));
+    
+    for(i = 0; i < SESSIONS_BUCKET_TOTAL; ++i) {
         msp_spinlock_init(&sessions_table->hash_bucket[i].bucket_lock);
-        TAILQ_INIT(&sessions_table->hash_bucket[i].bucket_entries);
     }
     
-    // start ager
+    bzero(frag_caches, sizeof(frag_caches));
+    
+    // init the indexes of sessions used by the cleanups
+    
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        for(j = 0; j < SERVER_INDEX_COUNT; ++j) {
+            msp_spinlock_init(&indexes[i].by_server[j].lock);
+            TAILQ_INIT(&indexes[i].by_server[j].pairs);
+        }
+        
+        for(j = 0; j < APP_INDEX_COUNT; ++j) {
+            msp_spinlock_init(&indexes[i].by_app[j].lock);
+            TAILQ_INIT(&indexes[i].by_app[j].pairs);
+        }
+        
+        for(j = 0; j < SVC_SET_INDEX_COUNT; ++j) {
+            msp_spinlock_init(&indexes[i].by_svc_set[j].lock);
+            TAILQ_INIT(&indexes[i].by_svc_set[j].pairs);
+        }
+    }
+    
+    // init the timer wheels used by the data cpus to age sessions
+    
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        msp_spinlock_init(&wheels[i].lock);
+        wheels[i].now = get_current_time();
+        for(j = 0; j < WHEEL_SLOTS; ++j) {
+            TAILQ_INIT(&wheels[i].slots[0][j]);
+            TAILQ_INIT(&wheels[i].slots[1][j]);
+        }
+        TAILQ_INIT(&wheels[i].unlinked);
+    }
+    
+    // start stats and shared memory cleanup
     
     if(evSetTimer(ctx, aging_cleanup, NULL,
-            evAddTime(evNowTime(), evConsTime(SESSION_AGE_CHECK_INTERVAL, 0)),
-            evConsTime(SESSION_AGE_CHECK_INTERVAL, 0),
+            evAddTime(evNowTime(), evConsTime(CLEANUP_INTERVAL, 0)),
+            evConsTime(CLEANUP_INTERVAL, 0),
             &aging_timer)) {
 
         LOG(LOG_EMERG, "%s: Failed to initialize a timer to periodically "
-            "check age of session entries (Error: %m)", __func__);
+            "cleanup shared memory (Error: %m)", __func__);
         return EFAIL;
     }
     
@@ -1009,6 +2309,7 @@ init_packet_loops(evContext ctx)
     bzero(&result, sizeof(msp_dataloop_result_t));
     
     loops_running = 0;
+    loop_count = 0;
     do_shutdown = 0;
     
     // go through the available data cores
@@ -1022,6 +2323,10 @@ init_packet_loops(evContext ctx)
             LOG(LOG_INFO, "%s: Creating a data loop on CPU %d (in core %d)",
                     __func__, rc, core);
             
+            loop_cpus[loop_count] = rc;
+            __sync_synchronize();
+            ++loop_count; // its fragment cache can be searched by other cpus
+            
             rc = msp_data_create_loop_on_cpu(rc, equilibrium_process_packet,
                     &params, &result);
             
@@ -1063,10 +2368,11 @@ destroy_packet_loops(evContext ctx)
     
     // now they are all shutdown
     
-    if(sessions_table) {
-        msp_objcache_free(
-                table_handle, sessions_table, msp_get_current_cpu(), obj_cache_id);
+    if(sessions_mem) {
         sessions_table = NULL;
+        msp_objcache_free(
+                table_handle, sessions_mem, msp_get_current_cpu(), obj_cache_id);
+        sessions_mem = NULL;
     }
     
     if(table_handle) {
@@ -1102,53 +2408,15 @@ clean_sessions_using_server(uint16_t ss_id,
                             uint16_t app_port,
                             in_addr_t server_addr)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    session_entry_t * session, * next;
-    
-    cpu = msp_get_current_cpu();
+    session_filter_t filter;
     
-    for(i = 0; i < SESSIONS_BUCKET_COUNT; ++i) {
-        
-        bucket = &sessions_table->hash_bucket[i];
-        
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-      
-        session = TAILQ_FIRST(&bucket->bucket_entries);
-        
-        while(session != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(session, entries);
-            
-            // Get the session lock
-            INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-            
-            if(session->ss_id == ss_id &&
-                ((session->dir == JBUF_PACKET_DIR_INGRESS &&
-                   session->faddr == app_addr && session->sport == app_port &&
-                        session->saddr == server_addr) ||
-                  (session->dir == JBUF_PACKET_DIR_EGRESS &&
-                   session->faddr == server_addr && session->dport == app_port &&
-                        session->daddr == app_addr))) {
-                
-                // we need to delete this session
-                
-                TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                msp_objcache_free(entry_handle, session, cpu, obj_cache_id); 
-            } else {
-                // Release the session lock
-                INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            }
-            session = next;
-        }
-        
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    filter.type = INDEX_BY_SERVER;
+    filter.ss_id = ss_id;
+    filter.app_addr = app_addr;
+    filter.app_port = app_port;
+    filter.server_addr = server_addr;
     
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_sessions(&filter);
 }
 
 
@@ -1169,51 +2437,15 @@ clean_sessions_with_app(uint16_t ss_id,
                         in_addr_t app_addr,
                         uint16_t app_port)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    session_entry_t * session, * next;
-    
-    cpu = msp_get_current_cpu();
+    session_filter_t filter;
     
-    for(i = 0; i < SESSIONS_BUCKET_COUNT; ++i) {
-        
-        bucket = &sessions_table->hash_bucket[i];
-        
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-      
-        session = TAILQ_FIRST(&bucket->bucket_entries);
-        
-        while(session != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(session, entries);
-            
-            // Get the session lock
-            INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-            
-            if(session->ss_id == ss_id &&
-                ((session->dir == JBUF_PACKET_DIR_INGRESS &&
-                  session->faddr == app_addr && session->sport == app_port) ||
-                 (session->dir == JBUF_PACKET_DIR_EGRESS &&
-                  session->daddr == app_addr && session->dport == app_port))) {
-                
-                // we need to delete this session
-                
-                TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                msp_objcache_free(entry_handle, session, cpu, obj_cache_id); 
-            } else {
-                // Release the session lock
-                INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            }
-            session = next;
-        }
-        
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    filter.type = INDEX_BY_APP;
+    filter.ss_id = ss_id;
+    filter.app_addr = app_addr;
+    filter.app_port = app_port;
+    filter.server_addr = 0;
     
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_sessions(&filter);
 }
 
 
@@ -1226,45 +2458,13 @@ clean_sessions_with_app(uint16_t ss_id,
 void
 clean_sessions_with_service_set(uint16_t ss_id)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    session_entry_t * session, * next;
-
-    cpu = msp_get_current_cpu();
+    session_filter_t filter;
     
-    for(i = 0; i < SESSIONS_BUCKET_COUNT; ++i) {
-        
-        bucket = &sessions_table->hash_bucket[i];
-        
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-      
-        session = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(session != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(session, entries);
-            
-            // Get the session lock
-            INSIST_ERR(msp_spinlock_lock(&session->lock) == MSP_OK);
-            
-            if(session->ss_id == ss_id) {
-                
-                // we need to delete this session
-                
-                TAILQ_REMOVE(&bucket->bucket_entries, session, entries);
-                msp_objcache_free(entry_handle, session, cpu, obj_cache_id); 
-            } else {
-                // Release the session lock
-                INSIST_ERR(msp_spinlock_unlock(&session->lock) == MSP_OK);
-            }
-            session = next;
-        }
-        
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    filter.type = INDEX_BY_SVC_SET;
+    filter.ss_id = ss_id;
+    filter.app_addr = 0;
+    filter.app_port = 0;
+    filter.server_addr = 0;
     
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_sessions(&filter);
 }
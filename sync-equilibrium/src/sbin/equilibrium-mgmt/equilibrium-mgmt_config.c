@@ -20,6 +20,7 @@
 
 #include <sync/common.h>
 #include <ddl/dax.h>
+#include <sync/equilibrium_ipc.h>
 #include "equilibrium-mgmt_config.h"
 #include "equilibrium-mgmt_conn.h"
 #include "equilibrium-mgmt_logging.h"
@@ -169,6 +170,9 @@ update_service_set(const char * ss_name,
  * @param[in] session_timeout
  *      The session timeout for the application
  * 
+ * @param[in] balancing_mode
+ *      The balancing mode for the application (BALANCING_MODE_*)
+ * 
  * @return
  *      The added application
  */
@@ -177,7 +181,8 @@ update_application(const char * name,
                    in_addr_t address,
                    uint16_t port,
                    eq_smon_t * server_monitor,
-                   uint16_t session_timeout)
+                   uint16_t session_timeout,
+                   uint8_t balancing_mode)
 {
     eq_app_t * app;
     
@@ -213,16 +218,18 @@ update_application(const char * name,
     app->application_addr = address;
     app->application_port = port;
     app->session_timeout = session_timeout;
+    app->balancing_mode = balancing_mode;
     
     if(app->server_mon_params == NULL) {
         app->server_mon_params = server_monitor;
         
         if(server_monitor == NULL) {
             notify_application_update(current_svc_set->svc_set_name,
-                name, address, port, session_timeout, 0, 0, 0, 0);
+                name, address, port, session_timeout, balancing_mode,
+                0, 0, 0, 0);
         } else {
             notify_application_update(current_svc_set->svc_set_name,
-                name, address, port, session_timeout,
+                name, address, port, session_timeout, balancing_mode,
                 server_monitor->connection_interval,
                 server_monitor->connection_timeout,
                 server_monitor->timeouts_allowed,
@@ -234,7 +241,8 @@ update_application(const char * name,
             app->server_mon_params = NULL;
             
             notify_application_update(current_svc_set->svc_set_name,
-                name, address, port, session_timeout, 0, 0, 0, 0);
+                name, address, port, session_timeout, balancing_mode,
+                0, 0, 0, 0);
         } else {
             app->server_mon_params->connection_interval = 
                 server_monitor->connection_interval;
@@ -246,7 +254,7 @@ update_application(const char * name,
                 server_monitor->down_retry_interval;
             
             notify_application_update(current_svc_set->svc_set_name,
-                name, address, port, session_timeout,
+                name, address, port, session_timeout, balancing_mode,
                 server_monitor->connection_interval,
                 server_monitor->connection_timeout,
                 server_monitor->timeouts_allowed,
@@ -259,13 +267,17 @@ update_application(const char * name,
 
 
 /**
- * Add a server to the set for the current application
+ * Add a server to the set for the current application, or update its weight
+ * if it is already in the set
  * 
  * @param[in] server_address
  *      The address of the server to add
+ * 
+ * @param[in] weight
+ *      The weight of the server
  */
 static void
-update_server(in_addr_t server_address)
+update_server(in_addr_t server_address, uint8_t weight)
 {
     eq_server_t * server = NULL;
     
@@ -280,14 +292,26 @@ update_server(in_addr_t server_address)
         TAILQ_INIT(current_app->servers);
     }
     
-    server = calloc(1, sizeof(eq_server_t));
-    INSIST(server != NULL);
+    server = TAILQ_FIRST(current_app->servers);
+    while(server != NULL) {
+        if(server->server_addr == server_address) {
+            break;
+        }
+        server = TAILQ_NEXT(server, entries);
+    }
     
-    server->server_addr = server_address;
-    TAILQ_INSERT_TAIL(current_app->servers, server, entries);
+    if(server == NULL) {
+        server = calloc(1, sizeof(eq_server_t));
+        INSIST(server != NULL);
+        
+        server->server_addr = server_address;
+        TAILQ_INSERT_TAIL(current_app->servers, server, entries);
+    }
+    
+    server->weight = weight;
     
     notify_server_update(current_svc_set->svc_set_name,
-            current_app->application_name, server->server_addr);
+            current_app->application_name, server->server_addr, weight);
 }
 
 
@@ -545,6 +569,7 @@ parse_server(dax_walk_data_t * dwd,
     char ip_str[INET_ADDRSTRLEN];
     struct in_addr tmp;
     in_addr_t server_addr;
+    uint8_t weight;
     int addr_fam;
     int check = *((int *)data);
     
@@ -590,7 +615,7 @@ parse_server(dax_walk_data_t * dwd,
         break;
         
     case DAX_ITEM_CHANGED:
-        // a server was added
+        // a server was added or its weight changed
 
         if(!dax_get_ipaddr_by_name(dop, DDLNAME_APP_SERVERS_SERVER,
                 &addr_fam, &server_addr, sizeof(server_addr)) ||
@@ -599,8 +624,13 @@ parse_server(dax_walk_data_t * dwd,
             return DAX_WALK_ABORT;
         }
         
+        if(!dax_get_ubyte_by_name(dop, DDLNAME_APP_SERVERS_WEIGHT, &weight)) {
+            dax_error(dop, "Failed to parse server weight");
+            return DAX_WALK_ABORT;
+        }
+        
         if(!check) {
-            update_server(server_addr);
+            update_server(server_addr, weight);
         }
         
         break;
@@ -723,6 +753,7 @@ parse_application(dax_walk_data_t * dwd,
     int addr_fam;
     uint16_t app_port;
     uint16_t app_session_timeout;
+    uint32_t app_balancing_mode;
     eq_smon_t * app_s_monitor;
     eq_app_t * app;
     ddl_handle_t * smon_dop;
@@ -805,6 +836,13 @@ parse_application(dax_walk_data_t * dwd,
             return DAX_WALK_ABORT;
         }
         
+        if (!dax_get_uint_by_name(dop,
+                DDLNAME_SVCS_SVC_SET_EXT_SERVICE_APP_BALANCING_MODE,
+                &app_balancing_mode)) {
+            dax_error(dop, "Failed to parse balancing mode");
+            return DAX_WALK_ABORT;
+        }
+        
         if(!dax_get_object_by_name(dop, DDLNAME_APP_SMON, &smon_dop, FALSE)) {
             app_s_monitor = NULL;
         } else {
@@ -852,7 +890,10 @@ parse_application(dax_walk_data_t * dwd,
         // update
         if(!check) {
             current_app = update_application(app_name, app_addr, app_port,
-                    app_s_monitor, app_session_timeout);
+                    app_s_monitor, app_session_timeout,
+                    (app_balancing_mode == EQUILIBRIUM_BALANCE_CONSISTENT_HASH)
+                        ? BALANCING_MODE_CONSISTENT_HASH
+                        : BALANCING_MODE_LEAST_SESSIONS);
         }
         
         // check servers
@@ -54,6 +54,7 @@ typedef struct eq_smon_s {
  */
 typedef struct eq_server_s {
     in_addr_t                  server_addr; ///< server IP address
+    uint8_t                    weight;      ///< server weight
     uint8_t                    status;      ///< server status
     TAILQ_ENTRY(eq_server_s)   entries;     ///< list entries
 } eq_server_t;
@@ -75,6 +76,7 @@ typedef struct eq_app_s {
     in_addr_t   application_addr;  ///< application IP address
     uint16_t    application_port;  ///< application port
     uint16_t    session_timeout;   ///< session timeout
+    uint8_t     balancing_mode;    ///< balancing mode (BALANCING_MODE_*)
     eq_smon_t * server_mon_params; ///< server monitoring parameters
     server_list_t * servers;       ///< server list
     uint32_t    session_count;     ///< last reported number of active sessions
@@ -134,7 +134,7 @@ receive_connection(pconn_session_t * session,
                     notify_application_update(
                             ss->svc_set_name, app->application_name,
                             app->application_addr, app->application_port,
-                            app->session_timeout,
+                            app->session_timeout, app->balancing_mode,
                             app->server_mon_params->connection_interval,
                             app->server_mon_params->connection_timeout,
                             app->server_mon_params->timeouts_allowed,
@@ -143,7 +143,8 @@ receive_connection(pconn_session_t * session,
                     notify_application_update(
                             ss->svc_set_name, app->application_name,
                             app->application_addr, app->application_port,
-                            app->session_timeout, 0, 0, 0, 0);
+                            app->session_timeout, app->balancing_mode,
+                            0, 0, 0, 0);
                 }
                 
                 // send all servers config
@@ -151,7 +152,8 @@ receive_connection(pconn_session_t * session,
                     server = TAILQ_FIRST(app->servers);
                     while(server != NULL) {
                         notify_server_update(ss->svc_set_name,
-                                app->application_name, server->server_addr);
+                                app->application_name, server->server_addr,
+                                server->weight);
                         
                         server = TAILQ_NEXT(server, entries);
                     }
@@ -234,6 +236,7 @@ receive_message(pconn_session_t * session,
     server_status_t * server_status = NULL;
     sessions_status_t * sessions_status = NULL;
     struct in_addr addr;
+    uint32_t offset;
     
     
     INSIST_ERR(session == data_session);
@@ -263,19 +266,26 @@ receive_message(pconn_session_t * session,
 
     case MSG_STATUS_UPDATE:
     
-        sessions_status = (sessions_status_t *)msg->data;
-        
-        // check message length
-        INSIST_ERR(msg->length == 
-            sizeof(sessions_status_t) + ntohs(sessions_status->app_name_len));
-        
-        set_app_sessions(ntohs(sessions_status->svc_set_id),
-                         sessions_status->app_name,
-                         ntohl(sessions_status->active_sessions));
-        
-        junos_trace(EQUILIBRIUM_TRACEFLAG_CONNECTION, "%s: got update that %d "
-            "sessions are active for app %s.", __func__,
-            ntohl(sessions_status->active_sessions), sessions_status->app_name);
+        // go thru all records
+        for(offset = 0; offset < msg->length; offset += 
+                sizeof(sessions_status_t) + ntohs(sessions_status->app_name_len)) {
+            
+            sessions_status = (sessions_status_t *)(msg->data + offset);
+            
+            // check message length
+            INSIST_ERR(msg->length - offset >= sizeof(sessions_status_t));
+            INSIST_ERR(msg->length - offset >= 
+                sizeof(sessions_status_t) + ntohs(sessions_status->app_name_len));
+            
+            set_app_sessions(ntohs(sessions_status->svc_set_id),
+                             sessions_status->app_name,
+                             ntohl(sessions_status->active_sessions));
+            
+            junos_trace(EQUILIBRIUM_TRACEFLAG_CONNECTION, "%s: got update that "
+                "%d sessions are active for app %s.", __func__,
+                ntohl(sessions_status->active_sessions),
+                sessions_status->app_name);
+        }
         
         break;
         
@@ -588,6 +598,9 @@ process_notifications(void)
  * @param[in] session_timeout
  *      Application session timeout
  * 
+ * @param[in] balancing_mode
+ *      Application balancing mode (BALANCING_MODE_*)
+ * 
  * @param[in] connection_interval
  *      Application server monitoring connection interval
  * 
@@ -606,6 +619,7 @@ notify_application_update(const char * svc_set_name,
                           in_addr_t address,
                           uint16_t port,
                           uint16_t session_timeout,
+                          uint8_t balancing_mode,
                           uint16_t connection_interval,
                           uint16_t connection_timeout,
                           uint8_t timeouts_allowed,
@@ -634,6 +648,7 @@ notify_application_update(const char * svc_set_name,
     data->connection_interval = htons(connection_interval);
     data->connection_timeout = htons(connection_timeout);
     data->timeouts_allowed = timeouts_allowed;
+    data->balancing_mode = balancing_mode;
     data->down_retry_interval = htons(down_retry_interval);
     data->app_name_len = htons(len);
     strcpy(data->app_name, app_name);
@@ -656,11 +671,15 @@ notify_application_update(const char * svc_set_name,
  * 
  * @param[in] address
  *      Application server address
+ * 
+ * @param[in] weight
+ *      Application server weight
  */
 void
 notify_server_update(const char * svc_set_name,
                      const char * app_name,
-                     in_addr_t address)
+                     in_addr_t address,
+                     uint8_t weight)
 {
     notification_msg_t * msg;
     server_info_t * data;
@@ -679,6 +698,7 @@ notify_server_update(const char * svc_set_name,
     msg->message = data = calloc(1, msg->message_len);
     INSIST(data != NULL);
     data->server_addr = address;
+    data->weight = weight;
     data->app_name_len = htons(len);
     strcpy(data->app_name, app_name);
     
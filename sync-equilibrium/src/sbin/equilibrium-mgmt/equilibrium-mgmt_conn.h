@@ -86,6 +86,9 @@ process_notifications(void);
  * @param[in] session_timeout
  *      Application session timeout
  * 
+ * @param[in] balancing_mode
+ *      Application balancing mode (BALANCING_MODE_*)
+ * 
  * @param[in] connection_interval
  *      Application server monitoring connection interval
  * 
@@ -104,6 +107,7 @@ notify_application_update(const char * svc_set_name,
                           in_addr_t address,
                           uint16_t port,
                           uint16_t session_timeout,
+                          uint8_t balancing_mode,
                           uint16_t connection_interval,
                           uint16_t connection_timeout,
                           uint8_t timeouts_allowed,
@@ -121,11 +125,15 @@ notify_application_update(const char * svc_set_name,
  * 
  * @param[in] address
  *      Application server address
+ * 
+ * @param[in] weight
+ *      Application server weight
  */
 void
 notify_server_update(const char * svc_set_name,
                      const char * app_name,
-                     in_addr_t address);
+                     in_addr_t address,
+                     uint8_t weight);
 
 
 /**
@@ -33,6 +33,10 @@
 #define EQUILIBRIUM_PORT_NUM 7080
 
 
+#define BALANCING_MODE_LEAST_SESSIONS   0 ///< server with the fewest sessions
+#define BALANCING_MODE_CONSISTENT_HASH  1 ///< server by hash of the client addr
+
+
 /*** Data Structures ***/
 
 
@@ -75,6 +79,9 @@ typedef struct del_app_info_s {
  */
 typedef struct server_info_s {
     in_addr_t   server_addr;   ///< server IP address
+    uint8_t     weight;        ///< server weight (ignored upon deletion)
+    uint8_t     pad;           ///< ignored
+    uint16_t    pad2;          ///< ignored
     uint16_t    svc_set_id;    ///< service-set id
     uint16_t    app_name_len;  ///< application name's length
     char        app_name[0];   ///< application name
@@ -92,7 +99,7 @@ typedef struct update_app_info_s {
     uint16_t    connection_interval; ///< server-connection interval (sec)
     uint16_t    connection_timeout;  ///< server-connection timeout (sec)
     uint8_t     timeouts_allowed;    ///< server timeouts allowed #
-    uint8_t     pad;                 ///< ignored
+    uint8_t     balancing_mode;      ///< uses the BALANCING_MODE_* defines
     uint16_t    down_retry_interval; ///< down server connection interval (sec)
     uint16_t    svc_set_id;          ///< service-set id
     uint16_t    app_name_len;        ///< application name's length
@@ -106,7 +113,8 @@ typedef struct update_app_info_s {
  */
 typedef enum {
     MSG_SERVER_UPDATE = 1,    ///< update server status, server_status_t
-    MSG_STATUS_UPDATE         ///< update active # of sessions
+    MSG_STATUS_UPDATE         ///< update active # of sessions, one or more
+                              ///< sessions_status_t back to back
 } update_type_e;
 
 
@@ -128,12 +136,13 @@ typedef struct server_status_s {
 
 
 /**
- * Message containing info about the server status for an application
+ * Record containing the number of sessions for an application. The name is
+ * zero-padded to a multiple of 4 bytes so the next record is aligned.
  */
 typedef struct sessions_status_s {
     uint32_t    active_sessions;  ///< number of active sessions for this app/ss
     uint16_t    svc_set_id;       ///< service-set id
-    uint16_t    app_name_len;     ///< application name's length
+    uint16_t    app_name_len;     ///< application name's length (with padding)
     char        app_name[0];      ///< application name
 } sessions_status_t;
 
@@ -32,6 +32,9 @@
 #include <jnx/msp_policy_db.h>
 #include <jnx/multi-svcs/msvcs_events.h>
 
+/** Number of buckets in the server group hash table, must be a power of 2 */
+#define SVR_GROUP_HASH_SIZE  256
+
 /** List item of session action for forward path. */
 typedef struct ssn_f_action_s {
     LIST_ENTRY(ssn_f_action_s) entry;      /**< list entry */
@@ -49,6 +52,7 @@ msvcs_control_context_t *ctrl_ctx;        /**< global copy of control context */
 sp_svc_set_head_t       svc_set_head;     /**< head of service-set list */
 msp_spinlock_t          svc_set_lock;     /**< lock for service-set list */
 svr_group_head_t        *svr_group_head;  /**< head of server group list */
+svr_group_head_t        *svr_group_hash;  /**< server groups hashed by name */
 msp_spinlock_t          svr_group_lock;   /**< lock for server group list */
 uint16_t                svr_group_count;  /**< number of server groups */
 msvcs_event_class_t     classify_ev_class;
@@ -111,5 +115,31 @@ sp_svc_set_t *get_svc_set(uint16_t id, bool active);
  */
 void del_svc_set(sp_svc_set_t *ss);
 
+/**
+ * @brief
+ * Get server group by name.
+ *
+ * Must be called with svr_group_lock held.
+ *
+ * @param[in] name
+ *      Server group name
+ *
+ * @return
+ *      Pointer to the server group on success, NULL on failure
+ */
+svr_group_t *get_svr_group(char *name);
+
+/**
+ * @brief
+ * Restore the order of a server group heap after the session count of one
+ * of its addresses changed.
+ *
+ * Must be called with svr_group_lock held.
+ *
+ * @param[in] addr
+ *      Pointer to the address
+ */
+void update_svr_addr_heap(svr_addr_t *addr);
+
 #endif /* __EQUILIBRIUM2_BALANCE_H__ */
 
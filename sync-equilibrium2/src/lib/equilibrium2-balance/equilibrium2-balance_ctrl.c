@@ -30,6 +30,75 @@ static connect_state_t  connect_state;    /**< connection state */
 static evTimerID        ev_timer_id;      /**< event timer ID */
 static pconn_client_t   *client_hdl;      /**< pconn client handle */
 
+/**
+ * @brief
+ * Hash a server group name.
+ *
+ * @param[in] name
+ *      Server group name
+ *
+ * @return
+ *      Index of the bucket in svr_group_hash
+ */
+static uint32_t
+svr_group_hash_idx (char *name)
+{
+    uint32_t hash = 5381;
+
+    while (*name != '\0') {
+        hash = (hash * 33) ^ (uint8_t)*name++;
+    }
+    return hash & (SVR_GROUP_HASH_SIZE - 1);
+}
+
+/**
+ * @brief
+ * Rebuild the heap of a server group from its address list.
+ *
+ * If the heap can't grow to hold every address, it is left empty and
+ * get_svr_addr falls back to searching the address list.
+ *
+ * @param[in] group
+ *      Pointer to the server group
+ */
+static void
+build_svr_group_heap (svr_group_t *group)
+{
+    svr_addr_t *addr;
+    svr_addr_t **heap;
+    int count = 0;
+
+    LIST_FOREACH(addr, &group->group_addr_head, entry) {
+        count++;
+    }
+
+    if (count > group->group_heap_max) {
+        heap = msp_shm_alloc(ctrl_ctx->scc_shm, count * sizeof(*heap));
+        if (heap == NULL) {
+            msp_log(LOG_ERR, "%s: Allocate memory ERROR! Group %s falls "
+                    "back to linear selection.", __func__, group->group_name);
+            count = 0;
+        } else {
+            if (group->group_heap) {
+                msp_shm_free(ctrl_ctx->scc_shm, group->group_heap);
+            }
+            group->group_heap = heap;
+            group->group_heap_max = count;
+        }
+    }
+
+    group->group_heap_size = 0;
+    LIST_FOREACH(addr, &group->group_addr_head, entry) {
+        if (group->group_heap_size < count) {
+            addr->addr_heap_idx = group->group_heap_size++;
+            group->group_heap[addr->addr_heap_idx] = addr;
+            update_svr_addr_heap(addr);
+        } else {
+            addr->addr_heap_idx = -1;
+        }
+    }
+}
+
 /**
  * @brief
  * Update server group address.
@@ -62,33 +131,12 @@ update_svr_group_addr (svr_group_t *group, in_addr_t addr)
     svr_addr->addr = addr;
     svr_addr->addr_ssn_count = 0;
     svr_addr->addr_new = true;
+    svr_addr->addr_group = group;
+    svr_addr->addr_heap_idx = -1;
 
     LIST_INSERT_HEAD(&group->group_addr_head, svr_addr, entry);
 }
 
-/**
- * @brief
- * Get server group by name.
- *
- * @param[in] name
- *      Server group name
- *
- * @return
- *      Pointer to the server group on success, NULL on failure
- */
-static svr_group_t *
-get_svr_group (char *name)
-{
-    svr_group_t *group;
-
-    LIST_FOREACH(group, svr_group_head, entry) {
-        if (strcmp(name, group->group_name) == 0) {
-            break;
-        }
-    }
-    return group;
-}
-
 /**
  * @brief
  * Process server group blob.
@@ -150,9 +198,14 @@ proc_svr_group_blob (void *blob, junos_kcom_gencfg_opcode_t op)
                     sizeof(group->group_name));
             group->group_addr_count = 0;
             LIST_INIT(&group->group_addr_head);
+            group->group_heap = NULL;
+            group->group_heap_size = 0;
+            group->group_heap_max = 0;
 
-            /* Add group to the list. */
+            /* Add group to the list and the hash table. */
             LIST_INSERT_HEAD(svr_group_head, group, entry);
+            LIST_INSERT_HEAD(&svr_group_hash[svr_group_hash_idx(
+                    group->group_name)], group, hash_entry);
         }
         group->group_addr_count = blob_group->group_addr_count;
 
@@ -178,7 +231,12 @@ proc_svr_group_blob (void *blob, junos_kcom_gencfg_opcode_t op)
                 msp_log(LOG_INFO, "%s: Address 0x%08x is deleted.",
                         __func__, addr->addr);
                 LIST_REMOVE(addr, entry);
-                msp_shm_free(ctrl_ctx->scc_shm, addr);
+
+                /* Sessions still using it free it when they're all closed. */
+                addr->addr_group = NULL;
+                if (addr->addr_ssn_count == 0) {
+                    msp_shm_free(ctrl_ctx->scc_shm, addr);
+                }
             }
         }
         if (LIST_FIRST(&group->group_addr_head) == NULL) {
@@ -187,7 +245,13 @@ proc_svr_group_blob (void *blob, junos_kcom_gencfg_opcode_t op)
 
             /* All addresses are deleted in this group, delete it. */
             LIST_REMOVE(group, entry);
+            LIST_REMOVE(group, hash_entry);
+            if (group->group_heap) {
+                msp_shm_free(ctrl_ctx->scc_shm, group->group_heap);
+            }
             msp_shm_free(ctrl_ctx->scc_shm, group);
+        } else {
+            build_svr_group_heap(group);
         }
     }
 
@@ -582,6 +646,80 @@ get_svc_set (uint16_t id, bool active)
     return ss;
 }
 
+/**
+ * @brief
+ * Get server group by name.
+ *
+ * Must be called with svr_group_lock held.
+ *
+ * @param[in] name
+ *      Server group name
+ *
+ * @return
+ *      Pointer to the server group on success, NULL on failure
+ */
+svr_group_t *
+get_svr_group (char *name)
+{
+    svr_group_t *group;
+
+    LIST_FOREACH(group, &svr_group_hash[svr_group_hash_idx(name)],
+            hash_entry) {
+        if (strcmp(name, group->group_name) == 0) {
+            break;
+        }
+    }
+    return group;
+}
+
+/**
+ * @brief
+ * Restore the order of a server group heap after the session count of one
+ * of its addresses changed.
+ *
+ * Must be called with svr_group_lock held.
+ *
+ * @param[in] addr
+ *      Pointer to the address
+ */
+void
+update_svr_addr_heap (svr_addr_t *addr)
+{
+    svr_group_t *group = addr->addr_group;
+    svr_addr_t **heap;
+    int i, child;
+
+    if (group == NULL || addr->addr_heap_idx < 0) {
+        return;
+    }
+    heap = group->group_heap;
+    i = addr->addr_heap_idx;
+
+    /* Move it up while its parent has more sessions. */
+    while (i > 0 && heap[(i - 1) / 2]->addr_ssn_count > addr->addr_ssn_count) {
+        heap[i] = heap[(i - 1) / 2];
+        heap[i]->addr_heap_idx = i;
+        i = (i - 1) / 2;
+    }
+
+    /* Move it down while its child with the fewest sessions has fewer. */
+    while ((child = 2 * i + 1) < group->group_heap_size) {
+        if (child + 1 < group->group_heap_size &&
+                heap[child + 1]->addr_ssn_count < heap[child]->addr_ssn_count) {
+            child++;
+        }
+        if (heap[child]->addr_ssn_count >= addr->addr_ssn_count) {
+            break;
+        }
+        heap[i] = heap[child];
+        heap[i]->addr_heap_idx = i;
+        i = child;
+    }
+
+    heap[i] = addr;
+    addr->addr_heap_idx = i;
+}
+
 /**
  * @brief
  * Delete a service-set by pointer.
@@ -617,6 +755,7 @@ int
 equilibrium2_balance_ctrl_hdlr (msvcs_control_context_t *ctx,
         msvcs_control_event_t ev)
 {
+    int i;
 
     /* Save control context. */
     ctrl_ctx = ctx;
@@ -643,6 +782,17 @@ equilibrium2_balance_ctrl_hdlr (msvcs_control_context_t *ctx,
         }
         LIST_INIT(svr_group_head);
         svr_group_count = 0;
+
+        /* Create the hash table of server groups. */
+        svr_group_hash = msp_shm_alloc(ctrl_ctx->policy_shm_handle,
+                SVR_GROUP_HASH_SIZE * sizeof(*svr_group_hash));
+        if (svr_group_hash == NULL) {
+            msp_log(LOG_ERR, "%s: Allocate memory ERROR!", __func__);
+            break;
+        }
+        for (i = 0; i < SVR_GROUP_HASH_SIZE; i++) {
+            LIST_INIT(&svr_group_hash[i]);
+        }
         msp_spinlock_init(&svc_set_lock);
         msp_spinlock_init(&svr_group_lock);
         connect_state = CONNECT_NA;
@@ -25,6 +25,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <sys/jnx/jbuf.h>
 #include <jnx/mpsdk.h>
 #include <jnx/msp_objcache.h>
@@ -34,92 +35,61 @@
 static msvcs_data_context_t *data_ctx; /**< global copy of data context */
 
 /**
- * Calculate IP header checksum.
+ * Adjust a checksum for a 32-bit word of the data it covers having changed
+ * (RFC 1624, eqn. 3), so there is no need to recalculate it over all the data.
  *
- * @param[in] buf
- *      Pointer to IP header
+ * @param[in,out] sum
+ *      Pointer to the checksum, in network order
  *
- * @param[in] len
- *      Length of IP header
+ * @param[in] old_word
+ *      The old value of the word, in network order
  *
- * @return
- *      The checksum with network order
+ * @param[in] new_word
+ *      The new value of the word, in network order
  */
-static uint16_t
-ip_cksum (void *buf, int len)
+static void
+cksum_adjust (uint16_t *sum, uint32_t old_word, uint32_t new_word)
 {
-    uint8_t *p = buf;
-    uint32_t sum = 0;
-
-    while (len > 1) {
-        sum += (*p << 8) + *(p + 1);
-        len -= 2;
-        p += 2;
-    }
-    if (len == 1) {
-        sum += (*p << 8);
+    uint32_t x;
+
+    /* HC' = ~(~HC + ~m + m') over the two 16-bit halves of the word. */
+    x = (uint16_t)~*sum;
+    x += (uint16_t)~(old_word >> 16);
+    x += (uint16_t)~(old_word & 0xFFFF);
+    x += new_word >> 16;
+    x += new_word & 0xFFFF;
+    while (x >> 16) {
+        x = (x & 0xFFFF) + (x >> 16);
     }
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-    sum = ~sum;
-    return(htons((uint16_t)sum));
+    *sum = (uint16_t)~x;
 }
 
-/** 
- * Calculate TCP checksum.
- *  
- * @param[in] len
- *      Length of TCP segment in byte
+/**
+ * Keep an adjusted UDP checksum from reading as "no checksum": one that
+ * computes to 0 is sent as 0xFFFF instead (RFC 768).
  *
- * @param[in] src_addr
- *      Pointer to the source IP address
- * 
- * @param[in] dst_addr
- *      Pointer to the destination IP address
+ * @param[in] ip_hdr
+ *      The IP header of the packet
  *
- * @param[in] buf
- *      Pointer to the TCP packet
- *  
- * @return
- *      The checksum with network order
- */ 
-static uint16_t
-tcp_cksum (uint16_t len, void *src_addr, void *dst_addr, void *buf)
-{   
-    uint32_t sum = 0;
-    uint8_t *p = NULL;
-    
-    p = (uint8_t *)src_addr;
-    sum += (*p << 8) + *(p + 1);
-    sum += (*(p + 2) << 8) + *(p + 3);
-
-    p = (uint8_t *)dst_addr;
-    sum += (*p << 8) + *(p + 1);
-    sum += (*(p + 2) << 8) + *(p + 3);
-
-    sum += IPPROTO_TCP + len;
-
-    p = (uint8_t *)buf;
-    while (len > 1) {
-        sum += (*p << 8) + *(p + 1);
-        len -= 2;
-        p += 2;
-    }
-    if (len == 1) {
-        sum += (*p << 8);
-    }
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+ * @param[in,out] sum
+ *      Pointer to the adjusted TCP or UDP checksum
+ */
+static void
+udp_cksum_fixup (struct ip *ip_hdr, uint16_t *sum)
+{
+    if (ip_hdr->ip_p == IPPROTO_UDP && *sum == 0) {
+        *sum = 0xFFFF;
     }
-    sum = ~sum;
-    return(htons((uint16_t)sum));
 }
 
 /**
  * @brief
  * Get server address from server group.
  *
+ * The address with the fewest sessions is at the top of the group heap. If
+ * the heap is empty because it couldn't be allocated, the address list is
+ * searched instead.
+ *
  * @param[in] name
  *      Server group name
  *
@@ -132,27 +102,29 @@ get_svr_addr (char *name)
     svr_group_t *group;
     svr_addr_t *addr;
     svr_addr_t *min_addr = NULL;
-    uint32_t min_count;
 
-    LIST_FOREACH(group, svr_group_head, entry) {
-        if (strcmp(group->group_name, name) != 0) {
-            continue;
-        }
+    group = get_svr_group(name);
+    if (group == NULL) {
+        return NULL;
+    }
 
-        /* Preset the maximum value of uint32_t to get the minimum count. */
-        min_count = 0xFFFFFFFF;
-        min_addr = NULL;
+    if (group->group_heap_size == 0) {
         LIST_FOREACH(addr, &group->group_addr_head, entry) {
-            if (addr->addr_ssn_count < min_count) {
-                min_count = addr->addr_ssn_count;
+            if (min_addr == NULL ||
+                    addr->addr_ssn_count < min_addr->addr_ssn_count) {
                 min_addr = addr;
             }
         }
         if (min_addr) {
             min_addr->addr_ssn_count++;
         }
-        break;
+        return min_addr;
     }
+
+    min_addr = group->group_heap[0];
+    min_addr->addr_ssn_count++;
+    update_svr_addr_heap(min_addr);
+
     return min_addr;
 }
 
@@ -170,9 +142,21 @@ take_action (void)
     ssn_r_action_t *r_action = NULL;
     struct jbuf *jb = (struct jbuf *)data_ctx->sc_pkt;
     struct ip *ip_hdr = jbuf_to_d(jb, struct ip *);
-    struct tcphdr *tcp_hdr;
+    char *l4_hdr = jbuf_to_d(jb, char *) + ip_hdr->ip_hl * 4;
+    uint16_t *l4_sum = NULL;
 
-    tcp_hdr = (struct tcphdr *)(jbuf_to_d(jb, char *) + ip_hdr->ip_hl * 4);
+    /*
+     * Only the first fragment carries the TCP or UDP header. A UDP checksum
+     * of 0 means there is none, so it is left alone.
+     */
+    if ((ntohs(ip_hdr->ip_off) & IP_OFFMASK) == 0) {
+        if (ip_hdr->ip_p == IPPROTO_TCP) {
+            l4_sum = &((struct tcphdr *)l4_hdr)->th_sum;
+        } else if (ip_hdr->ip_p == IPPROTO_UDP &&
+                ((struct udphdr *)l4_hdr)->uh_sum != 0) {
+            l4_sum = &((struct udphdr *)l4_hdr)->uh_sum;
+        }
+    }
 
     /* Get session action. */
     msvcs_session_get_ext_handle((msvcs_session_t *)data_ctx->sc_session,
@@ -183,16 +167,16 @@ take_action (void)
         if (f_action) {
             msp_log(LOG_INFO, "%s: Forward action %x -> %x", __func__,
                     ip_hdr->ip_dst.s_addr, f_action->svr_addr->addr);
-            ip_hdr->ip_dst.s_addr = f_action->svr_addr->addr;
 
-            /* Recalculate IP header checksum. */
-            ip_hdr->ip_sum = 0;
-            ip_hdr->ip_sum = ip_cksum(ip_hdr, ip_hdr->ip_hl * 4);
-
-            /* Recalculate TCP checksum. */
-            tcp_hdr->th_sum = 0;
-            tcp_hdr->th_sum = tcp_cksum(ip_hdr->ip_len - ip_hdr->ip_hl * 4,
-                    &ip_hdr->ip_src.s_addr, &ip_hdr->ip_dst.s_addr, tcp_hdr);
+            /* Adjust IP header and TCP/UDP (pseudo header) checksums. */
+            cksum_adjust(&ip_hdr->ip_sum, ip_hdr->ip_dst.s_addr,
+                    f_action->svr_addr->addr);
+            if (l4_sum) {
+                cksum_adjust(l4_sum, ip_hdr->ip_dst.s_addr,
+                        f_action->svr_addr->addr);
+                udp_cksum_fixup(ip_hdr, l4_sum);
+            }
+            ip_hdr->ip_dst.s_addr = f_action->svr_addr->addr;
         } else {
             msp_log(LOG_INFO, "%s: No action for forward flow!", __func__);
         }
@@ -200,16 +184,16 @@ take_action (void)
         if (r_action) {
             msp_log(LOG_INFO, "%s: Reverse action %x -> %x", __func__,
                     ip_hdr->ip_src.s_addr, r_action->addr);
-            ip_hdr->ip_src.s_addr = r_action->addr;
 
-            /* Recalculate IP header checksum. */
-            ip_hdr->ip_sum = 0;
-            ip_hdr->ip_sum = ip_cksum(ip_hdr, ip_hdr->ip_hl * 4);
-
-            /* Recalculate TCP checksum. */
-            tcp_hdr->th_sum = 0;
-            tcp_hdr->th_sum = tcp_cksum(ip_hdr->ip_len - ip_hdr->ip_hl * 4,
-                    &ip_hdr->ip_src.s_addr, &ip_hdr->ip_dst.s_addr, tcp_hdr);
+            /* Adjust IP header and TCP/UDP (pseudo header) checksums. */
+            cksum_adjust(&ip_hdr->ip_sum, ip_hdr->ip_src.s_addr,
+                    r_action->addr);
+            if (l4_sum) {
+                cksum_adjust(l4_sum, ip_hdr->ip_src.s_addr,
+                        r_action->addr);
+                udp_cksum_fixup(ip_hdr, l4_sum);
+            }
+            ip_hdr->ip_src.s_addr = r_action->addr;
         } else {
             msp_log(LOG_INFO, "%s: No action for reversed flow!", __func__);
         }
@@ -335,6 +319,14 @@ session_close (void)
 
     msp_spinlock_lock(&svr_group_lock);
     f_action->svr_addr->addr_ssn_count--;
+    if (f_action->svr_addr->addr_group) {
+        update_svr_addr_heap(f_action->svr_addr);
+    } else if (f_action->svr_addr->addr_ssn_count == 0) {
+        /* The address was deleted from its group, and this was its last
+         * session.
+         */
+        msp_shm_free(ctrl_ctx->scc_shm, f_action->svr_addr);
+    }
     msp_spinlock_unlock(&svr_group_lock);
     msp_shm_free(data_ctx->sc_shm, f_action);
     msp_shm_free(data_ctx->sc_shm, r_action);
@@ -66,6 +66,8 @@ typedef struct svr_addr_s {
     in_addr_t               addr;            /**< IPv4 address */
     uint16_t                addr_ssn_count;  /**< number of sessions */
     bool                    addr_new;        /**< flag of new address */
+    struct svr_group_s      *addr_group;     /**< group, NULL once deleted */
+    int                     addr_heap_idx;   /**< index in group heap */
 } svr_addr_t;
 
 /** List head of server address. */
@@ -74,9 +76,14 @@ typedef LIST_HEAD(svr_addr_head_s, svr_addr_s) svr_addr_head_t;
 /** List item of server group. */
 typedef struct svr_group_s {
     LIST_ENTRY(svr_group_s) entry;              /**< list entry */
+    LIST_ENTRY(svr_group_s) hash_entry;         /**< hash bucket entry */
     char                    group_name[MAX_NAME_LEN]; /**< group name */
     svr_addr_head_t         group_addr_head;    /**< head of address list */
     int                     group_addr_count;   /**< number of addresses */
+    svr_addr_t              **group_heap;       /**< addresses, min-heap on
+                                                     number of sessions */
+    int                     group_heap_size;    /**< addresses in heap */
+    int                     group_heap_max;     /**< capacity of heap */
 } svr_group_t;
 
 /** List head of server group. */
@@ -30,6 +30,12 @@
 
 #define MAX_MON_NAME_LEN  256     ///< Application name length
 
+#define MIRROR_VRF_REFRESH_INTERVAL 30 ///< re-resolve mirror VRFs (seconds)
+
+#define CONFIG_RECLAIM_INTERVAL 100 ///< retired config check interval (ms)
+
+#define READER_OFFLINE ((uint32_t)-1) ///< reader epoch of an idle data cpu
+
 /*** Data structures ***/
 
 
@@ -53,6 +59,7 @@ typedef struct monitor_s {
     char       name[MAX_MON_NAME_LEN]; ///< monitor name
     uint32_t   rate;                   ///< rate
     patroot *  addresses;              ///< addresses patricia tree
+    struct monitor_s * next_deleted;   ///< next deleted monitor to free
 } monitor_t;
 
 
@@ -64,6 +71,7 @@ typedef struct mirror_s {
     patnode    node;       ///< Tree node in mirror_conf
     in_addr_t  original;   ///< mirror from address
     in_addr_t  redirect;   ///< mirror to address
+    uint32_t   vrf;        ///< mirror with outgoing VRF (resolved from FDB)
 } mirror_t;
 
 
@@ -72,22 +80,105 @@ typedef struct mirror_s {
  * configuration we need depending on the tree (a monitor or mirror)
  */
 typedef struct prefix_s {
-    rnode_t     rnode;        ///< Radix tree node in mon/mir_prefixes
+    rnode_t     rnode;        ///< Radix tree node in mon_prefixes
     in_addr_t   prefix;       ///< prefix
     monitor_t * monitor;      ///< pointer to a monitor
+    uint32_t    rate;         ///< monitor's rate
 } prefix_t;
 
 
+/**
+ * The kinds of updates to existing flows that a configuration change needs
+ */
+typedef enum {
+    CLEAN_ANY_MONITOR = 0,    ///< clean_flows_with_any_monitor
+    CLEAN_ANY_MIRROR,         ///< clean_flows_with_any_mirror
+    CLEAN_MONITOR,            ///< clean_flows_with_monitor
+    CLEAN_MIRROR,             ///< clean_flows_with_mirror
+    CLEAN_PREFIX,             ///< clean_flows_in_monitored_prefix
+    REDIRECT_MIRROR           ///< redirect_flows_with_mirror
+} flow_update_e;
+
+
+/**
+ * An update to existing flows, queued with the configuration change that
+ * needs it
+ */
+typedef struct flow_update_s {
+    flow_update_e  type;                   ///< type of update
+    char           name[MAX_MON_NAME_LEN]; ///< monitor name (or empty)
+    in_addr_t      addr;                   ///< address or prefix
+    in_addr_t      mask;                   ///< prefix mask
+    in_addr_t      to;                     ///< mirror to address
+    uint32_t       vrf;                    ///< mirror VRF
+    TAILQ_ENTRY(flow_update_s) entries;    ///< ptrs to next/prev update
+} flow_update_t;
+
+
+/**
+ * List of flow updates
+ */
+typedef TAILQ_HEAD(flow_updates_s, flow_update_s) flow_updates_t;
+
+
+/**
+ * A read-only copy of the monitor prefixes and mirrors used for the lookups
+ * done by the data threads. A new one is built and published (swapping the
+ * pointer) upon every configuration change, so the lookups need no lock.
+ * A replaced snapshot is retired, and it is only freed once every data
+ * thread has passed through a quiescent state since. Only then are the
+ * flow updates of the change that replaced it applied, since by then all
+ * the flows created using it are in the flows_table.
+ */
+typedef struct config_snapshot_s {
+    radix_root_t  mon_prefixes;     ///< Radix tree for monitor lookups
+    patroot       mirrors;          ///< Pat. root for mirror lookups
+    uint32_t      epoch;            ///< epoch at which it was retired
+    flow_updates_t updates;         ///< flow updates to apply when freed
+    monitor_t *   deleted_monitors; ///< deleted monitors to free after them
+    TAILQ_ENTRY(config_snapshot_s) entries; ///< ptrs to next/prev retired
+    prefix_t *    prefixes;         ///< prefix nodes in mon_prefixes
+    mirror_t *    mirror_copies;    ///< mirror nodes in mirrors
+} config_snapshot_t;
+
+
 volatile boolean is_master; ///< mastership state of this data component
 
 static evContext       m_ctx;         ///< event context
 static patroot         monitors_conf; ///< Pat. root for monitors config
 static patroot         mirrors_conf;  ///< Pat. root for mirrors config
-static radix_root_t    mon_prefixes;  ///< Radix tree for monitor lookups
 static uint8_t         replication_interval;   ///< replication interval
 
-static msp_spinlock_t  mir_conf_lock; ///< lock for mirrors_conf config
-static msp_spinlock_t  mon_conf_lock; ///< lock for mon_prefixes config
+/**
+ * The published snapshot of the configuration used for lookups
+ */
+static config_snapshot_t * volatile snapshot;
+
+/**
+ * Retired snapshots not yet freed
+ */
+static TAILQ_HEAD(retired_snapshots_s, config_snapshot_s) retired_snapshots =
+            TAILQ_HEAD_INITIALIZER(retired_snapshots);
+
+/**
+ * Flow updates queued for the next snapshot published
+ */
+static flow_updates_t queued_updates = TAILQ_HEAD_INITIALIZER(queued_updates);
+
+/**
+ * Monitors deleted since the last snapshot published
+ */
+static monitor_t * deleted_monitors;
+
+/**
+ * Incremented upon every snapshot published
+ */
+static volatile uint32_t config_epoch;
+
+/**
+ * The last config_epoch seen by each data cpu while not using any snapshot
+ */
+static volatile uint32_t reader_epoch[MSP_MAX_CPUS];
 
 
 /**
@@ -145,6 +236,32 @@ update_time(evContext ctx __unused,
 }
 
 
+/**
+ * Periodically re-resolve the VRFs of the configured mirrors, in case the
+ * routes in the FDB have changed
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+refresh_mirror_vrfs(evContext ctx __unused,
+                    void * uap  __unused,
+                    struct timespec due __unused,
+                    struct timespec inter __unused)
+{
+    update_mirror_vrfs();
+}
+
+
 /**
  * Count the number of bits in a uint32_t / in_addr_t
  *
@@ -164,6 +281,294 @@ bit_count(uint32_t n)
 }
 
 
+/**
+ * Check if every data thread has passed through a quiescent state since
+ * the given epoch started
+ *
+ * @param[in] epoch
+ *      The epoch
+ *
+ * @return TRUE if they all have; FALSE otherwise
+ */
+static boolean
+readers_passed(uint32_t epoch)
+{
+    uint32_t i;
+
+    __sync_synchronize();
+
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        if(reader_epoch[i] != READER_OFFLINE &&
+                (int32_t)(reader_epoch[i] - epoch) < 0) {
+            return FALSE; // cpu i may still be using it (or a later one)
+        }
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Queue an update to existing flows to apply once no data thread can be
+ * creating flows using the configuration in place before the next snapshot
+ * is published
+ *
+ * @param[in] type
+ *      The type of update
+ *
+ * @param[in] name
+ *      The monitor name (or NULL)
+ *
+ * @param[in] addr
+ *      The address or prefix
+ *
+ * @param[in] mask
+ *      The prefix mask
+ *
+ * @param[in] to
+ *      The mirror to address
+ *
+ * @param[in] vrf
+ *      The mirror VRF
+ */
+static void
+queue_flow_update(flow_update_e type,
+                  char * name,
+                  in_addr_t addr,
+                  in_addr_t mask,
+                  in_addr_t to,
+                  uint32_t vrf)
+{
+    flow_update_t * update;
+
+    update = calloc(1, sizeof(flow_update_t));
+    INSIST(update != NULL);
+
+    update->type = type;
+    if(name != NULL) {
+        strncpy(update->name, name, MAX_MON_NAME_LEN - 1);
+    }
+    update->addr = addr;
+    update->mask = mask;
+    update->to = to;
+    update->vrf = vrf;
+
+    TAILQ_INSERT_TAIL(&queued_updates, update, entries);
+}
+
+
+/**
+ * Apply an update to the existing flows
+ *
+ * @param[in] update
+ *      The update
+ */
+static void
+apply_flow_update(flow_update_t * update)
+{
+    switch(update->type) {
+
+    case CLEAN_ANY_MONITOR:
+        clean_flows_with_any_monitor();
+        break;
+
+    case CLEAN_ANY_MIRROR:
+        clean_flows_with_any_mirror();
+        break;
+
+    case CLEAN_MONITOR:
+        clean_flows_with_monitor(update->name);
+        break;
+
+    case CLEAN_MIRROR:
+        clean_flows_with_mirror(update->addr);
+        break;
+
+    case CLEAN_PREFIX:
+        clean_flows_in_monitored_prefix(
+                (update->name[0] != '\0') ? update->name : NULL,
+                update->addr, update->mask);
+        break;
+
+    case REDIRECT_MIRROR:
+        redirect_flows_with_mirror(update->addr, update->to, update->vrf);
+        break;
+
+    default:
+        LOG(LOG_ERR, "%s: Unknown flow update type %d", __func__,
+                update->type);
+    }
+}
+
+
+/**
+ * Free the retired snapshots that no data thread can still be using, once
+ * the flow updates queued with them are applied
+ */
+static void
+reclaim_snapshots(void)
+{
+    config_snapshot_t * snap;
+    flow_update_t * update;
+    monitor_t * mon;
+
+    while((snap = TAILQ_FIRST(&retired_snapshots)) != NULL) {
+
+        if(!readers_passed(snap->epoch)) {
+            return; // and the later ones too, they stay in order
+        }
+
+        TAILQ_REMOVE(&retired_snapshots, snap, entries);
+
+        while((update = TAILQ_FIRST(&snap->updates)) != NULL) {
+            TAILQ_REMOVE(&snap->updates, update, entries);
+            apply_flow_update(update);
+            free(update);
+        }
+
+        // no more flows use the monitors' names now
+        while((mon = snap->deleted_monitors) != NULL) {
+            snap->deleted_monitors = mon->next_deleted;
+            free(mon);
+        }
+
+        free(snap->prefixes);
+        free(snap->mirror_copies);
+        free(snap);
+    }
+}
+
+
+/**
+ * Periodically free the retired snapshots
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+reclaim_config(evContext ctx __unused,
+               void * uap  __unused,
+               struct timespec due __unused,
+               struct timespec inter __unused)
+{
+    reclaim_snapshots();
+}
+
+
+/**
+ * Build a new snapshot from the current configuration and publish it for the
+ * data threads to use, retiring the one it replaces with the flow updates and
+ * deleted monitors queued since the last one. This never waits for the data
+ * threads; the retired snapshot is reclaimed later.
+ */
+static void
+publish_snapshot(void)
+{
+    config_snapshot_t * snap, * old;
+    monitor_t * mon;
+    mirror_t * mir, * copy;
+    address_t * add;
+    prefix_t * prefix;
+    uint32_t prefix_count = 0, mirror_count = 0;
+
+    // count what needs to be copied
+
+    mon = mon_entry(patricia_find_next(&monitors_conf, NULL));
+    while(mon != NULL) {
+        add = address_entry(patricia_find_next(mon->addresses, NULL));
+        while(add != NULL) {
+            ++prefix_count;
+            add = address_entry(patricia_find_next(mon->addresses, &add->node));
+        }
+        mon = mon_entry(patricia_find_next(&monitors_conf, &mon->node));
+    }
+
+    mir = mir_entry(patricia_find_next(&mirrors_conf, NULL));
+    while(mir != NULL) {
+        ++mirror_count;
+        mir = mir_entry(patricia_find_next(&mirrors_conf, &mir->node));
+    }
+
+    snap = calloc(1, sizeof(config_snapshot_t));
+    INSIST(snap != NULL);
+    TAILQ_INIT(&snap->updates);
+    snap->prefixes = calloc(prefix_count + 1, sizeof(prefix_t));
+    INSIST(snap->prefixes != NULL);
+    snap->mirror_copies = calloc(mirror_count + 1, sizeof(mirror_t));
+    INSIST(snap->mirror_copies != NULL);
+
+    radix_init_root(&snap->mon_prefixes);
+    patricia_root_init(&snap->mirrors, FALSE, sizeof(in_addr_t), 0);
+
+    // copy the monitored prefixes
+
+    prefix = snap->prefixes;
+    mon = mon_entry(patricia_find_next(&monitors_conf, NULL));
+    while(mon != NULL) {
+        add = address_entry(patricia_find_next(mon->addresses, NULL));
+        while(add != NULL) {
+            prefix->prefix = add->address;
+            prefix->monitor = mon;
+            prefix->rate = mon->rate;
+            radix_node_init(&prefix->rnode, bit_count(add->mask), 0);
+
+            if(radix_add(&snap->mon_prefixes, &prefix->rnode)) {
+                LOG(LOG_ERR, "%s: Failed to add monitor prefix "
+                        "to rtree configuration", __func__);
+            } else {
+                ++prefix;
+            }
+            add = address_entry(patricia_find_next(mon->addresses, &add->node));
+        }
+        mon = mon_entry(patricia_find_next(&monitors_conf, &mon->node));
+    }
+
+    // copy the mirrors
+
+    copy = snap->mirror_copies;
+    mir = mir_entry(patricia_find_next(&mirrors_conf, NULL));
+    while(mir != NULL) {
+        copy->original = mir->original;
+        copy->redirect = mir->redirect;
+        copy->vrf = mir->vrf;
+
+        if(!patricia_add(&snap->mirrors, &copy->node)) {
+            LOG(LOG_ERR, "%s: Failed to add mirror to configuration",
+                    __func__);
+        } else {
+            ++copy;
+        }
+        mir = mir_entry(patricia_find_next(&mirrors_conf, &mir->node));
+    }
+
+    // publish it, making sure it's all written before it's seen
+
+    old = snapshot;
+    __sync_synchronize();
+    snapshot = snap;
+    __sync_synchronize();
+
+    if(old != NULL) {
+        old->epoch = ++config_epoch;
+        TAILQ_CONCAT(&old->updates, &queued_updates, entries);
+        old->deleted_monitors = deleted_monitors;
+        deleted_monitors = NULL;
+        TAILQ_INSERT_TAIL(&retired_snapshots, old, entries);
+    }
+
+    reclaim_snapshots(); // only what it can without waiting
+}
+
+
 /**
  * Delete all address from a monitor's configuration
  *
@@ -174,7 +579,6 @@ static void
 delete_all_addresses(monitor_t * mon)
 {
     address_t * add = NULL;
-    rnode_t * rn;
 
     while(NULL != (add =
         address_entry(patricia_find_next(mon->addresses, NULL)))) {
@@ -183,21 +587,6 @@ delete_all_addresses(monitor_t * mon)
             LOG(LOG_ERR, "%s: Deleting address failed", __func__);
         }
 
-        INSIST_ERR(msp_spinlock_lock(&mon_conf_lock) == MSP_OK);
-
-        rn = radix_get(&mon_prefixes,
-                bit_count(add->mask), (uint8_t *)&add->address);
-
-        if(rn == NULL) {
-            LOG(LOG_ERR, "%s: Failed to find monitored prefix to remove from "
-                    "monitor's rtree configuration", __func__);
-        } else {
-            radix_delete(&mon_prefixes, rn);
-        }
-
-
-        INSIST_ERR(msp_spinlock_unlock(&mon_conf_lock) == MSP_OK);
-
         free(add);
     }
 }
@@ -222,13 +611,11 @@ init_config(evContext ctx)
 
     is_master = FALSE;
 
-    msp_spinlock_init(&mir_conf_lock);
-    msp_spinlock_init(&mon_conf_lock);
-
     patricia_root_init(&monitors_conf, FALSE, MAX_MON_NAME_LEN, 0);
     patricia_root_init(&mirrors_conf, FALSE, sizeof(in_addr_t), 0);
 
-    radix_init_root(&mon_prefixes);
+    memset((void *)reader_epoch, 0xFF, sizeof(reader_epoch)); // all offline
+    publish_snapshot();
 
     current_time = (atomic_uint_t)(time(NULL) - 1);
     replication_interval = 10; // default, but by the time it is used, it is set
@@ -240,6 +627,23 @@ init_config(evContext ctx)
         return EFAIL;
     }
 
+    // freeing of retired config snapshots
+    if(evSetTimer(ctx, reclaim_config, NULL, evNowTime(),
+            evConsTime(0, CONFIG_RECLAIM_INTERVAL * 1000000), NULL)) {
+        LOG(LOG_EMERG, "%s: Failed to initialize an eventlib timer to free "
+            "retired configuration", __func__);
+        return EFAIL;
+    }
+
+    // mirror VRF resolution
+    if(evSetTimer(ctx, refresh_mirror_vrfs, NULL,
+            evAddTime(evNowTime(), evConsTime(MIRROR_VRF_REFRESH_INTERVAL, 0)),
+            evConsTime(MIRROR_VRF_REFRESH_INTERVAL, 0), NULL)) {
+        LOG(LOG_EMERG, "%s: Failed to initialize an eventlib timer to refresh "
+            "the mirror VRFs", __func__);
+        return EFAIL;
+    }
+
     return SUCCESS;
 }
 
@@ -341,10 +745,12 @@ clear_monitors_configuration(void)
         delete_all_addresses(mon);
         patricia_root_delete(mon->addresses);
 
-        free(mon);
+        mon->next_deleted = deleted_monitors;
+        deleted_monitors = mon;
     }
 
-    clean_flows_with_any_monitor();
+    queue_flow_update(CLEAN_ANY_MONITOR, NULL, 0, 0, 0, 0);
+    publish_snapshot();
 }
 
 
@@ -356,8 +762,6 @@ clear_mirrors_configuration(void)
 {
     mirror_t * mir;
 
-    INSIST_ERR(msp_spinlock_lock(&mir_conf_lock) == MSP_OK);
-
     while(NULL != (mir = mir_entry(patricia_find_next(&mirrors_conf, NULL)))) {
 
         if(!patricia_delete(&mirrors_conf, &mir->node)) {
@@ -367,9 +771,8 @@ clear_mirrors_configuration(void)
         free(mir);
     }
 
-    INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
-
-    clean_flows_with_any_mirror();
+    queue_flow_update(CLEAN_ANY_MIRROR, NULL, 0, 0, 0, 0);
+    publish_snapshot();
 }
 
 
@@ -399,9 +802,11 @@ delete_monitor(char * name)
     delete_all_addresses(mon);
     patricia_root_delete(mon->addresses);
 
-    free(mon);
+    mon->next_deleted = deleted_monitors;
+    deleted_monitors = mon; // freed once no more flows use its name
 
-    clean_flows_with_monitor(name);
+    queue_flow_update(CLEAN_MONITOR, name, 0, 0, 0, 0);
+    publish_snapshot();
 }
 
 
@@ -416,24 +821,20 @@ delete_mirror(in_addr_t from)
 {
     mirror_t * mir;
 
-    INSIST_ERR(msp_spinlock_lock(&mir_conf_lock) == MSP_OK);
-
     mir = mir_entry(patricia_get(&mirrors_conf, sizeof(from), &from));
 
     if(mir == NULL) {
-        INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
         LOG(LOG_WARNING, "%s: Could not find mirror to remove", __func__);
         return;
     }
 
     if(!patricia_delete(&mirrors_conf, &mir->node)) {
-        INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
         LOG(LOG_ERR, "%s: Deleting mirror failed", __func__);
         return;
     }
-    INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
 
-    clean_flows_with_mirror(from);
+    queue_flow_update(CLEAN_MIRROR, NULL, from, 0, 0, 0);
+    publish_snapshot();
 
     free(mir);
 }
@@ -456,7 +857,6 @@ delete_address(char * name, in_addr_t addr, in_addr_t mask)
 {
     monitor_t * mon;
     address_t * address = NULL;
-    rnode_t * rn;
 
     mon = mon_entry(patricia_get(&monitors_conf, strlen(name) + 1, name));
 
@@ -480,20 +880,8 @@ delete_address(char * name, in_addr_t addr, in_addr_t mask)
         return;
     }
 
-    INSIST_ERR(msp_spinlock_lock(&mon_conf_lock) == MSP_OK);
-
-    rn = radix_get(&mon_prefixes, bit_count(mask), (uint8_t *)&addr);
-
-    if(rn == NULL) {
-        LOG(LOG_ERR, "%s: Failed to find monitored prefix to remove from "
-                "monitor's rtree configuration", __func__);
-    } else {
-        radix_delete(&mon_prefixes, rn);
-    }
-
-    INSIST_ERR(msp_spinlock_unlock(&mon_conf_lock) == MSP_OK);
-
-    clean_flows_in_monitored_prefix(name, addr, mask);
+    queue_flow_update(CLEAN_PREFIX, name, addr, mask, 0, 0);
+    publish_snapshot();
 
     free(address);
 }
@@ -516,7 +904,6 @@ add_address(char * name, in_addr_t addr, in_addr_t mask)
 {
     monitor_t * mon;
     address_t * address = NULL;
-    prefix_t * prefix;
     struct in_addr paddr;
     char * tmp;
 
@@ -548,30 +935,24 @@ add_address(char * name, in_addr_t addr, in_addr_t mask)
         return;
     }
 
-    prefix = calloc(1, sizeof(prefix_t));
-    INSIST(prefix != NULL);
-    prefix->prefix = addr;
-    prefix->monitor = mon;
-
-    radix_node_init(&prefix->rnode, bit_count(mask), 0);
-
-    INSIST_ERR(msp_spinlock_lock(&mon_conf_lock) == MSP_OK);
+    // only this (main) thread publishes snapshots, so it can use the current
+    // one to check that no other monitor has the same prefix
 
-    if(radix_add(&mon_prefixes, &prefix->rnode)) {
+    if(radix_get(&snapshot->mon_prefixes, bit_count(mask),
+            (uint8_t *)&addr) != NULL) {
 
         LOG(LOG_ERR, "%s: Failed to add monitor prefix "
                 "to rtree configuration", __func__);
-        free(prefix);
 
         patricia_delete(mon->addresses, &address->node);
         free(address);
+        return;
     }
 
-    INSIST_ERR(msp_spinlock_unlock(&mon_conf_lock) == MSP_OK);
-
     // clean any flows that might be unmonitored, but match this prefix,
     // so that they become monitored
-    clean_flows_in_monitored_prefix(NULL, addr, mask);
+    queue_flow_update(CLEAN_PREFIX, NULL, addr, mask, 0, 0);
+    publish_snapshot();
 }
 
 
@@ -612,7 +993,9 @@ update_monitor(char * name, uint32_t rate)
 
     if(mon->rate != rate) {
         mon->rate = rate;
-        clean_flows_with_monitor(name); // we don't reset stats, just clean
+        // we don't reset stats, just clean
+        queue_flow_update(CLEAN_MONITOR, name, 0, 0, 0, 0);
+        publish_snapshot();
     }
 }
 
@@ -631,8 +1014,10 @@ update_mirror(in_addr_t from, in_addr_t to)
 {
     boolean is_new = FALSE;
     mirror_t * mir;
+    uint32_t vrf = 0;
 
-    INSIST_ERR(msp_spinlock_lock(&mir_conf_lock) == MSP_OK);
+    // resolve the VRF now (off the data path) since it walks the FDB
+    lookup_mirror_vrf(to, &vrf);
 
     mir = mir_entry(patricia_get(&mirrors_conf, sizeof(from), &from));
 
@@ -645,18 +1030,54 @@ update_mirror(in_addr_t from, in_addr_t to)
             LOG(LOG_ERR, "%s: Failed to add "
                     "mirror to configuration", __func__);
             free(mir);
-            INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
             return;
         }
         is_new = TRUE;
     }
 
     mir->redirect = to;
-
-    INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
+    mir->vrf = vrf;
 
     if(!is_new) {
-        redirect_flows_with_mirror(from, to);
+        queue_flow_update(REDIRECT_MIRROR, NULL, from, 0, to, vrf);
+    }
+
+    publish_snapshot();
+}
+
+
+/**
+ * Re-resolve the VRFs of all configured mirrors from the FDB, and update
+ * the flows of any mirror whose VRF changed. All the changes are published
+ * in one snapshot.
+ */
+void
+update_mirror_vrfs(void)
+{
+    mirror_t * mir;
+    uint32_t vrf;
+    boolean changed = FALSE;
+
+    // only this (main) thread changes the mirrors_conf tree
+
+    mir = mir_entry(patricia_find_next(&mirrors_conf, NULL));
+
+    while(mir != NULL) {
+
+        if(lookup_mirror_vrf(mir->redirect, &vrf) == SUCCESS
+           && vrf != mir->vrf) {
+
+            mir->vrf = vrf;
+            queue_flow_update(REDIRECT_MIRROR, NULL, mir->original, 0,
+                    mir->redirect, vrf);
+            changed = TRUE;
+        }
+
+        mir = mir_entry(patricia_find_next(&mirrors_conf, &mir->node));
+    }
+
+    if(changed) {
+        publish_snapshot();
     }
 }
 
@@ -683,21 +1104,18 @@ get_monitored_rate(in_addr_t address, char ** name)
     tmp.s_addr = address;
     LOG(LOG_INFO, "%s: Looking up rate for %s", __func__, inet_ntoa(tmp));
 
-    INSIST_ERR(msp_spinlock_lock(&mon_conf_lock) == MSP_OK);
+    // no lock, the snapshot stays valid until our next quiescent state
 
-    rn = radix_lookup(&mon_prefixes, (uint8_t *)&address);
+    rn = radix_lookup(&snapshot->mon_prefixes, (uint8_t *)&address);
 
     if(rn == NULL) {
-        INSIST_ERR(msp_spinlock_unlock(&mon_conf_lock) == MSP_OK);
         return 0;
     }
 
     prefix = (prefix_t *)((uint8_t *)rn - offsetof(prefix_t, rnode));
 
     *name = prefix->monitor->name;
-    result = prefix->monitor->rate;
-
-    INSIST_ERR(msp_spinlock_unlock(&mon_conf_lock) == MSP_OK);
+    result = prefix->rate;
 
     LOG(LOG_INFO, "%s: Match for flow to %s. Name: %s, Rate: %d", __func__,
             inet_ntoa(tmp), *name, result);
@@ -712,23 +1130,56 @@ get_monitored_rate(in_addr_t address, char ** name)
  * @param[in] address
  *      The original destination
  *
+ * @param[out] vrf
+ *      The VRF to mirror with (set if found)
+ *
  * @return the address to mirror to; or 0 if none found
  */
 in_addr_t
-get_mirror(in_addr_t address)
+get_mirror(in_addr_t address, uint32_t * vrf)
 {
     mirror_t * mir;
     in_addr_t result = 0;
 
-    INSIST_ERR(msp_spinlock_lock(&mir_conf_lock) == MSP_OK);
+    // no lock, the snapshot stays valid until our next quiescent state
 
-    mir = mir_entry(patricia_get(&mirrors_conf, sizeof(address), &address));
+    mir = mir_entry(patricia_get(&snapshot->mirrors, sizeof(address),
+            &address));
 
     if(mir != NULL) {
         result = mir->redirect;
+        *vrf = mir->vrf;
     }
 
-    INSIST_ERR(msp_spinlock_unlock(&mir_conf_lock) == MSP_OK);
-
     return result;
 }
+
+
+/**
+ * Report that a data thread holds no reference into the configuration
+ * snapshot, so any snapshot retired before now can be freed. Data threads
+ * call this between packets.
+ *
+ * @param[in] cpu
+ *      The data thread's cpu
+ */
+void
+config_quiescent(int cpu)
+{
+    reader_epoch[cpu] = config_epoch;
+    __sync_synchronize();
+}
+
+
+/**
+ * Report that a data thread no longer does any configuration lookups
+ *
+ * @param[in] cpu
+ *      The data thread's cpu
+ */
+void
+config_offline(int cpu)
+{
+    __sync_synchronize();
+    reader_epoch[cpu] = READER_OFFLINE;
+}
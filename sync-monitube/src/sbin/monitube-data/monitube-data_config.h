@@ -186,6 +186,14 @@ void
 update_mirror(in_addr_t from, in_addr_t to);
 
 
+/**
+ * Re-resolve the VRFs of all configured mirrors from the FDB, and update
+ * the flows of any mirror whose VRF changed
+ */
+void
+update_mirror_vrfs(void);
+
+
 /**
  * Find the monitoring rate for an address if one exists
  *
@@ -207,10 +215,35 @@ get_monitored_rate(in_addr_t address, char ** name);
  * @param[in] address
  *      The original destination
  *
+ * @param[out] vrf
+ *      The VRF to mirror with (set if found)
+ *
  * @return the address to mirror to; or 0 if none found
  */
 in_addr_t
-get_mirror(in_addr_t address);
+get_mirror(in_addr_t address, uint32_t * vrf);
+
+
+/**
+ * Report that a data thread holds no reference into the configuration
+ * snapshot, so any snapshot retired before now can be freed. Data threads
+ * call this between packets.
+ *
+ * @param[in] cpu
+ *      The data thread's cpu
+ */
+void
+config_quiescent(int cpu);
+
+
+/**
+ * Report that a data thread no longer does any configuration lookups
+ *
+ * @param[in] cpu
+ *      The data thread's cpu
+ */
+void
+config_offline(int cpu);
 
 
 #endif
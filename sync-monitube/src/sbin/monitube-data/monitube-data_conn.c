@@ -33,34 +33,71 @@
 #define RETRY_CONNECT 60
 #define CONNECT_RETRIES    1  ///< max number of connect retries
 
+#define MAX_MON_NAME_LEN  256     ///< Application name length
+
+/**
+ * The number of stat records buffered per data cpu, must be a power of 2
+ */
+#define STAT_RING_SIZE 512
+
+/**
+ * Our mask to get a slot index in a stat ring
+ */
+#define STAT_RING_MASK (STAT_RING_SIZE - 1)
+
+/**
+ * Interval in ms at which the buffered stat records are sent to mgmt
+ */
+#define STAT_SEND_INTERVAL 100
+
+/**
+ * Max length of a message packed with stat records sent to the mgmt component
+ */
+#define STAT_MSG_MAX_LEN (16 * 1024)
+
 
 /*** Data Structures ***/
 
 extern volatile boolean is_master; ///< mastership state of this data component
 
 /**
- * A notification message to store in the queue of message to go out to the
+ * A stat update buffered until the main thread sends it out to the
  * mgmt component
  */
-typedef struct notification_msg_s {
-    msg_type_e     action;   ///< action to send (MSG_FLOW_STAT_UPDATE for now)
-    flow_stat_t *  message;  ///< data to send
-    TAILQ_ENTRY(notification_msg_s) entries;    ///< ptrs to next/prev
-} notification_msg_t;
+typedef struct stat_record_s {
+    in_addr_t   flow_addr;                  ///< Flow address
+    uint16_t    flow_port;                  ///< Flow port (net. byte-order)
+    uint16_t    mon_name_len;               ///< Monitor name length (w/ nul)
+    double      mdi_df;                     ///< MDI Delay factor
+    uint32_t    mdi_mlr;                    ///< MDI Media loss rate
+    char        mon_name[MAX_MON_NAME_LEN]; ///< Applicable monitor name
+} stat_record_t;
 
 
 /**
- * List of notification messages to buffer until main thread processes msgs
+ * A ring of stat records with a single producer (a data cpu) and a single
+ * consumer (the main thread), so it needs no lock. The indexes are free
+ * running and only taken modulo the ring size to index the records.
  */
-static TAILQ_HEAD(notification_buffer_s, notification_msg_s) notification_msgs =
-            TAILQ_HEAD_INITIALIZER(notification_msgs);
+typedef struct stat_ring_s {
+    volatile uint32_t  head;      ///< next record to produce (by data cpu)
+    volatile uint32_t  dropped;   ///< # records dropped because ring was full
+    volatile uint32_t  tail;      ///< next record to consume (by main thread)
+    uint32_t           reported;  ///< # dropped records already logged
+    stat_record_t      records[STAT_RING_SIZE]; ///< the records
+} stat_ring_t;
+
+
+static stat_ring_t *  stat_rings;    ///< stat rings, one per cpu
 
-static msp_spinlock_t msgs_lock;     ///< lock for accessing notification_msgs
+static uint8_t *      stat_msg;      ///< message being packed with records
 
 static pconn_client_t * mgmt_client; ///< client cnx to mgmt component
 
 static evTimerID  mgmt_timer_id;     ///< timerID for retrying cnx to mgmt
 
+static evTimerID  stat_timer_id;     ///< timerID for sending stat records
+
 static evContext  main_ctx;          ///< event context for main thread
 
 /*** STATIC/INTERNAL Functions ***/
@@ -74,8 +111,35 @@ static void connect_mgmt(evContext ctx, void * uap,
 
 
 /**
- * Go through the buffered messages and send them to the mgmt component
- * if it's connected.
+ * Send a message packed with stat records to the mgmt component
+ *
+ * @param[in] len
+ *      The length of the message in stat_msg
+ */
+static void
+send_stat_message(uint32_t len)
+{
+    flow_stats_t * msg = (flow_stats_t *)stat_msg;
+    uint32_t count = msg->count;
+    int rc;
+
+    msg->count = htonl(count);
+
+    rc = pconn_client_send(mgmt_client, MSG_FLOW_STATS_UPDATE, msg, len);
+
+    if(rc != PCONN_OK) {
+        // these stats are lost, but new ones are coming every second
+        LOG(LOG_ERR, "%s: Failed to send %d stat updates to mgmt component."
+                " Error: %d", __func__, count, rc);
+    }
+
+    msg->count = 0;
+}
+
+
+/**
+ * Drain the stat records buffered by the data cpus, and send them to the mgmt
+ * component, packing as many records as possible into each message
  *
  * @param[in] ctx
  *     The event context for this application
@@ -90,73 +154,82 @@ static void connect_mgmt(evContext ctx, void * uap,
  *     The period; when this will next be called
  */
 static void
-process_notifications_messages(evContext ctx UNUSED, void * uap  UNUSED,
+send_stat_notifications(evContext ctx UNUSED, void * uap  UNUSED,
             struct timespec due UNUSED, struct timespec inter UNUSED)
 {
-    notification_msg_t * msg;
-    int rc = 0;
-
-    if(mgmt_client == NULL) { // don't bother doing anything yet
-        return;
-    }
-
-    INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+    flow_stats_t * msg = (flow_stats_t *)stat_msg;
+    flow_stat_t * data;
+    stat_record_t * rec;
+    stat_ring_t * ring;
+    uint32_t i, head, tail, len, rec_len;
+    void * doub;
+    uint64_t out;
 
-    while((msg = TAILQ_FIRST(&notification_msgs)) != NULL) {
+    msg->count = 0;
+    len = sizeof(flow_stats_t);
 
-        TAILQ_REMOVE(&notification_msgs, msg, entries);
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
 
-        INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+        ring = &stat_rings[i];
+        head = ring->head;
 
-        rc = pconn_client_send(mgmt_client, msg->action, msg->message,
-                sizeof(flow_stat_t) + msg->message->mon_name_len);
+        if(ring->dropped != ring->reported) {
+            LOG(LOG_WARNING, "%s: Dropped %d stat updates on cpu %d because "
+                    "they came faster than they could be sent", __func__,
+                    ring->dropped - ring->reported, i);
+            ring->reported = ring->dropped;
+        }
 
-        if(rc != PCONN_OK) {
-            // put message back in and process soon
+        if(ring->tail == head) {
+            continue;
+        }
 
-            LOG(LOG_ERR, "%s: Failed to send message to mgmt component."
-                    " Error: %d", __func__, rc);
+        // make sure the records are read after the head
+        __sync_synchronize();
 
-            INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+        for(tail = ring->tail; tail != head; ++tail) {
 
-            TAILQ_INSERT_HEAD(&notification_msgs, msg, entries);
+            rec = &ring->records[tail & STAT_RING_MASK];
 
-            INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+            if(mgmt_client == NULL) { // just drop them
+                continue;
+            }
 
-            if(evSetTimer(main_ctx, process_notifications_messages, NULL,
-                    evAddTime(evNowTime(), evConsTime(5, 0)),
-                    evConsTime(0, 0), NULL)) {
+            rec_len = FLOW_STAT_RECORD_LEN(rec->mon_name_len);
 
-                LOG(LOG_EMERG, "%s: evSetTimer() failed! Will not be "
-                        "able to process buffered notifications", __func__);
+            if(len + rec_len > STAT_MSG_MAX_LEN) {
+                send_stat_message(len);
+                len = sizeof(flow_stats_t);
             }
-        } else {
-            free(msg->message);
-            free(msg);
-        }
 
-        INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
-    }
+            data = (flow_stat_t *)(stat_msg + len);
 
-    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
-}
+            data->flow_addr = rec->flow_addr;
+            data->pad = 0;
+            doub = &rec->mdi_df; // play around double type in case of a
+            out = *(uint64_t *)doub;  // truncating typecast
+            data->mdi_df = htonq(out);
+            data->mdi_mlr = htonl(rec->mdi_mlr);
+            data->flow_port = rec->flow_port;
+            data->mon_name_len = htons(rec->mon_name_len);
+            memcpy(data->mon_name, rec->mon_name, rec->mon_name_len);
 
+            len += rec_len;
+            ++msg->count;
+        }
 
-/**
- * Try to process all notification requests that have been buffered.
- * This should be called with a notify* call below
- */
-static void
-process_notifications(void)
-{
-    if(evSetTimer(main_ctx, process_notifications_messages, NULL,
-            evConsTime(0,0), evConsTime(0, 0), NULL)) {
+        // make sure the records are read before freeing them to the producer
+        __sync_synchronize();
 
-        LOG(LOG_EMERG, "%s: evSetTimer() failed! Will not be "
-                "able to process buffered notifications", __func__);
+        ring->tail = tail;
+    }
+
+    if(msg->count != 0) {
+        send_stat_message(len);
     }
 }
 
+
 /**
  * Connection handler for new and dying connections to the mgmt component
  *
@@ -503,7 +576,22 @@ init_connections(evContext ctx)
     main_ctx = ctx;
 
     evInitID(&mgmt_timer_id);
-    msp_spinlock_init(&msgs_lock);
+    evInitID(&stat_timer_id);
+
+    stat_rings = calloc(MSP_MAX_CPUS, sizeof(stat_ring_t));
+    INSIST(stat_rings != NULL);
+
+    stat_msg = calloc(1, STAT_MSG_MAX_LEN);
+    INSIST(stat_msg != NULL);
+
+    // Send stat updates buffered by the data cpus periodically
+    if(evSetTimer(ctx, send_stat_notifications, NULL, evNowTime(),
+        evConsTime(0, STAT_SEND_INTERVAL * 1000000), &stat_timer_id)) {
+
+        LOG(LOG_EMERG, "%s: Failed to initialize a timer to send stat "
+            "updates to the MGMT component", __func__);
+        return EFAIL;
+    }
 
     // Connect to the MGMT component
     if(evSetTimer(ctx, connect_mgmt, NULL, evNowTime(),
@@ -524,22 +612,36 @@ init_connections(evContext ctx)
 void
 close_connections(void)
 {
-    notification_msg_t * msg;
+    if(evTestID(stat_timer_id)) {
+        evClearTimer(main_ctx, stat_timer_id);
+        evInitID(&stat_timer_id);
+    }
 
     if(mgmt_client) {
         pconn_client_close(mgmt_client);
         mgmt_client = NULL;
     }
 
-    INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
-
-    while((msg = TAILQ_FIRST(&notification_msgs)) != NULL) {
-        TAILQ_REMOVE(&notification_msgs, msg, entries);
-        free(msg->message);
-        free(msg);
+    if(stat_msg) {
+        free(stat_msg);
+        stat_msg = NULL;
     }
+}
 
-    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+
+/**
+ * Free the stat rings. Any buffered records are dropped.
+ *
+ * The data cpus produce into the rings, so this must only be called once the
+ * packet loops are all stopped.
+ */
+void
+destroy_stat_rings(void)
+{
+    if(stat_rings) {
+        free(stat_rings);
+        stat_rings = NULL;
+    }
 }
 
 
@@ -568,36 +670,41 @@ notify_stat_update(in_addr_t flow_addr,
                    uint32_t mdi_mlr,
                    char * monitor_name)
 {
-    notification_msg_t * msg;
-    uint16_t len;
-    void * doub;
-    uint64_t out;
+    stat_ring_t * ring;
+    stat_record_t * rec;
+    uint32_t head;
+    size_t len;
 
     if(mgmt_client == NULL) { // don't bother doing anything yet
         return;
     }
 
-    msg = calloc(1, sizeof(notification_msg_t));
-    INSIST_ERR(msg != NULL);
+    // only this data cpu produces into its ring
+    ring = &stat_rings[msp_get_current_cpu()];
+    head = ring->head;
 
-    msg->action = MSG_FLOW_STAT_UPDATE;
+    if(head - ring->tail >= STAT_RING_SIZE) { // full
+        ++ring->dropped;
+        return;
+    }
 
-    len = strlen(monitor_name);
-    msg->message = calloc(1, sizeof(flow_stat_t) + len + 1);
-    msg->message->flow_addr = flow_addr;
-    msg->message->flow_port = flow_dport;
-    doub = &mdi_df; // play around double type in case of a truncating typecast
-    out = *(uint64_t *)doub;
-    msg->message->mdi_df = htonq(out);
-    msg->message->mdi_mlr = mdi_mlr;
-    msg->message->mon_name_len = len + 1;
-    strcpy(msg->message->mon_name, monitor_name);
+    rec = &ring->records[head & STAT_RING_MASK];
 
-    INSIST_ERR(msp_spinlock_lock(&msgs_lock) == MSP_OK);
+    len = strlen(monitor_name);
+    if(len >= MAX_MON_NAME_LEN) {
+        len = MAX_MON_NAME_LEN - 1;
+    }
 
-    TAILQ_INSERT_TAIL(&notification_msgs, msg, entries);
+    rec->flow_addr = flow_addr;
+    rec->flow_port = flow_dport;
+    rec->mdi_df = mdi_df;
+    rec->mdi_mlr = mdi_mlr;
+    rec->mon_name_len = len + 1;
+    memcpy(rec->mon_name, monitor_name, len);
+    rec->mon_name[len] = '\0';
 
-    INSIST_ERR(msp_spinlock_unlock(&msgs_lock) == MSP_OK);
+    // make sure the record is written before it's published with the head
+    __sync_synchronize();
 
-    process_notifications();
+    ring->head = head + 1;
 }
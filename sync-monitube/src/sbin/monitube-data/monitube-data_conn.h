@@ -53,6 +53,16 @@ void
 close_connections(void);
 
 
+/**
+ * Free the stat rings. Any buffered records are dropped.
+ *
+ * The data cpus produce into the rings, so this must only be called once the
+ * packet loops are all stopped.
+ */
+void
+destroy_stat_rings(void);
+
+
 /**
  * Notify the mgmt component about a statistic update
  * 
@@ -31,12 +31,97 @@
 
 #define MONITUBE_DC_REPLICATION_KA 30       ///< keepalive message interval
 
+/**
+ * Max number of flows with pending replication records in a pending set of
+ * one shard before they are flushed to the slave
+ */
+#define PENDING_MAX 1024
+
+/**
+ * Number of buckets in the pending record hashtable, must be a power of 2
+ */
+#define PENDING_BUCKETS (PENDING_MAX * 2)
+
+/**
+ * Interval in ms at which the pending replication records are flushed
+ */
+#define FLUSH_INTERVAL 100
+
+/**
+ * Max length of a batch of replication records sent in one TLV
+ */
+#define BATCH_MAX_LEN (32 * 1024)
+
+/**
+ * Length of a record in a batch with data of length len
+ */
+#define RECORD_LEN(len) \
+    ((sizeof(replication_record_t) + (len) + 7) & ~((size_t)7))
+
+/**
+ * Type of a pending record whose add and delete cancelled out
+ */
+#define RECORD_CANCELLED 0
+
+/**
+ * Size of a cache line on the data cores
+ */
+#define CACHE_LINE_SIZE 64
+
 /*** Data structures ***/
 
+/**
+ * The latest replication record for a flow, pending until it's flushed
+ */
+typedef struct pending_entry_s {
+    replication_record_type_e  type;    ///< type of data
+    boolean                    fresh;   ///< flow isn't known by the slave
+    union {
+        replication_data_t        update;   ///< latest state of flow
+        delete_replication_data_t delete;   ///< flow to delete
+    } data;                             ///< record data
+    struct pending_entry_s *   next;    ///< next entry in same bucket
+} pending_entry_t;
+
+
+/**
+ * A set of pending records, coalesced by flow
+ */
+typedef struct pending_set_s {
+    pending_entry_t   pending[PENDING_MAX];    ///< pending record pool
+    pending_entry_t * table[PENDING_BUCKETS];  ///< pool entries by flow key
+    uint32_t          count;                   ///< # of pool entries used
+} pending_set_t;
+
+
+/**
+ * A shard of the pending records. The records of a flow always go to the
+ * same shard, picked by the hash of the flow's key, so they stay in order.
+ * Every thread records into the active set of the flow's shard, and every
+ * FLUSH_INTERVAL the main thread swaps the sets and sends out the records in
+ * the one no longer active. There are as many shards as data cpus, so the
+ * data cpus seldom contend for a shard lock.
+ */
+typedef struct pending_shard_s {
+    msp_spinlock_t    lock;      ///< lock for the active set
+    pending_set_t *   active;    ///< set records go into
+    volatile uint32_t overflow;  ///< # records dropped as active set was full
+    uint32_t          reported;  ///< # dropped records already logged
+    pending_set_t     sets[2];   ///< the active set and the one to send
+} __attribute__((aligned(CACHE_LINE_SIZE))) pending_shard_t;
+
+
 static junos_sync_state_t     rep_state;     ///< replication state
 static junos_sync_callbacks_t rep_callbacks; ///< replication callbacks
 static junos_sync_context_t * rep_ctx;       ///< replication API context
 
+static pending_shard_t * pending_shards; ///< pending records by shard
+static uint32_t         shard_count;    ///< # of pending_shards
+static int              main_cpu;       ///< cpu of the main thread
+static uint8_t          batch_buf[BATCH_MAX_LEN]; ///< batch being built
+static evTimerID        flush_timer_id; ///< timer to flush pending records
+static evContext        rep_ev_ctx;     ///< main event context
+
 
 /*** STATIC/INTERNAL Functions ***/
 
@@ -52,6 +137,7 @@ replication_data_hton(replication_data_t * data)
 {
     data->bucket = htonl(data->bucket);
     data->dport = htons(data->dport);
+    data->vrf = htonl(data->vrf);
     data->age_ts = htonl(data->age_ts);
     data->ssrc = htonl(data->ssrc);
     data->rate = htonl(data->rate);
@@ -78,6 +164,7 @@ replication_data_ntoh(replication_data_t * data)
 {
     data->bucket = ntohl(data->bucket);
     data->dport = ntohs(data->dport);
+    data->vrf = ntohl(data->vrf);
     data->age_ts = ntohl(data->age_ts);
     data->ssrc = ntohl(data->ssrc);
     data->rate = ntohl(data->rate);
@@ -104,6 +191,7 @@ delete_replication_data_hton(delete_replication_data_t * data)
 {
     data->bucket = htonl(data->bucket);
     data->dport = htons(data->dport);
+    data->vrf = htonl(data->vrf);
 }
 
 
@@ -118,6 +206,448 @@ delete_replication_data_ntoh(delete_replication_data_t * data)
 {
     data->bucket = ntohl(data->bucket);
     data->dport = ntohs(data->dport);
+    data->vrf = ntohl(data->vrf);
+}
+
+
+/**
+ * Hash the key of a flow for the pending records
+ *
+ * @param[in] daddr
+ *      flow destination address
+ *
+ * @param[in] dport
+ *      flow destination port
+ *
+ * @param[in] vrf
+ *      flow ingress VRF
+ *
+ * @return
+ *      The hash, whose lower bits select a bucket in a pending set's table
+ *      and whose upper half selects the shard
+ */
+static uint32_t
+pending_hash(in_addr_t daddr, uint16_t dport, uint32_t vrf)
+{
+    return (daddr * 2654435761U) ^ (dport << 16) ^ vrf;
+}
+
+
+/**
+ * Find the pending record of a flow in a pending set
+ *
+ * @param[in] set
+ *      The pending set
+ *
+ * @param[in] daddr
+ *      flow destination address
+ *
+ * @param[in] dport
+ *      flow destination port
+ *
+ * @param[in] vrf
+ *      flow ingress VRF
+ *
+ * @param[out] bucket
+ *      The bucket of the flow in the set's table
+ *
+ * @return
+ *      The flow's pending record; NULL if there is none
+ */
+static pending_entry_t *
+find_pending_entry(pending_set_t * set, in_addr_t daddr, uint16_t dport,
+                   uint32_t vrf, uint32_t * bucket)
+{
+    pending_entry_t * entry;
+
+    *bucket = pending_hash(daddr, dport, vrf) & (PENDING_BUCKETS - 1);
+
+    for(entry = set->table[*bucket]; entry != NULL; entry = entry->next) {
+        // the key is at the same place for updates and deletes
+        if(entry->type == REPLICATION_UPDATE) {
+            if(entry->data.update.daddr == daddr &&
+               entry->data.update.dport == dport &&
+               entry->data.update.vrf == vrf) {
+                return entry;
+            }
+        } else if(entry->data.delete.daddr == daddr &&
+                  entry->data.delete.dport == dport &&
+                  entry->data.delete.vrf == vrf) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Find the pending record of a flow in a pending set, or get a new one for it
+ * from the set's pool
+ *
+ * @param[in] set
+ *      The pending set
+ *
+ * @param[in] daddr
+ *      flow destination address
+ *
+ * @param[in] dport
+ *      flow destination port
+ *
+ * @param[in] vrf
+ *      flow ingress VRF
+ *
+ * @param[out] found
+ *      Set to TRUE if there was a pending record for this flow
+ *
+ * @return
+ *      The flow's pending record; NULL if the pool is exhausted
+ */
+static pending_entry_t *
+get_pending_entry(pending_set_t * set, in_addr_t daddr, uint16_t dport,
+                  uint32_t vrf, boolean * found)
+{
+    pending_entry_t * entry;
+    uint32_t bucket;
+
+    entry = find_pending_entry(set, daddr, dport, vrf, &bucket);
+
+    if(entry != NULL) {
+        *found = TRUE;
+        return entry;
+    }
+
+    *found = FALSE;
+
+    if(set->count == PENDING_MAX) {
+        return NULL;
+    }
+
+    entry = &set->pending[set->count++];
+    entry->next = set->table[bucket];
+    set->table[bucket] = entry;
+
+    return entry;
+}
+
+
+/**
+ * Get the pending shard of a flow, locked. Must be called with the flow
+ * locked, so the flow's records are made in order.
+ *
+ * @param[in] daddr
+ *      flow destination address
+ *
+ * @param[in] dport
+ *      flow destination port
+ *
+ * @param[in] vrf
+ *      flow ingress VRF
+ *
+ * @return
+ *      The flow's pending shard, locked
+ */
+static pending_shard_t *
+lock_pending_shard(in_addr_t daddr, uint16_t dport, uint32_t vrf)
+{
+    pending_shard_t * ps;
+
+    ps = &pending_shards[(pending_hash(daddr, dport, vrf) >> 16) % shard_count];
+
+    // Get the lock of this shard's pending records
+    INSIST_ERR(msp_spinlock_lock(&ps->lock) == MSP_OK);
+
+    return ps;
+}
+
+
+/**
+ * Queue a batch of records to the slave
+ *
+ * @param[in] len
+ *      The length of the batch in batch_buf
+ */
+static void
+queue_batch(uint32_t len)
+{
+    replication_batch_t * batch = (replication_batch_t *)batch_buf;
+    junos_sync_tlv_t * tlv_data;
+
+    tlv_data = malloc(sizeof(junos_sync_tlv_t) + len);
+    INSIST_ERR(tlv_data != NULL);
+
+    batch->magic = htonl(REPLICATION_BATCH_MAGIC);
+    batch->count = htonl(batch->count);
+
+    tlv_data->tlv_len = len;
+    memcpy(&tlv_data->tlv_value, batch, len);
+
+    junos_sync_queue(rep_ctx, tlv_data, false);
+
+    batch->count = 0;
+}
+
+
+/**
+ * Add the records of a pending set to the batch being built, queuing the
+ * batch whenever it is full, and empty the set
+ *
+ * @param[in] set
+ *      The pending set, not being recorded into
+ *
+ * @param[in,out] len
+ *      The length of the batch in batch_buf
+ */
+static void
+batch_pending(pending_set_t * set, uint32_t * len)
+{
+    replication_batch_t * batch = (replication_batch_t *)batch_buf;
+    replication_record_t * record;
+    pending_entry_t * entry;
+    uint32_t i, rec_len;
+
+    if(set->count == 0) {
+        return;
+    }
+
+    for(i = 0; i < set->count; ++i) {
+        entry = &set->pending[i];
+
+        if(entry->type == RECORD_CANCELLED) {
+            continue;
+        }
+
+        rec_len = RECORD_LEN((entry->type == REPLICATION_UPDATE) ?
+                sizeof(replication_data_t) : sizeof(delete_replication_data_t));
+
+        if(*len + rec_len > BATCH_MAX_LEN) {
+            queue_batch(*len);
+            *len = sizeof(replication_batch_t);
+        }
+
+        record = (replication_record_t *)(batch_buf + *len);
+        record->type = htons(entry->type);
+        record->len = htons(rec_len);
+        record->pad = 0;
+
+        if(entry->type == REPLICATION_UPDATE) {
+            memcpy(record->data, &entry->data.update,
+                    sizeof(replication_data_t));
+            replication_data_hton((replication_data_t *)record->data);
+        } else {
+            memcpy(record->data, &entry->data.delete,
+                    sizeof(delete_replication_data_t));
+            delete_replication_data_hton(
+                    (delete_replication_data_t *)record->data);
+        }
+
+        *len += rec_len;
+        ++batch->count;
+    }
+
+    bzero(set->table, sizeof(set->table));
+    set->count = 0;
+}
+
+
+/**
+ * Send all the pending records to the slave, in as few batches as possible.
+ * Only called by the main thread.
+ *
+ * The active set of each shard is swapped for its empty one, and sent. The
+ * records of a flow are all in one shard, so they are sent in order.
+ */
+static void
+flush_pending(void)
+{
+    replication_batch_t * batch = (replication_batch_t *)batch_buf;
+    pending_shard_t * ps;
+    pending_set_t * set;
+    uint32_t len, i;
+
+    batch->count = 0;
+    len = sizeof(replication_batch_t);
+
+    for(i = 0; i < shard_count; ++i) {
+        ps = &pending_shards[i];
+
+        if(ps->overflow != ps->reported) {
+            LOG(LOG_WARNING, "%s: Dropped %d replication records of shard %d "
+                    "because they came faster than they could be sent",
+                    __func__, ps->overflow - ps->reported, i);
+            ps->reported = ps->overflow;
+        }
+
+        if(ps->active->count == 0) {
+            continue;
+        }
+
+        // Get the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_lock(&ps->lock) == MSP_OK);
+
+        set = ps->active;
+        ps->active = (set == &ps->sets[0]) ? &ps->sets[1] : &ps->sets[0];
+
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
+
+        batch_pending(set, &len);
+    }
+
+    if(batch->count != 0) {
+        queue_batch(len);
+    }
+}
+
+
+/**
+ * Periodically flush the pending records to the slave
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+flush_replication(evContext ctx UNUSED, void * uap  UNUSED,
+            struct timespec due UNUSED, struct timespec inter UNUSED)
+{
+    if(rep_ctx != NULL) {
+        flush_pending();
+    }
+}
+
+
+/**
+ * Drop all the pending records, and stop flushing them
+ */
+static void
+discard_pending(void)
+{
+    pending_shard_t * ps;
+    uint32_t i, j;
+
+    if(evTestID(flush_timer_id)) {
+        evClearTimer(rep_ev_ctx, flush_timer_id);
+        evInitID(&flush_timer_id);
+    }
+
+    for(i = 0; i < shard_count; ++i) {
+        ps = &pending_shards[i];
+
+        // Get the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_lock(&ps->lock) == MSP_OK);
+
+        for(j = 0; j < 2; ++j) {
+            bzero(ps->sets[j].table, sizeof(ps->sets[j].table));
+            ps->sets[j].count = 0;
+        }
+
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
+    }
+}
+
+
+/**
+ * Allocate the pending shards, one per data cpu (one data loop runs in each
+ * data core)
+ */
+static void
+init_pending(void)
+{
+    uint32_t i;
+    int core;
+
+    shard_count = 0;
+    core = msp_env_get_next_data_core(MSP_NEXT_NONE);
+    while(core != MSP_NEXT_END) {
+        ++shard_count;
+        core = msp_env_get_next_data_core(core);
+    }
+
+    if(shard_count == 0) {
+        shard_count = 1;
+    }
+
+    INSIST_ERR(posix_memalign((void **)&pending_shards, CACHE_LINE_SIZE,
+            shard_count * sizeof(pending_shard_t)) == 0);
+    bzero(pending_shards, shard_count * sizeof(pending_shard_t));
+
+    for(i = 0; i < shard_count; ++i) {
+        msp_spinlock_init(&pending_shards[i].lock);
+        pending_shards[i].active = &pending_shards[i].sets[0];
+    }
+}
+
+
+/**
+ * Decode a batch of records from the master, and apply them to the
+ * backup database
+ *
+ * @param[in] batch
+ *      The batch (in network byte order)
+ *
+ * @param[in] len
+ *      The length of the batch
+ */
+static void
+decode_batch(replication_batch_t * batch, size_t len)
+{
+    replication_record_t * record;
+    uint32_t count, offset, rec_len;
+
+    count = ntohl(batch->count);
+    offset = sizeof(replication_batch_t);
+
+    LOG(LOG_INFO, "%s: batch of %d records", __func__, count);
+
+    while(count-- > 0) {
+
+        record = (replication_record_t *)((uint8_t *)batch + offset);
+
+        if(offset + sizeof(replication_record_t) > len ||
+                (rec_len = ntohs(record->len)) < sizeof(replication_record_t)
+                || offset + rec_len > len) {
+            LOG(LOG_ERR, "%s: truncated batch", __func__);
+            return;
+        }
+
+        switch(ntohs(record->type)) {
+
+        case REPLICATION_UPDATE:
+            if(rec_len < RECORD_LEN(sizeof(replication_data_t))) {
+                LOG(LOG_ERR, "%s: short update record", __func__);
+                return;
+            }
+            replication_data_ntoh((replication_data_t *)record->data);
+            add_flow_state((replication_data_t *)record->data);
+            break;
+
+        case REPLICATION_DELETE:
+            if(rec_len < RECORD_LEN(sizeof(delete_replication_data_t))) {
+                LOG(LOG_ERR, "%s: short delete record", __func__);
+                return;
+            }
+            delete_replication_data_ntoh(
+                    (delete_replication_data_t *)record->data);
+            remove_flow_state((delete_replication_data_t *)record->data);
+            break;
+
+        default:
+            LOG(LOG_ERR, "%s: unknown record type %d", __func__,
+                    ntohs(record->type));
+        }
+
+        offset += rec_len;
+    }
 }
 
 
@@ -152,7 +682,12 @@ decode(void * data, size_t len)
 {
     INSIST_ERR(!rep_state.is_master);
 
-    if(len == sizeof(replication_data_t)) {
+    if(len >= sizeof(replication_batch_t) &&
+       ntohl(((replication_batch_t *)data)->magic) == REPLICATION_BATCH_MAGIC) {
+
+        decode_batch((replication_batch_t *)data, len);
+
+    } else if(len == sizeof(replication_data_t)) {
 
         LOG(LOG_INFO, "%s: update message of length %d", __func__, len);
 
@@ -286,6 +821,30 @@ db_clear(void)
 }
 
 
+/**
+ * Start flushing the pending records to the slave periodically
+ *
+ * @return
+ *      SUCCESS if successful; otherwise EFAIL with an error message.
+ */
+static status_t
+start_flushing(void)
+{
+    if(evTestID(flush_timer_id)) {
+        return SUCCESS;
+    }
+
+    if(evSetTimer(rep_ev_ctx, flush_replication, NULL, evNowTime(),
+            evConsTime(0, FLUSH_INTERVAL * 1000000), &flush_timer_id)) {
+
+        LOG(LOG_ERR, "%s: Failed to initialize a timer to flush replication "
+                "records", __func__);
+        return EFAIL;
+    }
+    return SUCCESS;
+}
+
+
 /*** GLOBAL/EXTERNAL Functions ***/
 
 
@@ -307,10 +866,18 @@ init_replication(in_addr_t master_address, evContext ev_ctx)
     static bool first_time = true;
     int rc;
 
-    if(!first_time) {
+    if(first_time) {
+        if(pending_shards == NULL) {
+            init_pending();
+        }
+        main_cpu = msp_get_current_cpu();
+        evInitID(&flush_timer_id);
+    } else {
 
         if(rep_state.is_master && master_address != 0) {
             // shutdown master server and become slave, but start from scratch
+            rep_state.is_master = false; // stop recording
+            discard_pending();
             junos_sync_exit(rep_ctx);
         } else if(!rep_state.is_master && master_address == 0) {
 
@@ -319,11 +886,12 @@ init_replication(in_addr_t master_address, evContext ev_ctx)
 
             // slave can take over as master
             junos_sync_switchover(rep_ctx, &rep_state, &rep_callbacks);
-            return SUCCESS;
+            return start_flushing();
         }
     }
 
     first_time = false;
+    rep_ev_ctx = ev_ctx;
 
     rep_ctx = NULL;
     bzero(&rep_state, sizeof(junos_sync_state_t));
@@ -379,6 +947,10 @@ init_replication(in_addr_t master_address, evContext ev_ctx)
         first_time = true;
         return EFAIL;
     }
+
+    if(rep_state.is_master) {
+        return start_flushing();
+    }
     return SUCCESS;
 }
 
@@ -388,31 +960,61 @@ init_replication(in_addr_t master_address, evContext ev_ctx)
  *
  * @param[in] data
  *      The data to replicate to the slave
+ *
+ * @param[in] new_flow
+ *      Whether the flow has just been created, and so is not known
+ *      by the slave yet
  */
 void
-update_replication_entry(replication_data_t * data)
+update_replication_entry(replication_data_t * data, boolean new_flow)
 {
-    replication_data_t * current;
-    junos_sync_tlv_t * tlv_data;
+    pending_shard_t * ps;
+    pending_entry_t * entry;
+    boolean found;
 
-    if(rep_ctx == NULL)
+    if(rep_ctx == NULL || !rep_state.is_master) // only the master records
         return;
 
-    LOG(LOG_INFO, "%s", __func__);
+    ps = lock_pending_shard(data->daddr, data->dport, data->vrf);
 
-    // create a new tlv with the trailing data
-    tlv_data = calloc(1, sizeof(junos_sync_tlv_t) + sizeof(replication_data_t));
-    INSIST_ERR(tlv_data != NULL);
+    entry = get_pending_entry(ps->active, data->daddr, data->dport, data->vrf,
+            &found);
 
-    tlv_data->tlv_len = sizeof(replication_data_t);
-    current = (replication_data_t *)&tlv_data->tlv_value;
+    if(entry == NULL && msp_get_current_cpu() == main_cpu) { // full
+        // on the main thread, so sending now is fine
 
-    // populate data to enqueue
-    memcpy(current, data, sizeof(replication_data_t));
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
 
-    replication_data_hton(current);
+        flush_pending();
 
-    junos_sync_queue(rep_ctx, tlv_data, false);
+        ps = lock_pending_shard(data->daddr, data->dport, data->vrf);
+        entry = get_pending_entry(ps->active, data->daddr, data->dport,
+                data->vrf, &found);
+    }
+
+    if(entry == NULL) { // full
+        // dropped, but the flow's next update is sent in full
+        ++ps->overflow;
+
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
+        return;
+    }
+
+    if(!found || entry->type == RECORD_CANCELLED) {
+        entry->fresh = new_flow;
+    } else if(entry->type == REPLICATION_DELETE) {
+        // a delete is pending, so the slave still knows about this flow
+        entry->fresh = FALSE;
+    }
+
+    // the latest state wins
+    entry->type = REPLICATION_UPDATE;
+    memcpy(&entry->data.update, data, sizeof(replication_data_t));
+
+    // Release the lock of this shard's pending records
+    INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
 }
 
 
@@ -425,28 +1027,57 @@ update_replication_entry(replication_data_t * data)
 void
 delete_replication_entry(delete_replication_data_t * data)
 {
-    delete_replication_data_t * current;
-    junos_sync_tlv_t * tlv_data;
+    pending_shard_t * ps;
+    pending_entry_t * entry;
+    boolean found;
 
-    if(rep_ctx == NULL)
+    if(rep_ctx == NULL || !rep_state.is_master) // only the master records
         return;
 
-    LOG(LOG_INFO, "%s", __func__);
+    ps = lock_pending_shard(data->daddr, data->dport, data->vrf);
 
-    // create a new tlv with the trailing data
-    tlv_data = calloc(1, sizeof(junos_sync_tlv_t) +
-                            sizeof(delete_replication_data_t));
-    INSIST_ERR(tlv_data != NULL);
+    entry = get_pending_entry(ps->active, data->daddr, data->dport, data->vrf,
+            &found);
 
-    tlv_data->tlv_len = sizeof(delete_replication_data_t);
-    current = (delete_replication_data_t *)&tlv_data->tlv_value;
+    if(entry == NULL && msp_get_current_cpu() == main_cpu) { // full
+        // on the main thread, so sending now is fine
 
-    // populate data to enqueue
-    memcpy(current, data, sizeof(delete_replication_data_t));
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
 
-    delete_replication_data_hton(current);
+        flush_pending();
 
-    junos_sync_queue(rep_ctx, tlv_data, false);
+        ps = lock_pending_shard(data->daddr, data->dport, data->vrf);
+        entry = get_pending_entry(ps->active, data->daddr, data->dport,
+                data->vrf, &found);
+    }
+
+    if(entry == NULL) { // full
+        // dropped, so the slave ages the flow out itself
+        ++ps->overflow;
+
+        // Release the lock of this shard's pending records
+        INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
+        return;
+    }
+
+    if(found && entry->type == RECORD_CANCELLED) {
+        // the slave never heard of this flow, nothing to do
+    } else if(found && entry->type == REPLICATION_UPDATE && entry->fresh) {
+        // the slave never heard of this flow, so the add and delete cancel
+        // out, but the entry stays in the table to keep the key known
+        entry->type = RECORD_CANCELLED;
+        entry->data.delete.daddr = data->daddr;
+        entry->data.delete.dport = data->dport;
+        entry->data.delete.vrf = data->vrf;
+    } else {
+        entry->type = REPLICATION_DELETE;
+        entry->fresh = FALSE;
+        memcpy(&entry->data.delete, data, sizeof(delete_replication_data_t));
+    }
+
+    // Release the lock of this shard's pending records
+    INSIST_ERR(msp_spinlock_unlock(&ps->lock) == MSP_OK);
 }
 
 
@@ -456,6 +1087,8 @@ delete_replication_entry(delete_replication_data_t * data)
 void
 stop_replication(void)
 {
+    discard_pending();
+
     if(rep_ctx) {
         junos_sync_exit(rep_ctx);
     }
@@ -38,9 +38,10 @@
 typedef struct replication_data_s {
     
     // flow table and identifier info:
-    uint32_t  bucket;    ///< hashtable bucket number (HT BUCKET field)
+    uint32_t  bucket;    ///< hashtable home bucket number (HT BUCKET field)
     in_addr_t daddr;     ///< flow destination address (HT Key/Identifier field)
     uint16_t  dport;     ///< flow destination port (HT Key/Identifier field)
+    uint32_t  vrf;       ///< flow ingress VRF (HT Key/Identifier field)
     
     // general:
     time_t    age_ts;    ///< flow age timestamp
@@ -67,11 +68,48 @@ typedef struct delete_replication_data_s {
     // flow table and identifier info:
     uint16_t  dport;     ///< flow destination port (HT Key/Identifier field)
     in_addr_t daddr;     ///< flow destination address (HT Key/Identifier field)
-    uint32_t  bucket;    ///< hashtable bucket number (HT BUCKET field)
+    uint32_t  vrf;       ///< flow ingress VRF (HT Key/Identifier field)
+    uint32_t  bucket;    ///< hashtable home bucket number (HT BUCKET field)
 
 } delete_replication_data_t;
 
 
+/**
+ * Magic value starting a batch of replication records
+ */
+#define REPLICATION_BATCH_MAGIC 0x4D544231
+
+/**
+ * Types of records contained in a batch
+ */
+typedef enum {
+    REPLICATION_UPDATE = 1,   ///< replication_data_t record
+    REPLICATION_DELETE        ///< delete_replication_data_t record
+} replication_record_type_e;
+
+
+/**
+ * Header of each record contained in a batch of replication records
+ */
+typedef struct replication_record_s {
+    uint16_t  type;      ///< one of replication_record_type_e
+    uint16_t  len;       ///< length of this record (including header)
+    uint32_t  pad;       ///< keep record data 8-byte aligned
+    uint8_t   data[0];   ///< replication_data_t or delete_replication_data_t
+} replication_record_t;
+
+
+/**
+ * Batch of replication records, coalesced by flow, sent to the backup/slave
+ * in one TLV
+ */
+typedef struct replication_batch_s {
+    uint32_t  magic;     ///< REPLICATION_BATCH_MAGIC
+    uint32_t  count;     ///< number of records
+    uint8_t   records[0]; ///< replication_record_t records
+} replication_batch_t;
+
+
 /*** GLOBAL/EXTERNAL Functions ***/
 
 
@@ -96,9 +134,13 @@ init_replication(in_addr_t master_address, evContext ev_ctx);
  * 
  * @param[in] data
  *      The data to replicate to the slave
+ *
+ * @param[in] new_flow
+ *      Whether the flow has just been created, and so is not known
+ *      by the slave yet
  */
 void
-update_replication_entry(replication_data_t * data);
+update_replication_entry(replication_data_t * data, boolean new_flow);
 
 
 /**
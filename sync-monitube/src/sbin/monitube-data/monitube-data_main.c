@@ -936,6 +936,8 @@ monitube_quit(int signo __unused)
     
         stop_packet_loops(mainctx);
     
+        destroy_stat_rings(); // no data cpu can produce stats anymore
+    
         clear_config();
     
         destroy_packet_loops_oc();
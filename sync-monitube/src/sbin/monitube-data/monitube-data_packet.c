@@ -44,10 +44,14 @@
 
 #define FLOW_ENTRY_NAME "monitube flow entry" ///< entry o.c. name
 
-#define FLOW_AGE_CHECK_INTERVAL 15 ///< run aging routine interval in seconds
+#define OC_CLEANUP_INTERVAL 15 ///< run OC cleanup routine interval in seconds
+
+#define FLOW_DURATION 180 ///< age out flows idle for this many seconds
 
 #define RETRY_FDB_ATTACH_INTERVAL 3 ///< retry every 3 seconds for fdb attach
 
+#define LOOP_STATS_INTERVAL 60 ///< report data loop performance interval (s)
+
 #define MAX_MSP_SEND_RETRIES 100 ///< Max msp_data_send retries before panic
 
 /**
@@ -74,108 +78,1145 @@
 /**
  * The number of buckets, must be a power of 2, currently 2^20
  */
-#define FLOW_BUCKET_COUNT (1024 * 1024)
+#define FLOW_BUCKET_COUNT (1024 * 1024)
+
+/**
+ * The number of flow slots stored inline in each bucket. With a 4-byte lock,
+ * a 4-byte overflow counter, and 8-byte pointers this fills a cache line.
+ */
+#define FLOW_BUCKET_SLOTS 5
+
+/**
+ * The max number of buckets following a full home bucket that are probed
+ * (open addressing). The table has this many extra buckets at its end, so
+ * probing never wraps around (and bucket locks are always taken in ascending
+ * order)
+ */
+#define FLOW_MAX_PROBE 8
+
+/**
+ * The number of buckets allocated in the table including the probe overflow
+ */
+#define FLOW_BUCKET_TOTAL (FLOW_BUCKET_COUNT + FLOW_MAX_PROBE)
+
+/**
+ * The number of entries in the fragment cache, must be a power of 2
+ */
+#define FRAG_CACHE_COUNT (64 * 1024)
+
+/**
+ * The number of bits of time (seconds) each level of a timer wheel spans
+ */
+#define WHEEL_BITS 6
+
+/**
+ * The number of slots in each level of a timer wheel
+ */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+/**
+ * The mask to get a slot index in a timer wheel level
+ */
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/**
+ * The maximum time ahead of a timer wheel's current time a flow can be armed
+ * for (roughly an hour); later expiries are clamped and re-armed when due
+ */
+#define WHEEL_MAX_DELTA ((WHEEL_SLOTS - 1) * WHEEL_SLOTS - 1)
+
+/**
+ * The number of buckets in the index of flows by monitor, must be a power of 2
+ */
+#define MON_INDEX_COUNT 256
+
+/**
+ * The number of buckets in the index of flows by destination address,
+ * must be a power of 2
+ */
+#define ADDR_INDEX_COUNT (64 * 1024)
+
+/**
+ * The max number of packets a data loop dequeues and processes together
+ */
+#define PACKET_BURST 16
+
+/**
+ * Size of a cache line on the data cores
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Our mask defining the width of our hash function
+ */
+const uint32_t HASH_MASK = FLOW_BUCKET_COUNT - 1;
+
+/**
+ * Our mask defining the width of our fragment cache hash function
+ */
+const uint32_t FRAG_HASH_MASK = FRAG_CACHE_COUNT - 1;
+
+
+/*** Data Structures ***/
+
+/**
+ * flow entry information structure
+ */
+typedef struct flow_entry_s {
+    // flow information
+    msp_spinlock_t               lock;       ///< flow lock
+    time_t                       age_ts;     ///< flow age timestamp
+    in_addr_t                    daddr;      ///< dest IP address (HT KEY field)
+    uint16_t                     dport;      ///< dest port (HT KEY field)
+    uint16_t                     frag_group; ///< frag group (ID) of last 1st frag
+    uint32_t                     vrf;        ///< ingress VRF (HT KEY field)
+    uint32_t                     hash;       ///< hash of the KEY fields
+    char *                       mon;        ///< monitor name
+
+    // replication related:
+    time_t                       r_trigger;  ///< replication trigger time
+
+    // mirroring related:
+    in_addr_t                    maddr;      ///< mirror IP address
+    uint32_t                     m_vrf;      ///< mirror with outgoing VRF
+
+    // monitoring related:
+       // MDI media loss rate related:
+    uint32_t                     ssrc;       ///< current RTP source
+    source_t                     source;     ///< RTP state of last known packet
+    int32_t                      mdi_mlr;    ///< last observed MDI MLR
+       // MDI delay factor related:
+    uint32_t                     rate;       ///< drain rate of RTP payload
+    msp_hw_ts32_t                base_ts;    ///< timestamp (start of timeframe)
+    uint32_t                     pl_sum;     ///< payload bits seen in timeframe
+       // (VBs are scaled by the HW timestamp frequency, ts_freq)
+    uint64_t                     vb_pre;     ///< VB(pre) of last seen packet
+    uint64_t                     vb_post;    ///< VB(post) of last seen packet
+    uint64_t                     vb_min;     ///< min VB seen this timeframe
+    uint64_t                     vb_max;     ///< max VB seen this timeframe
+    double                       mdi_df;     ///< last observed MDI DF
+
+    // aging related (protected by the timer wheel's lock):
+    time_t                       expiry;     ///< time the flow's timer is due
+    struct timer_wheel_s *       wheel;      ///< timer wheel it is armed in
+    struct wheel_slot_s *        slot;       ///< wheel slot or NULL if due
+    boolean                      unlinked;   ///< removed while due
+    TAILQ_ENTRY(flow_entry_s)    timer;      ///< next and prev in wheel slot
+
+    // config index related (links protected by the index buckets' locks):
+    struct flow_index_s *        mon_idx;    ///< bucket in mon_index or NULL
+    TAILQ_ENTRY(flow_entry_s)    mon_entry;  ///< next and prev in mon_idx
+    struct flow_index_s *        addr_idx;   ///< bucket in addr_index or NULL
+    TAILQ_ENTRY(flow_entry_s)    addr_entry; ///< next and prev in addr_idx
+} flow_entry_t;
+
+
+/**
+ * A list of flows armed to expire in the same timer wheel slot as a tailq
+ */
+typedef TAILQ_HEAD(wheel_slot_s, flow_entry_s) wheel_slot_t;
+
+
+/**
+ * A hierarchical timer wheel with a one second tick used to age flows.
+ * There is one per data loop.
+ *
+ * Level 0 has a slot for each of the next WHEEL_SLOTS seconds. Level 1 has
+ * a slot for each of the next WHEEL_SLOTS spans of WHEEL_SLOTS seconds,
+ * which gets cascaded down into level 0 as the span comes up.
+ *
+ * Flows are armed once when they are created and re-armed lazily when their
+ * timer fires, only if they saw traffic since it was armed. The data path
+ * just updates the flow's age_ts. Thus the work done aging is proportional
+ * to the number of flows expiring rather than the size of the flows_table.
+ *
+ * Once armed, a flow stays on its timer wheel until the wheel frees it. Other
+ * functions removing a flow from the flows_table move it to the wheel's
+ * unlinked list, which the wheel frees at its next tick.
+ */
+typedef struct timer_wheel_s {
+    msp_spinlock_t  lock;                              ///< lock for this wheel
+    time_t          now;                               ///< time advanced to
+    wheel_slot_t    slots[2][WHEEL_SLOTS];             ///< armed flows
+    wheel_slot_t    unlinked;                          ///< flows to free
+} timer_wheel_t;
+
+
+/**
+ * A bucket of an index of the flows in the flows_table by some config they
+ * use, so that config changes only visit the flows they might affect.
+ *
+ * Flows are indexed, while their lock is held, when they are created (after
+ * their config is looked up) and unindexed when they are removed from the
+ * flows_table. The config (main) thread collects the keys of the flows it
+ * is after with the index bucket lock, and then looks them up in the
+ * flows_table, so that it never holds an index lock while getting a bucket
+ * or flow lock.
+ */
+typedef struct flow_index_s {
+    msp_spinlock_t                     lock;  ///< lock for this index bucket
+    TAILQ_HEAD(, flow_entry_s)         flows; ///< the indexed flows
+} flow_index_t;
+
+
+/**
+ * The KEY of a flow collected from an index
+ */
+typedef struct flow_key_s {
+    in_addr_t   daddr;    ///< dest IP address
+    uint16_t    dport;    ///< dest port
+    uint32_t    vrf;      ///< ingress VRF
+    uint32_t    hash;     ///< hash of the KEY fields
+    uint16_t    fp;       ///< fingerprint of the KEY fields
+} flow_key_t;
+
+
+/**
+ * Criteria used to select the flows affected by a config change
+ */
+typedef struct flow_filter_s {
+    char *      mon;       ///< monitor name, or NULL for any (or none)
+    boolean     monitored; ///< only flows with a monitor
+    boolean     mirrored;  ///< only flows with a mirror
+    in_addr_t   daddr;     ///< dest prefix
+    in_addr_t   mask;      ///< dest prefix mask (0 for any)
+} flow_filter_t;
+
+
+/**
+ * Performance counters of a data loop, only written by its own cpu
+ */
+typedef struct loop_stats_s {
+    uint64_t  packets;   ///< # packets processed
+    uint64_t  ticks;     ///< HW timestamp ticks spent processing them
+    uint64_t  flows;     ///< # flows created
+    uint64_t  full;      ///< # flows dropped for lack of a free table slot
+} __attribute__((aligned(CACHE_LINE_SIZE))) loop_stats_t;
+
+
+/**
+ * A packet dequeued in a burst by a data loop
+ */
+typedef struct burst_packet_s {
+    struct jbuf *  pkt_buf;  ///< the packet
+    uint32_t       vrf;      ///< its ingress VRF
+    uint32_t       hash;     ///< hash of its flow's KEY fields (if PKT_UDP)
+    uint16_t       fp;       ///< fingerprint of its flow's KEY (if PKT_UDP)
+    enum {
+        PKT_UDP,             ///< UDP with its header available
+        PKT_FRAGMENT,        ///< an IP fragment, but not the first fragment
+        PKT_SHORT            ///< UDP, but not enough bytes for its header
+    }              kind;     ///< how the packet is processed
+} burst_packet_t;
+
+
+/**
+ * A bucket in a hashtable_t
+ *
+ * Each bucket occupies one cache line. Along with the flow pointers, it keeps
+ * a fingerprint of each flow's KEY inline, so that looking up a flow only
+ * dereferences the flow entry that is very likely to match.
+ */
+typedef struct hash_bucket_s {
+    msp_spinlock_t  bucket_lock;             ///< lock for this bucket
+    atomic_uint_t   overflow;                ///< # flows homed here, but stored
+                                             ///< in one of the next buckets
+    uint16_t        fp[FLOW_BUCKET_SLOTS];   ///< fingerprints of slot's flows
+    flow_entry_t *  flow[FLOW_BUCKET_SLOTS]; ///< slots (NULL if empty)
+} __attribute__((aligned(CACHE_LINE_SIZE))) hash_bucket_t;
+
+
+/**
+ * An entry in the fragment cache used to find the flow of IP fragments
+ * (which have no UDP header) given the flow's first fragment
+ */
+typedef struct frag_entry_s {
+    msp_spinlock_t  lock;       ///< lock for this entry
+    in_addr_t       daddr;      ///< dest IP address (KEY field)
+    uint16_t        frag_group; ///< frag group (ID) (KEY field)
+    uint16_t        dport;      ///< flow's dest port
+    uint32_t        vrf;        ///< ingress VRF (KEY field)
+} frag_entry_t;
+
+
+/**
+ * A hashtable for the flows_table
+ *
+ * In hashtable the destination addr, destination port and ingress VRF are
+ * hashed for the KEY to lookup a home bucket. The table uses open addressing:
+ * a flow is stored in an empty slot of its home bucket, or if the home bucket
+ * is full, in an empty slot of one of the next FLOW_MAX_PROBE buckets. Within
+ * a bucket an input search KEY must match exactly with an existing entry's
+ * KEY, but the fingerprint is checked first to avoid touching other entries.
+ *
+ * Non-first IP fragments have no UDP header, so they are mapped back to
+ * the full KEY with the frag_cache which is keyed by destination address,
+ * frag group (IP ID), and ingress VRF.
+ *
+ * The hashtable value is the whole flow entry (in which the key info is also
+ * stored).
+ */
+typedef struct hashtable_s {
+    hash_bucket_t hash_bucket[FLOW_BUCKET_TOTAL]; ///<maps hashes to buckets
+    frag_entry_t  frag_cache[FRAG_CACHE_COUNT];   ///<maps fragments to flows
+} hashtable_t;
+
+
+static evTimerID        aging_timer;   ///< timer set to do aging and cleanup
+static evTimerID        retry_timer;   ///< timer set to do fdb attach retry
+static evTimerID        stats_timer;   ///< timer set to report loop stats
+static msp_shm_handle_t shm_handle;    ///< handle for shared memory allocator
+static msp_oc_handle_t  table_handle;  ///< handle for OC table allocator
+static msp_oc_handle_t  entry_handle;  ///< handle for OC table entry allocator
+static hashtable_t *    flows_table;   ///< pointer to the hashtable of flows
+static void *           flows_mem;     ///< OC memory holding the flows_table
+static atomic_uint_t    loops_running; ///< # of data loops running
+static volatile uint8_t fdb_connected; ///< T/F depending if attached to FDB
+static volatile uint8_t do_shutdown;   ///< do the data loops need to shutdown
+static uint32_t         obj_cache_id;  ///< ID for OC memory tracking
+static msp_fdb_handle_t fdb_handle;    ///< handle for FDB (forwarding DB)
+static timer_wheel_t    wheels[MSP_MAX_CPUS];    ///< timer wheels by data cpu
+static int              loop_cpus[MSP_MAX_CPUS]; ///< cpus running data loops
+static int              loop_count;              ///< # of cpus in loop_cpus
+static uint32_t         ts_freq;       ///< HW timestamp frequency (ticks/s)
+static flow_index_t     mon_index[MON_INDEX_COUNT];   ///< flows by monitor
+static flow_index_t     addr_index[ADDR_INDEX_COUNT]; ///< flows by daddr
+static flow_key_t *     index_keys;    ///< keys collected from the indexes
+static uint32_t         index_keys_size; ///< # of keys index_keys can hold
+static loop_stats_t     loop_stats[MSP_MAX_CPUS]; ///< stats by data cpu
+
+extern volatile boolean is_master; ///< mastership state of this data component
+
+
+/*** STATIC/INTERNAL Functions ***/
+
+
+/**
+ * Callback to periodically retry attaching to FDB. It stops being called
+ * once successfully attached.
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+retry_attach_fdb(evContext ctx,
+                 void * uap __unused,
+                 struct timespec due __unused,
+                 struct timespec inter __unused)
+{
+    int rc = msp_fdb_attach(NULL, &fdb_handle);
+
+    if(rc == MSP_EAGAIN) {
+        return; // will retry again later
+    } else if(rc != MSP_OK) {
+        LOG(LOG_ALERT, "%s: Failed to attach to the forwarding database. Check "
+                "that it is configured (Error code: %d)", __func__, rc);
+        // we will keep trying, but something is probably wrong
+    } else { // it succeeded
+        evClearTimer(ctx, retry_timer);
+        evInitID(&retry_timer);
+        LOG(LOG_INFO, "%s: Attached to FDB", __func__);
+        fdb_connected = 1;
+
+        // resolve the VRFs of any mirrors configured before attaching
+        update_mirror_vrfs();
+
+        // Once FDB is initialized it is safe to init SHM & OC
+        init_application();
+    }
+}
+
+
+/**
+ * Mix the bits of a 32-bit value (murmur3 finalizer)
+ *
+ * @param[in] h
+ *      The input value
+ *
+ * @return the mixed value
+ */
+static inline uint32_t
+mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+
+/**
+ * Get the hash of a flow's KEY fields
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] vrf
+ *      The ingress VRF
+ *
+ * @return the hash; its lower bits select the home bucket
+ */
+static inline uint32_t
+flow_hash(in_addr_t daddr, uint16_t dport, uint32_t vrf)
+{
+    return mix32(mix32(daddr ^ vrf) ^ dport);
+}
+
+
+/**
+ * Get the (non-zero) fingerprint of a flow's KEY fields. It is taken from a
+ * second hash of the KEY, since the bits of flow_hash not used by the bucket
+ * index are too few to tell the flows of one bucket apart.
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] vrf
+ *      The ingress VRF
+ *
+ * @return the fingerprint
+ */
+static inline uint16_t
+flow_fp(in_addr_t daddr, uint16_t dport, uint32_t vrf)
+{
+    uint16_t fp;
+
+    fp = mix32(mix32(daddr ^ 0x9E3779B9) ^ vrf ^
+               ((uint32_t)dport << 16)) >> 16;
+    return (fp != 0) ? fp : 1;
+}
+
+
+/**
+ * Get the fragment cache entry for a fragment's KEY fields
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] frag_group
+ *      The fragment group (IP ID)
+ *
+ * @param[in] vrf
+ *      The ingress VRF
+ *
+ * @return the fragment cache entry
+ */
+static inline frag_entry_t *
+frag_entry(in_addr_t daddr, uint16_t frag_group, uint32_t vrf)
+{
+    return &flows_table->frag_cache[
+                mix32(daddr ^ vrf ^ frag_group) & FRAG_HASH_MASK];
+}
+
+
+/**
+ * Find a flow entry in the flows_table. The home bucket of the flow
+ * (hash & HASH_MASK) must be locked by the caller.
+ *
+ * @param[in] hash
+ *      The hash of the KEY fields
+ *
+ * @param[in] daddr
+ *      The destination address
+ *
+ * @param[in] dport
+ *      The destination port
+ *
+ * @param[in] vrf
+ *      The ingress VRF
+ *
+ * @return the locked flow entry if found; otherwise NULL
+ */
+static flow_entry_t *
+find_flow(uint32_t hash, in_addr_t daddr, uint16_t dport, uint32_t vrf)
+{
+    hash_bucket_t * bucket, * home;
+    flow_entry_t * flow;
+    uint16_t fp = flow_fp(daddr, dport, vrf);
+    int i, s;
+
+    home = &flows_table->hash_bucket[hash & HASH_MASK];
+
+    for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+        flow = home->flow[s];
+        if(home->fp[s] == fp && flow != NULL && flow->daddr == daddr
+           && flow->dport == dport && flow->vrf == vrf) {
+
+            // Get the flow lock
+            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+            return flow;
+        }
+    }
+
+    if(home->overflow == 0) { // nothing homed here was stored elsewhere
+        return NULL;
+    }
+
+    for(i = 1; i <= FLOW_MAX_PROBE; ++i) {
+
+        bucket = home + i;
+
+        // Get the bucket lock (always in ascending order)
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+        for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+            flow = bucket->flow[s];
+            if(bucket->fp[s] == fp && flow != NULL && flow->daddr == daddr
+               && flow->dport == dport && flow->vrf == vrf) {
+
+                // Get the flow lock
+                INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return flow;
+            }
+        }
+
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Insert a flow entry into the flows_table. The home bucket of the flow
+ * (flow->hash & HASH_MASK) must be locked by the caller.
+ *
+ * @param[in] flow
+ *      The flow entry with its KEY fields and hash set
+ *
+ * @return SUCCESS if inserted; EFAIL if there was no free slot
+ */
+static status_t
+insert_flow(flow_entry_t * flow)
+{
+    hash_bucket_t * bucket, * home;
+    uint16_t fp = flow_fp(flow->daddr, flow->dport, flow->vrf);
+    int i, s;
+
+    home = &flows_table->hash_bucket[flow->hash & HASH_MASK];
+
+    for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+        if(home->flow[s] == NULL) {
+            home->fp[s] = fp;
+            home->flow[s] = flow;
+            return SUCCESS;
+        }
+    }
+
+    for(i = 1; i <= FLOW_MAX_PROBE; ++i) {
+
+        bucket = home + i;
+
+        // Get the bucket lock (always in ascending order)
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+        for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+            if(bucket->flow[s] == NULL) {
+                bucket->fp[s] = fp;
+                bucket->flow[s] = flow;
+                atomic_add_uint(1, &home->overflow);
+
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return SUCCESS;
+            }
+        }
+
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
+
+    return EFAIL;
+}
+
+
+/**
+ * Get the hash of a monitor name
+ *
+ * @param[in] name
+ *      The monitor name
+ *
+ * @return the hash
+ */
+static inline uint32_t
+name_hash(const char * name)
+{
+    uint32_t h = 2166136261U; // FNV-1a
+
+    while(*name != '\0') {
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+    }
+    return h;
+}
+
+
+/**
+ * Index a flow by its monitor and destination address, or re-index it if its
+ * monitor changed. The flow must be locked by the caller.
+ *
+ * @param[in] flow
+ *      The flow with its KEY fields and monitor set
+ */
+static void
+index_flow(flow_entry_t * flow)
+{
+    flow_index_t * idx = NULL;
+
+    if(flow->mon != NULL) {
+        idx = &mon_index[name_hash(flow->mon) & (MON_INDEX_COUNT - 1)];
+    }
+
+    if(idx != flow->mon_idx) {
+        if(flow->mon_idx != NULL) {
+            INSIST_ERR(msp_spinlock_lock(&flow->mon_idx->lock) == MSP_OK);
+            TAILQ_REMOVE(&flow->mon_idx->flows, flow, mon_entry);
+            INSIST_ERR(msp_spinlock_unlock(&flow->mon_idx->lock) == MSP_OK);
+        }
+        if(idx != NULL) {
+            INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+            TAILQ_INSERT_TAIL(&idx->flows, flow, mon_entry);
+            INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+        }
+        flow->mon_idx = idx;
+    }
+
+    if(flow->addr_idx == NULL) {
+        idx = &addr_index[mix32(flow->daddr) & (ADDR_INDEX_COUNT - 1)];
+
+        INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+        TAILQ_INSERT_TAIL(&idx->flows, flow, addr_entry);
+        INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+
+        flow->addr_idx = idx;
+    }
+}
+
+
+/**
+ * Remove a flow from the indexes. The flow must be locked by the caller.
+ *
+ * @param[in] flow
+ *      The flow
+ */
+static void
+unindex_flow(flow_entry_t * flow)
+{
+    if(flow->mon_idx != NULL) {
+        INSIST_ERR(msp_spinlock_lock(&flow->mon_idx->lock) == MSP_OK);
+        TAILQ_REMOVE(&flow->mon_idx->flows, flow, mon_entry);
+        INSIST_ERR(msp_spinlock_unlock(&flow->mon_idx->lock) == MSP_OK);
+        flow->mon_idx = NULL;
+    }
+
+    if(flow->addr_idx != NULL) {
+        INSIST_ERR(msp_spinlock_lock(&flow->addr_idx->lock) == MSP_OK);
+        TAILQ_REMOVE(&flow->addr_idx->flows, flow, addr_entry);
+        INSIST_ERR(msp_spinlock_unlock(&flow->addr_idx->lock) == MSP_OK);
+        flow->addr_idx = NULL;
+    }
+}
+
+
+/**
+ * Remove a flow entry from the slot of the bucket where it is stored, and
+ * from the indexes. The bucket and the flow must be locked by the caller.
+ *
+ * @param[in] bucket
+ *      The bucket where the flow is stored
+ *
+ * @param[in] slot
+ *      The slot of the bucket where the flow is stored
+ */
+static void
+remove_flow(hash_bucket_t * bucket, int slot)
+{
+    hash_bucket_t * home;
+
+    home = &flows_table->hash_bucket[bucket->flow[slot]->hash & HASH_MASK];
+
+    if(home != bucket) {
+        atomic_sub_uint(1, &home->overflow);
+    }
+
+    unindex_flow(bucket->flow[slot]);
+
+    bucket->flow[slot] = NULL;
+    bucket->fp[slot] = 0;
+}
+
+
+/**
+ * Leave a flow removed from the flows_table, but not by its timer wheel,
+ * for its timer wheel to free at its next tick. The flow must be locked by
+ * the caller.
+ *
+ * @param[in] flow
+ *      The flow
+ */
+static void
+release_flow(flow_entry_t * flow)
+{
+    timer_wheel_t * wheel = flow->wheel;
+
+    INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+
+    if(flow->slot != NULL) {
+        TAILQ_REMOVE(flow->slot, flow, timer);
+        TAILQ_INSERT_TAIL(&wheel->unlinked, flow, timer);
+        flow->slot = &wheel->unlinked;
+    } else {
+        // it is due, the wheel will free it or move it to its unlinked list
+        flow->unlinked = TRUE;
+    }
+
+    INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+}
+
+
+/**
+ * Check if a flow is selected by a filter
+ *
+ * @param[in] flow
+ *      The flow
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @return TRUE if the flow matches all the criteria; FALSE otherwise
+ */
+static boolean
+match_flow(flow_entry_t * flow, flow_filter_t * filter)
+{
+    if(filter->monitored && flow->mon == NULL) {
+        return FALSE;
+    }
+
+    if(filter->mon != NULL &&
+            (flow->mon == NULL || strcmp(flow->mon, filter->mon) != 0)) {
+        return FALSE;
+    }
+
+    if(filter->mirrored && flow->maddr == 0) {
+        return FALSE;
+    }
+
+    return (flow->daddr & filter->mask) == (filter->daddr & filter->mask);
+}
+
+
+/**
+ * Collect the KEYs of the flows in an index bucket matching a filter into
+ * index_keys. Only called by the main thread.
+ *
+ * @param[in] idx
+ *      The index bucket (of mon_index or addr_index)
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @return the number of keys collected
+ */
+static uint32_t
+collect_flows(flow_index_t * idx, flow_filter_t * filter)
+{
+    flow_entry_t * flow;
+    uint32_t count = 0;
+    boolean by_mon = (idx >= mon_index && idx < mon_index + MON_INDEX_COUNT);
+
+    // Get the index bucket lock
+    INSIST_ERR(msp_spinlock_lock(&idx->lock) == MSP_OK);
+
+    flow = TAILQ_FIRST(&idx->flows);
+
+    while(flow != NULL) {
+
+        // flows aren't freed while indexed, and their config fields only
+        // change in this thread
+
+        if(match_flow(flow, filter)) {
+            if(count == index_keys_size) {
+                index_keys_size = (index_keys_size == 0) ?
+                        1024 : index_keys_size * 2;
+                index_keys = realloc(index_keys,
+                        index_keys_size * sizeof(flow_key_t));
+                INSIST(index_keys != NULL);
+            }
+            index_keys[count].daddr = flow->daddr;
+            index_keys[count].dport = flow->dport;
+            index_keys[count].vrf = flow->vrf;
+            index_keys[count].hash = flow->hash;
+            index_keys[count].fp = flow_fp(flow->daddr, flow->dport,
+                    flow->vrf);
+            ++count;
+        }
+
+        flow = by_mon ? TAILQ_NEXT(flow, mon_entry)
+                      : TAILQ_NEXT(flow, addr_entry);
+    }
+
+    // Release the index bucket lock
+    INSIST_ERR(msp_spinlock_unlock(&idx->lock) == MSP_OK);
+
+    return count;
+}
+
+
+/**
+ * Remove or redirect the flows in an index bucket matching a filter, and
+ * notify the slave
+ *
+ * @param[in] idx
+ *      The index bucket (of mon_index or addr_index)
+ *
+ * @param[in] filter
+ *      The criteria
+ *
+ * @param[in] to
+ *      The new mirror to address if redirecting; 0 to remove the flows
+ *
+ * @param[in] vrf
+ *      The new mirror VRF if redirecting
+ */
+static void
+clean_indexed_flows(flow_index_t * idx,
+                    flow_filter_t * filter,
+                    in_addr_t to,
+                    uint32_t vrf)
+{
+    uint32_t count, k, i;
+    int s;
+    hash_bucket_t * bucket;
+    flow_entry_t * flow;
+    flow_key_t * key;
+    delete_replication_data_t data;
+    replication_data_t rdata;
+
+    count = collect_flows(idx, filter);
+
+    for(k = 0; k < count; ++k) {
+
+        key = &index_keys[k];
+
+        // look in the home bucket and the ones it may have overflowed into
+
+        for(i = 0; i <= FLOW_MAX_PROBE; ++i) {
+
+            bucket = &flows_table->hash_bucket[(key->hash & HASH_MASK) + i];
+
+            // Get the bucket lock
+            INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+            for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+                flow = bucket->flow[s];
+                if(flow != NULL && bucket->fp[s] == key->fp
+                   && flow->daddr == key->daddr && flow->dport == key->dport
+                   && flow->vrf == key->vrf) {
+                    break;
+                }
+            }
+
+            if(s == FLOW_BUCKET_SLOTS) {
+                // Release the bucket lock
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                continue;
+            }
+
+            // Get the flow lock
+            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+
+            if(match_flow(flow, filter)) { // check it again now it's locked
+
+                if(to != 0) {
+                    flow->maddr = to; // update
+                    flow->m_vrf = vrf;
+
+                    // notify slave
+                    rdata.bucket = flow->hash & HASH_MASK;
+                    rdata.daddr = flow->daddr;
+                    rdata.dport = flow->dport;
+                    rdata.vrf = flow->vrf;
+                    rdata.maddr = flow->maddr; // new
+                    rdata.m_vrf = flow->m_vrf; // new
+                    rdata.age_ts = flow->age_ts;
+                    rdata.ssrc = flow->ssrc;
+                    memcpy(&rdata.source, &flow->source, sizeof(source_t));
+                    rdata.rate = flow->rate;
+                    if(flow->mon != NULL) {
+                        strncpy(rdata.mon, flow->mon, MAX_MON_NAME_LEN);
+                    } else {
+                        rdata.mon[0] = '\0';
+                    }
+
+                    update_replication_entry(&rdata, FALSE);
+                } else {
+                    // notify slave
+                    data.bucket = flow->hash & HASH_MASK;
+                    data.daddr = flow->daddr;
+                    data.dport = flow->dport;
+                    data.vrf = flow->vrf;
+                    delete_replication_entry(&data);
+
+                    remove_flow(bucket, s);
+                    release_flow(flow);
+                }
+            }
+
+            // Release the flow lock (if removed, its timer wheel frees it)
+            INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
+
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+            break;
+        }
+    }
+}
+
+
+/**
+ * Arm a flow's timer in a timer wheel. The wheel must be locked by the caller.
+ *
+ * @param[in] wheel
+ *      The timer wheel
+ *
+ * @param[in] flow
+ *      The flow with its expiry set
+ */
+static void
+arm_flow_timer(timer_wheel_t * wheel, flow_entry_t * flow)
+{
+    flow->wheel = wheel;
+
+    if(flow->unlinked) { // removed from the flows_table while it was due
+        TAILQ_INSERT_TAIL(&wheel->unlinked, flow, timer);
+        flow->slot = &wheel->unlinked;
+        return;
+    }
+
+    if(flow->expiry <= wheel->now) {
+        flow->expiry = wheel->now + 1; // fire at the next tick
+    } else if(flow->expiry - wheel->now > WHEEL_MAX_DELTA) {
+        flow->expiry = wheel->now + WHEEL_MAX_DELTA;
+    }
+
+    if(flow->expiry - wheel->now < WHEEL_SLOTS) {
+        flow->slot = &wheel->slots[0][flow->expiry & WHEEL_MASK];
+    } else {
+        flow->slot =
+                &wheel->slots[1][(flow->expiry >> WHEEL_BITS) & WHEEL_MASK];
+    }
+
+    TAILQ_INSERT_TAIL(flow->slot, flow, timer);
+}
+
+
+/**
+ * Expire a flow whose timer is due if it hasn't seen traffic since the timer
+ * was armed, otherwise leave it to be re-armed
+ *
+ * @param[in] flow
+ *      The flow whose timer is due (no longer in a wheel slot)
+ *
+ * @param[in] now
+ *      The current time of the wheel
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
+ *
+ * @return TRUE if the flow was freed; FALSE if it needs to be re-armed
+ */
+static boolean
+expire_flow(flow_entry_t * flow, time_t now, int cpu)
+{
+    uint32_t i;
+    int s;
+    hash_bucket_t * bucket;
+    delete_replication_data_t data;
+
+    // find the flow in the bucket it is stored in (it never moves)
+
+    for(i = 0; i <= FLOW_MAX_PROBE; ++i) {
+
+        bucket = &flows_table->hash_bucket[(flow->hash & HASH_MASK) + i];
+
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+        for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+            if(bucket->flow[s] == flow) {
+                break;
+            }
+        }
+
+        if(s < FLOW_BUCKET_SLOTS) {
+
+            // Get the flow lock
+            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+
+            if(flow->age_ts + FLOW_DURATION > now) { // not expired
+                flow->expiry = flow->age_ts + FLOW_DURATION;
+
+                // Release the flow and bucket locks
+                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return FALSE;
+            }
+
+            // notify slave
+            data.bucket = flow->hash & HASH_MASK;
+            data.daddr = flow->daddr;
+            data.dport = flow->dport;
+            data.vrf = flow->vrf;
+            delete_replication_entry(&data);
+
+            remove_flow(bucket, s);
+            msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+            return TRUE;
+        }
+
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
+
+    // It was already removed from the table, but left for us to free.
+    // Get the flow lock in case the remover is still releasing it.
+    INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+    msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+    return TRUE;
+}
+
+
+/**
+ * Free the flows left on a data loop's timer wheel after being removed from
+ * the flows_table
+ *
+ * @param[in] wheel
+ *      The timer wheel of the data loop
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
+ */
+static void
+free_unlinked_flows(timer_wheel_t * wheel, int cpu)
+{
+    wheel_slot_t unlinked;
+    flow_entry_t * flow;
 
-/**
- * Our mask defining the width of our hash function
- */
-const uint32_t HASH_MASK = FLOW_BUCKET_COUNT - 1;
+    TAILQ_INIT(&unlinked);
 
+    INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+    TAILQ_CONCAT(&unlinked, &wheel->unlinked, timer);
+    INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+
+    while((flow = TAILQ_FIRST(&unlinked)) != NULL) {
+        TAILQ_REMOVE(&unlinked, flow, timer);
+
+        // Get the flow lock in case the remover is still releasing it
+        INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+        msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+    }
+}
 
-/*** Data Structures ***/
 
 /**
- * flow entry information structure
+ * Advance a data loop's timer wheel up to the current time, freeing the
+ * flows unlinked from it, and age out the flows that are due
+ *
+ * @param[in] wheel
+ *      The timer wheel of the data loop
+ *
+ * @param[in] cpu
+ *      The current cpu of the caller (used for object cache free calls)
  */
-typedef struct flow_entry_s {
-    // flow information
-    msp_spinlock_t               lock;       ///< flow lock
-    time_t                       age_ts;     ///< flow age timestamp
-    in_addr_t                    daddr;      ///< dest IP address (HT KEY field)
-    uint16_t                     dport;      ///< dest port (HT KEY field)
-    uint16_t                     frag_group; ///< frag group (ID) (HT KEY field)
-    char *                       mon;        ///< monitor name
+static void
+advance_timer_wheel(timer_wheel_t * wheel, int cpu)
+{
+    time_t current_time = get_current_time();
+    wheel_slot_t due, rearm;
+    flow_entry_t * flow;
 
-    // replication related:
-    time_t                       r_trigger;  ///< replication trigger time
+    free_unlinked_flows(wheel, cpu);
 
-    // mirroring related:
-    in_addr_t                    maddr;      ///< mirror IP address
-    uint32_t                     m_vrf;      ///< mirror with outgoing VRF
+    while(wheel->now < current_time) {
 
-    // monitoring related:
-       // MDI media loss rate related:
-    uint32_t                     ssrc;       ///< current RTP source
-    source_t                     source;     ///< RTP state of last known packet
-    int32_t                      mdi_mlr;    ///< last observed MDI MLR
-       // MDI delay factor related:
-    uint32_t                     rate;       ///< drain rate of RTP payload
-    msp_hw_ts32_t                base_ts;    ///< timestamp (start of timeframe)
-    uint32_t                     pl_sum;     ///< payload bits seen in timeframe
-    double                       vb_pre;     ///< VB(pre) of last seen packet
-    double                       vb_post;    ///< VB(post) of last seen packet
-    double                       vb_min;     ///< min VB seen this timeframe
-    double                       vb_max;     ///< max VB seen this timeframe
-    double                       mdi_df;     ///< last observed MDI DF
+        TAILQ_INIT(&due);
+        TAILQ_INIT(&rearm);
 
-    // for list at this hash bucket:
-    TAILQ_ENTRY(flow_entry_s)    entries;    ///< next and prev list entries
-} flow_entry_t;
+        INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
 
+        ++wheel->now;
 
-/**
- * A list/set of servers type as a tailq
- */
-typedef TAILQ_HEAD(ht_bucket_list_s, flow_entry_s) ht_bucket_list_t;
+        if((wheel->now & WHEEL_MASK) == 0) {
+            // cascade the next span from level 1 down into level 0
+            TAILQ_CONCAT(&rearm,
+               &wheel->slots[1][(wheel->now >> WHEEL_BITS) & WHEEL_MASK], timer);
 
+            while((flow = TAILQ_FIRST(&rearm)) != NULL) {
+                TAILQ_REMOVE(&rearm, flow, timer);
+                arm_flow_timer(wheel, flow);
+            }
+        }
 
-/**
- * A bucket in a hashtable_t
- */
-typedef struct hash_bucket_s {
-    msp_spinlock_t        bucket_lock;    ///< lock for this bucket
-    ht_bucket_list_t      bucket_entries; ///< list of entries in bucket
-} hash_bucket_t;
+        TAILQ_CONCAT(&due, &wheel->slots[0][wheel->now & WHEEL_MASK], timer);
 
+        TAILQ_FOREACH(flow, &due, timer) {
+            flow->slot = NULL; // removers now leave them to expire_flow
+        }
 
-/**
- * A hashtable for the flows_table
- *
- * In hashtable the destination addr is hashed for the KEY to lookup a bucket
- * within the bucket list an input search KEY must match exactly with an
- * existing entry's KEY which is its dest addr + (port or frag_group)
- * We use the destination port for whole IP packets and the frag_group for IP
- * fragments.
- *
- * The hashtable value is the whole flow entry (in which the key info is also
- * stored).
- */
-typedef struct hashtable_s {
-    hash_bucket_t hash_bucket[FLOW_BUCKET_COUNT]; ///<maps hashes to buckets
-} hashtable_t;
+        INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
 
+        while((flow = TAILQ_FIRST(&due)) != NULL) {
+            TAILQ_REMOVE(&due, flow, timer);
 
-static evTimerID        aging_timer;   ///< timer set to do aging and cleanup
-static evTimerID        retry_timer;   ///< timer set to do fdb attach retry
-static msp_shm_handle_t shm_handle;    ///< handle for shared memory allocator
-static msp_oc_handle_t  table_handle;  ///< handle for OC table allocator
-static msp_oc_handle_t  entry_handle;  ///< handle for OC table entry allocator
-static hashtable_t *    flows_table;   ///< pointer to the hashtable of flows
-static atomic_uint_t    loops_running; ///< # of data loops running
-static volatile uint8_t fdb_connected; ///< T/F depending if attached to FDB
-static volatile uint8_t do_shutdown;   ///< do the data loops need to shutdown
-static uint32_t         obj_cache_id;  ///< ID for OC memory tracking
-static msp_fdb_handle_t fdb_handle;    ///< handle for FDB (forwarding DB)
+            if(!expire_flow(flow, wheel->now, cpu)) {
+                TAILQ_INSERT_TAIL(&rearm, flow, timer);
+            }
+        }
 
-extern volatile boolean is_master; ///< mastership state of this data component
+        if(!TAILQ_EMPTY(&rearm)) {
+            INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
 
+            while((flow = TAILQ_FIRST(&rearm)) != NULL) {
+                TAILQ_REMOVE(&rearm, flow, timer);
+                arm_flow_timer(wheel, flow);
+            }
 
-/*** STATIC/INTERNAL Functions ***/
+            INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+        }
+    }
+}
 
 
 /**
- * Callback to periodically retry attaching to FDB. It stops being called
- * once successfully attached.
+ * Callback to periodically cleanup shared memory. Flows are aged out by the
+ * data loops' timer wheels.
  *
  * @param[in] ctx
  *     The event context for this application
@@ -190,34 +1231,19 @@ extern volatile boolean is_master; ///< mastership state of this data component
  *     The period; when this will next be called
  */
 static void
-retry_attach_fdb(evContext ctx,
-                 void * uap __unused,
-                 struct timespec due __unused,
-                 struct timespec inter __unused)
+aging_cleanup(evContext ctx __unused,
+              void * uap __unused,
+              struct timespec due __unused,
+              struct timespec inter __unused)
 {
-    int rc = msp_fdb_attach(NULL, &fdb_handle);
-
-    if(rc == MSP_EAGAIN) {
-        return; // will retry again later
-    } else if(rc != MSP_OK) {
-        LOG(LOG_ALERT, "%s: Failed to attach to the forwarding database. Check "
-                "that it is configured (Error code: %d)", __func__, rc);
-        // we will keep trying, but something is probably wrong
-    } else { // it succeeded
-        evClearTimer(ctx, retry_timer);
-        evInitID(&retry_timer);
-        LOG(LOG_INFO, "%s: Attached to FDB", __func__);
-        fdb_connected = 1;
-
-        // Once FDB is initialized it is safe to init SHM & OC
-        init_application();
-    }
+    msp_objcache_reclaim(shm_handle);
 }
 
 
 /**
- * Callback to periodically age out entries in our flows_table and
- * cleanup shared memory
+ * Callback to periodically log the performance of the data loops over the
+ * last interval: packet rate, processing time per packet, and flow setup rate,
+ * as well as the flows that could not be set up because the table was full
  *
  * @param[in] ctx
  *     The event context for this application
@@ -232,61 +1258,45 @@ retry_attach_fdb(evContext ctx,
  *     The period; when this will next be called
  */
 static void
-aging_cleanup(evContext ctx __unused,
-              void * uap __unused,
-              struct timespec due __unused,
-              struct timespec inter __unused)
+report_loop_stats(evContext ctx __unused,
+                  void * uap __unused,
+                  struct timespec due __unused,
+                  struct timespec inter __unused)
 {
-    const time_t flow_duration = 180;
-
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    time_t current_time, flow_timeout;
-    delete_replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-    current_time = get_current_time();
-    flow_timeout = current_time - flow_duration;
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    static uint64_t last_packets, last_ticks, last_flows, last_full;
+    uint64_t packets = 0, ticks = 0, flows = 0, full = 0, ns_per_packet = 0;
+    int i;
 
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
+    // the counters may be a bit stale, but it doesn't matter
 
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+    for(i = 0; i < loop_count; ++i) {
+        packets += loop_stats[loop_cpus[i]].packets;
+        ticks += loop_stats[loop_cpus[i]].ticks;
+        flows += loop_stats[loop_cpus[i]].flows;
+        full += loop_stats[loop_cpus[i]].full;
+    }
 
-            if(flow->age_ts < flow_timeout) { // check for timeout/expiry
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
+    if(packets != last_packets && ts_freq != 0) {
+        ns_per_packet = ((ticks - last_ticks) * 1000000000ULL / ts_freq)
+                            / (packets - last_packets);
+    }
 
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-            }
-            flow = next;
-        }
+    LOG(LOG_INFO, "%s: %d loops processed %llu packets/s taking %llu ns per "
+            "packet (per loop), and set up %llu flows/s", __func__, loop_count,
+            (unsigned long long)(packets - last_packets) / LOOP_STATS_INTERVAL,
+            (unsigned long long)ns_per_packet,
+            (unsigned long long)(flows - last_flows) / LOOP_STATS_INTERVAL);
 
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    if(full != last_full) {
+        LOG(LOG_WARNING, "%s: %llu new flows were dropped since the flow "
+                "table had no free slot for them", __func__,
+                (unsigned long long)(full - last_full));
     }
 
-    msp_objcache_reclaim(shm_handle);
+    last_packets = packets;
+    last_ticks = ticks;
+    last_flows = flows;
+    last_full = full;
 }
 
 
@@ -399,29 +1409,20 @@ update_stats_for_flow(void * data,
 {
     rtp_hdr_t * rh = NULL;
     int pl_len;
-    double rel_time, tmp;
+    uint32_t rel_time;
+    uint64_t drained, sum;
     msp_hw_ts32_t now = msp_hw_ts32_read();
 
-    // find rcv'd time relative to base_ts but in seconds w/ 0.0001 precision
-    if(flow->base_ts < now) { // hasn't wrapped around yet
-
-        rel_time = (double)msp_hw_ts32_diff(now, flow->base_ts)
-                        / msp_hw_ts32_frequency();
-
-    } else if(flow->base_ts > now) { // wrapped around
-
-        rel_time = (double)(msp_hw_ts32_diff(now, flow->base_ts) + 1 + UINT_MAX)
-                        / msp_hw_ts32_frequency();
-    } else {
-        rel_time = 0.000001; // shouldn't happen
-    }
+    // find rcv'd time relative to base_ts in HW timestamp ticks
+    // (unsigned arithmetic takes care of the timestamp wrapping around)
+    rel_time = (uint32_t)(now - flow->base_ts);
 
     // Check if we are into the next timeframe (base + 1 sec)
-    if(rel_time > 1.0) {
+    if(rel_time > ts_freq) {
 
         // reset the timeframe start to the next second
-        flow->base_ts += msp_hw_ts32_frequency();
-        rel_time -= 1.0; // in next interval
+        flow->base_ts += ts_freq;
+        rel_time -= ts_freq; // in next interval
 
         // Check if we are updating the MLR yet
 
@@ -442,8 +1443,10 @@ update_stats_for_flow(void * data,
         // lost this interval:
         flow->mdi_mlr = expected_interval - received_interval;
 
-        // Calculate the DF, store and save
-        flow->mdi_df = (flow->vb_max - flow->vb_min) / (double)flow->rate;
+        // Calculate the DF, store and save (the only division, once per
+        // timeframe, to remove the ts_freq scale and get seconds)
+        flow->mdi_df = (double)(flow->vb_max - flow->vb_min)
+                        / ((double)flow->rate * ts_freq);
 
         /*
          * Really we don't need to save the mdi_df, but we do here anyway
@@ -458,10 +1461,10 @@ update_stats_for_flow(void * data,
         }
 
         flow->pl_sum = 0;
-        flow->vb_max = 0.0;
-        flow->vb_min = 0.0;
-        flow->vb_pre = 0.0;
-        flow->vb_post = 0.0;
+        flow->vb_max = 0;
+        flow->vb_min = 0;
+        flow->vb_pre = 0;
+        flow->vb_post = 0;
     }
 
     // Update information related to the MDI DF
@@ -519,16 +1522,19 @@ update_stats_for_flow(void * data,
     }
 
     // ... Continue updating information related to the MDI DF
+    // All VBs are scaled by ts_freq, so that we avoid a division here:
+    // the bits drained since base_ts are rate * rel_time / ts_freq
 
-    tmp = (double)flow->rate * rel_time;
+    drained = (uint64_t)flow->rate * rel_time;
+    sum = (uint64_t)flow->pl_sum * ts_freq;
 
-    if((double)flow->pl_sum > tmp) { // want a positive/abs value
-        flow->vb_pre = (double)flow->pl_sum - tmp;
+    if(sum > drained) { // want a positive/abs value
+        flow->vb_pre = sum - drained;
     } else {
-        flow->vb_pre = tmp - (double)flow->pl_sum;
+        flow->vb_pre = drained - sum;
     }
 
-    flow->vb_post = flow->vb_pre + pl_len;
+    flow->vb_post = flow->vb_pre + (uint64_t)pl_len * ts_freq;
     flow->pl_sum += (pl_len << 3); // need bits not bytes *8 = <<3
 
     if(flow->vb_max == 0 && flow->vb_min == 0) {
@@ -578,12 +1584,15 @@ set_vrf(msp_fdb_rt_info_t * route_info, void * ctxt)
  * @param[in] pkt_buf
  *      The received jbuf for this packet
  *
- * @param[in] length
- *      The IP packet length
- *
  * @param[in] cpu
  *      The current cpu of the caller (used for object cache alloc calls)
  *
+ * @param[in] hash
+ *      The hash of the flow's KEY fields (see flow_hash)
+ *
+ * @param[in] vrf
+ *      The ingress VRF
+ *
  * @param[out] mirror
  *      Should the packet be sent out (set to 1) or just monitored (unchanged)
  *
@@ -595,19 +1604,20 @@ set_vrf(msp_fdb_rt_info_t * route_info, void * ctxt)
 static status_t
 process_packet(struct jbuf * pkt_buf,
                int cpu,
+               uint32_t hash,
+               uint32_t vrf,
                uint8_t * mirror,
                uint32_t * mirror_vrf)
 {
-    register uint32_t hash;
-    uint16_t * key;
     hash_bucket_t * bucket;
     flow_entry_t * flow;
-    struct in_addr tmp;
+    frag_entry_t * frag;
     uint16_t jb_length = jbuf_total_len(pkt_buf);
     struct ip * ip_pkt = jbuf_to_d(pkt_buf, struct ip *);
     struct udphdr * udp_hdr =
         (struct udphdr *)((uint32_t *)ip_pkt + ip_pkt->ip_hl);
     replication_data_t data;
+    boolean is_new = FALSE;
 
     if(jb_length != ip_pkt->ip_len) {
         LOG(LOG_EMERG, "%s: Jbuf does not contain entire packet",
@@ -615,34 +1625,14 @@ process_packet(struct jbuf * pkt_buf,
         return EFAIL;
     }
 
-    // get hash of the just the destination address
-    // hash input key is 32 bits; hash output is FLOW_BUCKET_COUNT bits
-    // Could also hash the dest port but it makes dealing with fragments harder
-
-    key = (uint16_t *)&ip_pkt->ip_dst;
-    hash = 0x5F5F;
-    hash = ((hash << 5) + hash) ^ key[0];
-    hash = ((hash << 5) + hash) ^ key[1];
-
-    hash &= HASH_MASK; // trim to output width
-
     // use hash to lookup a hash bucket and find the matching entry
 
-    bucket = &flows_table->hash_bucket[hash]; // get bucket
+    bucket = &flows_table->hash_bucket[hash & HASH_MASK]; // get home bucket
 
     // Get the bucket lock
     INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
 
-    flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-    while(flow != NULL) {
-        if(flow->daddr == ip_pkt->ip_dst.s_addr
-           && flow->dport == udp_hdr->uh_dport) {
-
-            break; // match
-        }
-        flow = TAILQ_NEXT(flow, entries);
-    }
+    flow = find_flow(hash, ip_pkt->ip_dst.s_addr, udp_hdr->uh_dport, vrf);
 
     // if there's no matching flow, then create one... the slow path
     if(flow == NULL) {
@@ -663,10 +1653,27 @@ process_packet(struct jbuf * pkt_buf,
         msp_spinlock_init(&flow->lock);
         INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
 
-        TAILQ_INSERT_HEAD(&bucket->bucket_entries, flow, entries);
-
         flow->daddr = ip_pkt->ip_dst.s_addr;
         flow->dport = udp_hdr->uh_dport;
+        flow->vrf = vrf;
+        flow->hash = hash;
+        flow->mon = NULL;
+        flow->mon_idx = NULL;
+        flow->addr_idx = NULL;
+        flow->unlinked = FALSE;
+
+        if(insert_flow(flow) != SUCCESS) {
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+
+            msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+
+            ++loop_stats[cpu].full;
+
+            LOG(LOG_ERR, "%s: Failed to find a free slot in the flow table "
+                    "for a flow to %s", __func__, inet_ntoa(ip_pkt->ip_dst));
+            return EFAIL;
+        }
 
         // Release the bucket lock
         INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
@@ -684,35 +1691,34 @@ process_packet(struct jbuf * pkt_buf,
             flow->base_ts = msp_hw_ts32_read();
             bzero(&flow->source, sizeof(source_t));
             flow->pl_sum = 0;
-            flow->vb_max = 0.0;
-            flow->vb_min = 0.0;
-            flow->vb_pre = 0.0;
-            flow->vb_post = 0.0;
+            flow->vb_max = 0;
+            flow->vb_min = 0;
+            flow->vb_pre = 0;
+            flow->vb_post = 0;
         } else {
             LOG(LOG_INFO, "%s: NOT Monitoring new flow to %s",
                     __func__, inet_ntoa(ip_pkt->ip_dst));
         }
 
-        flow->maddr = get_mirror(flow->daddr);
-
-        if(flow->maddr != 0) {
-            flow->m_vrf = 0;
-            // look up VRF in FDB
-            if(msp_fdb_get_all_route_records(fdb_handle, PROTO_IPV4,
-                    set_vrf, &flow->m_vrf) != MSP_OK) {
+        // the mirror's VRF is resolved ahead of time with the mirror config
+        flow->maddr = get_mirror(flow->daddr, &flow->m_vrf);
 
-                tmp.s_addr = flow->maddr;
-                LOG(LOG_ERR, "%s: Did not successfully lookup a VRF "
-                        "for mirrored site %s", __func__, inet_ntoa(tmp));
-            }
-        }
+        // index it before any config change (using the old config) can look
+        // for it, i.e. before this data loop's next quiescent state
+        index_flow(flow);
 
         flow->r_trigger = get_current_time(); // flag to replicate asap
+        is_new = TRUE;
+        ++loop_stats[cpu].flows;
 
-    } else {
-        // Get the flow lock
-        INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+        // arm the flow's aging timer in this data loop's timer wheel
+        flow->expiry = get_current_time() + FLOW_DURATION;
 
+        INSIST_ERR(msp_spinlock_lock(&wheels[cpu].lock) == MSP_OK);
+        arm_flow_timer(&wheels[cpu], flow);
+        INSIST_ERR(msp_spinlock_unlock(&wheels[cpu].lock) == MSP_OK);
+
+    } else {
         // Release the bucket lock
         INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
     }
@@ -722,9 +1728,19 @@ process_packet(struct jbuf * pkt_buf,
 
     flow->age_ts = get_current_time();
 
-    // If it is the first fragment note the frag ID
+    // If it is the first fragment note the frag ID, so the next fragments
+    // (without the UDP header) can be mapped back to this flow
     if((ntohs(ip_pkt->ip_off) & IP_MF)) {
         flow->frag_group = ip_pkt->ip_id;
+
+        frag = frag_entry(flow->daddr, flow->frag_group, vrf);
+
+        INSIST_ERR(msp_spinlock_lock(&frag->lock) == MSP_OK);
+        frag->daddr = flow->daddr;
+        frag->frag_group = flow->frag_group;
+        frag->dport = flow->dport;
+        frag->vrf = vrf;
+        INSIST_ERR(msp_spinlock_unlock(&frag->lock) == MSP_OK);
     } else {
         flow->frag_group = 0;
     }
@@ -769,9 +1785,10 @@ process_packet(struct jbuf * pkt_buf,
     if(flow->r_trigger <= get_current_time()) { // is it time to replicate ?
 
         // notify slave
-        data.bucket = hash;
+        data.bucket = hash & HASH_MASK;
         data.daddr = flow->daddr;
         data.dport = flow->dport;
+        data.vrf = flow->vrf;
         data.age_ts = flow->age_ts;
         data.rate = flow->rate;
         data.maddr = flow->maddr;
@@ -784,7 +1801,7 @@ process_packet(struct jbuf * pkt_buf,
             data.mon[0] = '\0';
         }
 
-        update_replication_entry(&data);
+        update_replication_entry(&data, is_new);
         flow->r_trigger += get_replication_interval();
     }
 
@@ -806,6 +1823,9 @@ process_packet(struct jbuf * pkt_buf,
  * @param[in] jb_length
  *      The length of the received packet
  *
+ * @param[in] vrf
+ *      The ingress VRF of the packet
+ *
  * @param[out] mirror
  *      Should the packet be sent out (set to 1) or just monitored (unchanged)
  *
@@ -817,53 +1837,63 @@ process_packet(struct jbuf * pkt_buf,
 static status_t
 process_fragment(struct ip * ip_pkt,
                  uint16_t jb_length,
+                 uint32_t vrf,
                  uint8_t * mirror,
                  uint32_t * mirror_vrf)
 {
     register uint32_t hash;
-    uint16_t * key;
+    uint16_t dport = 0;
     hash_bucket_t * bucket;
-    flow_entry_t * flow;
+    flow_entry_t * flow = NULL;
+    frag_entry_t * frag;
+    boolean found = FALSE;
 
     if(jb_length != ip_pkt->ip_len) {
         LOG(LOG_WARNING, "%s: Jbuf does not contain entire packet",
                 __func__);
     }
 
-    // get hash of the just the destination address
-    // hash input key is 32 bits; hash output is FLOW_BUCKET_COUNT bits
-    // Could also hash the dest port but it makes dealing with fragments harder
+    // map the fragment back to the dest port of its flow (from the first
+    // fragment) since there's no UDP header in this one
 
-    key = (uint16_t *)&ip_pkt->ip_dst;
-    hash = 0x5F5F;
-    hash = ((hash << 5) + hash) ^ key[0];
-    hash = ((hash << 5) + hash) ^ key[1];
+    frag = frag_entry(ip_pkt->ip_dst.s_addr, ip_pkt->ip_id, vrf);
 
-    hash &= HASH_MASK; // trim to output width
+    INSIST_ERR(msp_spinlock_lock(&frag->lock) == MSP_OK);
 
-    // use hash to lookup a hash bucket and find the matching entry
+    if(frag->daddr == ip_pkt->ip_dst.s_addr
+       && frag->frag_group == ip_pkt->ip_id && frag->vrf == vrf) {
+
+        dport = frag->dport;
+        found = TRUE;
+    }
 
-    bucket = &flows_table->hash_bucket[hash]; // get bucket
+    INSIST_ERR(msp_spinlock_unlock(&frag->lock) == MSP_OK);
 
-    // Get the bucket lock
-    INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    if(found) {
 
-    flow = TAILQ_FIRST(&bucket->bucket_entries);
+        hash = flow_hash(ip_pkt->ip_dst.s_addr, dport, vrf);
 
-    while(flow != NULL) {
-        if(flow->daddr == ip_pkt->ip_dst.s_addr
-           && flow->frag_group == ip_pkt->ip_id) {
+        // use hash to lookup a hash bucket and find the matching entry
+
+        bucket = &flows_table->hash_bucket[hash & HASH_MASK]; // get bucket
+
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+
+        flow = find_flow(hash, ip_pkt->ip_dst.s_addr, dport, vrf);
+
+        // Release the bucket lock
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
 
-            break; // match
+        if(flow != NULL && flow->frag_group != ip_pkt->ip_id) {
+            // flow has moved on to another frag group
+            INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
+            flow = NULL;
         }
-        flow = TAILQ_NEXT(flow, entries);
     }
 
     // if there's no matching flow, we haven't seen the first fragment yet
     if(flow == NULL) {
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-
         LOG(LOG_WARNING, "%s: Received a packet from %s. It is an IP "
                 "fragment, but we have not yet received the first "
                 "fragment, so we cannot tell if it belongs to an "
@@ -871,12 +1901,6 @@ process_fragment(struct ip * ip_pkt,
             __func__, inet_ntoa(ip_pkt->ip_src));
 
         return SUCCESS; // don't know anything about this flow
-    } else {
-        // Get the flow lock
-        INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
-
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
     }
 
     // else there's a matching flow, so use it to forward the traffic
@@ -966,7 +1990,11 @@ monitube_process_packet(msp_dataloop_args_t * params)
     struct jbuf * pkt_buf;
     jbuf_svc_set_info_t ss_info;
     struct ip * ip_pkt;
-    int type, cpu;
+    struct udphdr * udp_hdr;
+    burst_packet_t burst[PACKET_BURST], * pkt;
+    hash_bucket_t * bucket;
+    msp_hw_ts32_t start;
+    int type, cpu, count, dequeued, i, s;
     uint16_t ip_frag_offset;
     uint8_t ip_options_bytes = 0, mirror = 0;
     uint32_t mirror_vrf = 0;
@@ -988,83 +2016,167 @@ monitube_process_packet(msp_dataloop_args_t * params)
     // Start the packet loop...
     while(!do_shutdown) {
 
-        // Dequeue a packet from the rx-fifo
-        pkt_buf = msp_data_recv(params->dhandle, &type);
+        // Let the config thread know we hold no config snapshot
+        config_quiescent(cpu);
 
-        if(pkt_buf == NULL) { // Didn't get anything
-            continue;
+        // Age out flows whose timers are due (usually a no-op)
+        if(wheels[cpu].now < get_current_time()) {
+            advance_timer_wheel(&wheels[cpu], cpu);
         }
 
-        if(!is_master) {
-            jbuf_free(pkt_buf);
-            continue;
-        }
+        // Dequeue a burst of packets from the rx-fifo, and start fetching
+        // the home bucket of each packet's flow. Dropped packets count
+        // towards the burst too, so we get back to the top of the loop.
 
-        if(type != MSP_MSG_TYPE_PACKET) { // Didn't get network traffic
-            LOG(LOG_WARNING, "%s: Message wasn't a packet...dropping",
-                __func__);
-            jbuf_free(pkt_buf);
-            continue;
+        count = 0;
+
+        for(dequeued = 0; dequeued < PACKET_BURST; ++dequeued) {
+
+            pkt_buf = msp_data_recv(params->dhandle, &type);
+
+            if(pkt_buf == NULL) { // Didn't get anything
+                break;
+            }
+
+            if(!is_master) {
+                jbuf_free(pkt_buf);
+                continue;
+            }
+
+            if(type != MSP_MSG_TYPE_PACKET) { // Didn't get network traffic
+                LOG(LOG_WARNING, "%s: Message wasn't a packet...dropping",
+                    __func__);
+                jbuf_free(pkt_buf);
+                continue;
+            }
+
+            jbuf_get_svc_set_info(pkt_buf, &ss_info);
+            if(ss_info.mon_svc == 0) { // we'll drop non-sampled packets
+                LOG(LOG_NOTICE,"%s: Monitube-data encountered a non-sampled "
+                    "packet", __func__);
+                jbuf_free(pkt_buf);
+                continue;
+            }
+
+            if(pullup_bytes(&pkt_buf, IP_NEEDED_BYTES)) {
+
+                LOG(LOG_ERR, "%s: Dropped a packet because there's not enough "
+                    "bytes to form an IP header.", __func__);
+
+                jbuf_free(pkt_buf);
+                continue;
+            }
+
+            // Get IP header
+            ip_pkt = jbuf_to_d(pkt_buf, struct ip *);
+
+            if(!ip_pkt || ip_pkt->ip_p != IPPROTO_UDP) { // only UDP/RTP
+                jbuf_free(pkt_buf);
+                continue;
+            }
+
+            pkt = &burst[count++];
+            pkt->vrf = jbuf_getvrf(pkt_buf);
+
+            ip_frag_offset = ntohs(ip_pkt->ip_off);
+            ip_options_bytes = (ip_pkt->ip_hl * 4) - sizeof(struct ip);
+
+            if((ip_frag_offset & IP_OFFMASK)) {
+                // It's a fragment, but not the first fragment
+                pkt->kind = PKT_FRAGMENT;
+
+            } else if(!pullup_bytes(&pkt_buf,
+                    UDP_NEEDED_BYTES + ip_options_bytes)) {
+
+                // It is UDP, and could be the first fragment or normal
+                ip_pkt = jbuf_to_d(pkt_buf, struct ip *);
+                udp_hdr = (struct udphdr *)((uint32_t *)ip_pkt + ip_pkt->ip_hl);
+
+                // get hash of the full KEY: destination address, port and
+                // ingress VRF; its lower bits select the home bucket
+                pkt->hash = flow_hash(ip_pkt->ip_dst.s_addr,
+                        udp_hdr->uh_dport, pkt->vrf);
+                pkt->fp = flow_fp(ip_pkt->ip_dst.s_addr,
+                        udp_hdr->uh_dport, pkt->vrf);
+                pkt->kind = PKT_UDP;
+
+                __builtin_prefetch(
+                        &flows_table->hash_bucket[pkt->hash & HASH_MASK]);
+            } else {
+                pkt->kind = PKT_SHORT;
+            }
+
+            pkt->pkt_buf = pkt_buf;
         }
 
-        jbuf_get_svc_set_info(pkt_buf, &ss_info);
-        if(ss_info.mon_svc == 0) { // we'll drop non-sampled packets
-            LOG(LOG_NOTICE,"%s: Monitube-data encountered a non-sampled packet",
-                __func__);
-            jbuf_free(pkt_buf);
+        if(count == 0) {
             continue;
         }
 
-        if(pullup_bytes(&pkt_buf, IP_NEEDED_BYTES)) {
+        start = msp_hw_ts32_read();
 
-            LOG(LOG_ERR, "%s: Dropped a packet because there's not enough "
-                "bytes to form an IP header.", __func__);
+        // Now the buckets are (likely) cached, start fetching the flows that
+        // will (likely) match. This peek is only a hint, so it needs no lock.
 
-            jbuf_free(pkt_buf);
-            continue;
-        }
+        for(i = 0; i < count; ++i) {
+            pkt = &burst[i];
+
+            if(pkt->kind != PKT_UDP) {
+                continue;
+            }
 
-        // Get IP header
-        ip_pkt = jbuf_to_d(pkt_buf, struct ip *);
+            bucket = &flows_table->hash_bucket[pkt->hash & HASH_MASK];
 
-        if(!ip_pkt || ip_pkt->ip_p != IPPROTO_UDP) { // only care about UDP/RTP
-            jbuf_free(pkt_buf);
-            continue;
+            for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
+                if(bucket->fp[s] == pkt->fp) {
+                    __builtin_prefetch(bucket->flow[s]);
+                    break;
+                }
+            }
         }
 
-        ip_frag_offset = ntohs(ip_pkt->ip_off);
-        ip_options_bytes = (ip_pkt->ip_hl * 4) - sizeof(struct ip);
-        mirror = 0;
+        // Process the burst
 
-        if((ip_frag_offset & IP_OFFMASK)) {
+        for(i = 0; i < count; ++i) {
+            pkt = &burst[i];
+            pkt_buf = pkt->pkt_buf;
+            ip_pkt = jbuf_to_d(pkt_buf, struct ip *);
+            mirror = 0;
 
-            // It's a fragment, but not the first fragment
-            process_fragment(ip_pkt, pkt_buf->jb_total_len,
-                    &mirror, &mirror_vrf);
+            if(pkt->kind == PKT_FRAGMENT) {
 
-        } else if(!pullup_bytes(&pkt_buf, UDP_NEEDED_BYTES+ ip_options_bytes)) {
+                process_fragment(ip_pkt, pkt_buf->jb_total_len,
+                        pkt->vrf, &mirror, &mirror_vrf);
 
-            // It is UDP, and could be the first fragment or normal
-            process_packet(pkt_buf, cpu, &mirror, &mirror_vrf);
+            } else if(pkt->kind == PKT_UDP) {
 
-        } else {
-            LOG(LOG_NOTICE, "%s: Did not process a packet to %s. There's not "
-                "enough bytes to form the UDP header (its not an IP fragment).",
-                __func__, inet_ntoa(ip_pkt->ip_dst));
-        }
+                process_packet(pkt_buf, cpu, pkt->hash, pkt->vrf,
+                        &mirror, &mirror_vrf);
+
+            } else {
+                LOG(LOG_NOTICE, "%s: Did not process a packet to %s. There's "
+                    "not enough bytes to form the UDP header (its not an IP "
+                    "fragment).", __func__, inet_ntoa(ip_pkt->ip_dst));
+            }
 
-        if(mirror) {
-            jbuf_setvrf(pkt_buf, mirror_vrf);
-            if(send_packet(pkt_buf, &params->dhandle) != MSP_OK) {
+            if(mirror) {
+                jbuf_setvrf(pkt_buf, mirror_vrf);
+                if(send_packet(pkt_buf, &params->dhandle) != MSP_OK) {
+                    jbuf_free(pkt_buf);
+                }
+            } else {
+                // Drop by default since we are a monitoring application and
+                // packets should be copies
                 jbuf_free(pkt_buf);
             }
-        } else {
-            // Drop by default since we are a monitoring application and
-            // packets should be copies
-            jbuf_free(pkt_buf);
         }
+
+        loop_stats[cpu].packets += count;
+        loop_stats[cpu].ticks += (uint32_t)(msp_hw_ts32_read() - start);
     }
 
+    config_offline(cpu);
+
     atomic_sub_uint(1, &loops_running);
 
     // thread is done if it reaches this point
@@ -1085,14 +2197,16 @@ monitube_process_packet(msp_dataloop_args_t * params)
 status_t
 init_packet_loops(evContext ctx)
 {
-    int i, rc, core;
+    int i, j, rc, core;
     msp_dataloop_params_t params;
     msp_dataloop_result_t result;
     msp_shm_params_t shmp;
     msp_objcache_params_t ocp;
 
-    shm_handle = table_handle = entry_handle = flows_table = NULL;
+    shm_handle = table_handle = entry_handle = flows_mem = NULL;
+    flows_table = NULL;
     evInitID(&aging_timer);
+    evInitID(&stats_timer);
     obj_cache_id = 0; // for now this can always be zero
 
     LOG(LOG_INFO, "%s: Initializing object cache for data loops", __func__);
@@ -1114,7 +2228,7 @@ init_packet_loops(evContext ctx)
 
     // create object cache allocator for the flow look up table
     ocp.oc_shm = shm_handle;
-    ocp.oc_size  = sizeof(hashtable_t);
+    ocp.oc_size  = sizeof(hashtable_t) + CACHE_LINE_SIZE; // room to align
     strncpy(ocp.oc_name, FLOW_TABLE_NAME, OC_NAME_LEN);
 
     if(msp_objcache_create(&ocp) != MSP_OK) {
@@ -1140,17 +2254,38 @@ init_packet_loops(evContext ctx)
 
     // allocate flows_table in OC:
 
-    flows_table = msp_objcache_alloc(table_handle,
+    flows_mem = msp_objcache_alloc(table_handle,
             msp_get_current_cpu(), obj_cache_id);
-    if(flows_table == NULL) {
+    if(flows_mem == NULL) {
         LOG(LOG_ERR, "%s: Failed to allocate object cache for flows table ",
                 __func__);
         return EFAIL;
     }
 
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
+    // align the buckets to cache lines
+    flows_table = (hashtable_t *)(((uintptr_t)flows_mem + CACHE_LINE_SIZE - 1)
+                                    & ~((uintptr_t)CACHE_LINE_SIZE - 1));
+
+    bzero(flows_table, sizeof(hashtable_t));
+
+    for(i = 0; i < FLOW_BUCKET_TOTAL; ++i) {
         msp_spinlock_init(&flows_table->hash_bucket[i].bucket_lock);
-        TAILQ_INIT(&flows_table->hash_bucket[i].bucket_entries);
+    }
+
+    for(i = 0; i < FRAG_CACHE_COUNT; ++i) {
+        msp_spinlock_init(&flows_table->frag_cache[i].lock);
+    }
+
+    // init the indexes of flows used by config changes
+
+    for(i = 0; i < MON_INDEX_COUNT; ++i) {
+        msp_spinlock_init(&mon_index[i].lock);
+        TAILQ_INIT(&mon_index[i].flows);
+    }
+
+    for(i = 0; i < ADDR_INDEX_COUNT; ++i) {
+        msp_spinlock_init(&addr_index[i].lock);
+        TAILQ_INIT(&addr_index[i].flows);
     }
 
     // init the hardware timestamp infrastructure
@@ -1161,15 +2296,44 @@ init_packet_loops(evContext ctx)
         return EFAIL;
     }
 
-    // start ager
+    ts_freq = msp_hw_ts32_frequency();
+
+    // init the timer wheels used by the data loops to age flows
+
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        msp_spinlock_init(&wheels[i].lock);
+        wheels[i].now = get_current_time();
+        for(j = 0; j < WHEEL_SLOTS; ++j) {
+            TAILQ_INIT(&wheels[i].slots[0][j]);
+            TAILQ_INIT(&wheels[i].slots[1][j]);
+        }
+        TAILQ_INIT(&wheels[i].unlinked);
+    }
+    loop_count = 0;
+
+    // start shared memory cleanup
 
     if(evSetTimer(ctx, aging_cleanup, NULL,
-            evAddTime(evNowTime(), evConsTime(FLOW_AGE_CHECK_INTERVAL, 0)),
-            evConsTime(FLOW_AGE_CHECK_INTERVAL, 0),
+            evAddTime(evNowTime(), evConsTime(OC_CLEANUP_INTERVAL, 0)),
+            evConsTime(OC_CLEANUP_INTERVAL, 0),
             &aging_timer)) {
 
         LOG(LOG_EMERG, "%s: Failed to initialize a timer to periodically "
-            "check age of flow entries (Error: %m)", __func__);
+            "cleanup shared memory (Error: %m)", __func__);
+        return EFAIL;
+    }
+
+    // start reporting data loop performance
+
+    bzero(loop_stats, sizeof(loop_stats));
+
+    if(evSetTimer(ctx, report_loop_stats, NULL,
+            evAddTime(evNowTime(), evConsTime(LOOP_STATS_INTERVAL, 0)),
+            evConsTime(LOOP_STATS_INTERVAL, 0),
+            &stats_timer)) {
+
+        LOG(LOG_EMERG, "%s: Failed to initialize a timer to periodically "
+            "report data loop performance (Error: %m)", __func__);
         return EFAIL;
     }
 
@@ -1192,6 +2356,8 @@ init_packet_loops(evContext ctx)
             LOG(LOG_INFO, "%s: Creating a data loop on CPU %d (in core %d)",
                     __func__, rc, core);
 
+            loop_cpus[loop_count++] = rc;
+
             rc = msp_data_create_loop_on_cpu(rc, monitube_process_packet,
                     &params, &result);
 
@@ -1257,6 +2423,11 @@ stop_packet_loops(evContext ctx)
         evInitID(&retry_timer);
     }
 
+    if(evTestID(stats_timer)) {
+        evClearTimer(ctx, stats_timer);
+        evInitID(&stats_timer);
+    }
+
     while(loops_running > 0) ; // note the spinning while waiting
 
     if(fdb_connected) {
@@ -1275,9 +2446,10 @@ destroy_packet_loops_oc(void)
 {
     // loops must be all shutdown
 
-    if(flows_table) {
+    if(flows_mem) {
         msp_objcache_free(
-                table_handle, flows_table, msp_get_current_cpu(), obj_cache_id);
+                table_handle, flows_mem, msp_get_current_cpu(), obj_cache_id);
+        flows_mem = NULL;
         flows_table = NULL;
     }
 
@@ -1294,57 +2466,56 @@ destroy_packet_loops_oc(void)
 
 
 /**
- * Find all flow entries using the a monitor, and remove them
+ * Look up the VRF to use to send to a mirror in the FDB. This walks the FDB,
+ * so it should only be used off the data path.
+ *
+ * @param[in] addr
+ *      The mirror to address
+ *
+ * @param[out] vrf
+ *      The VRF to use (set if found)
+ *
+ * @return SUCCESS if found; EFAIL if not attached to the FDB or not found
  */
-void
-clean_flows_with_any_monitor(void)
+status_t
+lookup_mirror_vrf(in_addr_t addr, uint32_t * vrf)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    delete_replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
+    struct in_addr tmp;
+    uint32_t found = 0;
 
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    if(!fdb_connected) {
+        return EFAIL;
+    }
 
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
+    if(msp_fdb_get_all_route_records(fdb_handle, PROTO_IPV4,
+            set_vrf, &found) != MSP_OK) {
 
-        while(flow != NULL) {
+        tmp.s_addr = addr;
+        LOG(LOG_ERR, "%s: Did not successfully lookup a VRF "
+                "for mirrored site %s", __func__, inet_ntoa(tmp));
+        return EFAIL;
+    }
 
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
+    *vrf = found;
+    return SUCCESS;
+}
 
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
 
-            if(flow->mon != NULL) {
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
+/**
+ * Find all flow entries using the a monitor, and remove them
+ */
+void
+clean_flows_with_any_monitor(void)
+{
+    uint32_t i;
+    flow_filter_t filter;
 
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-                flow = next;
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-                flow = next;
-            }
-        }
+    bzero(&filter, sizeof(filter));
+    filter.monitored = TRUE;
 
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    for(i = 0; i < MON_INDEX_COUNT; ++i) {
+        clean_indexed_flows(&mon_index[i], &filter, 0, 0);
     }
-
-    msp_objcache_reclaim(shm_handle);
 }
 
 
@@ -1354,52 +2525,15 @@ clean_flows_with_any_monitor(void)
 void
 clean_flows_with_any_mirror(void)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    delete_replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
-
-            if(flow->maddr != 0) {
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
+    uint32_t i;
+    flow_filter_t filter;
 
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-                flow = next;
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-                flow = next;
-            }
-        }
+    bzero(&filter, sizeof(filter));
+    filter.mirrored = TRUE;
 
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    for(i = 0; i < ADDR_INDEX_COUNT; ++i) {
+        clean_indexed_flows(&addr_index[i], &filter, 0, 0);
     }
-
-    msp_objcache_reclaim(shm_handle);
 }
 
 
@@ -1412,52 +2546,15 @@ clean_flows_with_any_mirror(void)
 void
 clean_flows_with_mirror(in_addr_t addr)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    delete_replication_data_t data;
+    flow_filter_t filter;
 
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
-
-            if(flow->daddr == addr && flow->maddr != 0) {
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
-
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-                flow = next;
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-                flow = next;
-            }
-        }
-
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    bzero(&filter, sizeof(filter));
+    filter.mirrored = TRUE;
+    filter.daddr = addr;
+    filter.mask = 0xFFFFFFFF;
 
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_flows(&addr_index[mix32(addr) & (ADDR_INDEX_COUNT - 1)],
+            &filter, 0, 0);
 }
 
 
@@ -1469,74 +2566,22 @@ clean_flows_with_mirror(in_addr_t addr)
  *
  * @param[in] to
  *      The new mirror to address
+ *
+ * @param[in] vrf
+ *      The new mirror VRF
  */
 void
-redirect_flows_with_mirror(in_addr_t addr, in_addr_t to)
+redirect_flows_with_mirror(in_addr_t addr, in_addr_t to, uint32_t vrf)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    struct in_addr tmp;
-    replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
-
-            if(flow->daddr == addr && flow->maddr != 0) {
-
-                flow->maddr = to; // update
-                flow->m_vrf = 0;
-                if(flow->maddr != 0) {
-                    flow->m_vrf = 0;
-                    // look up VRF in FDB
-                    if(msp_fdb_get_all_route_records(fdb_handle, PROTO_IPV4,
-                            set_vrf, &flow->m_vrf) != MSP_OK) {
-
-                        tmp.s_addr = flow->maddr;
-                        LOG(LOG_ERR, "Did not successfully lookup a VRF "
-                                "for mirrored site %s", inet_ntoa(tmp));
-                    }
-                }
-
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                data.maddr = flow->maddr; // new
-                data.m_vrf = flow->m_vrf; // new
-                data.age_ts = flow->age_ts;
-                data.ssrc = flow->ssrc;
-                memcpy(&data.source, &flow->source, sizeof(source_t));
-                data.rate = flow->rate;
-                strncpy(data.mon, flow->mon, sizeof(MAX_MON_NAME_LEN));
-
-                update_replication_entry(&data);
-            }
-            flow = next;
-            INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-        }
+    flow_filter_t filter;
 
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    bzero(&filter, sizeof(filter));
+    filter.mirrored = TRUE;
+    filter.daddr = addr;
+    filter.mask = 0xFFFFFFFF;
 
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_flows(&addr_index[mix32(addr) & (ADDR_INDEX_COUNT - 1)],
+            &filter, to, vrf);
 }
 
 
@@ -1549,53 +2594,13 @@ redirect_flows_with_mirror(in_addr_t addr, in_addr_t to)
 void
 clean_flows_with_monitor(char * name)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    delete_replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
-
-            if(flow->mon && strcmp(flow->mon, name) == 0) {
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
+    flow_filter_t filter;
 
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-            }
-
-            flow = next;
-        }
-
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-    }
+    bzero(&filter, sizeof(filter));
+    filter.mon = name;
 
-    msp_objcache_reclaim(shm_handle);
+    clean_indexed_flows(&mon_index[name_hash(name) & (MON_INDEX_COUNT - 1)],
+            &filter, 0, 0);
 }
 
 
@@ -1614,53 +2619,38 @@ clean_flows_with_monitor(char * name)
 void
 clean_flows_in_monitored_prefix(char * name, in_addr_t prefix, in_addr_t mask)
 {
-    uint32_t i, cpu;
-    hash_bucket_t * bucket;
-    flow_entry_t * flow, * next;
-    delete_replication_data_t data;
-
-    cpu = msp_get_current_cpu();
-
-    for(i = 0; i < FLOW_BUCKET_COUNT; ++i) {
-
-        bucket = &flows_table->hash_bucket[i];
-
-        // Get the bucket lock
-        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
-
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-        while(flow != NULL) {
-
-            // keep next to safely remove from list
-            next = TAILQ_NEXT(flow, entries);
-
-            // Get the flow lock
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+    uint32_t i, hosts;
+    in_addr_t addr;
+    flow_filter_t filter;
+
+    bzero(&filter, sizeof(filter));
+    filter.mon = name;
+    filter.daddr = prefix;
+    filter.mask = mask;
+
+    if(name != NULL) {
+        clean_indexed_flows(&mon_index[name_hash(name) & (MON_INDEX_COUNT-1)],
+                &filter, 0, 0);
+        return;
+    }
 
-            if(((name == NULL) || (flow->mon && strcmp(flow->mon, name) == 0))
-               && (prefix & mask) == (flow->daddr & mask)) {
+    // any flow in the prefix, so go by destination address
 
-                // notify slave
-                data.bucket = i;
-                data.daddr = flow->daddr;
-                data.dport = flow->dport;
-                delete_replication_entry(&data);
+    hosts = ~ntohl(mask) + 1;
 
-                TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-                msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
-            } else {
-                // Release the flow lock
-                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-            }
-            flow = next;
+    if(hosts != 0 && hosts < ADDR_INDEX_COUNT) {
+        // visit the index bucket of each address in the prefix
+        for(i = 0; i < hosts; ++i) {
+            addr = htonl(ntohl(prefix & mask) + i);
+            clean_indexed_flows(
+                    &addr_index[mix32(addr) & (ADDR_INDEX_COUNT - 1)],
+                    &filter, 0, 0);
+        }
+    } else {
+        for(i = 0; i < ADDR_INDEX_COUNT; ++i) {
+            clean_indexed_flows(&addr_index[i], &filter, 0, 0);
         }
-
-        // Release the bucket lock
-        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
     }
-
-    msp_objcache_reclaim(shm_handle);
 }
 
 
@@ -1681,48 +2671,74 @@ clean_flows_in_monitored_prefix(char * name, in_addr_t prefix, in_addr_t mask)
 status_t
 get_next_flow_state(replication_data_t * last, replication_data_t * next)
 {
-    uint32_t i;
+    uint32_t i, start = 0;
+    int s;
     hash_bucket_t * bucket;
     flow_entry_t * flow;
     boolean return_next = (last == NULL);
 
-    for(i = last->bucket; i < FLOW_BUCKET_COUNT; ++i) {
+    // Flows are stored in their home bucket or one of the next FLOW_MAX_PROBE
+    // buckets, so start looking for the last one returned from its home bucket
 
-        bucket = &flows_table->hash_bucket[last->bucket];
+    if(last != NULL) {
+        start = last->bucket;
+    }
+
+    for(i = start; i < FLOW_BUCKET_TOTAL; ++i) {
+
+        if(!return_next && i > start + FLOW_MAX_PROBE) {
+            // the last flow returned must have been removed since
+            return_next = TRUE;
+        }
+
+        bucket = &flows_table->hash_bucket[i];
 
         // Get the bucket lock
         INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
 
-        flow = TAILQ_FIRST(&bucket->bucket_entries);
+        for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
 
-        while(flow != NULL) {
+            flow = bucket->flow[s];
+
+            if(flow == NULL) {
+                continue;
+            }
 
             // Get the flow lock
             INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
 
             if(return_next) {
                 // return this flow's information
-                next->bucket = i;
+                next->bucket = flow->hash & HASH_MASK;
                 next->daddr = flow->daddr;
                 next->dport = flow->dport;
+                next->vrf = flow->vrf;
                 next->age_ts = flow->age_ts;
                 next->ssrc = flow->ssrc;
                 memcpy(&next->source, &flow->source, sizeof(source_t));
                 next->rate = flow->rate;
                 next->maddr = flow->maddr;
                 next->m_vrf = flow->m_vrf;
-                strncpy(next->mon, flow->mon, sizeof(MAX_MON_NAME_LEN));
+                if(flow->mon != NULL) {
+                    strncpy(next->mon, flow->mon, MAX_MON_NAME_LEN);
+                } else {
+                    next->mon[0] = '\0';
+                }
+
+                // Release the flow and bucket locks
+                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
                 return SUCCESS;
             }
 
             // match the last returned, then set return_next
-            if(last->daddr == flow->daddr && last->dport == flow->dport) {
+            if(last->daddr == flow->daddr && last->dport == flow->dport
+               && last->vrf == flow->vrf) {
                 // find the next flow and return it
                 return_next = TRUE;
             }
             // Release the flow lock
             INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
-            flow = TAILQ_NEXT(flow, entries);
         }
 
         // Release the bucket lock
@@ -1751,23 +2767,21 @@ add_flow_state(replication_data_t * new_data)
 {
     hash_bucket_t * bucket;
     flow_entry_t * flow;
-    uint32_t cpu, rc;
+    timer_wheel_t * wheel;
+    uint32_t cpu, rc, hash;
+    boolean is_new = FALSE;
 
     cpu = msp_get_current_cpu();
 
-    bucket = &flows_table->hash_bucket[new_data->bucket];
+    // recompute the hash rather than trust the bucket
+    hash = flow_hash(new_data->daddr, new_data->dport, new_data->vrf);
+
+    bucket = &flows_table->hash_bucket[hash & HASH_MASK];
 
     // Get the bucket lock
     INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
 
-    flow = TAILQ_FIRST(&bucket->bucket_entries);
-
-    while(flow != NULL) {
-        if(flow->daddr == new_data->daddr && flow->dport == new_data->dport) {
-            break; // match
-        }
-        flow = TAILQ_NEXT(flow, entries);
-    }
+    flow = find_flow(hash, new_data->daddr, new_data->dport, new_data->vrf);
 
     if(flow == NULL) { // adding a new one
         flow = msp_objcache_alloc(entry_handle, cpu, obj_cache_id);
@@ -1781,14 +2795,28 @@ add_flow_state(replication_data_t * new_data)
 
         // init flow lock
         msp_spinlock_init(&flow->lock);
+        INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+
         flow->daddr = new_data->daddr;
         flow->dport = new_data->dport;
-        // insert into bucket list of flows
-        TAILQ_INSERT_HEAD(&bucket->bucket_entries, flow, entries);
+        flow->vrf = new_data->vrf;
+        flow->hash = hash;
+        flow->mon = NULL;
+        flow->mon_idx = NULL;
+        flow->addr_idx = NULL;
+        flow->unlinked = FALSE;
 
+        // insert into the table
+        if(insert_flow(flow) != SUCCESS) {
+            // Release the bucket lock
+            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+            msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+            LOG(LOG_ERR, "%s: Failed to find a free slot in the flow table",
+                    __func__);
+            return EFAIL;
+        }
+        is_new = TRUE;
     }
-    // Get the flow lock
-    INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
 
     // Release the bucket lock
     INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
@@ -1803,7 +2831,6 @@ add_flow_state(replication_data_t * new_data)
     flow->m_vrf = new_data->m_vrf;
 
     // init flow info not present in new_data
-    msp_spinlock_init(&flow->lock);
     flow->frag_group = 0;
 
     if(flow->rate != 0) {
@@ -1818,15 +2845,28 @@ add_flow_state(replication_data_t * new_data)
         flow->base_ts = msp_hw_ts32_read();
         flow->mdi_mlr = 0;
         flow->pl_sum = 0;
-        flow->vb_max = 0.0;
-        flow->vb_min = 0.0;
-        flow->vb_pre = 0.0;
-        flow->vb_post = 0.0;
+        flow->vb_max = 0;
+        flow->vb_min = 0;
+        flow->vb_pre = 0;
+        flow->vb_post = 0;
         flow->mdi_df = 0.0;
     } else {
         flow->mon = NULL;
     }
 
+    index_flow(flow);
+
+    if(is_new) {
+        // arm the flow's aging timer in one of the data loops' timer wheels
+        INSIST_ERR(loop_count > 0);
+        wheel = &wheels[loop_cpus[hash % loop_count]];
+        flow->expiry = flow->age_ts + FLOW_DURATION;
+
+        INSIST_ERR(msp_spinlock_lock(&wheel->lock) == MSP_OK);
+        arm_flow_timer(wheel, flow);
+        INSIST_ERR(msp_spinlock_unlock(&wheel->lock) == MSP_OK);
+    }
+
     INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
 
     return SUCCESS;
@@ -1846,32 +2886,44 @@ remove_flow_state(delete_replication_data_t * data)
 {
     hash_bucket_t * bucket;
     flow_entry_t * flow;
-    uint32_t cpu;
+    uint32_t hash, i;
+    uint16_t fp;
+    int s;
 
-    cpu = msp_get_current_cpu();
+    hash = flow_hash(data->daddr, data->dport, data->vrf);
+    fp = flow_fp(data->daddr, data->dport, data->vrf);
 
-    bucket = &flows_table->hash_bucket[data->bucket];
+    // look in the home bucket and the ones it may have overflowed into
 
-    // Get the bucket lock
-    INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
+    for(i = 0; i <= FLOW_MAX_PROBE; ++i) {
 
-    flow = TAILQ_FIRST(&bucket->bucket_entries);
+        bucket = &flows_table->hash_bucket[(hash & HASH_MASK) + i];
 
-    while(flow != NULL) {
-        if(flow->daddr == data->daddr && flow->dport == data->dport) {
+        // Get the bucket lock
+        INSIST_ERR(msp_spinlock_lock(&bucket->bucket_lock) == MSP_OK);
 
-            INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+        for(s = 0; s < FLOW_BUCKET_SLOTS; ++s) {
 
-            TAILQ_REMOVE(&bucket->bucket_entries, flow, entries);
-            msp_objcache_free(entry_handle, flow, cpu, obj_cache_id);
+            flow = bucket->flow[s];
 
-            INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
-            return;
+            if(flow != NULL && bucket->fp[s] == fp
+               && flow->daddr == data->daddr && flow->dport == data->dport
+               && flow->vrf == data->vrf) {
+
+                INSIST_ERR(msp_spinlock_lock(&flow->lock) == MSP_OK);
+
+                remove_flow(bucket, s);
+                release_flow(flow); // it will be freed by its timer wheel
+                INSIST_ERR(msp_spinlock_unlock(&flow->lock) == MSP_OK);
+
+                INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock)
+                        == MSP_OK);
+                return;
+            }
         }
-        flow = TAILQ_NEXT(flow, entries);
-    }
 
-    INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+        INSIST_ERR(msp_spinlock_unlock(&bucket->bucket_lock) == MSP_OK);
+    }
 
     LOG(LOG_ERR, "%s: Did not find a flow entry to remove", __func__);
 }
@@ -69,6 +69,22 @@ void
 destroy_packet_loops_oc(void);
 
 
+/**
+ * Look up the VRF to use to send to a mirror in the FDB. This walks the FDB,
+ * so it should only be used off the data path.
+ *
+ * @param[in] addr
+ *      The mirror to address
+ *
+ * @param[out] vrf
+ *      The VRF to use (set if found)
+ *
+ * @return SUCCESS if found; EFAIL if not attached to the FDB or not found
+ */
+status_t
+lookup_mirror_vrf(in_addr_t addr, uint32_t * vrf);
+
+
 /**
  * Find all flow entries using the a monitor, and remove them
  */
@@ -101,9 +117,12 @@ clean_flows_with_mirror(in_addr_t addr);
  *
  * @param[in] to
  *      The new mirror to address
+ *
+ * @param[in] vrf
+ *      The new mirror VRF
  */
 void
-redirect_flows_with_mirror(in_addr_t addr, in_addr_t to);
+redirect_flows_with_mirror(in_addr_t addr, in_addr_t to, uint32_t vrf);
 
 
 /**
@@ -261,6 +261,34 @@ receive_connection(pconn_session_t * session,
 }
 
 
+/**
+ * Convert a flow's statistics sent by the data component and store them
+ *
+ * @param[in] info
+ *      The peer info of the data component that sent the statistics
+ *
+ * @param[in] data
+ *      The flow's statistics (in network byte order)
+ */
+static void
+receive_flow_stat(pconn_peer_info_t * info, flow_stat_t * data)
+{
+    double df;
+    void * tmp;
+
+    // check name length
+    INSIST_ERR(strlen(data->mon_name) + 1 == ntohs(data->mon_name_len));
+
+    // carefully convert to the double it really is
+    data->mdi_df = ntohq(data->mdi_df);
+    tmp = &data->mdi_df;
+    df = *(double *)tmp;
+
+    set_flow_stat(info->ppi_fpc_slot, info->ppi_pic_slot, data->mon_name,
+        data->flow_addr, ntohs(data->flow_port), df, ntohl(data->mdi_mlr));
+}
+
+
 /**
  * Message handler for open connections to the data component.
  * Called when we receive a message.
@@ -283,8 +311,8 @@ receive_message(pconn_session_t * session,
                 void * cookie __unused)
 {
     flow_stat_t * data = NULL;
-    double df;
-    void * tmp;
+    flow_stats_t * batch;
+    uint32_t count, offset, rec_len;
     pconn_peer_info_t  info;
 
     pconn_session_get_peer_info(session, &info);
@@ -299,16 +327,33 @@ receive_message(pconn_session_t * session,
         INSIST_ERR(msg->length ==
             sizeof(flow_stat_t) + ntohs(data->mon_name_len));
 
-        // check name length
-        INSIST_ERR(strlen(data->mon_name) + 1 == ntohs(data->mon_name_len));
+        receive_flow_stat(&info, data);
+
+        break;
 
-        // carefully convert to the double it really is
-        data->mdi_df = ntohq(data->mdi_df);
-        tmp = &data->mdi_df;
-        df = *(double *)tmp;
+    case MSG_FLOW_STATS_UPDATE:
+
+        batch = (flow_stats_t *)msg->data;
+
+        // check message length
+        INSIST_ERR(msg->length >= sizeof(flow_stats_t));
 
-        set_flow_stat(info.ppi_fpc_slot, info.ppi_pic_slot, data->mon_name,
-            data->flow_addr, ntohs(data->flow_port), df, ntohl(data->mdi_mlr));
+        count = ntohl(batch->count);
+        offset = sizeof(flow_stats_t);
+
+        while(count-- > 0) {
+            // check there's room for this record
+            INSIST_ERR(msg->length >= offset + sizeof(flow_stat_t));
+
+            data = (flow_stat_t *)(msg->data + offset);
+            rec_len = FLOW_STAT_RECORD_LEN(ntohs(data->mon_name_len));
+
+            INSIST_ERR(msg->length >= offset + rec_len);
+
+            receive_flow_stat(&info, data);
+
+            offset += rec_len;
+        }
 
         break;
 
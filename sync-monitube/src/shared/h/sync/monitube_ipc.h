@@ -121,7 +121,8 @@ typedef struct replication_info_s {
  * FROM the data component:
  */
 typedef enum {
-    MSG_FLOW_STAT_UPDATE = 1         ///< update of flow MDI statistics
+    MSG_FLOW_STAT_UPDATE = 1,        ///< update of flow MDI statistics
+    MSG_FLOW_STATS_UPDATE            ///< batch of updates, flow_stats_t sent
 } update_type_e;
 
 
@@ -138,4 +139,23 @@ typedef struct flow_stat_s {
     char        mon_name[0];  ///< Applicable monitor name
 } flow_stat_t;
 
+
+/**
+ * Length of a flow_stat_t record (with its name) within a flow_stats_t,
+ * padded to keep the next record 8-byte aligned
+ */
+#define FLOW_STAT_RECORD_LEN(name_len) \
+    ((sizeof(flow_stat_t) + (name_len) + 7) & ~((size_t)7))
+
+
+/**
+ * Message containing a batch of flow_stat_t records. Each record is
+ * FLOW_STAT_RECORD_LEN(its mon_name_len) bytes long.
+ */
+typedef struct flow_stats_s {
+    uint32_t    count;        ///< Number of records
+    uint32_t    pad;          ///< improve mem alignment of records
+    uint8_t     records[0];   ///< flow_stat_t records
+} flow_stats_t;
+
 #endif
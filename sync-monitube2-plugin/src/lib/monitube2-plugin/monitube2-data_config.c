@@ -21,21 +21,15 @@
  */
 
 #include "monitube2-data_main.h"
+#include <jnx/multi-svcs/msvcs_state.h>
 #include "monitube2-data_config.h"
+#include "monitube2-data_reclaim.h"
 
 
 /*** Constants ***/
 
 #define MONITUBE2_MGMT_STRLEN  256     ///< Application name length
 
-#define RLOCK(l) INSIST_ERR(msp_rwlock_rlock(l) == MSP_OK) ///< Read lock
-
-#define WLOCK(l) INSIST_ERR(msp_rwlock_wlock(l) == MSP_OK) ///< Write lock
-
-#define RUNLOCK(l) INSIST_ERR(msp_rwlock_runlock(l) == MSP_OK) ///< Read lock
-
-#define WUNLOCK(l) INSIST_ERR(msp_rwlock_wunlock(l) == MSP_OK) ///< Write lock
-
 /*** Data structures ***/
 
 /**
@@ -70,17 +64,38 @@ typedef struct list_item_s {
 typedef TAILQ_HEAD(list_s, list_item_s) list_t; ///< list typedef
 
 
+/**
+ * The structure we use to bundle the radix-tree node with the rule info
+ * copied from the rule it came from. Used only in the data path.
+ */
+typedef struct prefix_s {
+    rnode_t     rnode;        ///< Radix tree node in prefixes of a classifier_t
+    in_addr_t   prefix;       ///< prefix (radix key, must follow rnode)
+    uint32_t    rate;         ///< monitoring rate of the rule
+    in_addr_t   redirect;     ///< mirror to address of the rule
+} prefix_t;
+
+
+/**
+ * The classifier for one service set: a radix tree of the prefixes of all the
+ * rules applied to it, allocated in one block. It is never modified once
+ * published; a changed configuration is published as a new classifier.
+ */
+typedef struct classifier_s {
+    radix_root_t prefixes;   ///< Radix tree for monitor lookups in data path
+    uint32_t     count;      ///< number of prefixes in entries
+    prefix_t     entries[0]; ///< the prefixes
+} classifier_t;
+
+
 /**
  * The structure we use to bundle service-set info
- * 
- * We don't need the prefixes_lock during the delayed delete
  */
 typedef struct ss_info_s {
     uint16_t     id;        ///< service set id number
     u_int32_t    svc_id;    ///< service id
     u_int32_t    gen_num;   ///< generation number
-    radix_root_t prefixes;  ///< Radix tree for monitor lookups in data path
-    msp_rwlock_t prefixes_lock; ///< Lock while using prefixes or its contents
+    classifier_t * volatile classifier; ///< published classifier or NULL
     list_t       rules;     ///< list of rules (only used in ctrl path)
 } ss_info_t;
 
@@ -100,11 +115,8 @@ typedef struct address_s {
  * The structure we use to bundle the patricia-tree node with the data 
  * to store for each rule
  * 
- * Only redirect and rate could be used in the fast path. To change these or 
- * delete the rule one should have a write lock. The rest is only touched in the
- * ctrl path (and from one thread). In ctrl side we don't always grab the lock
- * when reading, b/c we don't care about reading while data side is reading.
- * We just want to block ctrl side writing while data side is reading. 
+ * Rules are only touched in the ctrl path (and from one thread). The data
+ * path uses the copies of rate and redirect in the service sets' classifiers.
  */
 typedef struct rule_s {
     patnode    node;                ///< Tree node in rules
@@ -113,22 +125,9 @@ typedef struct rule_s {
     in_addr_t  redirect;            ///< mirror to address
     patroot *  addresses;           ///< "from" dest addresses
     list_t     ssets;               ///< list of service sets using this rule
-    
-    msp_rwlock_t lock;              ///< Lock 
 } rule_t;
 
 
-/**
- * The structure we use to bundle the radix-tree node with a pointer to the
- * rule we need. Used in the data & ctrl paths with a lock in ss_info_t
- */
-typedef struct prefix_s {
-    rnode_t     rnode;        ///< Radix tree node in prefixes of a ss_info_t
-    in_addr_t   prefix;       ///< prefix
-    rule_t *    rule;         ///< pointer to a monitor
-} prefix_t;
-
-
 /**
  * The current cached time. Cache it to prevent many system time() calls by the
  * data threads.
@@ -203,64 +202,198 @@ bit_count(uint32_t n)
 
 
 /**
- * Callback to free policy after some delay
+ * Free a classifier (passed to defer_free)
  *
- * @param[in] ctx
- *     The event context for this application
+ * @param[in] data
+ *      The classifier
+ */
+static void
+free_classifier(void * data)
+{
+    msp_shm_free(pdb_shm_handle, data);
+}
+
+
+/**
+ * Free a service set's info along with its classifier and list of rules
+ * (passed to defer_free)
  *
- * @param[in] uap
- *     The user data for this callback
+ * @param[in] data
+ *      The service set info
+ */
+static void
+free_ss_info(void * data)
+{
+    ss_info_t * ssi = (ss_info_t *)data;
+    list_item_t * item;
+
+    if(ssi->classifier != NULL) {
+        msp_shm_free(pdb_shm_handle, ssi->classifier);
+    }
+
+    while((item = TAILQ_FIRST(&ssi->rules)) != NULL) {
+        TAILQ_REMOVE(&ssi->rules, item, entries);
+        msp_shm_free(pdb_shm_handle, item);
+    }
+
+    msp_shm_free(pdb_shm_handle, ssi);
+}
+
+
+/**
+ * Build a new classifier from the rules applied to a service set and publish
+ * it for the data path, deferring the free of the one it replaces. On failure
+ * to allocate the old classifier stays in use.
  *
- * @param[in] due
- *     The absolute time when the event is due (now)
+ * @param[in] ssi
+ *      The service set info
+ */
+static void
+publish_classifier(ss_info_t * ssi)
+{
+    classifier_t * cls, * old;
+    list_item_t * item;
+    address_t * a;
+    rule_t * rule;
+    prefix_t * prefix;
+    uint32_t count = 0;
+
+    item = TAILQ_FIRST(&ssi->rules);
+    while(item != NULL) {
+        rule = item->data;
+        a = address_entry(patricia_find_next(rule->addresses, NULL));
+        while(a != NULL) {
+            ++count;
+            a = address_entry(patricia_find_next(rule->addresses, &a->node));
+        }
+        item = TAILQ_NEXT(item, entries);
+    }
+
+    if(count == 0) {
+        cls = NULL;
+    } else {
+        cls = msp_shm_alloc(pdb_shm_handle,
+                sizeof(classifier_t) + count * sizeof(prefix_t));
+        if(cls == NULL) {
+            CLOG(LOG_ALERT, "%s: Cannot allocate into policy SHM...", __func__);
+            return;
+        }
+
+        radix_init_root(&cls->prefixes);
+        cls->count = 0;
+
+        item = TAILQ_FIRST(&ssi->rules);
+        while(item != NULL) {
+            rule = item->data;
+            a = address_entry(patricia_find_next(rule->addresses, NULL));
+            while(a != NULL) {
+                prefix = &cls->entries[cls->count];
+                prefix->prefix = a->address;
+                prefix->rate = rule->rate;
+                prefix->redirect = rule->redirect;
+
+                radix_node_init(&prefix->rnode, bit_count(a->mask), 0);
+
+                if(radix_add(&cls->prefixes, &prefix->rnode)) {
+                    CLOG(LOG_ERR, "%s: Failed to add prefix to rtree "
+                        "configuration. Could be due to a duplicate prefix.",
+                        __func__);
+                } else {
+                    ++cls->count;
+                }
+                a = address_entry(patricia_find_next(rule->addresses, &a->node));
+            }
+            item = TAILQ_NEXT(item, entries);
+        }
+
+        __sync_synchronize(); // fully built before it is visible
+    }
+
+    old = ssi->classifier;
+    ssi->classifier = cls;
+
+    if(old != NULL) {
+        defer_free(old, free_classifier);
+    }
+}
+
+
+/**
+ * Republish the classifiers of all service sets using a rule
  *
- * @param[in] inter
- *     The period; when this will next be called
+ * @param[in] rule
+ *      The rule
  */
 static void
-free_policy(evContext ectx UNUSED,
-            void * uap,
-            struct timespec due UNUSED,
-            struct timespec inter UNUSED)
+publish_rule(rule_t * rule)
 {
-    ss_info_t * ssi;
-	msp_policy_db_svc_set_key_t * key= (msp_policy_db_svc_set_key_t *)uap;
-	msp_policy_db_params_t policy_db_params;	
-	list_item_t * item;
-	prefix_t * p;
-	rnode_t * r;
-	
+    list_item_t * item;
+
+    item = TAILQ_FIRST(&rule->ssets);
+    while(item != NULL) {
+        publish_classifier((ss_info_t *)item->data);
+        item = TAILQ_NEXT(item, entries);
+    }
+}
+
+
+/**
+ * Unlink a service set from its rules and delete its policy from the PDB. Its
+ * info is freed once no data cpu can still be using it.
+ *
+ * @param[in] ssi
+ *      The service set info
+ *
+ * @return 0 on success; -1 o/w
+ */
+static int
+delete_policy(ss_info_t * ssi)
+{
+    msp_policy_db_params_t policy_db_params;
+    rule_t * rule;
+    list_item_t * item, * item2;
+
+	// delete references from rules to this service set
+	// its own list of rules is freed along with it
+
+    item = TAILQ_FIRST(&ssi->rules);
+    while(item != NULL) {
+        rule = item->data;
+    	
+        item2 = TAILQ_FIRST(&rule->ssets);
+        while(item2 != NULL) {
+        	if(ssi == item2->data) {
+            	TAILQ_REMOVE(&rule->ssets, item2, entries);
+            	msp_shm_free(pdb_shm_handle, item2);
+        		break;
+        	}
+        	item2 = TAILQ_NEXT(item2, entries);
+        }
+    	item = TAILQ_NEXT(item, entries);
+    }
+
 	bzero(&policy_db_params, sizeof(msp_policy_db_params_t));
+
+	// Delete the current policy for the service set
+
 	policy_db_params.handle = pdb_handle;
+	policy_db_params.svc_set_id = ssi->id;
+	policy_db_params.svc_id = ssi->svc_id;
 	policy_db_params.plugin_id = plugin_id;
+	policy_db_params.policy_op = MSP_POLICY_DB_POLICY_DEL;
+	policy_db_params.op.del_params.gen_num = ssi->gen_num;
 	strlcpy(policy_db_params.plugin_name, PLUGIN_NAME,
-            sizeof(policy_db_params.plugin_name));
-	policy_db_params.svc_set_id = key->svc_set_id;
-	policy_db_params.svc_id = key->svc_id;
-	policy_db_params.policy_op = MSP_POLICY_DB_POLICY_GET;
+			sizeof(policy_db_params.plugin_name));
 
 	if (msp_policy_db_op(&policy_db_params) != MSP_OK) {
-            CLOG(LOG_INFO, "%s: No PDB configuration found", __func__);
-            return;
+		CLOG(LOG_ERR, "%s: PDB Delete failed!", __func__);
+		return -1;
 	}
 
-	ssi = policy_db_params.op.get_params.policy;
+	// someone may have done a GET op and still be using it
 
-    // Empty the rules list and the prefixes rtree
-	// should be no readers of the prefixes by this delayed point
-    
-	while((r = radix_find_next(&ssi->prefixes, NULL)) != NULL) {
-		radix_delete(&ssi->prefixes, r);
-		p = (prefix_t *)((uint8_t *)r - offsetof(prefix_t, rnode));
-		msp_shm_free(pdb_shm_handle, p);
-	}
-	
-    while((item = TAILQ_FIRST(&ssi->rules)) != NULL) {
-    	TAILQ_REMOVE(&ssi->rules, item, entries);
-    	msp_shm_free(pdb_shm_handle, item);
-    }
-	
-	msp_shm_free(pdb_shm_handle, ssi);
+	defer_free(ssi, free_ss_info);
+	return 0;
 }
 
 /*** GLOBAL/EXTERNAL Functions ***/
@@ -276,6 +409,8 @@ init_config(void)
 {
     patricia_root_init(&rules, FALSE, MONITUBE2_MGMT_STRLEN, 0);
 
+    init_reclaim();
+
     current_time = (atomic_uint_t)(time(NULL) - 1);
 
     // cached system time
@@ -325,28 +460,14 @@ clear_config(void)
 		
 		policy_db_params.svc_set_id = next_key.svc_set_id;
 		policy_db_params.svc_id = next_key.svc_id;
-		policy_db_params.policy_op = MSP_POLICY_DB_POLICY_DEL;
-		policy_db_params.op.del_params.gen_num = next_key.gen_num;
+		policy_db_params.policy_op = MSP_POLICY_DB_POLICY_GET;
 
 		// Delete the policy for the service set
 		
-		if (msp_policy_db_op(&policy_db_params) != MSP_OK) {
+		if (msp_policy_db_op(&policy_db_params) != MSP_OK ||
+				policy_db_params.op.get_params.policy == NULL ||
+				delete_policy(policy_db_params.op.get_params.policy)) {
 			CLOG(LOG_INFO, "%s: PDB Delete failed!", __func__);
-	        key.svc_set_id = next_key.svc_set_id;
-	        key.svc_id = next_key.svc_id;
-			continue;
-		}
-			
-	        // delay the free of the policy in case someone did a GET op and 
-		// is using it make some random delay between 5-15 secs so there's 
-		// not too many frees at once (since it uses some locking in the shm
-		// pool) in case we're clearing a lot
-			
-	        if (evSetTimer(*ctx, free_policy, &next_key, evAddTime(evNowTime(),
-		    	evConsTime(5 + (rand() % 11), 0)), evConsTime(0, 0), NULL)) {
-
-		        CLOG(LOG_EMERG, "%s: Failed to initialize a timer to free the "
-		        		"policy (Error: %m)", __func__);
 		}
 
 		key.svc_set_id = next_key.svc_set_id;
@@ -386,7 +507,8 @@ update_rule(char * name, uint32_t rate, in_addr_t redirect)
     rule = rule_entry(patricia_get(&rules, strlen(name) + 1, name));
     
     if(rule == NULL) {
-        rule = msp_shm_alloc(pdb_shm_handle, sizeof(rule_t));
+        // rule won't be SHM b/c it's never accessed in fast path
+        rule = calloc(1, sizeof(rule_t));
         INSIST_ERR(rule != NULL);
         strlcpy(rule->name, name, sizeof(rule->name));
 
@@ -396,7 +518,6 @@ update_rule(char * name, uint32_t rate, in_addr_t redirect)
         // init addresses
         rule->addresses = patricia_root_init(NULL, FALSE, sizeof(in_addr_t), 0);
         TAILQ_INIT(&rule->ssets);
-        INSIST_ERR(msp_rwlock_init(&rule->lock) == MSP_OK);
         
         rule->rate = rate;
         rule->redirect = redirect;
@@ -409,10 +530,10 @@ update_rule(char * name, uint32_t rate, in_addr_t redirect)
         return;        
     }
     
-    WLOCK(&rule->lock);
     rule->rate = rate;
     rule->redirect = redirect;
-    WUNLOCK(&rule->lock);
+
+    publish_rule(rule);
 }
 
 
@@ -430,8 +551,6 @@ delete_rule(char * name)
 	rule_t * rule;
 	address_t * a;
     ss_info_t * ssi;
-	rnode_t * rn;
-	prefix_t * prefix;
 	list_item_t * item;
 	
     rule = rule_entry(patricia_get(&rules, strlen(name) + 1, name));
@@ -446,8 +565,6 @@ delete_rule(char * name)
 		return -1;
 	}
     
-    WLOCK(&rule->lock); // wait for any readers to finish
-	
 	// Delete ssets and references from those sets to this rule
 	
     while((item = TAILQ_FIRST(&rule->ssets)) != NULL) {
@@ -467,29 +584,9 @@ delete_rule(char * name)
 	        item = TAILQ_NEXT(item, entries);
 	    }
 	    
-	    // remove any prefixes in this service set coming from this rule
-	    
-	    a = address_entry(patricia_find_next(rule->addresses, NULL));
-	    while(a != NULL) {
-	    	
-	        rn = radix_get(&ssi->prefixes, bit_count(a->mask),
-	        		(uint8_t *)&a->address);
-
-	        if(rn != NULL) {
-	            prefix = (prefix_t *)((uint8_t *)rn - offsetof(prefix_t,rnode));
-	            
-	        	if(prefix->rule == rule) {
-	        		WLOCK(&ssi->prefixes_lock);
-	        		
-	        		radix_delete(&ssi->prefixes, rn);
-	        		
-	        		WUNLOCK(&ssi->prefixes_lock);
-	        	}
-	        }
-	    	
-	    	a = address_entry(patricia_find_next(rule->addresses, &a->node));
-	    }
+	    // republish without any prefixes coming from this rule
 	    
+	    publish_classifier(ssi);
     }
     
     // delete all addresses
@@ -501,9 +598,9 @@ delete_rule(char * name)
     
     patricia_root_delete(rule->addresses);
 
-	// delete rule
+	// delete rule (no classifier refers to it)
     
-	msp_shm_free(pdb_shm_handle, rule);
+	free(rule);
 	return 0;
 }
 
@@ -525,9 +622,6 @@ add_address(char * name, in_addr_t addr, in_addr_t mask)
 {
 	rule_t * rule;
 	address_t * address;
-	ss_info_t * ssi;
-	prefix_t * prefix;
-	list_item_t * item;
 	
     rule = rule_entry(patricia_get(&rules, strlen(name) + 1, name));
     
@@ -551,32 +645,12 @@ add_address(char * name, in_addr_t addr, in_addr_t mask)
         CLOG(LOG_ERR, "%s: Cannot add address %08X / %08X as it conflicts with"
             " another address in the same rule (%s)", __func__, addr, mask, name);
         free(address);
+        return;
     }
     
-    // Ssets using this rule need their radix tree updated
+    // Ssets using this rule need their classifier updated
     
-    item = TAILQ_FIRST(&rule->ssets);
-    while(item != NULL) {
-    	ssi = item->data;
-    	
-        prefix = msp_shm_alloc(pdb_shm_handle, sizeof(prefix_t));
-        INSIST_ERR(prefix != NULL);
-        prefix->prefix = addr;
-        prefix->rule = rule;
-
-        radix_node_init(&prefix->rnode, bit_count(mask), 0);
-
-        WLOCK(&ssi->prefixes_lock);
-        
-        if(radix_add(&ssi->prefixes, &prefix->rnode)) {
-        	WUNLOCK(&ssi->prefixes_lock);
-            msp_shm_free(pdb_shm_handle, prefix);
-            CLOG(LOG_ERR, "%s: Failed to add prefix to rtree configuration."
-            		" Could be due to a duplicate prefix.", __func__);
-        } else {
-        	WUNLOCK(&ssi->prefixes_lock);
-        }
-    }
+    publish_rule(rule);
 }
 
 
@@ -597,11 +671,6 @@ delete_address(char * name, in_addr_t addr, in_addr_t mask)
 {
 	rule_t * rule;
 	address_t * address;
-	rnode_t * rn;
-	ss_info_t * ssi;
-	prefix_t * prefix;
-	list_item_t * item;
-	
 	
     rule = rule_entry(patricia_get(&rules, strlen(name) + 1, name));
     
@@ -623,31 +692,9 @@ delete_address(char * name, in_addr_t addr, in_addr_t mask)
         return;
     }
     
-    // Ssets using this rule need their radix tree updated
+    // Ssets using this rule need their classifier updated
     
-    item = TAILQ_FIRST(&rule->ssets);
-    while(item != NULL) {
-    	ssi = item->data;
-    	
-        rn = radix_get(&ssi->prefixes, bit_count(mask), (uint8_t *)&addr);
-
-        if(rn == NULL) {
-            CLOG(LOG_ERR, "%s: Failed to find prefix to remove from "
-                    "rtree configuration", __func__);
-        } else {
-            prefix = (prefix_t *)((uint8_t *)rn - offsetof(prefix_t, rnode));
-        	if(prefix->rule != rule) {
-                CLOG(LOG_WARNING, "%s: Prefix in the rtree doesn't belong to "
-					"this rule. Could be due to a duplicate prefix.", __func__);
-        	} else {
-        		WLOCK(&ssi->prefixes_lock);
-        		
-        		radix_delete(&ssi->prefixes, rn);
-        		
-        		WUNLOCK(&ssi->prefixes_lock);
-        	}
-        }
-    }
+    publish_rule(rule);
     
     free(address);
 }
@@ -711,9 +758,8 @@ apply_rule(char * name, uint16_t ssid, uint32_t gennum, uint32_t svcid)
 		ssi->id = ssid;
 		ssi->svc_id = svcid;
 		ssi->gen_num = gennum;
-		radix_init_root(&ssi->prefixes);
+		ssi->classifier = NULL;
 		TAILQ_INIT(&ssi->rules);
-		INSIST_ERR(msp_rwlock_init(&ssi->prefixes_lock) == MSP_OK);
 	    
 		bzero(&policy_db_params, sizeof(msp_policy_db_params_t));
 		
@@ -770,6 +816,8 @@ apply_rule(char * name, uint16_t ssid, uint32_t gennum, uint32_t svcid)
 	item->data = ssi;
 	
 	TAILQ_INSERT_TAIL(&rule->ssets, item, entries);
+	
+	publish_classifier(ssi);
 }
 
 
@@ -858,31 +906,14 @@ remove_rule(char * name, uint16_t ssid, uint32_t gennum, uint32_t svcid)
         item = TAILQ_NEXT(item, entries);
     }
     
+    publish_classifier(ssi);
+    
     if(TAILQ_FIRST(&ssi->rules) != NULL) // List is not empty
     	return;
     
     // List of rules is empty, so let's remove this set's policy
-	// Delete the current policy for the service set
     
-	policy_db_params.policy_op = MSP_POLICY_DB_POLICY_DEL;
-	policy_db_params.op.del_params.gen_num = gennum;
-
-	if (msp_policy_db_op(&policy_db_params) != MSP_OK) {
-		CLOG(LOG_ERR, "%s: PDB Delete failed!", __func__);
-		return;
-	}
-	
-    // delay the free of the policy in case someone did a GET op and is using it
-	// make some random delay between 5-15 secs so there's not too many frees at
-	// once (since it uses some locking in the shm pool) in case we're clearing
-	// a lot
-	
-    if(evSetTimer(*ctx, free_policy, ssi, evAddTime(evNowTime(),
-    		evConsTime(5 + (rand() % 11), 0)), evConsTime(0, 0), NULL)) {
-
-        CLOG(LOG_EMERG, "%s: Failed to initialize a timer to free the policy "
-            "(Error: %m)", __func__);
-    }
+	delete_policy(ssi);
 }
 
 
@@ -897,8 +928,6 @@ delete_serviceset(uint16_t ssid, uint32_t gennum, uint32_t svcid)
 {
     msp_policy_db_params_t policy_db_params;
     ss_info_t * ssi;
-    rule_t * rule;
-    list_item_t * item, * item2;
 	
 	bzero(&policy_db_params, sizeof(msp_policy_db_params_t));
     
@@ -931,52 +960,14 @@ delete_serviceset(uint16_t ssid, uint32_t gennum, uint32_t svcid)
 		return;
 	}
 	
-	// delete references from rules to this service set
-	// we delete the reference to the rules from this sset in the delayed delete
-	
-    while((item = TAILQ_FIRST(&ssi->rules)) != NULL) {
-        rule = item->data;
-    	
-        item2 = TAILQ_FIRST(&rule->ssets);
-        while(item2 != NULL) {
-        	if(ssi == item2->data) {
-            	TAILQ_REMOVE(&rule->ssets, item2, entries);
-            	msp_shm_free(pdb_shm_handle, item2);
-        		break;
-        	}
-        	item2 = TAILQ_NEXT(item2, entries);
-        }
-    	item = TAILQ_NEXT(item, entries);
-    }
-	
-	// Delete the current policy for the service set
-	
-	policy_db_params.policy_op = MSP_POLICY_DB_POLICY_DEL;
-	policy_db_params.op.del_params.gen_num = gennum;
-
-	if (msp_policy_db_op(&policy_db_params) != MSP_OK) {
-		CLOG(LOG_ERR, "%s: PDB Delete failed!", __func__);
-		return;
-	}
-	
-	
-    // delay the free of the policy in case someone did a GET op and is using it
-	// make some random delay between 5-15 secs so there's not too many frees at
-	// once (since it uses some locking in the shm pool) in case we're clearing
-	// a lot
-	
-    if(evSetTimer(*ctx, free_policy, ssi, evAddTime(evNowTime(),
-    		evConsTime(5 + (rand() % 11), 0)), evConsTime(0, 0), NULL)) {
-
-        CLOG(LOG_EMERG, "%s: Failed to initialize a timer to free the policy "
-            "(Error: %m)", __func__);
-    }
+	delete_policy(ssi);
 }
 
 
 /**
  * Find the monitoring rate and redirect address a rule-match happen one exists.
- * This will be run in the fast path.
+ * This will be run in the fast path. It takes no locks and writes only to
+ * this cpu's reclaim state.
  *
  * @param[in] ssid
  *      The service set id
@@ -1006,7 +997,15 @@ get_monitored_rule_info(uint16_t ssid,
 	rnode_t * rn;
     prefix_t * prefix;
     ss_info_t * ssi;
+    classifier_t * cls;
+    int cpu;
 
+	// announce this lookup; the service set info and classifier we get cannot
+	// be freed until we are done
+	
+	cpu = msvcs_state_get_cpuid();
+	reclaim_enter(cpu);
+	
 	bzero(&policy_db_params, sizeof(msp_policy_db_params_t));
 	
 	// Get the current policy for the service set
@@ -1021,36 +1020,34 @@ get_monitored_rule_info(uint16_t ssid,
 
 	if (msp_policy_db_op(&policy_db_params) != MSP_OK) {
 		DLOG(LOG_ERR, "%s: PDB Get failed!", __func__);
+		reclaim_exit(cpu);
 		return -1;
 	}
 	
 	ssi = policy_db_params.op.get_params.policy;
 	
-	if(!ssi)
+	if(!ssi) {
+		reclaim_exit(cpu);
 		return -1;
+	}
 	
-	RLOCK(&ssi->prefixes_lock); // hold while using any prefix in prefixes
+	cls = ssi->classifier;
 	
-    rn = radix_lookup(&ssi->prefixes, (uint8_t *)&address);
+    rn = (cls != NULL) ?
+    		radix_lookup(&cls->prefixes, (uint8_t *)&address) : NULL;
     
-    if(rn == NULL) {
-        return -1;
-    }
-
-    prefix = (prefix_t *)((uint8_t *)rn - offsetof(prefix_t, rnode));
-
-	RLOCK(&prefix->rule->lock);
+    if(rn != NULL) {
+        prefix = (prefix_t *)((uint8_t *)rn - offsetof(prefix_t, rnode));
 	
-    if(rate)
-    	*rate = prefix->rule->rate;
-    
-    if(redirect_addr)
-    	*redirect_addr = prefix->rule->redirect;
-    
-    RUNLOCK(&prefix->rule->lock);
+        if(rate)
+        	*rate = prefix->rate;
+        
+        if(redirect_addr)
+        	*redirect_addr = prefix->redirect;
+    }
     
-    RUNLOCK(&ssi->prefixes_lock);
+    reclaim_exit(cpu);
     
-    return 0;
+    return (rn != NULL) ? 0 : -1;
 }
 
@@ -168,7 +168,8 @@ delete_serviceset(uint16_t ssid, uint32_t gennum, uint32_t svcid);
 
 /**
  * Find the monitoring rate and redirect address a rule-match happen one exists.
- * This will be run in the fast path.
+ * This will be run in the fast path. It takes no locks and writes only to
+ * this cpu's reclaim state.
  *
  * @param[in] ssid
  *      The service set id
@@ -563,9 +563,30 @@ const char * no_op = "none"; ///< NONE
 const char * switch_op = "switch"; ///< SWITCH
 const char * revert_op = "revert"; ///< REVERT
 
+#define VRF_REFRESH_INTERVAL 15  ///< seconds between refreshing mirror_vrf
+
+#define VRF_UNRESOLVED ((uint32_t)-1) ///< mirror_vrf when no VRF was found
+
+#define FLOW_CACHE_BATCH 32 ///< flow entries moved to/from the OC at once
+
+#define FLOW_CACHE_MAX  128 ///< free flow entries kept per cpu before draining
+
+#define FLOW_OC_ID        0 ///< OC id of all flow entries (any service set)
+
 
 /*** Data Structures ***/
 
+/**
+ * A per-cpu list of free flow entries in front of the flow entry OC. It is
+ * only used by the data thread of its cpu, so it needs no lock. Entries of
+ * all the service sets are mixed in it, so they are all allocated from the
+ * OC with the same id, FLOW_OC_ID.
+ */
+typedef struct flow_cache_s {
+    flow_entry_t * head;   ///< first free entry
+    uint32_t       count;  ///< number of free entries
+} __attribute__((aligned(CACHE_LINE_SIZE))) flow_cache_t;
+
 /**
  * The id assigned by mspmand unique over all plugins
  */
@@ -588,10 +609,20 @@ void * pdb_shm_handle;
 
 static msp_oc_handle_t  entry_handle; ///< handle for OC flow entry allocator
 
+static flow_cache_t     flow_cache[MSP_MAX_CPUS]; ///< free flow entries per cpu
+
 static msp_fdb_handle_t fdb_handle;    ///< handle for FDB (forwarding DB)
 
 static evTimerID        retry_timer;   ///< timer set to do fdb attach retry
 
+static evTimerID        vrf_timer;     ///< timer set to refresh mirror_vrf
+
+/**
+ * The VRF used to send mirrored packets, resolved from the FDB in the ctrl path
+ * so that setting up a session never walks the FDB. VRF_UNRESOLVED if none.
+ */
+static volatile uint32_t mirror_vrf = VRF_UNRESOLVED;
+
 /*** STATIC/INTERNAL Functions ***/
 
 
@@ -603,7 +634,7 @@ static evTimerID        retry_timer;   ///< timer set to do fdb attach retry
  *
  * @param[in] ctxt
  *      The user data passed into the callback msp_fdb_get_all_route_records
- *      (this was &flow->m_vrf)
+ *      (this was &vrf in refresh_mirror_vrf)
  *
  * @return the iterator result to stop iterating
  */
@@ -619,6 +650,121 @@ set_vrf(msp_fdb_rt_info_t * route_info, void * ctxt)
 }
 
 
+/**
+ * Callback to periodically resolve the VRF used for mirroring again from the
+ * FDB, so that mirror_vrf follows routing changes
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+refresh_mirror_vrf(evContext ectx UNUSED,
+                   void * uap UNUSED,
+                   struct timespec due UNUSED,
+                   struct timespec inter UNUSED)
+{
+    uint32_t vrf = VRF_UNRESOLVED;
+
+    if(msp_fdb_get_all_route_records(fdb_handle, PROTO_IPV4,
+            set_vrf, &vrf) != MSP_OK) {
+        CLOG(LOG_ERR, "%s: Failed to walk the FDB route records", __func__);
+        return; // keep what we had
+    }
+
+    if(vrf == mirror_vrf) {
+        return;
+    }
+
+    if(vrf == VRF_UNRESOLVED) {
+        CLOG(LOG_ERR, "%s: Did not successfully lookup a VRF for mirroring",
+                __func__);
+    } else {
+        CLOG(LOG_INFO, "%s: Mirroring to VRF %d", __func__, vrf);
+    }
+
+    mirror_vrf = vrf;
+}
+
+
+/**
+ * Allocate a flow entry from this cpu's free list, refilling the list with a
+ * batch from the OC when it is empty
+ *
+ * @param[in] cpu
+ *      The current cpu
+ *
+ * @return the flow entry; NULL if none could be allocated
+ */
+static flow_entry_t *
+alloc_flow(int cpu)
+{
+    flow_cache_t * fc = &flow_cache[cpu];
+    flow_entry_t * flow;
+    int i;
+
+    if(fc->head == NULL) {
+        for(i = 0; i < FLOW_CACHE_BATCH; ++i) {
+            flow = msp_objcache_alloc(entry_handle, cpu, FLOW_OC_ID);
+            if(flow == NULL) {
+                break;
+            }
+            flow->next_free = fc->head;
+            fc->head = flow;
+            ++fc->count;
+        }
+
+        if(fc->head == NULL) {
+            return NULL;
+        }
+    }
+
+    flow = fc->head;
+    fc->head = flow->next_free;
+    --fc->count;
+
+    return flow;
+}
+
+
+/**
+ * Free a flow entry onto this cpu's free list, draining a batch from the list
+ * back to the OC when it holds too many
+ *
+ * @param[in] flow
+ *      The flow entry
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+static void
+free_flow(flow_entry_t * flow, int cpu)
+{
+    flow_cache_t * fc = &flow_cache[cpu];
+    int i;
+
+    flow->next_free = fc->head;
+    fc->head = flow;
+
+    if(++fc->count > FLOW_CACHE_MAX) {
+        for(i = 0; i < FLOW_CACHE_BATCH; ++i) {
+            flow = fc->head;
+            fc->head = flow->next_free;
+            msp_objcache_free(entry_handle, flow, cpu, FLOW_OC_ID);
+        }
+        fc->count -= FLOW_CACHE_BATCH;
+    }
+}
+
+
 /**
  * Callback to periodically retry attaching to FDB. It stops being called
  * once successfully attached.
@@ -656,6 +802,14 @@ retry_attach_fdb(evContext ectx UNUSED,
 
         // Once FDB is attached, init the rest:
 
+        evInitID(&vrf_timer);
+        if(evSetTimer(*ctx, refresh_mirror_vrf, NULL, evConsTime(0, 0),
+                evConsTime(VRF_REFRESH_INTERVAL, 0), &vrf_timer)) {
+
+            CLOG(LOG_EMERG, "%s: Failed to initialize a timer to refresh "
+                "the mirroring VRF", __func__);
+        }
+
         init_config();
         init_connections();
     }
@@ -780,7 +934,7 @@ static int monitube_data_hdlr(msvcs_data_context_t * md_ctx,
 
         cpu = msvcs_state_get_cpuid();
 
-        flow = msp_objcache_alloc(entry_handle, cpu, md_ctx->sc_sset_id);
+        flow = alloc_flow(cpu);
 
         if (!flow) {
             DLOG(LOG_ERR, "%s: Failed to allocate flow state", __func__);
@@ -820,13 +974,13 @@ static int monitube_data_hdlr(msvcs_data_context_t * md_ctx,
 
         if (flow->maddr != 0) {
             
-            flow->m_vrf = 0;
+            // use the VRF cached from the FDB
+            flow->m_vrf = mirror_vrf;
 
-            // look up VRF in FDB
-            if (msp_fdb_get_all_route_records(fdb_handle, PROTO_IPV4,
-                    set_vrf, &flow->m_vrf) != MSP_OK) {
+            if (flow->m_vrf == VRF_UNRESOLVED) {
             
                 struct in_addr tmp;
+                flow->m_vrf = 0;
                 tmp.s_addr = flow->maddr;
                 DLOG(LOG_ERR, "%s: Did not successfully lookup a VRF "
                     "for mirrored site %s", __func__, inet_ntoa(tmp));
@@ -949,7 +1103,7 @@ static int monitube_data_hdlr(msvcs_data_context_t * md_ctx,
                 (uint8_t) plugin_id, (void **) &flow, NULL);
 
         if (flow) {
-            msp_objcache_free(entry_handle, flow, cpu, md_ctx->sc_sset_id);
+            free_flow(flow, cpu);
         }
 
         // Get and free attached session context containing the flow entry
@@ -957,7 +1111,7 @@ static int monitube_data_hdlr(msvcs_data_context_t * md_ctx,
                 (uint8_t) plugin_id, NULL, (void **) &flow);
 
         if (flow) {
-            msp_objcache_free(entry_handle, flow, cpu, md_ctx->sc_sset_id);
+            free_flow(flow, cpu);
         }
 
         break;
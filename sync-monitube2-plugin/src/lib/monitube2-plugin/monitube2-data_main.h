@@ -74,6 +74,11 @@
  */
 #define PLUGIN_ID 1
 
+/**
+ * Cache line size of the data cpus
+ */
+#define CACHE_LINE_SIZE 64
+
 /*** Data structures ***/
 
 
@@ -28,34 +28,35 @@
 
 /**
  * flow entry information structure
+ * 
+ * The fields used for every packet come first so that they are contiguous.
+ * The rest are only used when a timeframe ends, or while the entry is free.
  */
 typedef struct flow_entry_s {
-    // flow information
+    // used for every packet:
     time_t                       age_ts;     ///< flow age timestamp
-    in_addr_t                    daddr;      ///< dest IP address (HT KEY field)
-    uint16_t                     dport;      ///< dest port (HT KEY field)
-
-    // mirroring related:
+    uint32_t                     rate;       ///< drain rate of RTP payload
     in_addr_t                    maddr;      ///< mirror IP address
     uint32_t                     m_vrf;      ///< mirror with outgoing VRF
-
-    // monitoring related:
-       // MDI media loss rate related:
     uint32_t                     ssrc;       ///< current RTP source
-    source_t                     source;     ///< RTP state of last known packet
-    int32_t                      mdi_mlr;    ///< last observed MDI MLR
-       // MDI delay factor related:
-    uint32_t                     rate;       ///< drain rate of RTP payload
     msp_hw_ts32_t                base_ts;    ///< timestamp (start of timeframe)
     uint32_t                     pl_sum;     ///< payload bits seen in timeframe
     double                       vb_pre;     ///< VB(pre) of last seen packet
     double                       vb_post;    ///< VB(post) of last seen packet
     double                       vb_min;     ///< min VB seen this timeframe
     double                       vb_max;     ///< max VB seen this timeframe
+    source_t                     source;     ///< RTP state of last known packet
+
+    // MDI results:
+    int32_t                      mdi_mlr;    ///< last observed MDI MLR
     double                       mdi_df;     ///< last observed MDI DF
 
-    // for list at this hash bucket:
-    TAILQ_ENTRY(flow_entry_s)    entries;    ///< next and prev list entries
+    // flow information
+    in_addr_t                    daddr;      ///< dest IP address
+    uint16_t                     dport;      ///< dest port
+
+    // for the per-cpu list of free entries:
+    struct flow_entry_s *        next_free;  ///< next free entry
 } flow_entry_t;
 
 /*** GLOBAL/EXTERNAL Functions ***/
@@ -0,0 +1,216 @@
+/*
+ * $Id$
+ *
+ * This code is provided as is by Juniper Networks SDK Developer Support.
+ * It is provided with no warranties or guarantees, and Juniper Networks
+ * will not provide support or maintenance of this code in any fashion.
+ * The code is provided only to help a developer better understand how
+ * the SDK can be used.
+ *
+ * Copyright (c) 2009, Juniper Networks, Inc.
+ * All rights reserved.
+ */
+
+/**
+ * @file monitube2-data_reclaim.c
+ * @brief Relating to freeing shared data once the data path is done with it
+ *
+ * Each data cpu records the epoch in which it started using shared data, or
+ * that it is idle. Data handed to defer_free() is stamped with the epoch then
+ * current, and the epoch is advanced. A periodic timer frees all data stamped
+ * before the oldest epoch still in use by a data cpu.
+ */
+
+#include "monitube2-data_main.h"
+#include "monitube2-data_reclaim.h"
+
+
+/*** Constants ***/
+
+#define READER_IDLE 0       ///< Reader epoch of a cpu not using shared data
+
+#define RECLAIM_INTERVAL 1  ///< seconds between freeing deferred data
+
+/*** Data structures ***/
+
+/**
+ * The main evContext on the ctrl plane side
+ */
+extern evContext * ctx;
+
+
+/**
+ * The reader state of a data cpu, on its own cache line so that entering and
+ * leaving never writes to a line shared with another cpu
+ */
+typedef struct reader_s {
+    volatile uint32_t epoch; ///< global_epoch upon entering or READER_IDLE
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_t;
+
+
+/**
+ * Data waiting to be freed
+ */
+typedef struct deferred_s {
+    void *        data;     ///< data to free
+    free_func_t   func;     ///< function to free it
+    uint32_t      epoch;    ///< global_epoch when it was deferred
+    TAILQ_ENTRY(deferred_s) entries; ///< next/prev deferred data
+} deferred_t;
+
+
+/**
+ * Data waiting to be freed in the order it was deferred (only used in the
+ * ctrl path)
+ */
+static TAILQ_HEAD(, deferred_s) deferred = TAILQ_HEAD_INITIALIZER(deferred);
+
+
+/**
+ * Advanced upon every defer_free (skipping READER_IDLE)
+ */
+static volatile uint32_t global_epoch = READER_IDLE + 1;
+
+
+/**
+ * The reader state of each data cpu
+ */
+static reader_t readers[MSP_MAX_CPUS];
+
+
+/*** STATIC/INTERNAL Functions ***/
+
+
+/**
+ * Free the deferred data that no data cpu can still be using
+ *
+ * @param[in] ctx
+ *     The event context for this application
+ *
+ * @param[in] uap
+ *     The user data for this callback
+ *
+ * @param[in] due
+ *     The absolute time when the event is due (now)
+ *
+ * @param[in] inter
+ *     The period; when this will next be called
+ */
+static void
+reclaim(evContext ectx UNUSED,
+        void * uap UNUSED,
+        struct timespec due UNUSED,
+        struct timespec inter UNUSED)
+{
+    deferred_t * d;
+    uint32_t i, epoch, oldest = READER_IDLE;
+
+    if(TAILQ_FIRST(&deferred) == NULL) {
+        return;
+    }
+
+    __sync_synchronize();
+
+    // find the oldest epoch of any data cpu using shared data
+
+    for(i = 0; i < MSP_MAX_CPUS; ++i) {
+        epoch = readers[i].epoch;
+        if(epoch != READER_IDLE && (oldest == READER_IDLE ||
+                (int32_t)(epoch - oldest) < 0)) {
+            oldest = epoch;
+        }
+    }
+
+    // anything deferred before that epoch began is no longer in use
+
+    while((d = TAILQ_FIRST(&deferred)) != NULL) {
+        if(oldest != READER_IDLE && (int32_t)(d->epoch - oldest) >= 0) {
+            break;
+        }
+        TAILQ_REMOVE(&deferred, d, entries);
+        d->func(d->data);
+        free(d);
+    }
+}
+
+
+/*** GLOBAL/EXTERNAL Functions ***/
+
+
+/**
+ * Start freeing deferred data periodically
+ *
+ * Should only be called on startup (one time)
+ */
+void
+init_reclaim(void)
+{
+    if(evSetTimer(*ctx, reclaim, NULL, evNowTime(),
+            evConsTime(RECLAIM_INTERVAL, 0), NULL)) {
+        CLOG(LOG_EMERG, "%s: Failed to initialize an eventlib timer to free "
+            "deferred data", __func__);
+    }
+}
+
+
+/**
+ * Free some data that is no longer published to the data path, once no data
+ * cpu can still be using it. Only called in the ctrl path.
+ *
+ * @param[in] data
+ *      The data
+ *
+ * @param[in] func
+ *      The function to free the data
+ */
+void
+defer_free(void * data, free_func_t func)
+{
+    deferred_t * d;
+    uint32_t epoch;
+
+    d = calloc(1, sizeof(deferred_t));
+    INSIST_ERR(d != NULL);
+
+    d->data = data;
+    d->func = func;
+
+    __sync_synchronize(); // unpublished before the epoch advances
+
+    d->epoch = epoch = global_epoch;
+    if(++epoch == READER_IDLE) {
+        ++epoch;
+    }
+    global_epoch = epoch;
+
+    TAILQ_INSERT_TAIL(&deferred, d, entries);
+}
+
+
+/**
+ * Announce that a data cpu starts using shared data. This takes no locks and
+ * writes only to this cpu's own state.
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+void
+reclaim_enter(int cpu)
+{
+    readers[cpu].epoch = global_epoch;
+    __sync_synchronize();
+}
+
+
+/**
+ * Announce that a data cpu is done using shared data
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+void
+reclaim_exit(int cpu)
+{
+    __sync_synchronize();
+    readers[cpu].epoch = READER_IDLE;
+}
@@ -0,0 +1,83 @@
+/*
+ * $Id$
+ *
+ * This code is provided as is by Juniper Networks SDK Developer Support.
+ * It is provided with no warranties or guarantees, and Juniper Networks
+ * will not provide support or maintenance of this code in any fashion.
+ * The code is provided only to help a developer better understand how
+ * the SDK can be used.
+ *
+ * Copyright (c) 2009, Juniper Networks, Inc.
+ * All rights reserved.
+ */
+
+/**
+ * @file monitube2-data_reclaim.h
+ * @brief Relating to freeing shared data once the data path is done with it
+ *
+ * The data cpus announce when they start and finish using data shared with
+ * the ctrl path. The ctrl path unpublishes such data and hands it to
+ * defer_free(), which frees it once no data cpu can still be using it.
+ */
+
+#ifndef __MONITUBE2_DATA_RECLAIM_H__
+#define __MONITUBE2_DATA_RECLAIM_H__
+
+
+/*** Constants ***/
+
+
+/*** Data structures ***/
+
+/**
+ * A function to free data handed to defer_free()
+ */
+typedef void (* free_func_t)(void * data);
+
+
+/*** GLOBAL/EXTERNAL Functions ***/
+
+/**
+ * Start freeing deferred data periodically
+ *
+ * Should only be called on startup (one time)
+ */
+void
+init_reclaim(void);
+
+
+/**
+ * Free some data that is no longer published to the data path, once no data
+ * cpu can still be using it. Only called in the ctrl path.
+ *
+ * @param[in] data
+ *      The data
+ *
+ * @param[in] func
+ *      The function to free the data
+ */
+void
+defer_free(void * data, free_func_t func);
+
+
+/**
+ * Announce that a data cpu starts using shared data. This takes no locks and
+ * writes only to this cpu's own state.
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+void
+reclaim_enter(int cpu);
+
+
+/**
+ * Announce that a data cpu is done using shared data
+ *
+ * @param[in] cpu
+ *      The current cpu
+ */
+void
+reclaim_exit(int cpu);
+
+#endif